@@ -10,6 +10,7 @@ local AC = require "avro.c"
 local ACC = require "avro.constants"
 local AS = require "avro.schema"
 local AW = require "avro.wrapper"
+local AWire = require "avro.wire"
 
 local pairs = pairs
 local print = print
@@ -39,13 +40,31 @@ avro.MapSchema = AS.MapSchema
 avro.RecordSchema = AS.RecordSchema
 avro.Schema = AS.Schema
 avro.UnionSchema = AS.UnionSchema
+avro.check_compatibility = AS.check_compatibility
 
+avro.Channel = AC.Channel
 avro.ResolvedReader = AC.ResolvedReader
 avro.ResolvedWriter = AC.ResolvedWriter
+avro.RollingWriter = AC.RollingWriter
+avro.StreamReader = AC.StreamReader
+avro.enable_allocation_stats = AC.enable_allocation_stats
+avro.enable_timings = AC.enable_timings
+avro.export_resolver = AC.export_resolver
+avro.export_schema = AC.export_schema
+avro.import_channel = AC.import_channel
+avro.import_resolver = AC.import_resolver
+avro.import_schema = AC.import_schema
 avro.open = AC.open
+avro.parallel_scan = AC.parallel_scan
 avro.raw_decode_value = AC.raw_decode_value
 avro.raw_encode_value = AC.raw_encode_value
 avro.raw_value = AC.raw_value
+avro.release_handle = AC.release_handle
+avro.reset_stats = AC.reset_stats
+avro.reset_timings = AC.reset_timings
+avro.stats = AC.stats
+avro.timings = AC.timings
+avro.with_arena = AC.with_arena
 avro.wrapped_value = AC.wrapped_value
 
 avro.get_wrapper_class = AW.get_wrapper_class
@@ -77,4 +96,6 @@ avro.map = AS.map
 avro.record = AS.record
 avro.union = AS.union
 
+avro.wire = AWire
+
 return avro
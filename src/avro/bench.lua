@@ -0,0 +1,124 @@
+-- -*- coding: utf-8 -*-
+------------------------------------------------------------------------
+-- Copyright © 2011-2015, RedJack, LLC.
+-- All rights reserved.
+--
+-- Please see the COPYING file in this distribution for license details.
+------------------------------------------------------------------------
+
+-- Benchmarks the Avro bindings.  Results are printed as one JSON object
+-- per line.  Usage:
+--
+--   lua avro/bench.lua [options]
+--
+-- Options:
+--
+--   --binding=legacy   Use the C binding even if the FFI is available,
+--                      so the two bindings can be compared under LuaJIT
+--   --filter=STR       Only run benchmarks whose "case.operation" name
+--                      contains STR
+--   --min-time=SECS    Minimum duration of each measured run
+
+local options = {}
+for _, a in ipairs(arg or {}) do
+   local key, value = a:match("^%-%-([%w%-]+)=(.*)$")
+   if not key then
+      error("Invalid option "..a)
+   end
+   options[key] = value
+end
+
+if options.binding == "legacy" then
+   -- Preload the C binding before anything else loads avro.c.
+   local AM = require "avro.module"
+   AM.c = require "avro.legacy.avro"
+   AM.c.ffi_present = false
+   package.loaded["avro.c"] = AM.c
+elseif options.binding and options.binding ~= "default" then
+   error("Invalid binding "..options.binding)
+end
+
+local A = require "avro"
+local Runner = require "avro.bench.runner"
+local cases = require "avro.bench.schemas"
+
+local lua_version = _VERSION
+if jit then lua_version = jit.version end
+
+local runner = Runner:new {
+   filter=options.filter,
+   min_time=tonumber(options["min-time"]),
+   tags={
+      binding=A.c.ffi_present and "ffi" or "legacy",
+      lua=lua_version,
+   },
+}
+
+local FILE_RECORDS = 1000
+
+for _, case in ipairs(cases) do
+   local schema = case.schema
+   local value = schema:new_raw_value()
+   value:set_from_ast(case.ast)
+   local buf = value:encode()
+   local size = #buf
+   local resolver = assert(A.ResolvedWriter(schema, schema))
+   local scratch = schema:new_raw_value()
+
+   runner:run(case.name, "set_from_ast", function (n)
+      local ast = case.ast
+      for i = 1, n do
+         scratch:set_from_ast(ast)
+      end
+   end)
+
+   runner:run(case.name, "encode", function (n)
+      for i = 1, n do
+         value:encode()
+      end
+   end, size)
+
+   runner:run(case.name, "decode", function (n)
+      for i = 1, n do
+         resolver:decode(buf, scratch)
+      end
+   end, size)
+
+   if case.iterable then
+      runner:run(case.name, "iterate", function (n)
+         for i = 1, n do
+            for _, element in value:iterate(false, true) do
+            end
+         end
+      end)
+   end
+
+   local filename = os.tmpname()
+
+   runner:run(case.name, "file_write", function (n)
+      local writer = A.open(filename, "w", schema)
+      for i = 1, n * FILE_RECORDS do
+         writer:write_raw(value)
+      end
+      writer:close()
+   end, size * FILE_RECORDS)
+
+   -- Leave a file with a known number of records to read back.
+   local writer = A.open(filename, "w", schema)
+   for i = 1, FILE_RECORDS do
+      writer:write_raw(value)
+   end
+   writer:close()
+
+   runner:run(case.name, "file_read", function (n)
+      for i = 1, n do
+         local reader = A.open(filename)
+         while reader:read_raw(scratch) do end
+         reader:close()
+      end
+   end, size * FILE_RECORDS)
+
+   os.remove(filename)
+   value:release()
+   scratch:release()
+end
@@ -0,0 +1,87 @@
+-- -*- coding: utf-8 -*-
+------------------------------------------------------------------------
+-- Copyright © 2011-2015, RedJack, LLC.
+-- All rights reserved.
+--
+-- Please see the COPYING file in this distribution for license details.
+------------------------------------------------------------------------
+
+-- A small benchmark harness.  Each benchmark is a function that
+-- performs some operation a given number of times.  We keep doubling
+-- the number of iterations until a run takes at least min_time
+-- seconds, and then report the throughput of that run.
+
+local json = require "avro.dkjson"
+
+local collectgarbage = collectgarbage
+local io = io
+local os = os
+local pairs = pairs
+local setmetatable = setmetatable
+
+local Runner = {}
+Runner.__mt = { __index=Runner }
+
+-- Creates a new runner.  Results are written as one JSON object per
+-- line to output (which defaults to io.stdout).  Every result includes
+-- the fields in tags, which should identify the binding and Lua
+-- implementation being measured.  If filter is given, only benchmarks
+-- whose "case.operation" name contains it are run.
+function Runner:new(options)
+   local obj = {
+      min_time=options.min_time or 0.5,
+      output=options.output or io.stdout,
+      tags=options.tags or {},
+      filter=options.filter,
+   }
+   return setmetatable(obj, self.__mt)
+end
+
+local function time_run(fn, iterations)
+   collectgarbage()
+   local start = os.clock()
+   fn(iterations)
+   return os.clock() - start
+end
+
+-- Runs a benchmark.  bytes_per_op, if given, is used to calculate a
+-- byte throughput in addition to the operation throughput.
+function Runner:run(case_name, operation, fn, bytes_per_op)
+   local name = case_name.."."..operation
+   if self.filter and not name:find(self.filter, 1, true) then
+      return
+   end
+
+   -- Warm up (and give the JIT a chance to compile the hot loop).
+   fn(1)
+
+   local iterations = 1
+   local elapsed = time_run(fn, iterations)
+   while elapsed < self.min_time do
+      iterations = iterations * 2
+      elapsed = time_run(fn, iterations)
+   end
+
+   local result = {
+      case=case_name,
+      operation=operation,
+      iterations=iterations,
+      seconds=elapsed,
+      ops_per_sec=iterations / elapsed,
+   }
+   if bytes_per_op then
+      result.bytes_per_sec = bytes_per_op * iterations / elapsed
+   end
+   for k, v in pairs(self.tags) do
+      result[k] = v
+   end
+
+   self.output:write(json.encode(result, { keyorder = {
+      "binding", "lua", "case", "operation", "iterations", "seconds",
+      "ops_per_sec", "bytes_per_sec",
+   }}), "\n")
+   self.output:flush()
+   return result
+end
+
+return Runner
@@ -0,0 +1,120 @@
+-- -*- coding: utf-8 -*-
+------------------------------------------------------------------------
+-- Copyright © 2011-2015, RedJack, LLC.
+-- All rights reserved.
+--
+-- Please see the COPYING file in this distribution for license details.
+------------------------------------------------------------------------
+
+-- Representative schemas for the benchmark suite.  Each case has a
+-- name, a schema, and an AST for a sample value.  Cases whose values
+-- are arrays or maps also set iterable, so that we can benchmark
+-- iterating through their elements.
+
+local A = require "avro"
+
+local string = string
+local table = table
+
+local cases = {}
+
+local function add_case(name, schema, ast, iterable)
+   table.insert(cases, {
+      name=name,
+      schema=schema,
+      ast=ast,
+      iterable=iterable,
+   })
+end
+
+
+------------------------------------------------------------------------
+-- A wide record with a mix of scalar field types
+
+do
+   local FIELD_TYPES = { A.int, A.long, A.double, A.string, A.boolean }
+   local fields = {}
+   local ast = {}
+   for i = 1, 50 do
+      local field_type = FIELD_TYPES[(i-1) % #FIELD_TYPES + 1]
+      local name = "f"..i
+      table.insert(fields, {[name] = field_type})
+      if field_type == A.string then
+         ast[name] = "value "..i
+      elseif field_type == A.boolean then
+         ast[name] = (i % 2 == 0)
+      elseif field_type == A.double then
+         ast[name] = i + 0.5
+      else
+         ast[name] = i * 1000
+      end
+   end
+   add_case("wide_record", A.record "wide" (fields), ast)
+end
+
+
+------------------------------------------------------------------------
+-- Deeply nested records
+
+do
+   local DEPTH = 8
+   local schema = A.record "level8" { {id = A.int}, {name = A.string} }
+   local ast = { id = DEPTH, name = "leaf" }
+   for i = DEPTH-1, 1, -1 do
+      schema = A.record("level"..i) {
+         {id = A.int},
+         {child = schema},
+      }
+      ast = { id = i, child = ast }
+   end
+   add_case("deep_nesting", schema, ast)
+end
+
+
+------------------------------------------------------------------------
+-- A large numeric array
+
+do
+   local ast = {}
+   for i = 1, 1000 do
+      ast[i] = i * 0.25
+   end
+   add_case("numeric_array", A.array(A.double), ast, true)
+end
+
+
+------------------------------------------------------------------------
+-- A map with string values
+
+do
+   local ast = {}
+   for i = 1, 100 do
+      ast["key"..i] = string.rep("x", i % 32)
+   end
+   add_case("string_map", A.map(A.string), ast, true)
+end
+
+
+------------------------------------------------------------------------
+-- An array of unions
+
+do
+   local point = A.record "point" { {x = A.double}, {y = A.double} }
+   local schema = A.array(A.union { A.null, A.int, A.string, point })
+   local ast = {}
+   for i = 1, 100 do
+      local branch = i % 4
+      if branch == 0 then
+         ast[i] = { int = i }
+      elseif branch == 1 then
+         ast[i] = { string = "item "..i }
+      elseif branch == 2 then
+         ast[i] = { point = { x = i, y = -i } }
+      else
+         ast[i] = { null = A.null }
+      end
+   end
+   add_case("union_array", schema, ast, true)
+end
+
+return cases
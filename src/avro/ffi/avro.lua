@@ -23,6 +23,7 @@ local assert = assert
 local getmetatable = getmetatable
 local error = error
 local ipairs = ipairs
+local math = math
 local next = next
 local pairs = pairs
 local print = print
@@ -203,9 +204,96 @@ typedef struct LuaAvroDataInputFile {
     avro_value_iface_t  *iface;
 } LuaAvroDataInputFile;
 
+typedef struct LuaAvroAsyncWriter  LuaAvroAsyncWriter;
+
 typedef struct LuaAvroDataOutputFile {
     avro_file_writer_t  writer;
+    LuaAvroAsyncWriter  *async;
+    void  *fp;
 } LuaAvroDataOutputFile;
+
+typedef struct LuaAvroSharedHandle {
+    uint64_t  id;
+    int  kind;
+    avro_schema_t  schema;
+    avro_value_iface_t  *iface;
+    bool  has_fingerprint;
+    char  fingerprint[8];
+    void  *channel;
+} LuaAvroSharedHandle;
+
+typedef struct LuaAvroSharedHandleApi {
+    int (*export_iface)(int kind, avro_schema_t schema,
+                        avro_value_iface_t *iface, const char *fingerprint,
+                        char *handle);
+    int (*import_iface)(const char *handle, int kind,
+                        LuaAvroSharedHandle *dest);
+} LuaAvroSharedHandleApi;
+
+typedef struct LuaAvroAsyncWriterApi {
+    int (*open)(const char *path, avro_schema_t schema, const char *codec,
+                size_t block_size, size_t queue_depth, size_t thread_count,
+                LuaAvroAsyncWriter **dest);
+    int (*append)(LuaAvroAsyncWriter *w, avro_value_t *value);
+    int (*flush)(LuaAvroAsyncWriter *w);
+    int (*close)(LuaAvroAsyncWriter *w);
+    int (*sync)(LuaAvroAsyncWriter *w);
+    int (*set_durability)(LuaAvroAsyncWriter *w, int durability,
+                          int64_t sync_interval);
+} LuaAvroAsyncWriterApi;
+
+typedef struct LuaAvroOutputFileApi {
+    int (*open)(const char *path, avro_schema_t schema, const char *codec,
+                size_t block_size, LuaAvroDataOutputFile *dest);
+    int (*sync)(LuaAvroDataOutputFile *file);
+    int (*close)(LuaAvroDataOutputFile *file);
+} LuaAvroOutputFileApi;
+
+typedef struct LuaAvroStats {
+    int64_t  values_created;
+    int64_t  values_freed;
+    int64_t  values_live;
+    int64_t  schemas_created;
+    int64_t  schemas_freed;
+    int64_t  schemas_live;
+    int64_t  resolvers_created;
+    int64_t  resolvers_freed;
+    int64_t  resolvers_live;
+    int64_t  files_opened;
+    int64_t  files_closed;
+    int64_t  files_live;
+    int64_t  alloc_calls;
+    int64_t  realloc_calls;
+    int64_t  free_calls;
+    int64_t  bytes_allocated;
+    int64_t  bytes_freed;
+    int64_t  bytes_live;
+    int64_t  bytes_peak;
+    int64_t  arena_slabs_live;
+} LuaAvroStats;
+
+typedef struct LuaAvroStatsApi {
+    void (*add)(int64_t *counter, int64_t n);
+} LuaAvroStatsApi;
+
+typedef struct LuaAvroHistogram {
+    int64_t  count;
+    int64_t  total_ns;
+    int64_t  min_ns;
+    int64_t  max_ns;
+    int64_t  bytes;
+    int64_t  buckets[48];
+} LuaAvroHistogram;
+
+typedef struct LuaAvroTimings {
+    int64_t  enabled;
+    LuaAvroHistogram  ops[5];
+} LuaAvroTimings;
+
+typedef struct LuaAvroTimingsApi {
+    int64_t (*now)(void);
+    void (*record)(int op, int64_t start, size_t bytes);
+} LuaAvroTimingsApi;
 ]]
 
 local avro_schema_t = ffi.typeof([[avro_schema_t]])
@@ -217,6 +305,75 @@ local LuaAvroValue
 local LuaAvroDataInputFile
 local LuaAvroDataOutputFile
 
+-- The statistics counters live in the legacy module; we update them
+-- directly for the objects that we create ourselves.
+local stats = ffi.cast([[LuaAvroStats *]], L.stats_counters())
+
+-- LuaJIT can't update the counters atomically, and we might be sharing
+-- them with other threads, so the legacy module does that for us.
+local stats_api = ffi.cast([[LuaAvroStatsApi *]], L.stats_api())
+
+local function stats_kind(created, freed, live)
+   local base = ffi.cast([[char *]], stats)
+   local function counter(field)
+      return ffi.cast([[int64_t *]],
+                      base + ffi.offsetof([[LuaAvroStats]], field))
+   end
+   return {
+      created=counter(created),
+      freed=counter(freed),
+      live=counter(live),
+   }
+end
+
+local VALUES_STATS =
+   stats_kind("values_created", "values_freed", "values_live")
+local RESOLVERS_STATS =
+   stats_kind("resolvers_created", "resolvers_freed", "resolvers_live")
+local FILES_STATS = stats_kind("files_opened", "files_closed", "files_live")
+
+local function stats_created(kind)
+   stats_api.add(kind.created, 1)
+   stats_api.add(kind.live, 1)
+end
+
+local function stats_freed(kind)
+   stats_api.add(kind.freed, 1)
+   stats_api.add(kind.live, -1)
+end
+
+-- Same for the timing histograms.  We only check whether they're
+-- enabled ourselves; the legacy module reads the clock and records each
+-- duration, so that both bindings use the same clock and update the
+-- histograms atomically.  The operation indices must match the TimingOp
+-- enum in the legacy module.
+local timings = ffi.cast([[LuaAvroTimings *]], L.timings_counters())
+local timings_api = ffi.cast([[LuaAvroTimingsApi *]], L.timings_api())
+-- The asynchronous file writers are implemented in the legacy module,
+-- which gives us a table of function pointers to call.
+local async_writer_api =
+   ffi.cast([[LuaAvroAsyncWriterApi *]], L.async_writer_api())
+local LuaAvroAsyncWriter_ptr = ffi.typeof([=[ LuaAvroAsyncWriter *[1] ]=])
+-- As are opening, syncing, and closing the synchronous writers, which
+-- need the file's stdio stream.
+local output_file_api =
+   ffi.cast([[LuaAvroOutputFileApi *]], L.output_file_api())
+
+local TIMING_ENCODE = 0
+local TIMING_DECODE = 1
+local TIMING_READ = 2
+local TIMING_WRITE = 3
+
+local function timing_start()
+   if timings.enabled == 0 then return 0 end
+   return timings_api.now()
+end
+
+local function timing_record(op, start, bytes)
+   if timings.enabled == 0 or start == 0 then return end
+   timings_api.record(op, start, bytes)
+end
+
 
 ------------------------------------------------------------------------
 -- Constants
@@ -253,6 +410,7 @@ typedef struct avro_writer_t  *avro_writer_t;
 ]]
 
 local char_p = ffi.typeof([=[ char * ]=])
+local const_char_p = ffi.typeof([=[ const char * ]=])
 local char_p_ptr = ffi.typeof([=[ char *[1] ]=])
 local const_char_p_ptr = ffi.typeof([=[ const char *[1] ]=])
 local double_ptr = ffi.typeof([=[ double[1] ]=])
@@ -261,6 +419,7 @@ local int_ptr = ffi.typeof([=[ int[1] ]=])
 local int8_t_ptr = ffi.typeof([=[ int8_t[1] ]=])
 local int32_t_ptr = ffi.typeof([=[ int32_t[1] ]=])
 local int64_t_ptr = ffi.typeof([=[ int64_t[1] ]=])
+local intptr_t = ffi.typeof([=[ intptr_t ]=])
 local size_t_ptr = ffi.typeof([=[ size_t[1] ]=])
 local void_p = ffi.typeof([=[ void * ]=])
 local void_p_ptr = ffi.typeof([=[ void *[1] ]=])
@@ -276,6 +435,22 @@ local avro_schema_error_t_ptr = ffi.typeof([=[ avro_schema_error_t[1] ]=])
 ------------------------------------------------------------------------
 -- Function declarations
 
+-- avro/data.h
+
+ffi.cdef [[
+typedef struct avro_raw_array {
+	size_t  element_size;
+	size_t  element_count;
+	size_t  allocated_size;
+	void  *data;
+} avro_raw_array_t;
+
+int
+avro_raw_array_ensure_size(avro_raw_array_t *array, size_t desired_count);
+]]
+
+local avro_raw_array_t_p = ffi.typeof([=[ avro_raw_array_t * ]=])
+
 -- avro/generic.h
 
 ffi.cdef [[
@@ -311,6 +486,14 @@ int
 avro_file_writer_create(const char *path, avro_schema_t schema,
                         avro_file_writer_t *writer);
 
+int
+avro_file_writer_create_with_codec(const char *path, avro_schema_t schema,
+                                   avro_file_writer_t *writer,
+                                   const char *codec, size_t block_size);
+
+int
+avro_file_writer_flush(avro_file_writer_t writer);
+
 avro_reader_t
 avro_reader_memory(const char *buf, int64_t len);
 
@@ -552,6 +735,7 @@ function Schema_class:new_raw_value(value)
    local rc = avro.avro_generic_value_new(self.iface, value)
    if rc ~= 0 then avro_error() end
    value.should_decref = true
+   stats_created(VALUES_STATS)
    return value
 end
 
@@ -559,19 +743,79 @@ function Schema_class:raw()
    return self.self
 end
 
+function Schema_class:raw_schema()
+   return self
+end
+
 function Schema_class:type()
    return self.self[0].type
 end
 
+-- Maps each schema that has a fingerprint (as a number) to its Schema
+-- instance.
+local single_object_schemas = setmetatable({}, { __mode = "v" })
+
+local function schema_key(schema)
+   return tonumber(ffi.cast(intptr_t, schema))
+end
+
+local function store_fingerprint(self, fingerprint)
+   if type(fingerprint) ~= "string" or #fingerprint ~= 8 then
+      error "Fingerprint must be 8 bytes"
+   end
+   self.single_object_header = "\195\001"..fingerprint
+end
+
+-- The fingerprint can also be a function that returns it, which we
+-- only call the first time we need the fingerprint.
+function Schema_class:set_fingerprint(fingerprint)
+   if type(fingerprint) == "function" then
+      self.single_object_header = nil
+      self.fingerprint_source = fingerprint
+   else
+      store_fingerprint(self, fingerprint)
+   end
+   single_object_schemas[schema_key(self.self)] = self
+end
+
+local function single_object_header(self)
+   if not self.single_object_header and self.fingerprint_source then
+      store_fingerprint(self, self.fingerprint_source())
+      self.fingerprint_source = nil
+   end
+   return self.single_object_header
+end
+
 function avro_module.ffi.avro.Schema(json)
    if getmetatable(json) == Schema_mt then
       return Schema_mt
    else
+      -- The legacy module parses the JSON, and records the schema_parse
+      -- timing while it's at it.
       local legacy, self = L.Schema(json)
       return new_schema(self, legacy)
    end
 end
 
+-- The fingerprint function only works on Lua strings, so we can use the
+-- legacy implementation as-is.
+avro_module.ffi.avro.fingerprint64 = L.fingerprint64
+
+-- The allocation arenas are installed into the Avro library itself,
+-- so they apply to values created via the FFI as well.
+avro_module.ffi.avro.with_arena = L.with_arena
+
+avro_module.ffi.avro.stats = L.stats
+avro_module.ffi.avro.reset_stats = L.reset_stats
+avro_module.ffi.avro.enable_allocation_stats = L.enable_allocation_stats
+avro_module.ffi.avro.enable_timings = L.enable_timings
+avro_module.ffi.avro.timings = L.timings
+avro_module.ffi.avro.reset_timings = L.reset_timings
+
+-- Parallel scans run their workers in separate Lua states, which always
+-- use the C binding, so we can use the legacy implementation as-is.
+avro_module.ffi.avro.parallel_scan = L.parallel_scan
+
 
 ------------------------------------------------------------------------
 -- Values
@@ -935,6 +1179,368 @@ function Value_class:add(key)
    return element
 end
 
+-- A scratch value that we use to walk to a record field, so that we
+-- don't have to allocate a new LuaAvroValue for scalar fields.
+local v_field
+
+local function get_field_by_index(record, index, field)
+   if record:type() ~= RECORD then
+      return nil, "Field handles can only be used with records"
+   end
+   if index < 1 then
+      return nil, "Record field doesn't exist"
+   end
+   local rc = record.iface.get_by_index(record.iface, record.self, index-1,
+                                        field, nil)
+   if rc ~= 0 then
+      return nil, "Record field doesn't exist"
+   end
+   return field
+end
+
+-- A field handle is either the index of a field, or an array-like table
+-- of indices that identifies a field in a nested record.  We also
+-- accept a field name, though that requires a lookup.
+local function get_field_by_handle(self, handle)
+   if type(handle) == "number" then
+      return get_field_by_index(self, handle, v_field)
+   end
+
+   if type(handle) == "string" then
+      if self:type() ~= RECORD then
+         return nil, "Field handles can only be used with records"
+      end
+      v_field.self = nil
+      local rc = self.iface.get_by_name(self.iface, self.self, handle,
+                                        v_field, nil)
+      if rc ~= 0 or v_field.self == nil then
+         return nil, "Record field doesn't exist"
+      end
+      return v_field
+   end
+
+   if #handle == 0 then
+      return nil, "Empty field handle"
+   end
+
+   local field, err = self
+   for i = 1, #handle do
+      field, err = get_field_by_index(field, handle[i], v_field)
+      if not field then return nil, err end
+   end
+   return field
+end
+
+local function is_compound(value_type)
+   return value_type == RECORD or value_type == ARRAY or
+          value_type == MAP or value_type == UNION
+end
+
+local function field_value(field)
+   if is_compound(field:type()) then
+      local result = LuaAvroValue()
+      result.iface = field.iface
+      result.self = field.self
+      result.should_decref = false
+      return result
+   end
+   return field:get()
+end
+
+function Value_class:get_field(handle)
+   local field, err = get_field_by_handle(self, handle)
+   if not field then return nil, err end
+   return field_value(field)
+end
+
+local function get_many_from(self, handles, i, count)
+   if i > count then return end
+   local field, err = get_field_by_handle(self, handles[i])
+   if not field then
+      error("Field handle "..i..": "..err)
+   end
+   return field_value(field), get_many_from(self, handles, i+1, count)
+end
+
+function Value_class:get_many(handles, out)
+   if out == nil then
+      return get_many_from(self, handles, 1, #handles)
+   end
+
+   for i = 1, #handles do
+      local field, err = get_field_by_handle(self, handles[i])
+      if not field then
+         error("Field handle "..i..": "..err)
+      end
+      out[i] = field_value(field)
+   end
+   return out
+end
+
+local function set_field(field, val)
+   if is_compound(field:type()) then
+      field:set_from_ast(val)
+   else
+      field:set(val)
+   end
+end
+
+function Value_class:set_field(handle, val)
+   local field, err = get_field_by_handle(self, handle)
+   if not field then return nil, err end
+   set_field(field, val)
+end
+
+function Value_class:set_many(values, handles)
+   if handles == nil then
+      for handle, val in pairs(values) do
+         local field, err = get_field_by_handle(self, handle)
+         if not field then error(err) end
+         set_field(field, val)
+      end
+      return
+   end
+
+   for i = 1, #handles do
+      local field, err = get_field_by_handle(self, handles[i])
+      if not field then
+         error("Field handle "..i..": "..err)
+      end
+      set_field(field, values[i])
+   end
+end
+
+-- Follows a compiled path from a root value; see the compile_path
+-- method of the schema classes for the format of the steps table.
+function Value_class:get_path(steps)
+   local current = self
+   for i = 1, #steps - 1, 2 do
+      local step_type = steps[i]
+      if current:type() ~= step_type then
+         return nil, "Path doesn't match value"
+      end
+
+      if step_type == RECORD or step_type == ARRAY then
+         local index = steps[i+1]
+         local rc = current.iface.get_size(current.iface, current.self, v_size)
+         if rc ~= 0 then avro_error() end
+         if index < 1 or index > v_size[0] then
+            return nil, "Index out of bounds"
+         end
+         rc = current.iface.get_by_index(current.iface, current.self,
+                                         index-1, v_field, nil)
+         if rc ~= 0 then avro_error() end
+
+      elseif step_type == MAP then
+         local parent_iface, parent_self = current.iface, current.self
+         v_field.iface = nil
+         v_field.self = nil
+         local rc = parent_iface.get_by_name(parent_iface, parent_self,
+                                             steps[i+1], v_field, nil)
+         if rc ~= 0 or v_field.self == nil then
+            return nil, "Map element doesn't exist"
+         end
+
+      elseif step_type == UNION then
+         local rc = current.iface.get_discriminant(current.iface,
+                                                   current.self, v_int)
+         if rc ~= 0 then avro_error() end
+         if v_int[0] ~= steps[i+1] - 1 then
+            return nil, "Union branch doesn't match path"
+         end
+         rc = current.iface.get_current_branch(current.iface, current.self,
+                                               v_field)
+         if rc ~= 0 then avro_error() end
+
+      else
+         error("Invalid path step type "..tostring(step_type))
+      end
+
+      current = v_field
+   end
+
+   return field_value(current)
+end
+
+-- The Avro C library doesn't give us a way to reserve space in an
+-- array, or to copy a block of numbers into one.  The generic array
+-- implementation stores its elements in an avro_raw_array_t, though,
+-- which is the only field of its instance struct.  We detect generic
+-- arrays by comparing their append method with that of a reference
+-- generic array class; for anything else (such as resolved values), we
+-- fall back on appending elements one at a time.
+
+local generic_array_class
+do
+   local int_schema = avro.avro_schema_int()
+   local array_schema = avro.avro_schema_array(int_schema)
+   generic_array_class = avro.avro_generic_class_from_schema(array_schema)
+   avro.avro_schema_decref(array_schema)
+   avro.avro_schema_decref(int_schema)
+end
+
+local function generic_raw_array(self)
+   if self.iface.append == generic_array_class.append then
+      return ffi.cast(avro_raw_array_t_p, self.self)
+   end
+   return nil
+end
+
+local function ensure_size(raw, count)
+   local rc = avro.avro_raw_array_ensure_size(raw, count)
+   if rc ~= 0 then avro_error() end
+end
+
+function Value_class:reserve(count)
+   if self:type() ~= ARRAY then
+      error "Can only reserve space in an array"
+   end
+   local raw = generic_raw_array(self)
+   if raw == nil or count < 0 then return false end
+   ensure_size(raw, count)
+   return true
+end
+
+function Value_class:append_many(values)
+   if self:type() ~= ARRAY then
+      error "Can only append to an array"
+   end
+
+   local count = #values
+   local raw = generic_raw_array(self)
+   if raw ~= nil then ensure_size(raw, raw.element_count + count) end
+
+   for i = 1, count do
+      local rc = self.iface.append(self.iface, self.self, v_field, nil)
+      if rc ~= 0 then avro_error() end
+      set_field(v_field, values[i])
+   end
+end
+
+local BUFFER_INT32 = { ctype=ffi.typeof([=[ const int32_t * ]=]),
+                       size=4, avro_type=INT }
+local BUFFER_INT64 = { ctype=ffi.typeof([=[ const int64_t * ]=]),
+                       size=8, avro_type=LONG }
+local BUFFER_FLOAT = { ctype=ffi.typeof([=[ const float * ]=]),
+                       size=4, avro_type=FLOAT }
+local BUFFER_DOUBLE = { ctype=ffi.typeof([=[ const double * ]=]),
+                        size=8, avro_type=DOUBLE }
+
+local BUFFER_TYPES = {
+   int = BUFFER_INT32,
+   int32_t = BUFFER_INT32,
+   long = BUFFER_INT64,
+   int64_t = BUFFER_INT64,
+   float = BUFFER_FLOAT,
+   double = BUFFER_DOUBLE,
+}
+
+function Value_class:append_buffer(buf, count, ctype)
+   local buf_type = BUFFER_TYPES[ctype]
+   if not buf_type then
+      error("Invalid buffer type "..tostring(ctype))
+   end
+   if type(count) ~= "number" or count < 0 or count ~= math.floor(count) then
+      error("Invalid element count "..tostring(count))
+   end
+
+   if type(buf) == "string" then
+      if count * buf_type.size > #buf then
+         error "Buffer is too small"
+      end
+      buf = ffi.cast(const_char_p, buf)
+   end
+   local ptr = ffi.cast(buf_type.ctype, buf)
+
+   if self:type() ~= ARRAY then
+      error "Can only append to an array"
+   end
+
+   local schema = self.iface.get_schema(self.iface, self.self)
+   local item_schema = avro.avro_schema_array_items(schema)
+   local raw = generic_raw_array(self)
+   if raw ~= nil and item_schema[0].type == buf_type.avro_type and
+      raw.element_size == buf_type.size then
+      local start = raw.element_count
+      ensure_size(raw, start + count)
+      ffi.copy(ffi.cast(char_p, raw.data) + start * buf_type.size,
+               ptr, count * buf_type.size)
+      raw.element_count = start + count
+      return
+   end
+
+   if raw ~= nil then ensure_size(raw, raw.element_count + count) end
+
+   local item_type = item_schema[0].type
+   if item_type ~= INT and item_type ~= LONG and
+      item_type ~= FLOAT and item_type ~= DOUBLE then
+      error "Can only append numbers to an int, long, float, or double array"
+   end
+
+   for i = 0, count-1 do
+      local rc = self.iface.append(self.iface, self.self, v_field, nil)
+      if rc ~= 0 then avro_error() end
+      local val = ptr[i]
+      if buf_type == BUFFER_INT64 and item_type ~= LONG then
+         val = tonumber(val)
+      end
+      v_field:set(val)
+   end
+end
+
+local VIEW_TYPES = {
+   [INT] = { ptr=ffi.typeof([=[ int32_t * ]=]),
+             array=ffi.typeof([=[ int32_t[?] ]=]), size=4 },
+   [LONG] = { ptr=ffi.typeof([=[ int64_t * ]=]),
+              array=ffi.typeof([=[ int64_t[?] ]=]), size=8 },
+   [FLOAT] = { ptr=ffi.typeof([=[ float * ]=]),
+               array=ffi.typeof([=[ float[?] ]=]), size=4 },
+   [DOUBLE] = { ptr=ffi.typeof([=[ double * ]=]),
+                array=ffi.typeof([=[ double[?] ]=]), size=8 },
+}
+
+-- Returns a typed FFI pointer to the elements of an int, long, float,
+-- or double array, along with the number of elements.  For generic
+-- arrays, the pointer aliases the array's own storage, so it's only
+-- valid until the array is modified, reset, or released.  If the
+-- array's storage can't be aliased (for instance, for resolved values),
+-- or if dest is given, we copy the elements into dest (or a new FFI
+-- array) instead.  dest must have room for all of the elements.
+function Value_class:as_ffi_view(dest)
+   if self:type() ~= ARRAY then
+      error "Can only create a view of an array"
+   end
+
+   local schema = self.iface.get_schema(self.iface, self.self)
+   local item_schema = avro.avro_schema_array_items(schema)
+   local view_type = VIEW_TYPES[item_schema[0].type]
+   if not view_type then
+      error "Can only create a view of an int, long, float, or double array"
+   end
+
+   local raw = generic_raw_array(self)
+   if raw ~= nil and raw.element_size == view_type.size then
+      local count = tonumber(raw.element_count)
+      local ptr = ffi.cast(view_type.ptr, raw.data)
+      if dest == nil then
+         return ptr, count
+      end
+      ffi.copy(dest, ptr, count * view_type.size)
+      return dest, count
+   end
+
+   local rc = self.iface.get_size(self.iface, self.self, v_size)
+   if rc ~= 0 then avro_error() end
+   local count = tonumber(v_size[0])
+   dest = dest or view_type.array(count)
+   for i = 0, count-1 do
+      rc = self.iface.get_by_index(self.iface, self.self, i, v_field, nil)
+      if rc ~= 0 then avro_error() end
+      dest[i] = v_field:get()
+   end
+   return dest, count
+end
+
 function Value_class:size()
    local value_type = self:type()
    if value_type == ARRAY then
@@ -982,8 +1588,10 @@ function Value_class:discriminant()
    return ffi.string(avro.avro_schema_type_name(branch))
 end
 
-function Value_class:encode()
-   local size = self:encoded_size()
+function Value_class:encode(header)
+   local start = timing_start()
+   local header_size = header and #header or 0
+   local size = self:encoded_size() + header_size
 
    -- Use the static buffer if we can, to save on some mallocs.
    local buf, free_buf
@@ -996,7 +1604,12 @@ function Value_class:encode()
       free_buf = true
    end
 
-   avro.avro_writer_memory_set_dest(memory_writer, buf, size)
+   if header_size > 0 then
+      ffi.copy(buf, header, header_size)
+   end
+
+   avro.avro_writer_memory_set_dest(memory_writer, buf + header_size,
+                                    size - header_size)
    local rc = avro.avro_value_write(memory_writer, self)
 
    if rc ~= 0 then
@@ -1005,10 +1618,22 @@ function Value_class:encode()
    else
       local result = ffi.string(buf, size)
       if free_buf then ffi.C.free(buf) end
+      timing_record(TIMING_ENCODE, start, size)
       return result
    end
 end
 
+function Value_class:encode_single_object()
+   local schema = self.iface.get_schema(self.iface, self.self)
+   local l_schema = single_object_schemas[schema_key(schema)]
+   local header = l_schema and l_schema.self == schema and
+                  single_object_header(l_schema)
+   if not header then
+      return nil, "Schema doesn't have a fingerprint"
+   end
+   return self:encode(header)
+end
+
 function Value_class:encoded_size()
    local rc = avro.avro_value_sizeof(self, v_size)
    if rc ~= 0 then avro_error() end
@@ -1016,22 +1641,37 @@ function Value_class:encoded_size()
 end
 
 function avro_module.ffi.avro.raw_encode_value(self, buf, size)
+   local start = timing_start()
    local writer = avro.avro_writer_memory(buf, size)
    local rc = avro.avro_value_write(writer, self)
+   local written = avro.avro_writer_tell(writer)
    avro.avro_writer_free(writer)
    if rc == 0 then
+      timing_record(TIMING_ENCODE, start, written)
       return true
    else
       return get_avro_error()
    end
 end
 
+local function iterate_element(state, element)
+   if not state.no_scalar and not is_compound(element:type()) then
+      return element:get()
+   end
+   if state.element then return element end
+   local result = LuaAvroValue()
+   result.iface = element.iface
+   result.self = element.self
+   result.should_decref = false
+   return result
+end
+
 local function iterate_array(state, unused)
    -- NOTE: state.next_index is 0-based
    -- Have we reached the end?
    if state.next_index >= state.length then return nil end
    -- Nope.
-   local element = LuaAvroValue()
+   local element = state.element or v_field
    local rc = state.value.iface.get_by_index(
       state.value.iface, state.value.self,
       state.next_index, element, nil
@@ -1039,7 +1679,7 @@ local function iterate_array(state, unused)
    if rc ~= 0 then avro_error() end
    state.next_index = state.next_index + 1
    -- Result should be a 1-based index for Lua
-   return state.next_index, element
+   return state.next_index, iterate_element(state, element)
 end
 
 local function iterate_map(state, unused)
@@ -1047,45 +1687,49 @@ local function iterate_map(state, unused)
    -- Have we reached the end?
    if state.next_index >= state.length then return nil end
    -- Nope.
-   local key = ffi.new(const_char_p_ptr)
-   local element = LuaAvroValue()
+   local element = state.element or v_field
    local rc = state.value.iface.get_by_index(
       state.value.iface, state.value.self,
-      state.next_index, element, key
+      state.next_index, element, state.key
    )
    if rc ~= 0 then avro_error() end
    state.next_index = state.next_index + 1
-   return ffi.string(key[0]), element
+   return ffi.string(state.key[0]), iterate_element(state, element)
 end
 
-function Value_class:iterate()
+-- Iterates through the elements of an array or map.  Scalar elements
+-- are translated into the Lua equivalent unless no_scalar is true.  If
+-- reuse is true, a single value instance is pointed at each element in
+-- turn, so elements can't be kept after the iteration that produced
+-- them.
+function Value_class:iterate(no_scalar, reuse)
    local value_type = self:type()
+   local iterate
 
    if value_type == ARRAY then
-      local rc = self.iface.get_size(self.iface, self.self, v_size)
-      if rc ~= 0 then avro_error() end
-      local state = {
-         no_scalar = no_scalar,
-         value = self,
-         next_index = 0,
-         length = v_size[0],
-      }
-      return iterate_array, state, nil
-
+      iterate = iterate_array
    elseif value_type == MAP then
-      local rc = self.iface.get_size(self.iface, self.self, v_size)
-      if rc ~= 0 then avro_error() end
-      local state = {
-         no_scalar = no_scalar,
-         value = self,
-         next_index = 0,
-         length = v_size[0],
-      }
-      return iterate_map, state, nil
-
+      iterate = iterate_map
    else
       error "Can only iterate arrays and maps"
    end
+
+   local rc = self.iface.get_size(self.iface, self.self, v_size)
+   if rc ~= 0 then avro_error() end
+   local state = {
+      no_scalar = no_scalar,
+      value = self,
+      next_index = 0,
+      length = v_size[0],
+   }
+   if value_type == MAP then
+      state.key = ffi.new(const_char_p_ptr)
+   end
+   if reuse then
+      state.element = LuaAvroValue()
+      state.element.should_decref = false
+   end
+   return iterate, state, nil
 end
 
 
@@ -1219,6 +1863,7 @@ end
 function Value_class:release()
    if self.should_decref and self.self ~= nil then
       avro.avro_value_decref(self)
+      stats_freed(VALUES_STATS)
    end
    self.iface = nil
    self.self = nil
@@ -1237,6 +1882,7 @@ end
 
 LuaAvroValue = ffi.metatype([[avro_value_t]], Value_mt)
 avro_module.ffi.avro.LuaAvroValue = LuaAvroValue
+v_field = LuaAvroValue()
 
 ------------------------------------------------------------------------
 -- ResolvedReaders
@@ -1250,6 +1896,7 @@ function ResolvedReader_class:new_raw_value()
    local rc = avro.avro_resolved_reader_new_value(self.resolver, value)
    if rc ~= 0 then avro_error() end
    value.should_decref = true
+   stats_created(VALUES_STATS)
    return value
 end
 
@@ -1257,6 +1904,7 @@ function ResolvedReader_mt:__gc()
    if self.resolver ~= nil then
       self.resolver.decref_iface(self.resolver)
       self.resolver = nil
+      stats_freed(RESOLVERS_STATS)
    end
 end
 
@@ -1266,6 +1914,7 @@ local function ResolvedReader(wschema, rschema)
    rschema = rschema:raw_schema().self
    resolver.resolver = avro.avro_resolved_reader_new(wschema, rschema)
    if resolver.resolver == nil then return get_avro_error() end
+   stats_created(RESOLVERS_STATS)
    return resolver
 end
 
@@ -1286,21 +1935,31 @@ function ResolvedWriter_class:new_raw_value()
    local rc = avro.avro_resolved_writer_new_value(self.resolver, value)
    if rc ~= 0 then avro_error() end
    value.should_decref = true
+   stats_created(VALUES_STATS)
    return value
 end
 
 local function raw_decode_value(resolver, buf, size, dest)
+   local start = timing_start()
    avro.avro_reader_memory_set_source(memory_reader, buf, size)
    avro.avro_resolved_writer_set_dest(resolver.value, dest)
    local rc = avro.avro_value_read(memory_reader, resolver.value)
    if rc == 0 then
+      timing_record(TIMING_DECODE, start, size)
       return true
    else
       return get_avro_error()
    end
 end
 
-function ResolvedWriter_class:decode(buf, dest)
+function ResolvedWriter_class:decode(buf, dest, offset)
+   if offset then
+      if offset < 0 or offset > #buf then
+         return nil, "Offset out of bounds"
+      end
+      local start = ffi.cast(const_char_p, buf) + offset
+      return raw_decode_value(self, start, #buf - offset, dest)
+   end
    return raw_decode_value(self, buf, #buf, dest)
 end
 
@@ -1314,6 +1973,7 @@ function ResolvedWriter_mt:__gc()
    if self.resolver ~= nil then
       self.resolver.decref_iface(self.resolver)
       self.resolver = nil
+      stats_freed(RESOLVERS_STATS)
    end
 end
 
@@ -1323,6 +1983,7 @@ local function ResolvedWriter(wschema, rschema)
    rschema = rschema:raw_schema().self
    resolver.resolver = avro.avro_resolved_writer_new(wschema, rschema)
    if resolver.resolver == nil then return get_avro_error() end
+   stats_created(RESOLVERS_STATS)
    local rc = avro.avro_resolved_writer_new_value(resolver.resolver, resolver.value)
    if rc ~= 0 then return get_avro_error() end
    return resolver
@@ -1332,6 +1993,310 @@ avro_module.ffi.avro.LuaAvroResolvedWriter = LuaAvroResolvedWriter
 avro_module.ffi.avro.ResolvedWriter = ResolvedWriter
 avro_module.ffi.avro.raw_decode_value = raw_decode_value
 
+------------------------------------------------------------------------
+-- Shared handles
+
+-- Schemas are wrappers around legacy schema instances, so we can use
+-- the legacy implementation to share them.  Resolvers are our own, so
+-- we use the legacy module's handle table directly.
+
+local shared_handle_api =
+   ffi.cast([[LuaAvroSharedHandleApi *]], L.shared_handle_api())
+local SHARED_SCHEMA = 0
+local SHARED_RESOLVED_READER = 1
+local SHARED_RESOLVED_WRITER = 2
+local SHARED_HANDLE_SIZE = 64
+
+function avro_module.ffi.avro.export_schema(schema)
+   local raw = schema:raw_schema()
+   local fingerprint
+   local header = single_object_header(raw)
+   if header then
+      fingerprint = header:sub(3)
+   end
+   return L.export_schema(raw.legacy, fingerprint)
+end
+
+function avro_module.ffi.avro.import_schema(handle)
+   local legacy, self, iface, fingerprint = L.import_schema(handle)
+   if not legacy then return nil, self end
+   local schema = new_schema(self, legacy)
+   -- The iface is owned by the legacy instance.
+   schema.iface = ffi.cast([[avro_value_iface_t *]], iface)
+   if fingerprint then
+      schema:set_fingerprint(fingerprint)
+   end
+   return schema
+end
+
+function avro_module.ffi.avro.export_resolver(resolver)
+   local kind
+   if ffi.istype(LuaAvroResolvedReader, resolver) then
+      kind = SHARED_RESOLVED_READER
+   elseif ffi.istype(LuaAvroResolvedWriter, resolver) then
+      kind = SHARED_RESOLVED_WRITER
+   else
+      error("Can only export ResolvedReaders and ResolvedWriters")
+   end
+   local handle = ffi.new([[ char[?] ]], SHARED_HANDLE_SIZE)
+   local rc = shared_handle_api.export_iface(
+      kind, nil, resolver.resolver, nil, handle)
+   if rc ~= 0 then avro_error() end
+   return ffi.string(handle)
+end
+
+function avro_module.ffi.avro.import_resolver(handle)
+   local shared = ffi.new([[LuaAvroSharedHandle]])
+   if shared_handle_api.import_iface(
+         handle, SHARED_RESOLVED_READER, shared) == 0 then
+      local resolver = LuaAvroResolvedReader()
+      resolver.resolver = shared.iface
+      stats_created(RESOLVERS_STATS)
+      return resolver
+   end
+
+   if shared_handle_api.import_iface(
+         handle, SHARED_RESOLVED_WRITER, shared) == 0 then
+      local resolver = LuaAvroResolvedWriter()
+      resolver.resolver = shared.iface
+      stats_created(RESOLVERS_STATS)
+      local rc = avro.avro_resolved_writer_new_value(
+         resolver.resolver, resolver.value)
+      if rc ~= 0 then return get_avro_error() end
+      return resolver
+   end
+
+   return nil, "Unknown resolver handle "..handle
+end
+
+avro_module.ffi.avro.release_handle = L.release_handle
+
+------------------------------------------------------------------------
+-- Channels
+
+-- The channel itself lives in the legacy module, which also handles
+-- closing and exporting it.  We send and receive through channel_api,
+-- so that we can use our own values.  Our avro_value_t has an extra
+-- field, so batches are copied into an array of plain values first.
+
+ffi.cdef [[
+typedef struct LuaAvroChannelValue {
+    avro_value_iface_t  *iface;
+    void  *self;
+} LuaAvroChannelValue;
+
+typedef struct LuaAvroChannelApi {
+    int (*send)(void *c, avro_writer_t writer, LuaAvroChannelValue *values,
+                size_t count, bool wait);
+    int (*receive)(void *c, avro_reader_t reader, avro_value_t *dest,
+                   bool wait);
+} LuaAvroChannelApi;
+]]
+
+local channel_api = ffi.cast([[LuaAvroChannelApi *]], L.channel_api())
+local LuaAvroChannelValue_array = ffi.typeof([[LuaAvroChannelValue[?] ]])
+local EAGAIN = L.EAGAIN
+local EPIPE = L.EPIPE
+
+local Channel_class = {}
+local Channel_mt = { __index = Channel_class }
+
+local function new_channel(legacy, channel)
+   if not legacy then return nil, channel end
+   local obj = { legacy = legacy, channel = channel }
+   return setmetatable(obj, Channel_mt)
+end
+
+local function channel_send_result(rc)
+   if rc == EAGAIN then return false, "full" end
+   if rc ~= 0 then avro_error() end
+   return true
+end
+
+function Channel_class:send(value, wait)
+   local plain = LuaAvroChannelValue_array(1)
+   plain[0].iface = value.iface
+   plain[0].self = value.self
+   local rc = channel_api.send(
+      self.channel, memory_writer, plain, 1, wait and true or false)
+   return channel_send_result(rc)
+end
+
+function Channel_class:send_batch(values, wait)
+   local count = #values
+   if count == 0 then return true end
+   local plain = LuaAvroChannelValue_array(count)
+   for i = 1, count do
+      plain[i-1].iface = values[i].iface
+      plain[i-1].self = values[i].self
+   end
+   local rc = channel_api.send(
+      self.channel, memory_writer, plain, count, wait and true or false)
+   return channel_send_result(rc)
+end
+
+function Channel_class:receive(value, wait)
+   local rc = channel_api.receive(
+      self.channel, memory_reader, value, wait and true or false)
+   if rc == EAGAIN then return nil, "empty" end
+   if rc == EPIPE then return nil, "closed" end
+   if rc ~= 0 then avro_error() end
+   return value
+end
+
+function Channel_class:close()
+   return self.legacy:close()
+end
+
+function Channel_class:export()
+   return self.legacy:export()
+end
+
+function avro_module.ffi.avro.Channel(capacity)
+   return new_channel(L.Channel(capacity))
+end
+
+function avro_module.ffi.avro.import_channel(handle)
+   return new_channel(L.import_channel(handle))
+end
+
+------------------------------------------------------------------------
+-- Rolling writers
+
+-- The legacy module manages the sequence of files; we only need to
+-- write our own values through rolling_writer_api.
+
+ffi.cdef [[
+typedef struct LuaAvroRollingWriterApi {
+    int (*append)(void *rw, avro_value_t *value);
+} LuaAvroRollingWriterApi;
+]]
+
+local rolling_writer_api =
+   ffi.cast([[LuaAvroRollingWriterApi *]], L.rolling_writer_api())
+
+local RollingWriter_class = {}
+local RollingWriter_mt = { __index = RollingWriter_class }
+
+function RollingWriter_class:write_raw(value)
+   if self.writer == nil then error("Rolling writer has been closed") end
+   local start = timing_start()
+   local rc = rolling_writer_api.append(self.writer, value)
+   if rc ~= 0 then avro_error() end
+   timing_record(TIMING_WRITE, start, 0)
+end
+
+function RollingWriter_class:roll()
+   return self.legacy:roll()
+end
+
+function RollingWriter_class:flush()
+   return self.legacy:flush()
+end
+
+function RollingWriter_class:path()
+   return self.legacy:path()
+end
+
+function RollingWriter_class:close()
+   self.writer = nil
+   return self.legacy:close()
+end
+
+function avro_module.ffi.avro.RollingWriter(pattern, schema, options)
+   local legacy, writer =
+      L.RollingWriter(pattern, schema:raw_schema().legacy, options)
+   if not legacy then return nil, writer end
+   local obj = { legacy = legacy, writer = writer }
+   return setmetatable(obj, RollingWriter_mt)
+end
+
+------------------------------------------------------------------------
+-- Stream readers
+
+-- Like channels, the parser lives in the legacy module, which also
+-- handles feeding it; we read records through stream_reader_api, so
+-- that we can decode into our own values.
+
+ffi.cdef [[
+typedef struct LuaAvroStreamReaderApi {
+    int (*fill)(void *s);
+    int (*next)(void *s, avro_value_t *dest);
+    avro_value_iface_t *(*iface)(void *s);
+} LuaAvroStreamReaderApi;
+]]
+
+local stream_reader_api =
+   ffi.cast([[LuaAvroStreamReaderApi *]], L.stream_reader_api())
+
+local StreamReader_class = {}
+local StreamReader_mt = { __index = StreamReader_class }
+
+function StreamReader_class:feed(chunk)
+   return self.legacy:feed(chunk)
+end
+
+function StreamReader_class:finish()
+   return self.legacy:finish()
+end
+
+function StreamReader_class:schema_json()
+   return self.legacy:schema_json()
+end
+
+function StreamReader_class:next(value)
+   if self.stream == nil then error("Stream reader has been closed") end
+   local rc = stream_reader_api.fill(self.stream)
+   if rc == EAGAIN then return nil, "need more data" end
+   if rc == EPIPE then return nil, "eof" end
+   if rc ~= 0 then return get_avro_error() end
+
+   if not value then
+      value = LuaAvroValue()
+      local rc = avro.avro_generic_value_new(
+         stream_reader_api.iface(self.stream), value)
+      if rc ~= 0 then avro_error() end
+      value.should_decref = true
+      stats_created(VALUES_STATS)
+
+      local start = timing_start()
+      local rc = stream_reader_api.next(self.stream, value)
+      if rc ~= 0 then
+         value:release()
+         return get_avro_error()
+      end
+      timing_record(TIMING_READ, start, 0)
+      return value
+   end
+
+   local start = timing_start()
+   local rc = stream_reader_api.next(self.stream, value)
+   if rc ~= 0 then return get_avro_error() end
+   timing_record(TIMING_READ, start, 0)
+   return value
+end
+
+StreamReader_class.read_raw = StreamReader_class.next
+
+function StreamReader_class:wait(timeout)
+   return self.legacy:wait(timeout)
+end
+
+function StreamReader_class:close()
+   self.stream = nil
+   return self.legacy:close()
+end
+
+local function new_stream_reader(legacy, stream)
+   if not legacy then return nil, stream end
+   local obj = { legacy = legacy, stream = stream }
+   return setmetatable(obj, StreamReader_mt)
+end
+
+function avro_module.ffi.avro.StreamReader()
+   return new_stream_reader(L.StreamReader())
+end
+
 ------------------------------------------------------------------------
 -- Data files
 
@@ -1343,6 +2308,7 @@ local function new_input_file(reader)
    l_reader.reader = reader
    l_reader.wschema = avro.avro_file_reader_get_writer_schema(reader)
    l_reader.iface = avro.avro_generic_class_from_schema(l_reader.wschema)
+   stats_created(FILES_STATS)
    return l_reader
 end
 
@@ -1360,17 +2326,22 @@ function DataInputFile_class:read_raw(value)
       local rc = avro.avro_generic_value_new(self.iface, value)
       if rc ~= 0 then avro_error() end
       value.should_decref = true
+      stats_created(VALUES_STATS)
 
+      local start = timing_start()
       local rc = avro.avro_file_reader_read_value(self.reader, value)
       if rc ~= 0 then
          value:release()
          return get_avro_error()
       end
+      timing_record(TIMING_READ, start, 0)
       return value
    end
 
+   local start = timing_start()
    local rc = avro.avro_file_reader_read_value(self.reader, value)
    if rc ~= 0 then return get_avro_error() end
+   timing_record(TIMING_READ, start, 0)
    return value
 end
 
@@ -1378,6 +2349,7 @@ function DataInputFile_class:close()
    if self.reader ~= nil then
       avro.avro_file_reader_close(self.reader)
       self.reader = nil
+      stats_freed(FILES_STATS)
    end
    self.wschema = nil
    if self.iface ~= nil then
@@ -1396,36 +2368,101 @@ local DataOutputFile_class = {}
 local DataOutputFile_mt = { __index = DataOutputFile_class }
 
 function DataOutputFile_class:write_raw(value)
-   local rc = avro.avro_file_writer_append_value(self.writer, value)
+   local start = timing_start()
+   local rc
+   if self.async ~= nil then
+      rc = async_writer_api.append(self.async, value)
+   elseif self.writer ~= nil then
+      rc = avro.avro_file_writer_append_value(self.writer, value)
+   else
+      error("File is closed")
+   end
    if rc ~= 0 then avro_error() end
+   timing_record(TIMING_WRITE, start, 0)
 end
 
-function DataOutputFile_class:close()
+function DataOutputFile_class:flush()
+   local rc = 0
    if self.writer ~= nil then
-      avro.avro_file_writer_close(self.writer)
-      self.writer = nil
+      rc = avro.avro_file_writer_flush(self.writer)
+   elseif self.async ~= nil then
+      rc = async_writer_api.flush(self.async)
    end
+   if rc ~= 0 then avro_error() end
+end
+
+function DataOutputFile_class:sync()
+   local rc = output_file_api.sync(self)
+   if rc ~= 0 then avro_error() end
+end
+
+-- Closes the file, returning an error code if any buffered values
+-- couldn't be written.
+local function close_output_file(self)
+   return output_file_api.close(self)
+end
+
+function DataOutputFile_class:close()
+   local rc = close_output_file(self)
+   if rc ~= 0 then avro_error() end
 end
 
-DataOutputFile_mt.__gc = DataOutputFile_class.close
+DataOutputFile_mt.__gc = close_output_file
 LuaAvroDataOutputFile = ffi.metatype([[LuaAvroDataOutputFile]], DataOutputFile_mt)
 avro_module.ffi.avro.LuaAvroDataOutputFile = LuaAvroDataOutputFile
 
-function avro_module.ffi.avro.open(path, mode, schema)
+local DURABILITY = { none = 0, block = 1, interval = 2 }
+
+function avro_module.ffi.avro.open(path, mode, schema, options)
    mode = mode or "r"
 
    if mode == "r" then
+      -- The read-ahead thread lives in the C binding; we just wrap the
+      -- reader that it gives us.
+      local options = schema
+      if type(options) == "table" and options.follow then
+         return new_stream_reader(L.follow_file_reader(path, options))
+      end
+      if type(options) == "table" and options.prefetch then
+         local reader, err = L.prefetch_file_reader(path, options.prefetch)
+         if not reader then error(err) end
+         return new_input_file(ffi.cast([[avro_file_reader_t]], reader))
+      end
+
       local reader = ffi.new(avro_file_reader_t_ptr)
       local rc = avro.avro_file_reader(path, reader)
       if rc ~= 0 then avro_error() end
       return new_input_file(reader[0])
 
    elseif mode == "w" then
-      local writer = ffi.new(avro_file_writer_t_ptr)
+      local options = options or {}
       schema = schema:raw_schema().self
-      local rc = avro.avro_file_writer_create(path, schema, writer)
+      local threads = options.compression_threads or 0
+      local interval_ms = options.interval_ms or 0
+      local durability = DURABILITY[options.durability or
+         (interval_ms > 0 and "interval" or "none")]
+      if not durability then
+         error("Invalid durability "..tostring(options.durability))
+      end
+
+      -- Only the asynchronous writer can sync blocks as they're written.
+      if options.async or threads > 1 or durability ~= 0 then
+         local writer = ffi.new(LuaAvroAsyncWriter_ptr)
+         local rc = async_writer_api.open(
+            path, schema, options.codec, options.block_size or 0,
+            options.queue_depth or 0, threads, writer)
+         if rc ~= 0 then avro_error() end
+         async_writer_api.set_durability(
+            writer[0], durability, interval_ms * 1000000)
+         stats_created(FILES_STATS)
+         return LuaAvroDataOutputFile(nil, writer[0])
+      end
+
+      local file = LuaAvroDataOutputFile()
+      local rc = output_file_api.open(
+         path, schema, options.codec, options.block_size or 0, file)
       if rc ~= 0 then avro_error() end
-      return LuaAvroDataOutputFile(writer[0])
+      return file
 
    else
       error("Invalid mode "..mode)
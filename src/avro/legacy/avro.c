@@ -7,10 +7,25 @@
  * ----------------------------------------------------------------------
  */
 
+/* We need fopencookie for read-ahead readers on glibc. */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #include <avro.h>
 #include <lauxlib.h>
@@ -27,6 +42,11 @@
 #define luaL_register(L,n,l) (luaL_setfuncs(L, l, 0))
 #endif
 
+#ifndef lua_getfenv
+#define lua_getfenv     lua_getuservalue
+#define lua_setfenv     lua_setuservalue
+#endif
+
 #endif
 
 #if LUA_VERSION_NUM >= 503 /* Lua 5.3 */
@@ -44,6 +64,369 @@ int
 lua_avro_push_schema_no_link(lua_State *L, avro_schema_t schema);
 
 
+/*-----------------------------------------------------------------------
+ * Portability
+ */
+
+/**
+ * Custom read-only streams are built with fopencookie on Linux, and
+ * funopen on the BSDs and macOS.  Anywhere else, reader_stream_open
+ * fails with ENOTSUP, and callers fall back on something simpler.
+ */
+
+#if defined(__linux__)
+#define LUA_AVRO_HAVE_FOPENCOOKIE  1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || \
+      defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+#define LUA_AVRO_HAVE_FUNOPEN  1
+#endif
+
+typedef ssize_t
+(*ReaderStreamRead)(void *cookie, char *buf, size_t size);
+typedef int
+(*ReaderStreamClose)(void *cookie);
+
+#if LUA_AVRO_HAVE_FUNOPEN
+typedef struct _ReaderStream
+{
+    void  *cookie;
+    ReaderStreamRead  read;
+    ReaderStreamClose  close;
+} ReaderStream;
+
+static int
+reader_stream_read(void *vs, char *buf, int size)
+{
+    ReaderStream  *s = vs;
+    return (int) s->read(s->cookie, buf, (size_t) size);
+}
+
+static int
+reader_stream_close(void *vs)
+{
+    ReaderStream  *s = vs;
+    int  rc = (s->close == NULL)? 0: s->close(s->cookie);
+    free(s);
+    return rc;
+}
+#endif
+
+static FILE *
+reader_stream_open(void *cookie, ReaderStreamRead read,
+                   ReaderStreamClose close)
+{
+#if LUA_AVRO_HAVE_FOPENCOOKIE
+    cookie_io_functions_t  functions = { read, NULL, NULL, close };
+    return fopencookie(cookie, "r", functions);
+#elif LUA_AVRO_HAVE_FUNOPEN
+    ReaderStream  *s = malloc(sizeof(ReaderStream));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->cookie = cookie;
+    s->read = read;
+    s->close = close;
+    FILE  *fp = funopen(s, reader_stream_read, NULL, NULL,
+                        reader_stream_close);
+    if (fp == NULL) {
+        free(s);
+    }
+    return fp;
+#else
+    errno = ENOTSUP;
+    return NULL;
+#endif
+}
+
+/**
+ * Opens a read-only stream over a memory buffer.  fmemopen is only
+ * available on newer macOS releases, so wherever we have funopen, we
+ * use that instead.
+ */
+
+#if LUA_AVRO_HAVE_FUNOPEN
+typedef struct _MemoryStream
+{
+    const char  *buf;
+    size_t  size;
+    size_t  pos;
+} MemoryStream;
+
+static ssize_t
+memory_stream_read(void *vs, char *buf, size_t size)
+{
+    MemoryStream  *s = vs;
+    if (size > s->size - s->pos) {
+        size = s->size - s->pos;
+    }
+    memcpy(buf, s->buf + s->pos, size);
+    s->pos += size;
+    return size;
+}
+
+static int
+memory_stream_close(void *vs)
+{
+    free(vs);
+    return 0;
+}
+#endif
+
+static FILE *
+memory_stream_open(void *buf, size_t size)
+{
+#if LUA_AVRO_HAVE_FUNOPEN
+    MemoryStream  *s = malloc(sizeof(MemoryStream));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->buf = buf;
+    s->size = size;
+    s->pos = 0;
+    FILE  *fp = reader_stream_open(s, memory_stream_read,
+                                   memory_stream_close);
+    if (fp == NULL) {
+        free(s);
+    }
+    return fp;
+#else
+    return fmemopen(buf, size, "rb");
+#endif
+}
+
+/**
+ * fdatasync isn't available everywhere (notably macOS); fsync is a
+ * slower but always correct substitute.
+ */
+
+static int
+lua_avro_fdatasync(int fd)
+{
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+/**
+ * Condition variables that are used for timed waits are set up with
+ * cond_init.  Where we can choose their clock (pthread_condattr_setclock),
+ * they use the monotonic clock; where we can't (macOS), they use the
+ * realtime clock.  cond_deadline converts a deadline on the monotonic
+ * clock (like the timestamps from timing_now) into a timespec for
+ * pthread_cond_timedwait.
+ */
+
+#if defined(_POSIX_CLOCK_SELECTION) && _POSIX_CLOCK_SELECTION > 0
+#define LUA_AVRO_HAVE_COND_CLOCK  1
+#endif
+
+static void
+cond_init(pthread_cond_t *cond)
+{
+#if LUA_AVRO_HAVE_COND_CLOCK
+    pthread_condattr_t  cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+#else
+    pthread_cond_init(cond, NULL);
+#endif
+}
+
+static void
+cond_deadline(int64_t deadline, struct timespec *ts)
+{
+#if !LUA_AVRO_HAVE_COND_CLOCK
+    struct timespec  mono;
+    struct timespec  real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    deadline += ((int64_t) real.tv_sec - mono.tv_sec) * 1000000000 +
+        (real.tv_nsec - mono.tv_nsec);
+#endif
+    ts->tv_sec = deadline / 1000000000;
+    ts->tv_nsec = deadline % 1000000000;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Statistics
+ */
+
+/**
+ * Counters that track how many objects of each kind we've created and
+ * freed, and how much memory the Avro library has allocated.  The
+ * "live" counters are gauges, and aren't affected when the statistics
+ * are reset.  The memory counters are only updated while they're
+ * turned on with enable_allocation_stats.  The FFI binding updates
+ * these same counters for the objects that it creates, so this struct's
+ * layout is duplicated there.
+ */
+
+typedef struct _LuaAvroStats
+{
+    int64_t  values_created;
+    int64_t  values_freed;
+    int64_t  values_live;
+    int64_t  schemas_created;
+    int64_t  schemas_freed;
+    int64_t  schemas_live;
+    int64_t  resolvers_created;
+    int64_t  resolvers_freed;
+    int64_t  resolvers_live;
+    int64_t  files_opened;
+    int64_t  files_closed;
+    int64_t  files_live;
+    int64_t  alloc_calls;
+    int64_t  realloc_calls;
+    int64_t  free_calls;
+    int64_t  bytes_allocated;
+    int64_t  bytes_freed;
+    int64_t  bytes_live;
+    int64_t  bytes_peak;
+    int64_t  arena_slabs_live;
+} LuaAvroStats;
+
+static LuaAvroStats  stats;
+
+/**
+ * Avro objects can be created and freed from worker threads (see
+ * parallel_scan below), so the counters are updated atomically.
+ */
+
+#define atomic_add(var, n)  __atomic_add_fetch(&(var), (n), __ATOMIC_RELAXED)
+
+#define stats_created(kind) \
+    do { \
+        atomic_add(stats.kind##_created, 1); \
+        atomic_add(stats.kind##_live, 1); \
+    } while (0)
+#define stats_freed(kind) \
+    do { \
+        atomic_add(stats.kind##_freed, 1); \
+        atomic_add(stats.kind##_live, -1); \
+    } while (0)
+
+
+/**
+ * Optional latency histograms for the main serialization operations.
+ * Durations are measured in nanoseconds, and bucketed by their bit
+ * length: bucket 0 holds zero-length durations, and bucket b holds
+ * durations in the range [2^(b-1), 2^b).  When timings are disabled,
+ * the only cost is checking the enabled flag.  The FFI binding checks
+ * that flag directly, so this layout is duplicated there, but it goes
+ * through timings_api to read the clock and record durations.
+ *
+ * An empty histogram's min_ns is INT64_MAX, so that several threads can
+ * lower it with a compare-and-swap without having to agree on which of
+ * them recorded the first duration.
+ */
+
+#define TIMING_BUCKETS  48
+
+typedef enum {
+    TIMING_ENCODE,
+    TIMING_DECODE,
+    TIMING_READ,
+    TIMING_WRITE,
+    TIMING_SCHEMA_PARSE,
+    TIMING_OP_COUNT
+} TimingOp;
+
+static const char  *TIMING_OP_NAMES[TIMING_OP_COUNT] =
+{
+    "encode", "decode", "read_raw", "write_raw", "schema_parse"
+};
+
+typedef struct _LuaAvroHistogram
+{
+    int64_t  count;
+    int64_t  total_ns;
+    int64_t  min_ns;
+    int64_t  max_ns;
+    int64_t  bytes;
+    int64_t  buckets[TIMING_BUCKETS];
+} LuaAvroHistogram;
+
+typedef struct _LuaAvroTimings
+{
+    int64_t  enabled;
+    LuaAvroHistogram  ops[TIMING_OP_COUNT];
+} LuaAvroTimings;
+
+static LuaAvroTimings  timings;
+static pthread_once_t  timings_once = PTHREAD_ONCE_INIT;
+
+static void
+timings_clear(void)
+{
+    int  op;
+    memset(timings.ops, 0, sizeof(timings.ops));
+    for (op = 0; op < TIMING_OP_COUNT; op++) {
+        timings.ops[op].min_ns = INT64_MAX;
+    }
+}
+
+static void
+timings_init(void)
+{
+    pthread_once(&timings_once, timings_clear);
+}
+
+static int64_t
+timing_now(void)
+{
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t
+timing_start(void)
+{
+    return timings.enabled? timing_now(): 0;
+}
+
+static void
+timing_record(TimingOp op, int64_t start, size_t bytes)
+{
+    if (!timings.enabled || start == 0) {
+        return;
+    }
+
+    int64_t  elapsed = timing_now() - start;
+    LuaAvroHistogram  *hist = &timings.ops[op];
+    int  bucket = 0;
+    uint64_t  rest;
+    for (rest = elapsed; rest != 0; rest >>= 1) {
+        bucket++;
+    }
+    if (bucket >= TIMING_BUCKETS) {
+        bucket = TIMING_BUCKETS - 1;
+    }
+
+    int64_t  min = __atomic_load_n(&hist->min_ns, __ATOMIC_RELAXED);
+    while (elapsed < min &&
+           !__atomic_compare_exchange_n(&hist->min_ns, &min, elapsed, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        /* Someone else updated the minimum; try again. */
+    }
+    int64_t  max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+    while (elapsed > max &&
+           !__atomic_compare_exchange_n(&hist->max_ns, &max, elapsed, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        /* Someone else updated the maximum; try again. */
+    }
+    atomic_add(hist->count, 1);
+    atomic_add(hist->total_ns, elapsed);
+    atomic_add(hist->bytes, (int64_t) bytes);
+    atomic_add(hist->buckets[bucket], 1);
+}
+
+
 /*-----------------------------------------------------------------------
  * Lua access — data
  */
@@ -79,6 +462,20 @@ lua_avro_error(lua_State *L)
         } \
     } while (0)
 
+/**
+ * Like check, but for functions that return an Avro error code rather
+ * than a Lua result.
+ */
+
+#define check_rc(call) \
+    do { \
+        int __rc; \
+        __rc = call; \
+        if (__rc != 0) { \
+            return __rc; \
+        } \
+    } while (0)
+
 
 typedef struct _LuaAvroValue
 {
@@ -95,6 +492,9 @@ lua_avro_push_value(lua_State *L, avro_value_t *value, bool should_decref)
     l_value = lua_newuserdata(L, sizeof(LuaAvroValue));
     l_value->value = *value;
     l_value->should_decref = should_decref;
+    if (should_decref) {
+        stats_created(values);
+    }
     luaL_getmetatable(L, MT_AVRO_VALUE);
     lua_setmetatable(L, -2);
     return 1;
@@ -383,18 +783,14 @@ select_union_branch(lua_State *L, avro_value_t *value, int branch_index)
 }
 
 /**
- * Extract the contents of an Avro value.  For scalars, we push the
- * equivalent Lua value onto the stack.  For arrays and maps, we
- * retrieve the element the given index.  For records, we retrieve the
- * field with the given name or index.  For unions, we return the
- * current branch.
+ * Pushes the contents of a scalar Avro value onto the stack as the
+ * equivalent Lua value.  If the value is not a scalar, we raise a Lua
+ * error.
  */
 
 static int
-l_value_get(lua_State *L)
+lua_avro_get_scalar(lua_State *L, avro_value_t *value)
 {
-    avro_value_t  *value = lua_avro_get_value(L, 1);
-
     switch (avro_value_get_type(value))
     {
       case AVRO_STRING:
@@ -482,6 +878,28 @@ l_value_get(lua_State *L)
             return 1;
         }
 
+      default:
+        return luaL_error(L, "Don't know how to get from value type %d",
+                          avro_value_get_type(value));
+    }
+}
+
+
+/**
+ * Extract the contents of an Avro value.  For scalars, we push the
+ * equivalent Lua value onto the stack.  For arrays and maps, we
+ * retrieve the element the given index.  For records, we retrieve the
+ * field with the given name or index.  For unions, we return the
+ * current branch.
+ */
+
+static int
+l_value_get(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+
+    switch (avro_value_get_type(value))
+    {
       case AVRO_ARRAY:
         {
             lua_Integer  index = luaL_checkinteger(L, 2);
@@ -610,8 +1028,7 @@ l_value_get(lua_State *L)
         }
 
       default:
-        return luaL_error(L, "Don't know how to get from value type %d",
-                          avro_value_get_type(value));
+        return lua_avro_get_scalar(L, value);
     }
 }
 
@@ -631,21 +1048,19 @@ l_value_hash(lua_State *L)
 
 
 /**
- * Sets the value value of an Avro scalar.  If the value is not a
- * scalar, we raise a Lua error.
+ * Sets the value of a scalar Avro value from the Lua value at the given
+ * stack index.  If the value is not a scalar, we raise a Lua error.
  */
 
 static int
-l_value_set(lua_State *L)
+lua_avro_set_scalar(lua_State *L, avro_value_t *value, int index)
 {
-    avro_value_t  *value = lua_avro_get_value(L, 1);
-
     switch (avro_value_get_type(value))
     {
       case AVRO_STRING:
         {
             size_t  str_len;
-            const char  *str = luaL_checklstring(L, 2, &str_len);
+            const char  *str = luaL_checklstring(L, index, &str_len);
             /* value length must include NUL terminator */
             check(avro_value_set_string_len(value, (char *) str, str_len+1));
             return 0;
@@ -654,42 +1069,42 @@ l_value_set(lua_State *L)
       case AVRO_BYTES:
         {
             size_t  len;
-            const char  *buf = luaL_checklstring(L, 2, &len);
+            const char  *buf = luaL_checklstring(L, index, &len);
             check(avro_value_set_bytes(value, (void *) buf, len));
             return 0;
         }
 
       case AVRO_INT32:
         {
-            lua_Integer  i = luaL_checkinteger(L, 2);
+            lua_Integer  i = luaL_checkinteger(L, index);
             check(avro_value_set_int(value, i));
             return 0;
         }
 
       case AVRO_INT64:
         {
-            long  l = luaL_checklong(L, 2);
+            long  l = luaL_checklong(L, index);
             check(avro_value_set_long(value, l));
             return 0;
         }
 
       case AVRO_FLOAT:
         {
-            lua_Number  n = luaL_checknumber(L, 2);
+            lua_Number  n = luaL_checknumber(L, index);
             check(avro_value_set_float(value, (float) n));
             return 0;
         }
 
       case AVRO_DOUBLE:
         {
-            lua_Number  n = luaL_checknumber(L, 2);
+            lua_Number  n = luaL_checknumber(L, index);
             check(avro_value_set_double(value, (double) n));
             return 0;
         }
 
       case AVRO_BOOLEAN:
         {
-            int  b = lua_toboolean(L, 2);
+            int  b = lua_toboolean(L, index);
             check(avro_value_set_boolean(value, b));
             return 0;
         }
@@ -704,12 +1119,12 @@ l_value_set(lua_State *L)
         {
             int  symbol_value;
 
-            if (lua_isnumber(L, 2)) {
-                symbol_value = lua_tointeger(L, 2) - 1;
+            if (lua_isnumber(L, index)) {
+                symbol_value = lua_tointeger(L, index) - 1;
             }
 
             else {
-                const char  *symbol = luaL_checkstring(L, 2);
+                const char  *symbol = luaL_checkstring(L, index);
                 avro_schema_t  enum_schema = avro_value_get_schema(value);
                 symbol_value = avro_schema_enum_get_by_name(enum_schema, symbol);
                 if (symbol_value < 0) {
@@ -724,11 +1139,30 @@ l_value_set(lua_State *L)
       case AVRO_FIXED:
         {
             size_t  len = 0;
-            const char  *buf = luaL_checklstring(L, 2, &len);
+            const char  *buf = luaL_checklstring(L, index, &len);
             check(avro_value_set_fixed(value, (void *) buf, len));
             return 0;
         }
 
+      default:
+        return luaL_error(L, "Don't know how to set in value type %d",
+                          avro_value_get_type(value));
+    }
+}
+
+
+/**
+ * Sets the value value of an Avro scalar.  If the value is not a
+ * scalar, we raise a Lua error.
+ */
+
+static int
+l_value_set(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+
+    switch (avro_value_get_type(value))
+    {
       case AVRO_MAP:
         {
             const char  *key = luaL_checkstring(L, 2);
@@ -750,8 +1184,7 @@ l_value_set(lua_State *L)
         }
 
       default:
-        return luaL_error(L, "Don't know how to set in value type %d",
-                          avro_value_get_type(value));
+        return lua_avro_set_scalar(L, value, 2);
     }
 }
 
@@ -921,1008 +1354,7210 @@ l_value_set_from_ast(lua_State *L)
 
 
 /**
- * Adds a new element to an Avro map.  The first parameter is always the
- * key of the new element.  If called with two parameter, then the map
- * values must be scalars, and the parameter is used as the value of the
- * new element.  If called with one parameter, then the map can contain
- * any kind of value.  In both cases, we return the AvroValue for the
- * new element.
+ * Retrieves the field of a record with the given (1-based) index.
+ * Returns true if the field exists; otherwise pushes nil and an error
+ * message onto the stack.
  */
 
-static int
-l_value_add(lua_State *L)
+static bool
+get_field_by_index(lua_State *L, avro_value_t *record, lua_Integer index,
+                   avro_value_t *field)
 {
-    int  nargs = lua_gettop(L);
-    avro_value_t  *value = lua_avro_get_value(L, 1);
-    const char  *key = luaL_checkstring(L, 2);
-
-    if (avro_value_get_type(value) != AVRO_MAP) {
-        lua_pushliteral(L, "Can only add to an map");
-        return lua_error(L);
+    if (avro_value_get_type(record) != AVRO_RECORD) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Field handles can only be used with records");
+        return false;
     }
 
-    if (nargs > 3) {
-        lua_pushliteral(L, "Bad number of arguments to AvroValue:add");
-        return lua_error(L);
+    if (index < 1 ||
+        avro_value_get_by_index(record, index-1, field, NULL) != 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Record field doesn't exist");
+        return false;
     }
 
-    avro_value_t  element;
-    check(avro_value_add(value, key, &element, NULL, NULL));
-    lua_avro_push_value(L, &element, false);
-
-    /*
-     * Otherwise just return the new element value.
-     */
-
-    return 1;
+    return true;
 }
 
 
 /**
- * Appends a new element to an Avro array.  If called with one
- * parameter, then the array must contain scalars, and the parameter is
- * used as the value of the new element.  If called with no parameters,
- * then the array can contain any kind of element.  In both cases, we
- * return the AvroValue for the new element.
+ * Retrieves a record field using a field handle.  A field handle is
+ * either the index of a field, or an array-like table of indices that
+ * identifies a field in a nested record.  We also accept a field name,
+ * though that requires a lookup.  Returns true if the field exists;
+ * otherwise pushes nil and an error message onto the stack.
  */
 
-static int
-l_value_append(lua_State *L)
+static bool
+get_field_by_handle(lua_State *L, avro_value_t *value, int handle_index,
+                    avro_value_t *field)
 {
-    avro_value_t  *value = lua_avro_get_value(L, 1);
+    if (lua_type(L, handle_index) == LUA_TNUMBER) {
+        lua_Integer  index = lua_tointeger(L, handle_index);
+        return get_field_by_index(L, value, index, field);
+    }
 
-    if (avro_value_get_type(value) != AVRO_ARRAY) {
-        lua_pushliteral(L, "Can only append to an array");
-        return lua_error(L);
+    if (lua_type(L, handle_index) == LUA_TSTRING) {
+        const char  *name = lua_tostring(L, handle_index);
+        field->self = NULL;
+        if (avro_value_get_type(value) != AVRO_RECORD ||
+            avro_value_get_by_name(value, name, field, NULL) != 0 ||
+            field->self == NULL) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "Record field doesn't exist");
+            return false;
+        }
+        return true;
     }
 
-    avro_value_t  element;
-    check(avro_value_append(value, &element, NULL));
-    lua_avro_push_value(L, &element, false);
-    return 1;
+    luaL_checktype(L, handle_index, LUA_TTABLE);
+    size_t  depth = lua_objlen(L, handle_index);
+    if (depth == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Empty field handle");
+        return false;
+    }
+
+    *field = *value;
+    size_t  i;
+    for (i = 1; i <= depth; i++) {
+        avro_value_t  parent = *field;
+        lua_rawgeti(L, handle_index, i);
+        lua_Integer  index = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if (!get_field_by_index(L, &parent, index, field)) {
+            return false;
+        }
+    }
+
+    return true;
 }
 
 
 /**
- * Iterates through the elements of an Avro array or map.  The result of
- * this function can be used as a for loop iterator.  For arrays, the
- * iterator behaves like the builtin ipairs function, returning [i,
- * element] pairs during each iteration.  For maps, it behaves like the
- * builtin pairs function, returning [key, element] pairs.  In both
- * cases, if the elements are scalars, these will be translated into the
- * Lua equivalent; if they're compound value objects, you'll get an
- * AvroValue instance.
+ * Pushes a record field onto the stack.  Scalar fields are pushed as
+ * the equivalent Lua value; compound fields as an AvroValue.
  */
 
-typedef struct _Iterator
+static int
+push_field(lua_State *L, avro_value_t *field)
 {
-    bool  no_scalar;
-    avro_value_t  *value;
-    size_t  next_index;
-} Iterator;
-
-#define MT_ITERATOR "sawmill:AvroValue:iterator"
+    switch (avro_value_get_type(field))
+    {
+      case AVRO_ARRAY:
+      case AVRO_MAP:
+      case AVRO_RECORD:
+      case AVRO_UNION:
+        lua_avro_push_value(L, field, false);
+        return 1;
 
-static void
-create_iterator(lua_State *L, avro_value_t *value, bool no_scalar)
-{
-    lua_newuserdata(L, sizeof(Iterator));
-    Iterator  *state = lua_touserdata(L, -1);
-    state->no_scalar = no_scalar;
-    state->value = value;
-    state->next_index = 0;
-    luaL_getmetatable(L, MT_ITERATOR);
-    lua_setmetatable(L, -2);
+      default:
+        return lua_avro_get_scalar(L, field);
+    }
 }
 
+
+/**
+ * Returns a record field identified by a field handle, which can be
+ * created with the field_handle method of a record schema.  Scalar
+ * fields are returned as the equivalent Lua value, without creating an
+ * intermediate AvroValue.
+ */
+
 static int
-iterator_gc(lua_State *L)
+l_value_get_field(lua_State *L)
 {
-    Iterator  *state = luaL_checkudata(L, 1, MT_ITERATOR);
-    state->value = NULL;
-    return 0;
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    avro_value_t  field;
+    if (!get_field_by_handle(L, value, 2, &field)) {
+        return 2;
+    }
+    return push_field(L, &field);
 }
 
+
+/**
+ * Returns several record fields at once.  The first parameter is an
+ * array-like table of field handles (or field names).  If a second
+ * table is given, the field values are stored into it, using the same
+ * indices as the handles, and we return that table.  Otherwise we
+ * return each of the field values.  As with get_field, scalar fields
+ * are returned as the equivalent Lua value.
+ */
+
 static int
-iterate_array(lua_State *L)
+l_value_get_many(lua_State *L)
 {
-    Iterator  *state = luaL_checkudata(L, 1, MT_ITERATOR);
-    size_t  length;
-    check(avro_value_get_size(state->value, &length));
-
-    /*
-     * next_index is the 0-based avro index, not the 1-based Lua index.
-     */
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    bool  fill_table = !lua_isnoneornil(L, 3);
+    if (fill_table) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+    lua_settop(L, 3);
 
-    if (state->next_index >= length) {
-        return 0;
+    int  count = lua_objlen(L, 2);
+    if (!fill_table) {
+        luaL_checkstack(L, count + 3, "Too many fields");
     }
 
-    avro_value_t  element;
-    check(avro_value_get_by_index(state->value, state->next_index, &element, NULL));
-    lua_pushinteger(L, state->next_index+1);
-    lua_avro_push_value(L, &element, false);
+    int  i;
+    for (i = 1; i <= count; i++) {
+        avro_value_t  field;
+        lua_rawgeti(L, 2, i);
+        if (!get_field_by_handle(L, value, lua_gettop(L), &field)) {
+            return luaL_error(L, "Field handle %d: %s",
+                              i, lua_tostring(L, -1));
+        }
+        lua_pop(L, 1);
+        push_field(L, &field);
+        if (fill_table) {
+            lua_rawseti(L, 3, i);
+        }
+    }
 
-    state->next_index++;
-    return 2;
+    if (fill_table) {
+        return 1;
+    } else {
+        return count;
+    }
 }
 
-static int
-iterate_map(lua_State *L)
-{
-    Iterator  *state = luaL_checkudata(L, 1, MT_ITERATOR);
-    size_t  length;
-    check(avro_value_get_size(state->value, &length));
 
-    /*
-     * next_index is the 0-based avro index, not the 1-based Lua index.
-     */
+/**
+ * Sets a record field from the Lua value at the given stack index.
+ * Scalar fields are set directly from the Lua value; compound fields
+ * are filled in from a Lua AST, as in set_from_ast.
+ */
 
-    if (state->next_index >= length) {
+static int
+set_field(lua_State *L, avro_value_t *field, int val_index)
+{
+    switch (avro_value_get_type(field))
+    {
+      case AVRO_ARRAY:
+      case AVRO_MAP:
+      case AVRO_RECORD:
+      case AVRO_UNION:
+        lua_pushcfunction(L, l_value_set_from_ast);
+        lua_avro_push_value(L, field, false);
+        lua_pushvalue(L, val_index);
+        lua_call(L, 2, 0);
         return 0;
+
+      default:
+        return lua_avro_set_scalar(L, field, val_index);
     }
+}
 
-    const char  *key = NULL;
-    avro_value_t  element;
-    check(avro_value_get_by_index(state->value, state->next_index, &element, &key));
 
-    lua_pushstring(L, key);
-    lua_avro_push_value(L, &element, false);
+/**
+ * Sets a record field identified by a field handle.
+ */
 
-    state->next_index++;
-    return 2;
+static int
+l_value_set_field(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    avro_value_t  field;
+    if (!get_field_by_handle(L, value, 2, &field)) {
+        return 2;
+    }
+    return set_field(L, &field, 3);
 }
 
+
+/**
+ * Sets several record fields at once.  If only a table is given, its
+ * keys are field handles (or field names), and its values are the new
+ * field values.  If an array-like table of field handles is also
+ * given, then the first table is array-like too, and its values are
+ * matched up with the handles by position.  Fields are set as in
+ * set_field.
+ */
+
 static int
-l_value_iterate(lua_State *L)
+l_value_set_many(lua_State *L)
 {
     avro_value_t  *value = lua_avro_get_value(L, 1);
-    avro_type_t  value_type = avro_value_get_type(value);
-    int  no_scalar = lua_toboolean(L, 2);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 3);
+    avro_value_t  field;
 
-    if (value_type == AVRO_ARRAY) {
-        lua_pushcfunction(L, iterate_array);
-        create_iterator(L, value, no_scalar);
+    if (lua_isnil(L, 3)) {
         lua_pushnil(L);
-        return 3;
+        while (lua_next(L, 2) != 0) {
+            /* Stack is now: -2 key; -1 value */
+            if (!get_field_by_handle(L, value, lua_gettop(L)-1, &field)) {
+                return luaL_error(L, "%s", lua_tostring(L, -1));
+            }
+            set_field(L, &field, lua_gettop(L));
+            lua_pop(L, 1);
+        }
+        return 0;
     }
 
-    if (value_type == AVRO_MAP) {
-        lua_pushcfunction(L, iterate_map);
-        create_iterator(L, value, no_scalar);
-        lua_pushnil(L);
-        return 3;
+    luaL_checktype(L, 3, LUA_TTABLE);
+    int  count = lua_objlen(L, 3);
+    int  i;
+    for (i = 1; i <= count; i++) {
+        lua_rawgeti(L, 3, i);
+        if (!get_field_by_handle(L, value, lua_gettop(L), &field)) {
+            return luaL_error(L, "Field handle %d: %s",
+                              i, lua_tostring(L, -1));
+        }
+        lua_rawgeti(L, 2, i);
+        set_field(L, &field, lua_gettop(L));
+        lua_pop(L, 2);
     }
-
-    lua_pushliteral(L, "Can only iterate through arrays and maps");
-    return lua_error(L);
+    return 0;
 }
 
 
 /**
- * Encode an Avro value using the binary encoding.  Returns the result
- * as a Lua string.
+ * Pushes nil and an error message onto the stack, and returns the
+ * number of pushed values.  Used by the path accessor below.
  */
 
 static int
-l_value_encode(lua_State *L)
+path_error(lua_State *L, const char *message)
 {
-    static char  static_buf[65536];
+    lua_pushnil(L);
+    lua_pushstring(L, message);
+    return 2;
+}
+
+
+/**
+ * Follows a compiled path from a root value, and returns the value at
+ * the end of the path.  Paths are created by the compile_path method of
+ * a schema; the steps are given as a flat array-like table of (type,
+ * argument) pairs:
+ *
+ *   AVRO_RECORD, field index
+ *   AVRO_ARRAY,  element index
+ *   AVRO_MAP,    key
+ *   AVRO_UNION,  branch index
+ *
+ * All indices are 1-based.  A union step only matches if the union's
+ * current branch is the given one.  Scalar leaves are returned as the
+ * equivalent Lua value.  If the path doesn't exist in this value, we
+ * return nil and an error message.
+ */
 
+static int
+l_value_get_path(lua_State *L)
+{
     avro_value_t  *value = lua_avro_get_value(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    size_t  step_count = lua_objlen(L, 2);
+
+    avro_value_t  current = *value;
+    size_t  i;
+    for (i = 1; i < step_count; i += 2) {
+        avro_value_t  parent = current;
+        lua_rawgeti(L, 2, i);
+        avro_type_t  step_type = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+
+        if (avro_value_get_type(&parent) != step_type) {
+            return path_error(L, "Path doesn't match value");
+        }
 
-    size_t  size = 0;
-    check(avro_value_sizeof(value, &size));
+        switch (step_type)
+        {
+          case AVRO_RECORD:
+          case AVRO_ARRAY:
+            {
+                lua_rawgeti(L, 2, i+1);
+                lua_Integer  index = lua_tointeger(L, -1);
+                lua_pop(L, 1);
 
-    int  result;
-    char  *buf;
-    bool  free_buf;
+                size_t  size;
+                check(avro_value_get_size(&parent, &size));
+                if (index < 1 || index > size) {
+                    return path_error(L, "Index out of bounds");
+                }
+                check(avro_value_get_by_index(&parent, index-1, &current, NULL));
+                break;
+            }
 
-    if (size <= sizeof(static_buf)) {
-        buf = static_buf;
-        free_buf = false;
-    } else {
-        buf = malloc(size);
-        if (buf == NULL) {
-            lua_pushnil(L);
-            lua_pushliteral(L, "Out of memory");
-            return 2;
-        }
-        free_buf = true;
-    }
+          case AVRO_MAP:
+            {
+                lua_rawgeti(L, 2, i+1);
+                const char  *key = lua_tostring(L, -1);
+                current.iface = NULL;
+                current.self = NULL;
+                int  rc = -1;
+                if (key != NULL) {
+                    rc = avro_value_get_by_name(&parent, key, &current, NULL);
+                }
+                lua_pop(L, 1);
+                if (rc != 0 || current.self == NULL) {
+                    return path_error(L, "Map element doesn't exist");
+                }
+                break;
+            }
 
-    avro_writer_t  writer = avro_writer_memory(buf, size);
-    result = avro_value_write(writer, value);
-    avro_writer_free(writer);
+          case AVRO_UNION:
+            {
+                lua_rawgeti(L, 2, i+1);
+                lua_Integer  branch_index = lua_tointeger(L, -1);
+                lua_pop(L, 1);
+
+                int  discriminant;
+                check(avro_value_get_discriminant(&parent, &discriminant));
+                if (discriminant != branch_index-1) {
+                    return path_error(L, "Union branch doesn't match path");
+                }
+                check(avro_value_get_current_branch(&parent, &current));
+                break;
+            }
 
-    if (result) {
-        if (free_buf) {
-            free(buf);
+          default:
+            return luaL_error(L, "Invalid path step type %d", step_type);
         }
-        return lua_return_avro_error(L);
     }
 
-    lua_pushlstring(L, buf, size);
-    if (free_buf) {
-        free(buf);
-    }
-    return 1;
+    return push_field(L, &current);
 }
 
 
 /**
- * Return the length of the binary encoding of the value.
+ * Adds a new element to an Avro map.  The first parameter is always the
+ * key of the new element.  If called with two parameter, then the map
+ * values must be scalars, and the parameter is used as the value of the
+ * new element.  If called with one parameter, then the map can contain
+ * any kind of value.  In both cases, we return the AvroValue for the
+ * new element.
  */
 
 static int
-l_value_encoded_size(lua_State *L)
+l_value_add(lua_State *L)
 {
+    int  nargs = lua_gettop(L);
     avro_value_t  *value = lua_avro_get_value(L, 1);
+    const char  *key = luaL_checkstring(L, 2);
 
-    size_t  size = 0;
-    check(avro_value_sizeof(value, &size));
+    if (avro_value_get_type(value) != AVRO_MAP) {
+        lua_pushliteral(L, "Can only add to an map");
+        return lua_error(L);
+    }
+
+    if (nargs > 3) {
+        lua_pushliteral(L, "Bad number of arguments to AvroValue:add");
+        return lua_error(L);
+    }
+
+    avro_value_t  element;
+    check(avro_value_add(value, key, &element, NULL, NULL));
+    lua_avro_push_value(L, &element, false);
+
+    /*
+     * Otherwise just return the new element value.
+     */
 
-    lua_pushinteger(L, size);
     return 1;
 }
 
 
 /**
- * Encode an Avro value using the binary encoding.  The result is placed
- * into the given memory region, which is provided as a light user data
- * and a size.  There's no safety checking here; to make it easier to
- * not include this function in sandboxes, it's exposed as a global
- * function in the "avro" package, and not as a method of the AvroValue
- * class.
+ * Appends a new element to an Avro array.  If called with one
+ * parameter, then the array must contain scalars, and the parameter is
+ * used as the value of the new element.  If called with no parameters,
+ * then the array can contain any kind of element.  In both cases, we
+ * return the AvroValue for the new element.
  */
 
 static int
-l_value_encode_raw(lua_State *L)
+l_value_append(lua_State *L)
 {
     avro_value_t  *value = lua_avro_get_value(L, 1);
-    if (!lua_islightuserdata(L, 2)) {
-        return luaL_error(L, "Destination buffer should be a light userdata");
-    }
-    void  *buf = lua_touserdata(L, 2);
-    size_t  size = luaL_checkinteger(L, 3);
-
-    avro_writer_t  writer = avro_writer_memory(buf, size);
-    int  result = avro_value_write(writer, value);
-    avro_writer_free(writer);
 
-    if (result) {
-        lua_pushboolean(L, false);
-        lua_pushstring(L, avro_strerror());
-        return 2;
+    if (avro_value_get_type(value) != AVRO_ARRAY) {
+        lua_pushliteral(L, "Can only append to an array");
+        return lua_error(L);
     }
 
-    lua_pushboolean(L, true);
+    avro_value_t  element;
+    check(avro_value_append(value, &element, NULL));
+    lua_avro_push_value(L, &element, false);
     return 1;
 }
 
 
-/**
- * Finalizes an AvroValue instance.
+/*
+ * The Avro C library doesn't give us a way to reserve space in an
+ * array, or to copy a block of numbers into one.  The generic array
+ * implementation stores its elements in an avro_raw_array_t, though,
+ * which is the only field of its instance struct.  We detect generic
+ * arrays by comparing their append method with that of a reference
+ * generic array class; for anything else (such as resolved values),
+ * we fall back on appending elements one at a time.
  */
 
-static int
-l_value_release(lua_State *L)
+static avro_value_iface_t  *generic_array_class = NULL;
+static pthread_once_t  generic_array_class_once = PTHREAD_ONCE_INIT;
+
+static void
+generic_array_class_create(void)
 {
-    LuaAvroValue  *l_value = luaL_checkudata(L, 1, MT_AVRO_VALUE);
-    if (l_value->should_decref && l_value->value.self != NULL) {
-        avro_value_decref(&l_value->value);
-    }
-    l_value->value.iface = NULL;
-    l_value->value.self = NULL;
-    l_value->should_decref = false;
+    avro_schema_t  int_schema = avro_schema_int();
+    avro_schema_t  array_schema = avro_schema_array(int_schema);
+    generic_array_class = avro_generic_class_from_schema(array_schema);
+    avro_schema_decref(array_schema);
+    avro_schema_decref(int_schema);
+}
+
+/* Worker states can load the module at the same time. */
+static void
+generic_array_class_init(void)
+{
+    pthread_once(&generic_array_class_once, generic_array_class_create);
+}
+
+static avro_raw_array_t *
+generic_raw_array(avro_value_t *value)
+{
+    if (generic_array_class != NULL &&
+        value->iface->append == generic_array_class->append) {
+        return (avro_raw_array_t *) value->self;
+    }
+    return NULL;
+}
+
+
+/**
+ * Ensures that an Avro array has space for at least the given number
+ * of elements, so that appending to it doesn't need to reallocate.
+ * Returns true if we could reserve the space, or false if this kind of
+ * array doesn't support it.
+ */
+
+static int
+l_value_reserve(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    lua_Integer  count = luaL_checkinteger(L, 2);
+
+    if (avro_value_get_type(value) != AVRO_ARRAY) {
+        lua_pushliteral(L, "Can only reserve space in an array");
+        return lua_error(L);
+    }
+
+    avro_raw_array_t  *raw = generic_raw_array(value);
+    if (raw == NULL || count < 0) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    check(avro_raw_array_ensure_size(raw, count));
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+
+/**
+ * Appends each element of an array-like Lua table to an Avro array.
+ * Scalar elements are set directly from the Lua values; compound
+ * elements are filled in from a Lua AST, as in set_from_ast.
+ */
+
+static int
+l_value_append_many(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    if (avro_value_get_type(value) != AVRO_ARRAY) {
+        lua_pushliteral(L, "Can only append to an array");
+        return lua_error(L);
+    }
+
+    size_t  count = lua_objlen(L, 2);
+    avro_raw_array_t  *raw = generic_raw_array(value);
+    if (raw != NULL) {
+        check(avro_raw_array_ensure_size(raw, raw->element_count + count));
+    }
+
+    size_t  i;
+    for (i = 1; i <= count; i++) {
+        avro_value_t  element;
+        check(avro_value_append(value, &element, NULL));
+        lua_rawgeti(L, 2, i);
+        set_field(L, &element, lua_gettop(L));
+        lua_pop(L, 1);
+    }
+
+    return 0;
+}
+
+
+/**
+ * The C types that append_buffer can read from.
+ */
+
+typedef enum {
+    BUFFER_INT32,
+    BUFFER_INT64,
+    BUFFER_FLOAT,
+    BUFFER_DOUBLE
+} buffer_type_t;
+
+static const char  *BUFFER_TYPE_NAMES[] = {
+    "int", "int32_t", "long", "int64_t", "float", "double", NULL
+};
+
+static const buffer_type_t  BUFFER_TYPES[] = {
+    BUFFER_INT32, BUFFER_INT32, BUFFER_INT64, BUFFER_INT64,
+    BUFFER_FLOAT, BUFFER_DOUBLE
+};
+
+static const size_t  BUFFER_TYPE_SIZES[] = {
+    sizeof(int32_t), sizeof(int64_t), sizeof(float), sizeof(double)
+};
+
+/* The Avro type whose generic representation matches each C type. */
+static const avro_type_t  BUFFER_AVRO_TYPES[] = {
+    AVRO_INT32, AVRO_INT64, AVRO_FLOAT, AVRO_DOUBLE
+};
+
+
+/**
+ * Sets a numeric Avro value from an element of a C buffer, converting
+ * between number types if needed.
+ */
+
+static int
+set_from_buffer(avro_value_t *value, const void *buf,
+                buffer_type_t buf_type, size_t index)
+{
+    int64_t  i = 0;
+    double  d = 0;
+    switch (buf_type) {
+        case BUFFER_INT32:  i = ((const int32_t *) buf)[index]; d = i; break;
+        case BUFFER_INT64:  i = ((const int64_t *) buf)[index]; d = i; break;
+        case BUFFER_FLOAT:  d = ((const float *) buf)[index]; i = d; break;
+        case BUFFER_DOUBLE: d = ((const double *) buf)[index]; i = d; break;
+    }
+
+    switch (avro_value_get_type(value)) {
+        case AVRO_INT32:  return avro_value_set_int(value, (int32_t) i);
+        case AVRO_INT64:  return avro_value_set_long(value, i);
+        case AVRO_FLOAT:  return avro_value_set_float(value, (float) d);
+        case AVRO_DOUBLE: return avro_value_set_double(value, d);
+        default:
+            avro_set_error("Cannot append a number to this array");
+            return EINVAL;
+    }
+}
+
+
+/**
+ * Appends a block of numbers from a C buffer to an Avro array of ints,
+ * longs, floats, or doubles.  The buffer is given as a light userdata
+ * (or a Lua string), followed by the number of elements, and the C type
+ * of the elements ("int", "long", "float", or "double").  There's no
+ * safety checking for light userdata buffers.  If the buffer's type
+ * matches the array's element type, and the array is a generic array,
+ * we copy the whole block in one go.
+ */
+
+static int
+l_value_append_buffer(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    lua_Integer  count_arg = luaL_checkinteger(L, 3);
+    int  type_index = luaL_checkoption(L, 4, NULL, BUFFER_TYPE_NAMES);
+    buffer_type_t  buf_type = BUFFER_TYPES[type_index];
+    size_t  element_size = BUFFER_TYPE_SIZES[buf_type];
+
+    if (count_arg < 0 ||
+        (uint64_t) count_arg > SIZE_MAX / element_size) {
+        return luaL_error(L, "Invalid element count");
+    }
+    size_t  count = (size_t) count_arg;
+
+    const void  *buf;
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        size_t  buf_size;
+        buf = lua_tolstring(L, 2, &buf_size);
+        if (count > buf_size / element_size) {
+            return luaL_error(L, "Buffer is too small");
+        }
+    } else if (lua_islightuserdata(L, 2)) {
+        buf = lua_touserdata(L, 2);
+    } else {
+        return luaL_error(L, "Buffer should be a light userdata or string");
+    }
+
+    if (avro_value_get_type(value) != AVRO_ARRAY) {
+        lua_pushliteral(L, "Can only append to an array");
+        return lua_error(L);
+    }
+
+    avro_schema_t  item_schema =
+        avro_schema_array_items(avro_value_get_schema(value));
+    avro_raw_array_t  *raw = generic_raw_array(value);
+    bool  same_type = (avro_typeof(item_schema) == BUFFER_AVRO_TYPES[buf_type]);
+    if (raw != NULL && same_type && raw->element_size == element_size) {
+        check(avro_raw_array_ensure_size(raw, raw->element_count + count));
+        memcpy(avro_raw_array_get_raw(raw, raw->element_count),
+               buf, count * element_size);
+        raw->element_count += count;
+        return 0;
+    }
+
+    switch (avro_typeof(item_schema)) {
+        case AVRO_INT32:
+        case AVRO_INT64:
+        case AVRO_FLOAT:
+        case AVRO_DOUBLE:
+            break;
+        default:
+            return luaL_error(L, "Can only append numbers to an int, long, "
+                              "float, or double array");
+    }
+
+    if (raw != NULL) {
+        check(avro_raw_array_ensure_size(raw, raw->element_count + count));
+    }
+
+    size_t  i;
+    for (i = 0; i < count; i++) {
+        avro_value_t  element;
+        check(avro_value_append(value, &element, NULL));
+        check(set_from_buffer(&element, buf, buf_type, i));
+    }
+    return 0;
+}
+
+
+/**
+ * Iterates through the elements of an Avro array or map.  The result of
+ * this function can be used as a for loop iterator.  For arrays, the
+ * iterator behaves like the builtin ipairs function, returning [i,
+ * element] pairs during each iteration.  For maps, it behaves like the
+ * builtin pairs function, returning [key, element] pairs.  In both
+ * cases, if the elements are scalars, these will be translated into the
+ * Lua equivalent; if they're compound value objects, you'll get an
+ * AvroValue instance.  If no_scalar is true, you'll always get an
+ * AvroValue instance, even for scalar elements.
+ *
+ * If reuse is true, we create a single AvroValue instance up front, and
+ * point it at each element in turn, instead of creating a new instance
+ * for each element.  This means that you can't hold on to an element
+ * after the iteration that produced it.
+ */
+
+typedef struct _Iterator
+{
+    bool  no_scalar;
+    avro_value_t  *value;
+    size_t  next_index;
+} Iterator;
+
+#define MT_ITERATOR "sawmill:AvroValue:iterator"
+
+static void
+create_iterator(lua_State *L, avro_value_t *value, bool no_scalar)
+{
+    lua_newuserdata(L, sizeof(Iterator));
+    Iterator  *state = lua_touserdata(L, -1);
+    state->no_scalar = no_scalar;
+    state->value = value;
+    state->next_index = 0;
+    luaL_getmetatable(L, MT_ITERATOR);
+    lua_setmetatable(L, -2);
+}
+
+static int
+iterator_gc(lua_State *L)
+{
+    Iterator  *state = luaL_checkudata(L, 1, MT_ITERATOR);
+    state->value = NULL;
+    return 0;
+}
+
+static int
+push_element(lua_State *L, Iterator *state, avro_value_t *element)
+{
+    if (!state->no_scalar) {
+        switch (avro_value_get_type(element))
+        {
+          case AVRO_ARRAY:
+          case AVRO_MAP:
+          case AVRO_RECORD:
+          case AVRO_UNION:
+            break;
+
+          default:
+            return lua_avro_get_scalar(L, element);
+        }
+    }
+
+    if (lua_isnone(L, lua_upvalueindex(1))) {
+        return lua_avro_push_value(L, element, false);
+    }
+
+    LuaAvroValue  *l_value = lua_touserdata(L, lua_upvalueindex(1));
+    l_value->value = *element;
+    lua_pushvalue(L, lua_upvalueindex(1));
+    return 1;
+}
+
+static int
+iterate_array(lua_State *L)
+{
+    Iterator  *state = luaL_checkudata(L, 1, MT_ITERATOR);
+    size_t  length;
+    check(avro_value_get_size(state->value, &length));
+
+    /*
+     * next_index is the 0-based avro index, not the 1-based Lua index.
+     */
+
+    if (state->next_index >= length) {
+        return 0;
+    }
+
+    avro_value_t  element;
+    check(avro_value_get_by_index(state->value, state->next_index, &element, NULL));
+    lua_pushinteger(L, state->next_index+1);
+    push_element(L, state, &element);
+
+    state->next_index++;
+    return 2;
+}
+
+static int
+iterate_map(lua_State *L)
+{
+    Iterator  *state = luaL_checkudata(L, 1, MT_ITERATOR);
+    size_t  length;
+    check(avro_value_get_size(state->value, &length));
+
+    /*
+     * next_index is the 0-based avro index, not the 1-based Lua index.
+     */
+
+    if (state->next_index >= length) {
+        return 0;
+    }
+
+    const char  *key = NULL;
+    avro_value_t  element;
+    check(avro_value_get_by_index(state->value, state->next_index, &element, &key));
+
+    lua_pushstring(L, key);
+    push_element(L, state, &element);
+
+    state->next_index++;
+    return 2;
+}
+
+static int
+l_value_iterate(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    avro_type_t  value_type = avro_value_get_type(value);
+    int  no_scalar = lua_toboolean(L, 2);
+    int  reuse = lua_toboolean(L, 3);
+    lua_CFunction  iterate;
+
+    if (value_type == AVRO_ARRAY) {
+        iterate = iterate_array;
+    } else if (value_type == AVRO_MAP) {
+        iterate = iterate_map;
+    } else {
+        lua_pushliteral(L, "Can only iterate through arrays and maps");
+        return lua_error(L);
+    }
+
+    if (reuse) {
+        /*
+         * The shared element starts off pointing at the container
+         * itself; it's repointed before it's ever returned.  It never
+         * owns a reference, so there's nothing to decref.
+         */
+
+        lua_avro_push_value(L, value, false);
+        lua_pushcclosure(L, iterate, 1);
+    } else {
+        lua_pushcfunction(L, iterate);
+    }
+
+    create_iterator(L, value, no_scalar);
+    lua_pushnil(L);
+    return 3;
+}
+
+
+/**
+ * Encode an Avro value using the binary encoding.  Returns the result
+ * as a Lua string.  If a header string is given, it's copied verbatim
+ * in front of the encoded value, so that framed messages can be built
+ * without an extra concatenation.
+ */
+
+static int
+l_value_encode(lua_State *L)
+{
+    static char  static_buf[65536];
+
+    int64_t  start = timing_start();
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    size_t  header_size = 0;
+    const char  *header = NULL;
+    if (!lua_isnoneornil(L, 2)) {
+        header = luaL_checklstring(L, 2, &header_size);
+    }
+
+    size_t  size = 0;
+    check(avro_value_sizeof(value, &size));
+    size += header_size;
+
+    int  result;
+    char  *buf;
+    bool  free_buf;
+
+    if (size <= sizeof(static_buf)) {
+        buf = static_buf;
+        free_buf = false;
+    } else {
+        buf = malloc(size);
+        if (buf == NULL) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "Out of memory");
+            return 2;
+        }
+        free_buf = true;
+    }
+
+    if (header_size > 0) {
+        memcpy(buf, header, header_size);
+    }
+
+    avro_writer_t  writer =
+        avro_writer_memory(buf + header_size, size - header_size);
+    result = avro_value_write(writer, value);
+    avro_writer_free(writer);
+
+    if (result) {
+        if (free_buf) {
+            free(buf);
+        }
+        return lua_return_avro_error(L);
+    }
+
+    lua_pushlstring(L, buf, size);
+    if (free_buf) {
+        free(buf);
+    }
+    timing_record(TIMING_ENCODE, start, size);
+    return 1;
+}
+
+
+/**
+ * Return the length of the binary encoding of the value.
+ */
+
+static int
+l_value_encoded_size(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+
+    size_t  size = 0;
+    check(avro_value_sizeof(value, &size));
+
+    lua_pushinteger(L, size);
+    return 1;
+}
+
+
+/**
+ * Encode an Avro value using the binary encoding.  The result is placed
+ * into the given memory region, which is provided as a light user data
+ * and a size.  There's no safety checking here; to make it easier to
+ * not include this function in sandboxes, it's exposed as a global
+ * function in the "avro" package, and not as a method of the AvroValue
+ * class.
+ */
+
+static int
+l_value_encode_raw(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    if (!lua_islightuserdata(L, 2)) {
+        return luaL_error(L, "Destination buffer should be a light userdata");
+    }
+    void  *buf = lua_touserdata(L, 2);
+    size_t  size = luaL_checkinteger(L, 3);
+
+    int64_t  start = timing_start();
+    avro_writer_t  writer = avro_writer_memory(buf, size);
+    int  result = avro_value_write(writer, value);
+    size_t  written = avro_writer_tell(writer);
+    avro_writer_free(writer);
+
+    if (result) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, avro_strerror());
+        return 2;
+    }
+
+    timing_record(TIMING_ENCODE, start, written);
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+
+/**
+ * Finalizes an AvroValue instance.
+ */
+
+static int
+l_value_release(lua_State *L)
+{
+    LuaAvroValue  *l_value = luaL_checkudata(L, 1, MT_AVRO_VALUE);
+    if (l_value->should_decref && l_value->value.self != NULL) {
+        avro_value_decref(&l_value->value);
+        stats_freed(values);
+    }
+    l_value->value.iface = NULL;
+    l_value->value.self = NULL;
+    l_value->should_decref = false;
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lua access — schemas
+ */
+
+/**
+ * The string used to identify the AvroSchema class's metatable in the
+ * Lua registry.
+ */
+
+#define MT_AVRO_SCHEMA "avro:AvroSchema"
+
+/**
+ * The key of a weak table in the Lua registry, which maps each schema
+ * that has a fingerprint (as a light userdata) to its AvroSchema
+ * instance.
+ */
+
+#define SINGLE_OBJECT_SCHEMAS "avro:SingleObjectSchemas"
+
+/**
+ * Single-object encodings start with a two-byte marker, followed by
+ * the 8-byte Rabin fingerprint of the writer schema.
+ */
+
+#define SINGLE_OBJECT_MARKER_SIZE  2
+#define FINGERPRINT_SIZE  8
+#define SINGLE_OBJECT_HEADER_SIZE  (SINGLE_OBJECT_MARKER_SIZE + FINGERPRINT_SIZE)
+
+typedef struct _LuaAvroSchema
+{
+    avro_schema_t  schema;
+    avro_value_iface_t  *iface;
+    bool  has_fingerprint;
+    char  single_object_header[SINGLE_OBJECT_HEADER_SIZE];
+} LuaAvroSchema;
+
+
+int
+lua_avro_push_schema(lua_State *L, avro_schema_t schema)
+{
+    LuaAvroSchema  *l_schema;
+    l_schema = lua_newuserdata(L, sizeof(LuaAvroSchema));
+    l_schema->schema = avro_schema_incref(schema);
+    l_schema->iface = NULL;
+    l_schema->has_fingerprint = false;
+    stats_created(schemas);
+    luaL_getmetatable(L, MT_AVRO_SCHEMA);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+int
+lua_avro_push_schema_no_link(lua_State *L, avro_schema_t schema)
+{
+    while (is_avro_link(schema)) {
+        schema = avro_schema_link_target(schema);
+    }
+    return lua_avro_push_schema(L, schema);
+}
+
+
+avro_schema_t
+lua_avro_get_schema(lua_State *L, int index)
+{
+    lua_pushliteral(L, "raw_schema");
+    lua_gettable(L, index);
+    lua_pushvalue(L, index);
+    lua_call(L, 1, 1);
+    LuaAvroSchema  *l_schema = luaL_checkudata(L, -1, MT_AVRO_SCHEMA);
+    lua_pop(L, 1);
+    return l_schema->schema;
+}
+
+avro_schema_t
+lua_avro_get_raw_schema(lua_State *L, int index)
+{
+    LuaAvroSchema  *l_schema = luaL_checkudata(L, index, MT_AVRO_SCHEMA);
+    return l_schema->schema;
+}
+
+
+static int
+l_new_raw_schema(lua_State *L)
+{
+    avro_schema_t  schema = lua_touserdata(L, 1);
+    if (schema == NULL) {
+        lua_pushliteral(L, "Cannot create NULL schema wrapper");
+        return lua_error(L);
+    }
+    lua_avro_push_schema(L, schema);
+    lua_pushlightuserdata(L, schema);
+    return 2;
+}
+
+
+/**
+ * Creates a new AvroValue for the given schema.
+ */
+
+static int
+l_schema_new_raw_value(lua_State *L)
+{
+    LuaAvroSchema  *l_schema = luaL_checkudata(L, 1, MT_AVRO_SCHEMA);
+    if (l_schema->iface == NULL) {
+        l_schema->iface = avro_generic_class_from_schema(l_schema->schema);
+        if (l_schema->iface == NULL) {
+            lua_pushstring(L, avro_strerror());
+            return lua_error(L);
+        }
+    }
+
+    if (lua_gettop(L) >= 2) {
+        LuaAvroValue  *l_value = luaL_checkudata(L, 2, MT_AVRO_VALUE);
+        if (l_value->should_decref && l_value->value.self != NULL) {
+            avro_value_decref(&l_value->value);
+            stats_freed(values);
+        }
+        l_value->value.iface = NULL;
+        l_value->value.self = NULL;
+        l_value->should_decref = false;
+        check(avro_generic_value_new(l_schema->iface, &l_value->value));
+        l_value->should_decref = true;
+        stats_created(values);
+        lua_pushvalue(L, 2);
+    } else {
+        avro_value_t  value;
+        check(avro_generic_value_new(l_schema->iface, &value));
+        lua_avro_push_value(L, &value, true);
+    }
+    return 1;
+}
+
+
+/**
+ * Returns the AvroSchema instance itself, so that it can be used
+ * anywhere that a Lua schema object is expected.
+ */
+
+static int
+l_schema_raw_schema(lua_State *L)
+{
+    luaL_checkudata(L, 1, MT_AVRO_SCHEMA);
+    lua_settop(L, 1);
+    return 1;
+}
+
+
+/**
+ * Returns the type of an AvroSchema instance.
+ */
+
+static int
+l_schema_type(lua_State *L)
+{
+    avro_schema_t  schema = lua_avro_get_raw_schema(L, 1);
+    lua_pushnumber(L, avro_typeof(schema));
+    return 1;
+}
+
+
+/**
+ * Returns the name of an AvroSchema instance.
+ */
+
+static int
+l_schema_name(lua_State *L)
+{
+    avro_schema_t  schema = lua_avro_get_raw_schema(L, 1);
+    lua_pushstring(L, avro_schema_type_name(schema));
+    return 1;
+}
+
+
+/**
+ * Associates a Rabin fingerprint (as returned by the fingerprint64
+ * function) with an AvroSchema instance.  Values of this schema can
+ * then be encoded using the single-object encoding.  The fingerprint
+ * should be calculated from the schema's Parsing Canonical Form.
+ * Instead of the fingerprint itself, you can pass in a function that
+ * returns it; we'll only call it the first time we need the
+ * fingerprint.  The function is kept in the instance's environment
+ * table until then.
+ */
+
+static void
+schema_store_fingerprint(lua_State *L, LuaAvroSchema *l_schema, int index)
+{
+    size_t  fingerprint_size;
+    const char  *fingerprint = lua_tolstring(L, index, &fingerprint_size);
+    if (fingerprint == NULL || fingerprint_size != FINGERPRINT_SIZE) {
+        luaL_error(L, "Fingerprint must be %d bytes", FINGERPRINT_SIZE);
+        return;
+    }
+
+    l_schema->single_object_header[0] = (char) 0xc3;
+    l_schema->single_object_header[1] = (char) 0x01;
+    memcpy(l_schema->single_object_header + SINGLE_OBJECT_MARKER_SIZE,
+           fingerprint, FINGERPRINT_SIZE);
+    l_schema->has_fingerprint = true;
+}
+
+/**
+ * Makes sure that the AvroSchema instance at the given stack index has
+ * a fingerprint, calling its fingerprint function if it hasn't been
+ * calculated yet.  Returns whether it has one.
+ */
+
+static bool
+schema_resolve_fingerprint(lua_State *L, int index)
+{
+    LuaAvroSchema  *l_schema = lua_touserdata(L, index);
+    if (l_schema->has_fingerprint) {
+        return true;
+    }
+
+    lua_getfenv(L, index);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_rawgeti(L, -1, 1);
+    if (!lua_isfunction(L, -1)) {
+        lua_pop(L, 2);
+        return false;
+    }
+    lua_call(L, 0, 1);
+    schema_store_fingerprint(L, l_schema, lua_gettop(L));
+    lua_pop(L, 1);
+
+    /* We don't need the function anymore. */
+    lua_pushnil(L);
+    lua_rawseti(L, -2, 1);
+    lua_pop(L, 1);
+    return true;
+}
+
+static int
+l_schema_set_fingerprint(lua_State *L)
+{
+    LuaAvroSchema  *l_schema = luaL_checkudata(L, 1, MT_AVRO_SCHEMA);
+    if (lua_isfunction(L, 2)) {
+        lua_createtable(L, 1, 0);
+        lua_pushvalue(L, 2);
+        lua_rawseti(L, -2, 1);
+        lua_setfenv(L, 1);
+        l_schema->has_fingerprint = false;
+    } else {
+        luaL_checkstring(L, 2);
+        schema_store_fingerprint(L, l_schema, 2);
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, SINGLE_OBJECT_SCHEMAS);
+    lua_pushlightuserdata(L, l_schema->schema);
+    lua_pushvalue(L, 1);
+    lua_rawset(L, -3);
+    return 0;
+}
+
+
+/**
+ * Encode an Avro value using the single-object encoding.  The value's
+ * schema must have been given a fingerprint via the set_fingerprint
+ * method.
+ */
+
+static int
+l_value_encode_single_object(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    avro_schema_t  schema = avro_value_get_schema(value);
+
+    lua_settop(L, 1);
+    lua_getfield(L, LUA_REGISTRYINDEX, SINGLE_OBJECT_SCHEMAS);
+    lua_pushlightuserdata(L, schema);
+    lua_rawget(L, -2);
+    LuaAvroSchema  *l_schema = lua_touserdata(L, -1);
+
+    /*
+     * The schema instance might have been finalized without its entry
+     * being removed from the weak table yet, so make sure that it still
+     * refers to the same schema.
+     */
+
+    if (l_schema == NULL || l_schema->schema != schema ||
+        !schema_resolve_fingerprint(L, lua_gettop(L))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Schema doesn't have a fingerprint");
+        return 2;
+    }
+
+    lua_settop(L, 1);
+    lua_pushlstring(L, l_schema->single_object_header,
+                    SINGLE_OBJECT_HEADER_SIZE);
+    return l_value_encode(L);
+}
+
+
+/**
+ * Finalizes an AvroSchema instance.
+ */
+
+static int
+l_schema_gc(lua_State *L)
+{
+    LuaAvroSchema  *l_schema = luaL_checkudata(L, 1, MT_AVRO_SCHEMA);
+    if (l_schema->schema != NULL) {
+        avro_schema_decref(l_schema->schema);
+        l_schema->schema = NULL;
+        stats_freed(schemas);
+    }
+    if (l_schema->iface != NULL) {
+        avro_value_iface_decref(l_schema->iface);
+        l_schema->iface = NULL;
+    }
+    return 0;
+}
+
+
+/**
+ * Creates a new AvroSchema instance from a JSON schema string.
+ */
+
+static int
+l_schema_new(lua_State *L)
+{
+    if (lua_isstring(L, 1)) {
+        size_t  json_len;
+        const char  *json_str = lua_tolstring(L, 1, &json_len);
+        avro_schema_t  schema;
+
+        /* First check for the primitive types */
+        if (strcmp(json_str, "boolean") == 0) {
+            schema = avro_schema_boolean();
+        }
+
+        else if (strcmp(json_str, "bytes") == 0) {
+            schema = avro_schema_bytes();
+        }
+
+        else if (strcmp(json_str, "double") == 0) {
+            schema = avro_schema_double();
+        }
+
+        else if (strcmp(json_str, "float") == 0) {
+            schema = avro_schema_float();
+        }
+
+        else if (strcmp(json_str, "int") == 0) {
+            schema = avro_schema_int();
+        }
+
+        else if (strcmp(json_str, "long") == 0) {
+            schema = avro_schema_long();
+        }
+
+        else if (strcmp(json_str, "null") == 0) {
+            schema = avro_schema_null();
+        }
+
+        else if (strcmp(json_str, "string") == 0) {
+            schema = avro_schema_string();
+        }
+
+        /* Otherwise assume it's JSON */
+
+        else {
+            avro_schema_error_t  schema_error;
+            int64_t  start = timing_start();
+            check(avro_schema_from_json(json_str, json_len, &schema, &schema_error));
+            timing_record(TIMING_SCHEMA_PARSE, start, json_len);
+        }
+
+        lua_avro_push_schema(L, schema);
+        avro_schema_decref(schema);
+        lua_pushlightuserdata(L, schema);
+        return 2;
+    }
+
+    if (lua_isuserdata(L, 1)) {
+        if (lua_getmetatable(L, 1)) {
+            lua_getfield(L, LUA_REGISTRYINDEX, MT_AVRO_SCHEMA);
+            if (lua_rawequal(L, -1, -2)) {
+                /* This is already a schema object, so just return it. */
+                lua_pop(L, 2);  /* remove both metatables */
+                LuaAvroSchema  *l_schema = lua_touserdata(L, 1);
+                lua_pushlightuserdata(L, l_schema->schema);
+                return 2;
+            }
+        }
+    }
+
+    lua_pushliteral(L, "Invalid input to Schema function");
+    return lua_error(L);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lua access — schema fingerprints
+ */
+
+/**
+ * The Rabin fingerprint of an empty string, as defined by the Avro
+ * specification.
+ */
+
+#define CRC64_AVRO_EMPTY  UINT64_C(0xc15d213aa4d7a795)
+
+static uint64_t  crc64_avro_table[256];
+static pthread_once_t  crc64_avro_once = PTHREAD_ONCE_INIT;
+
+static void
+crc64_avro_fill_table(void)
+{
+    int  i;
+    int  j;
+    for (i = 0; i < 256; i++) {
+        uint64_t  fp = i;
+        for (j = 0; j < 8; j++) {
+            fp = (fp >> 1) ^ (CRC64_AVRO_EMPTY & -(fp & 1));
+        }
+        crc64_avro_table[i] = fp;
+    }
+}
+
+/**
+ * Every Lua state that loads the module calls this, and worker states
+ * can be loading it at the same time, so the table is only filled in
+ * once.
+ */
+
+static void
+crc64_avro_init(void)
+{
+    pthread_once(&crc64_avro_once, crc64_avro_fill_table);
+}
+
+uint64_t
+lua_avro_fingerprint64(const void *buf, size_t size)
+{
+    const unsigned char  *bytes = buf;
+    uint64_t  fp = CRC64_AVRO_EMPTY;
+    size_t  i;
+    for (i = 0; i < size; i++) {
+        fp = (fp >> 8) ^ crc64_avro_table[(fp ^ bytes[i]) & 0xff];
+    }
+    return fp;
+}
+
+
+/**
+ * Calculates the 64-bit Rabin fingerprint of a string, which should be
+ * the Parsing Canonical Form of a schema.  The fingerprint is returned
+ * as an 8-byte little-endian string, which is how it appears in the
+ * single-object encoding.
+ */
+
+static int
+l_fingerprint64(lua_State *L)
+{
+    size_t  size;
+    const char  *str = luaL_checklstring(L, 1, &size);
+    uint64_t  fp = lua_avro_fingerprint64(str, size);
+
+    char  result[FINGERPRINT_SIZE];
+    int  i;
+    for (i = 0; i < FINGERPRINT_SIZE; i++) {
+        result[i] = (char) (fp & 0xff);
+        fp >>= 8;
+    }
+
+    lua_pushlstring(L, result, FINGERPRINT_SIZE);
+    return 1;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lua access — allocation arenas
+ */
+
+/**
+ * We install our own allocation function into the Avro library.
+ * Normally it behaves just like the default allocator, but within a
+ * call to with_arena, new allocations are carved out of large slabs
+ * using a simple bump allocator.  Freeing an individual allocation
+ * from a slab doesn't return any memory; it just decrements the slab's
+ * count of live allocations.  Once a slab is no longer being allocated
+ * from and has no live allocations, the whole slab is freed at once.
+ * This means that it's always safe for a value allocated within an
+ * arena to outlive the with_arena call; it just keeps its slab around
+ * a bit longer.
+ */
+
+#define ARENA_DEFAULT_SLAB_SIZE  (64 * 1024)
+#define ARENA_ALIGNMENT  16
+#define ARENA_ALIGN(sz) \
+    (((sz) + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1))
+
+/**
+ * Every pointer that passes through the allocator has to be classified
+ * as either a slab allocation or a plain malloc one, and that has to be
+ * cheap, since it happens on every call from every thread.  So slabs
+ * are allocated in aligned "pages", and we keep a two-level page map
+ * from each page's address to the slab that contains it.  Looking up a
+ * pointer is then two loads, without any locks.  The map covers 48-bit
+ * addresses; a slab that lands above that is just not used.
+ */
+
+#define ARENA_PAGE_SHIFT  16
+#define ARENA_PAGE_SIZE  ((size_t) 1 << ARENA_PAGE_SHIFT)
+#define ARENA_MAP_BITS  16
+#define ARENA_MAP_SIZE  ((size_t) 1 << ARENA_MAP_BITS)
+
+typedef struct _ArenaSlab
+{
+    char  *data;
+    size_t  size;
+    size_t  span;
+    size_t  used;
+    size_t  last_offset;
+    size_t  live;
+} ArenaSlab;
+
+#define ARENA_SLAB_HEADER_SIZE  ARENA_ALIGN(sizeof(ArenaSlab))
+
+typedef struct _Arena
+{
+    ArenaSlab  *slab;
+    size_t  slab_size;
+} Arena;
+
+/**
+ * Each thread has its own current arena, and only that thread ever
+ * allocates from the arena's current slab, so the bump pointer doesn't
+ * need any synchronization.  A value allocated on one thread can be
+ * freed on another, though, so each slab's count of live allocations
+ * is atomic.  The arena itself holds one reference while the slab is
+ * current; whoever drops the count to zero frees the slab.
+ */
+
+static pthread_once_t  allocator_once = PTHREAD_ONCE_INIT;
+static __thread Arena  *current_arena = NULL;
+static ArenaSlab  **arena_map[ARENA_MAP_SIZE];
+static size_t  arena_slab_count = 0;
+
+static ArenaSlab **
+arena_map_leaf(uintptr_t page, bool create)
+{
+    ArenaSlab  ***root = &arena_map[page >> ARENA_MAP_BITS];
+    ArenaSlab  **leaf = __atomic_load_n(root, __ATOMIC_ACQUIRE);
+    if (leaf == NULL && create) {
+        ArenaSlab  **fresh = calloc(ARENA_MAP_SIZE, sizeof(ArenaSlab *));
+        if (fresh == NULL) {
+            return NULL;
+        }
+        if (__atomic_compare_exchange_n(root, &leaf, fresh, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            leaf = fresh;
+        } else {
+            free(fresh);
+        }
+    }
+    return leaf;
+}
+
+static ArenaSlab *
+arena_find_slab(const void *ptr)
+{
+    uintptr_t  page = (uintptr_t) ptr >> ARENA_PAGE_SHIFT;
+    if (page >> (2 * ARENA_MAP_BITS) != 0) {
+        return NULL;
+    }
+    ArenaSlab  **leaf = arena_map_leaf(page, false);
+    if (leaf == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&leaf[page & (ARENA_MAP_SIZE - 1)],
+                           __ATOMIC_ACQUIRE);
+}
+
+static bool
+arena_map_slab(ArenaSlab *slab, ArenaSlab *entry)
+{
+    uintptr_t  first = (uintptr_t) slab >> ARENA_PAGE_SHIFT;
+    uintptr_t  last = first + (slab->span >> ARENA_PAGE_SHIFT);
+    uintptr_t  page;
+    if ((last - 1) >> (2 * ARENA_MAP_BITS) != 0) {
+        return false;
+    }
+    for (page = first; page < last; page++) {
+        ArenaSlab  **leaf = arena_map_leaf(page, entry != NULL);
+        if (leaf == NULL) {
+            return false;
+        }
+        __atomic_store_n(&leaf[page & (ARENA_MAP_SIZE - 1)], entry,
+                         __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+static void
+arena_free_slab(ArenaSlab *slab)
+{
+    arena_map_slab(slab, NULL);
+    __atomic_sub_fetch(&arena_slab_count, 1, __ATOMIC_RELEASE);
+    atomic_add(stats.arena_slabs_live, -1);
+    free(slab);
+}
+
+static ArenaSlab *
+arena_new_slab(size_t size)
+{
+    size_t  span = (ARENA_SLAB_HEADER_SIZE + size + ARENA_PAGE_SIZE - 1) &
+        ~(ARENA_PAGE_SIZE - 1);
+    void  *mem;
+    if (posix_memalign(&mem, ARENA_PAGE_SIZE, span) != 0) {
+        return NULL;
+    }
+
+    ArenaSlab  *slab = mem;
+    slab->data = (char *) slab + ARENA_SLAB_HEADER_SIZE;
+    slab->size = span - ARENA_SLAB_HEADER_SIZE;
+    slab->span = span;
+    slab->used = 0;
+    slab->last_offset = 0;
+    /* The reference held by the arena that's allocating from it */
+    slab->live = 1;
+    if (!arena_map_slab(slab, slab)) {
+        arena_map_slab(slab, NULL);
+        free(slab);
+        return NULL;
+    }
+    __atomic_add_fetch(&arena_slab_count, 1, __ATOMIC_RELEASE);
+    atomic_add(stats.arena_slabs_live, 1);
+    return slab;
+}
+
+static void
+arena_release(ArenaSlab *slab)
+{
+    if (__atomic_sub_fetch(&slab->live, 1, __ATOMIC_ACQ_REL) == 0) {
+        arena_free_slab(slab);
+    }
+}
+
+/**
+ * Stops allocating from an arena's current slab, freeing it if nothing
+ * allocated from it is still alive.
+ */
+
+static void
+arena_retire_slab(Arena *arena)
+{
+    ArenaSlab  *slab = arena->slab;
+    if (slab != NULL) {
+        arena->slab = NULL;
+        arena_release(slab);
+    }
+}
+
+static void *
+arena_alloc(Arena *arena, size_t size)
+{
+    size_t  aligned = ARENA_ALIGN(size);
+    ArenaSlab  *slab = arena->slab;
+
+    if (slab != NULL &&
+        __atomic_load_n(&slab->live, __ATOMIC_ACQUIRE) == 1) {
+        /* Nothing else is using the slab, so start over at the front. */
+        slab->used = 0;
+        slab->last_offset = 0;
+    }
+
+    if (slab == NULL || slab->used + aligned > slab->size) {
+        size_t  slab_size =
+            (aligned > arena->slab_size)? aligned: arena->slab_size;
+        arena_retire_slab(arena);
+        slab = arena_new_slab(slab_size);
+        if (slab == NULL) {
+            return malloc(size);
+        }
+        arena->slab = slab;
+    }
+
+    void  *result = slab->data + slab->used;
+    slab->last_offset = slab->used;
+    slab->used += aligned;
+    __atomic_add_fetch(&slab->live, 1, __ATOMIC_RELAXED);
+    return result;
+}
+
+/**
+ * Counting every allocation means several atomic updates to a shared
+ * cache line on every call into the allocator, so like the timing
+ * histograms, it's off unless someone asks for it.  The memory counters
+ * only reflect allocations made while it's on; in particular, bytes_live
+ * can go negative if memory allocated before then is freed.
+ */
+
+static int  allocation_stats_enabled = 0;
+
+static void
+stats_count_allocation(void *ptr, size_t osize, size_t nsize)
+{
+    if (nsize == 0) {
+        atomic_add(stats.free_calls, 1);
+    } else if (ptr == NULL) {
+        atomic_add(stats.alloc_calls, 1);
+    } else {
+        atomic_add(stats.realloc_calls, 1);
+    }
+
+    if (nsize > osize) {
+        atomic_add(stats.bytes_allocated, (int64_t) (nsize - osize));
+    } else {
+        atomic_add(stats.bytes_freed, (int64_t) (osize - nsize));
+    }
+    int64_t  live =
+        atomic_add(stats.bytes_live, (int64_t) nsize - (int64_t) osize);
+    int64_t  peak = __atomic_load_n(&stats.bytes_peak, __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&stats.bytes_peak, &peak, live, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        /* Someone else updated the peak; try again. */
+    }
+}
+
+static void *
+arena_realloc(void *ptr, size_t osize, size_t nsize)
+{
+    ArenaSlab  *slab = NULL;
+    if (ptr != NULL &&
+        __atomic_load_n(&arena_slab_count, __ATOMIC_ACQUIRE) != 0) {
+        slab = arena_find_slab(ptr);
+    }
+
+    if (nsize == 0) {
+        if (slab != NULL) {
+            arena_release(slab);
+        } else {
+            free(ptr);
+        }
+        return NULL;
+    }
+
+    if (slab == NULL) {
+        if (ptr == NULL && current_arena != NULL) {
+            return arena_alloc(current_arena, nsize);
+        }
+        return realloc(ptr, nsize);
+    }
+
+    /*
+     * Reallocating something that lives in a slab.  If it's the most
+     * recent allocation from this thread's current slab, we can grow or
+     * shrink it in place.
+     */
+
+    size_t  offset = (char *) ptr - slab->data;
+    if (current_arena != NULL && current_arena->slab == slab &&
+        offset == slab->last_offset &&
+        offset + ARENA_ALIGN(nsize) <= slab->size) {
+        slab->used = offset + ARENA_ALIGN(nsize);
+        return ptr;
+    }
+
+    void  *result = (current_arena != NULL)?
+        arena_alloc(current_arena, nsize):
+        malloc(nsize);
+    if (result == NULL) {
+        return NULL;
+    }
+    memcpy(result, ptr, (osize < nsize)? osize: nsize);
+    arena_release(slab);
+    return result;
+}
+
+static void *
+lua_avro_allocator(void *user_data, void *ptr, size_t osize, size_t nsize)
+{
+    if (allocation_stats_enabled) {
+        stats_count_allocation(ptr, osize, nsize);
+    }
+
+    if (current_arena == NULL &&
+        __atomic_load_n(&arena_slab_count, __ATOMIC_ACQUIRE) == 0) {
+        if (nsize == 0) {
+            free(ptr);
+            return NULL;
+        }
+        return realloc(ptr, nsize);
+    }
+
+    return arena_realloc(ptr, osize, nsize);
+}
+
+static void
+allocator_install(void)
+{
+    avro_set_allocator(lua_avro_allocator, NULL);
+}
+
+/* Like crc64_avro_init, this can run on several threads at once. */
+
+static void
+allocator_init(void)
+{
+    pthread_once(&allocator_once, allocator_install);
+}
+
+
+/**
+ * Calls a function with an allocation arena active.  Anything that
+ * the Avro library allocates during the call — values, strings, array
+ * and map storage — comes out of the arena's slabs.  Any additional
+ * parameters are passed to the function, and its results are returned.
+ * An optional slab size can be given in the first parameter, before
+ * the function.
+ */
+
+static int
+l_with_arena(lua_State *L)
+{
+    Arena  arena;
+    arena.slab = NULL;
+    arena.slab_size = ARENA_DEFAULT_SLAB_SIZE;
+
+    if (lua_type(L, 1) == LUA_TNUMBER) {
+        lua_Integer  slab_size = lua_tointeger(L, 1);
+        if (slab_size <= 0) {
+            return luaL_error(L, "Invalid arena slab size");
+        }
+        arena.slab_size = slab_size;
+        lua_remove(L, 1);
+    }
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+
+    Arena  *previous = current_arena;
+    current_arena = &arena;
+    int  rc = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+    current_arena = previous;
+    arena_retire_slab(&arena);
+
+    if (rc != 0) {
+        return lua_error(L);
+    }
+    return lua_gettop(L);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lua access — statistics
+ */
+
+/**
+ * Returns a table with the current values of our statistics counters.
+ */
+
+#define push_stat(field) \
+    do { \
+        lua_pushnumber(L, (lua_Number) stats.field); \
+        lua_setfield(L, -2, #field); \
+    } while (0)
+
+static int
+l_stats(lua_State *L)
+{
+    lua_createtable(L, 0, 20);
+    push_stat(values_created);
+    push_stat(values_freed);
+    push_stat(values_live);
+    push_stat(schemas_created);
+    push_stat(schemas_freed);
+    push_stat(schemas_live);
+    push_stat(resolvers_created);
+    push_stat(resolvers_freed);
+    push_stat(resolvers_live);
+    push_stat(files_opened);
+    push_stat(files_closed);
+    push_stat(files_live);
+    push_stat(alloc_calls);
+    push_stat(realloc_calls);
+    push_stat(free_calls);
+    push_stat(bytes_allocated);
+    push_stat(bytes_freed);
+    push_stat(bytes_live);
+    push_stat(bytes_peak);
+    push_stat(arena_slabs_live);
+    return 1;
+}
+
+/**
+ * Resets all of the statistics counters, other than the gauges that
+ * track how many objects are currently live.
+ */
+
+static int
+l_reset_stats(lua_State *L)
+{
+    LuaAvroStats  reset;
+    memset(&reset, 0, sizeof(LuaAvroStats));
+    reset.values_live = stats.values_live;
+    reset.schemas_live = stats.schemas_live;
+    reset.resolvers_live = stats.resolvers_live;
+    reset.files_live = stats.files_live;
+    reset.bytes_live = stats.bytes_live;
+    reset.bytes_peak = stats.bytes_live;
+    reset.arena_slabs_live = stats.arena_slabs_live;
+    stats = reset;
+    return 0;
+}
+
+/**
+ * Turns the allocation counters on or off.  Returns whether they were
+ * previously enabled.
+ */
+
+static int
+l_enable_allocation_stats(lua_State *L)
+{
+    lua_pushboolean(L, allocation_stats_enabled != 0);
+    allocation_stats_enabled = lua_toboolean(L, 1);
+    return 1;
+}
+
+/**
+ * Turns the timing histograms on or off.  Returns whether they were
+ * previously enabled.
+ */
+
+static int
+l_enable_timings(lua_State *L)
+{
+    lua_pushboolean(L, timings.enabled != 0);
+    timings.enabled = lua_toboolean(L, 1);
+    return 1;
+}
+
+/**
+ * Returns the upper bound of the bucket that contains the given
+ * percentile of a histogram's durations.
+ */
+
+static int64_t
+timing_percentile(LuaAvroHistogram *hist, double percentile)
+{
+    int64_t  target = (int64_t) (hist->count * percentile + 0.5);
+    int64_t  seen = 0;
+    int  i;
+    if (target < 1) {
+        target = 1;
+    }
+    for (i = 0; i < TIMING_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target) {
+            int64_t  upper = (i == 0)? 0: ((int64_t) 1 << i) - 1;
+            return (upper < hist->max_ns)? upper: hist->max_ns;
+        }
+    }
+    return hist->max_ns;
+}
+
+/**
+ * Returns a snapshot of the timing histograms, as a table keyed by
+ * operation name.
+ */
+
+#define push_timing(field, val) \
+    do { \
+        lua_pushnumber(L, (lua_Number) (val)); \
+        lua_setfield(L, -2, field); \
+    } while (0)
+
+static int
+l_timings(lua_State *L)
+{
+    int  op;
+    int  i;
+    lua_createtable(L, 0, TIMING_OP_COUNT);
+    for (op = 0; op < TIMING_OP_COUNT; op++) {
+        LuaAvroHistogram  *hist = &timings.ops[op];
+        lua_createtable(L, 0, 9);
+        push_timing("count", hist->count);
+        push_timing("total_ns", hist->total_ns);
+        push_timing("min_ns",
+                    (hist->min_ns == INT64_MAX)? 0: hist->min_ns);
+        push_timing("max_ns", hist->max_ns);
+        push_timing("bytes", hist->bytes);
+        push_timing("p50_ns", timing_percentile(hist, 0.50));
+        push_timing("p90_ns", timing_percentile(hist, 0.90));
+        push_timing("p99_ns", timing_percentile(hist, 0.99));
+        lua_createtable(L, TIMING_BUCKETS, 0);
+        for (i = 0; i < TIMING_BUCKETS; i++) {
+            lua_pushnumber(L, (lua_Number) hist->buckets[i]);
+            lua_rawseti(L, -2, i+1);
+        }
+        lua_setfield(L, -2, "buckets");
+        lua_setfield(L, -2, TIMING_OP_NAMES[op]);
+    }
+    return 1;
+}
+
+/**
+ * Clears the timing histograms, without changing whether they're
+ * enabled.
+ */
+
+static int
+l_reset_timings(lua_State *L)
+{
+    timings_clear();
+    return 0;
+}
+
+/**
+ * Returns a light userdata pointing at the timing histograms, so that
+ * the FFI binding can check whether they're enabled.
+ */
+
+static int
+l_timings_counters(lua_State *L)
+{
+    lua_pushlightuserdata(L, &timings);
+    return 1;
+}
+
+static void
+timings_api_record(int op, int64_t start, size_t bytes)
+{
+    if (op >= 0 && op < TIMING_OP_COUNT) {
+        timing_record((TimingOp) op, start, bytes);
+    }
+}
+
+/**
+ * The timing functions, made available to the LuaJIT FFI binding via
+ * timings_api, so that both bindings use the same clock.
+ */
+
+typedef struct _TimingsApi
+{
+    int64_t (*now)(void);
+    void (*record)(int op, int64_t start, size_t bytes);
+} TimingsApi;
+
+static const TimingsApi  timings_api = {
+    timing_now,
+    timings_api_record
+};
+
+static int
+l_timings_api(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void *) &timings_api);
+    return 1;
+}
+
+/**
+ * Returns a light userdata pointing at the statistics counters, so that
+ * the FFI binding can find them.  LuaJIT can't update them atomically
+ * itself, so it does that via stats_api.
+ */
+
+static int
+l_stats_counters(lua_State *L)
+{
+    lua_pushlightuserdata(L, &stats);
+    return 1;
+}
+
+static void
+stats_add(int64_t *counter, int64_t n)
+{
+    atomic_add(*counter, n);
+}
+
+/**
+ * The statistics functions, made available to the LuaJIT FFI binding
+ * via stats_api.
+ */
+
+typedef struct _StatsApi
+{
+    void (*add)(int64_t *counter, int64_t n);
+} StatsApi;
+
+static const StatsApi  stats_api = {
+    stats_add
+};
+
+static int
+l_stats_api(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void *) &stats_api);
+    return 1;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lua access — resolved readers
+ */
+
+/**
+ * The string used to identify the AvroResolvedReader class's metatable
+ * in the Lua registry.
+ */
+
+#define MT_AVRO_RESOLVED_READER "avro:AvroResolvedReader"
+
+typedef struct _LuaAvroResolvedReader
+{
+    avro_value_iface_t  *resolver;
+} LuaAvroResolvedReader;
+
+
+int
+lua_avro_push_resolved_reader(lua_State *L, avro_value_iface_t *resolver)
+{
+    LuaAvroResolvedReader  *l_resolver;
+
+    l_resolver = lua_newuserdata(L, sizeof(LuaAvroResolvedReader));
+    l_resolver->resolver = resolver;
+    stats_created(resolvers);
+    luaL_getmetatable(L, MT_AVRO_RESOLVED_READER);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+
+avro_value_iface_t *
+lua_avro_get_resolved_reader(lua_State *L, int index)
+{
+    LuaAvroResolvedReader  *l_resolver =
+        luaL_checkudata(L, index, MT_AVRO_RESOLVED_READER);
+    return l_resolver->resolver;
+}
+
+
+/**
+ * Creates a new AvroResolvedReader for the given schemas.
+ */
+
+static int
+l_resolved_reader_new(lua_State *L)
+{
+    avro_schema_t  writer_schema = lua_avro_get_schema(L, 1);
+    avro_schema_t  reader_schema = lua_avro_get_schema(L, 2);
+    avro_value_iface_t  *resolver =
+        avro_resolved_reader_new(writer_schema, reader_schema);
+    if (resolver == NULL) {
+        return lua_return_avro_error(L);
+    } else {
+        lua_avro_push_resolved_reader(L, resolver);
+        return 1;
+    }
+}
+
+
+/**
+ * Finalizes an AvroResolvedReader instance.
+ */
+
+static int
+l_resolved_reader_gc(lua_State *L)
+{
+    LuaAvroResolvedReader  *l_resolver =
+        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_READER);
+    if (l_resolver->resolver != NULL) {
+        avro_value_iface_decref(l_resolver->resolver);
+        l_resolver->resolver = NULL;
+        stats_freed(resolvers);
+    }
+    return 0;
+}
+
+
+/**
+ * Creates a new AvroValue for the given resolved reader.
+ */
+
+static int
+l_resolved_reader_new_raw_value(lua_State *L)
+{
+    avro_value_iface_t  *resolver = lua_avro_get_resolved_reader(L, 1);
+    avro_value_t  value;
+    check(avro_resolved_reader_new_value(resolver, &value));
+    lua_avro_push_value(L, &value, true);
+    return 1;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lua access — resolved writers
+ */
+
+/**
+ * The string used to identify the AvroResolvedWriter class's metatable
+ * in the Lua registry.
+ */
+
+#define MT_AVRO_RESOLVED_WRITER "avro:AvroResolvedWriter"
+
+typedef struct _LuaAvroResolvedWriter
+{
+    avro_value_iface_t  *resolver;
+    avro_value_t  value;
+} LuaAvroResolvedWriter;
+
+
+int
+lua_avro_push_resolved_writer(lua_State *L, avro_value_iface_t *resolver)
+{
+    LuaAvroResolvedWriter  *l_resolver;
+
+    l_resolver = lua_newuserdata(L, sizeof(LuaAvroResolvedWriter));
+    l_resolver->resolver = resolver;
+    stats_created(resolvers);
+    avro_resolved_writer_new_value(resolver, &l_resolver->value);
+    luaL_getmetatable(L, MT_AVRO_RESOLVED_WRITER);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+
+avro_value_iface_t *
+lua_avro_get_resolved_writer(lua_State *L, int index)
+{
+    LuaAvroResolvedWriter  *l_resolver =
+        luaL_checkudata(L, index, MT_AVRO_RESOLVED_WRITER);
+    return l_resolver->resolver;
+}
+
+
+/**
+ * Creates a new AvroResolvedWriter for the given schemas.
+ */
+
+static int
+l_resolved_writer_new(lua_State *L)
+{
+    avro_schema_t  writer_schema = lua_avro_get_schema(L, 1);
+    avro_schema_t  reader_schema = lua_avro_get_schema(L, 2);
+    avro_value_iface_t  *resolver =
+        avro_resolved_writer_new(writer_schema, reader_schema);
+    if (resolver == NULL) {
+        return lua_return_avro_error(L);
+    } else {
+        lua_avro_push_resolved_writer(L, resolver);
+        return 1;
+    }
+}
+
+
+/**
+ * Finalizes an AvroResolvedWriter instance.
+ */
+
+static int
+l_resolved_writer_gc(lua_State *L)
+{
+    LuaAvroResolvedWriter  *l_resolver =
+        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_WRITER);
+    if (l_resolver->value.self != NULL) {
+        avro_value_decref(&l_resolver->value);
+        l_resolver->value.iface = NULL;
+        l_resolver->value.self = NULL;
+    }
+    if (l_resolver->resolver != NULL) {
+        avro_value_iface_decref(l_resolver->resolver);
+        l_resolver->resolver = NULL;
+        stats_freed(resolvers);
+    }
+    return 0;
+}
+
+
+/**
+ * Creates a new AvroValue for the given resolved writer.
+ */
+
+static int
+l_resolved_writer_new_raw_value(lua_State *L)
+{
+    avro_value_iface_t  *resolver = lua_avro_get_resolved_writer(L, 1);
+    avro_value_t  value;
+    check(avro_resolved_writer_new_value(resolver, &value));
+    lua_avro_push_value(L, &value, true);
+    return 1;
+}
+
+
+/**
+ * Decode an Avro value using the given resolver.  The optional fourth
+ * parameter is the number of bytes at the start of the buffer to skip
+ * over (a framing header, for instance) before decoding.
+ */
+
+static int
+l_resolved_writer_decode(lua_State *L)
+{
+    LuaAvroResolvedWriter  *l_resolver =
+        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_WRITER);
+    size_t  size = 0;
+    const char  *buf = luaL_checklstring(L, 2, &size);
+    avro_value_t  *value = lua_avro_get_value(L, 3);
+    lua_Integer  offset = 0;
+    if (!lua_isnoneornil(L, 4)) {
+        offset = luaL_checkinteger(L, 4);
+    }
+
+    if ((offset < 0) || ((size_t) offset > size)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Offset out of bounds");
+        return 2;
+    }
+
+    int64_t  start = timing_start();
+    avro_reader_t  reader = avro_reader_memory(buf + offset, size - offset);
+    avro_resolved_writer_set_dest(&l_resolver->value, value);
+    int rc = avro_value_read(reader, &l_resolver->value);
+    avro_reader_free(reader);
+
+    if (rc != 0) {
+        return lua_return_avro_error(L);
+    }
+
+    timing_record(TIMING_DECODE, start, size - offset);
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+
+/**
+ * Decode an Avro value, using the binary encoding, from the given
+ * memory region, which is provided as a light user data and a size.
+ * There's no safety checking here; to make it easier to not include
+ * this function in sandboxes, it's exposed as a global function in the
+ * "avro" package, and not as a method of the AvroValue class.
+ */
+
+static int
+l_value_decode_raw(lua_State *L)
+{
+    LuaAvroResolvedWriter  *l_resolver =
+        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_WRITER);
+    if (!lua_islightuserdata(L, 2)) {
+        return luaL_error(L, "Destination buffer should be a light userdata");
+    }
+    void  *buf = lua_touserdata(L, 2);
+    size_t  size = luaL_checkinteger(L, 3);
+    avro_value_t  *value = lua_avro_get_value(L, 4);
+
+    int64_t  start = timing_start();
+    avro_reader_t  reader = avro_reader_memory(buf, size);
+    avro_resolved_writer_set_dest(&l_resolver->value, value);
+    int rc = avro_value_read(reader, &l_resolver->value);
+    avro_reader_free(reader);
+
+    if (rc != 0) {
+        return lua_return_avro_error(L);
+    }
+
+    timing_record(TIMING_DECODE, start, size);
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Channels
+ */
+
+/**
+ * A channel is a ring buffer of encoded Avro records, which lets
+ * threads (each with their own Lua state) hand values to one another.
+ * Any number of threads can send records into a channel, but only one
+ * thread should receive from it at a time.  Sending and receiving are
+ * lock-free.
+ *
+ * Positions in the ring are 64-bit counters that only ever increase;
+ * we take them modulo the (power-of-two) capacity to find the actual
+ * offset into the buffer.  There are three of them:
+ *
+ *   reserved:   the end of the space that producers have claimed
+ *   published:  the end of the records that the consumer can read
+ *   consumed:   the end of the records that the consumer has read
+ *
+ * A producer claims space by advancing reserved with a compare-and-
+ * swap, encodes its records directly into that space, and then waits
+ * for any earlier producers to finish before advancing published.  A
+ * batch of records is claimed and published all at once.
+ *
+ * Each record starts with an 8-byte header containing its length and
+ * flags, and is padded to a multiple of 8 bytes.  A record is never
+ * split across the end of the buffer; if it doesn't fit, we write a
+ * wrap marker and put the record at the start of the buffer instead.
+ */
+
+#define CHANNEL_MIN_CAPACITY  4096
+#define CHANNEL_HEADER_SIZE  8
+#define CHANNEL_WRAP  UINT32_MAX
+#define CHANNEL_ALIGN(size)  (((uint64_t) (size) + 7) & ~((uint64_t) 7))
+
+/* A record that couldn't be encoded, which the consumer skips */
+#define CHANNEL_FLAG_SKIP  1
+
+/* The number of records in a batch that we can send without malloc */
+#define CHANNEL_STATIC_BATCH  16
+
+typedef struct _Channel
+{
+    int  refcount;
+    int  closed;
+    uint64_t  capacity;
+    char  *buf;
+    uint64_t  reserved __attribute__((aligned(64)));
+    uint64_t  published __attribute__((aligned(64)));
+    uint64_t  consumed __attribute__((aligned(64)));
+} Channel;
+
+static Channel *
+channel_new(size_t capacity)
+{
+    uint64_t  actual = CHANNEL_MIN_CAPACITY;
+    while (actual < capacity) {
+        actual *= 2;
+    }
+
+    void  *mem;
+    if (posix_memalign(&mem, 64, sizeof(Channel)) != 0) {
+        return NULL;
+    }
+    Channel  *c = mem;
+    memset(c, 0, sizeof(Channel));
+    c->refcount = 1;
+    c->capacity = actual;
+    c->buf = malloc(actual);
+    if (c->buf == NULL) {
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+static Channel *
+channel_incref(Channel *c)
+{
+    __atomic_add_fetch(&c->refcount, 1, __ATOMIC_RELAXED);
+    return c;
+}
+
+static void
+channel_decref(Channel *c)
+{
+    if (__atomic_sub_fetch(&c->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(c->buf);
+        free(c);
+    }
+}
+
+/**
+ * Waits a little while before trying again.  We spin for a bit before
+ * yielding, and then sleeping, so that a waiting thread doesn't burn
+ * a whole core if the other side is slow.
+ */
+
+static void
+channel_backoff(int *spins)
+{
+    (*spins)++;
+    if (*spins < 64) {
+        __asm__ __volatile__ ("" ::: "memory");
+    } else if (*spins < 256) {
+        sched_yield();
+    } else {
+        struct timespec  delay = { 0, 50000 };
+        nanosleep(&delay, NULL);
+    }
+}
+
+/**
+ * Returns the position where a record of the given size would be
+ * placed, if the previous record ends at pos.
+ */
+
+static uint64_t
+channel_place(Channel *c, uint64_t pos, size_t size)
+{
+    uint64_t  offset = pos & (c->capacity - 1);
+    if (offset + CHANNEL_HEADER_SIZE + CHANNEL_ALIGN(size) > c->capacity) {
+        return pos + (c->capacity - offset);
+    }
+    return pos;
+}
+
+static void
+channel_write_header(Channel *c, uint64_t pos, uint32_t length,
+                     uint32_t flags)
+{
+    uint32_t  *header = (uint32_t *) (c->buf + (pos & (c->capacity - 1)));
+    header[0] = length;
+    header[1] = flags;
+}
+
+/**
+ * Sends a batch of values into a channel, encoding them with the given
+ * memory writer.  If there isn't room for them, we either return
+ * EAGAIN or wait until there is, depending on wait.  Returns EPIPE if
+ * the channel has been closed.
+ */
+
+static int
+channel_send(Channel *c, avro_writer_t writer, avro_value_t *values,
+             size_t count, bool wait)
+{
+    size_t  static_sizes[CHANNEL_STATIC_BATCH];
+    size_t  *sizes = static_sizes;
+    if (count > CHANNEL_STATIC_BATCH) {
+        sizes = malloc(count * sizeof(size_t));
+        if (sizes == NULL) {
+            avro_set_error("Out of memory");
+            return ENOMEM;
+        }
+    }
+
+    /*
+     * A batch (or a single record) can take up at most half of the
+     * channel.  Then it needs at most one wrap marker, and the padding
+     * before the wrap is smaller than the record that follows it, so
+     * the whole batch is guaranteed to fit once the channel is empty.
+     * Anything bigger might never fit, and we'd wait forever.
+     */
+
+    size_t  i;
+    int  rc = 0;
+    uint64_t  total = 0;
+    for (i = 0; i < count && rc == 0; i++) {
+        rc = avro_value_sizeof(&values[i], &sizes[i]);
+        if (rc == 0) {
+            total += CHANNEL_HEADER_SIZE + CHANNEL_ALIGN(sizes[i]);
+            if (total > c->capacity / 2) {
+                avro_set_error((count == 1)?
+                               "Record is too large for channel":
+                               "Batch is too large for channel");
+                rc = EMSGSIZE;
+            }
+        }
+    }
+
+    /* Claim space for the whole batch. */
+    uint64_t  start = 0;
+    uint64_t  end = 0;
+    int  spins = 0;
+    while (rc == 0) {
+        if (__atomic_load_n(&c->closed, __ATOMIC_SEQ_CST)) {
+            avro_set_error("Channel is closed");
+            rc = EPIPE;
+            break;
+        }
+
+        start = __atomic_load_n(&c->reserved, __ATOMIC_RELAXED);
+        end = start;
+        for (i = 0; i < count; i++) {
+            end = channel_place(c, end, sizes[i]) +
+                CHANNEL_HEADER_SIZE + CHANNEL_ALIGN(sizes[i]);
+        }
+
+        uint64_t  consumed = __atomic_load_n(&c->consumed, __ATOMIC_ACQUIRE);
+        if (end - consumed > c->capacity) {
+            if (!wait) {
+                rc = EAGAIN;
+                break;
+            }
+            channel_backoff(&spins);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&c->reserved, &start, end, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (rc != 0) {
+        if (sizes != static_sizes) {
+            free(sizes);
+        }
+        return rc;
+    }
+
+    /*
+     * The channel might have been closed while we were claiming space,
+     * and the consumer might already have seen that reserved hadn't
+     * moved and given up.  (channel_receive checks closed before
+     * reserved, and all of these are sequentially consistent, so if we
+     * don't see closed here, the consumer will see our reservation.)
+     * We still have to fill in and publish the space we've claimed, but
+     * we mark the records as skipped and report that they weren't sent.
+     */
+
+    bool  closed = __atomic_load_n(&c->closed, __ATOMIC_SEQ_CST);
+    if (closed) {
+        avro_set_error("Channel is closed");
+        rc = EPIPE;
+    }
+
+    /*
+     * Encode each record into place.  We've already claimed the space,
+     * so if a record can't be encoded, we have to mark it as skipped
+     * rather than bail out.
+     */
+
+    uint64_t  pos = start;
+    for (i = 0; i < count; i++) {
+        uint64_t  record_pos = channel_place(c, pos, sizes[i]);
+        if (record_pos != pos) {
+            channel_write_header(c, pos, CHANNEL_WRAP, 0);
+        }
+
+        uint64_t  offset = record_pos & (c->capacity - 1);
+        int  write_rc = EPIPE;
+        if (!closed) {
+            avro_writer_memory_set_dest
+                (writer, c->buf + offset + CHANNEL_HEADER_SIZE, sizes[i]);
+            write_rc = avro_value_write(writer, &values[i]);
+        }
+        if (write_rc != 0 && rc == 0) {
+            rc = write_rc;
+        }
+        channel_write_header(c, record_pos, sizes[i],
+                             (write_rc == 0)? 0: CHANNEL_FLAG_SKIP);
+        pos = record_pos + CHANNEL_HEADER_SIZE + CHANNEL_ALIGN(sizes[i]);
+    }
+
+    /* Wait for earlier producers, and then publish the whole batch. */
+    spins = 0;
+    while (__atomic_load_n(&c->published, __ATOMIC_ACQUIRE) != start) {
+        channel_backoff(&spins);
+    }
+    __atomic_store_n(&c->published, end, __ATOMIC_RELEASE);
+
+    if (sizes != static_sizes) {
+        free(sizes);
+    }
+    return rc;
+}
+
+/**
+ * Receives the next value from a channel, decoding it into dest using
+ * the given memory reader.  If the channel is empty, we either return
+ * EAGAIN or wait for a value, depending on wait.  Returns EPIPE once
+ * the channel has been closed and everything in it has been received.
+ */
+
+static int
+channel_receive(Channel *c, avro_reader_t reader, avro_value_t *dest,
+                bool wait)
+{
+    int  spins = 0;
+    for (;;) {
+        uint64_t  pos = __atomic_load_n(&c->consumed, __ATOMIC_RELAXED);
+        uint64_t  published =
+            __atomic_load_n(&c->published, __ATOMIC_ACQUIRE);
+
+        if (pos == published) {
+            /* Don't report closed while a producer is still publishing. */
+            if (__atomic_load_n(&c->closed, __ATOMIC_SEQ_CST) &&
+                __atomic_load_n(&c->reserved, __ATOMIC_SEQ_CST) == pos) {
+                return EPIPE;
+            }
+            if (!wait) {
+                return EAGAIN;
+            }
+            channel_backoff(&spins);
+            continue;
+        }
+
+        uint64_t  offset = pos & (c->capacity - 1);
+        uint32_t  *header = (uint32_t *) (c->buf + offset);
+        if (header[0] == CHANNEL_WRAP) {
+            __atomic_store_n(&c->consumed, pos + (c->capacity - offset),
+                             __ATOMIC_RELEASE);
+            continue;
+        }
+
+        uint32_t  length = header[0];
+        int  rc = 0;
+        bool  skip = (header[1] & CHANNEL_FLAG_SKIP) != 0;
+        if (!skip) {
+            avro_reader_memory_set_source
+                (reader, c->buf + offset + CHANNEL_HEADER_SIZE, length);
+            rc = avro_value_read(reader, dest);
+        }
+
+        __atomic_store_n(&c->consumed,
+                         pos + CHANNEL_HEADER_SIZE + CHANNEL_ALIGN(length),
+                         __ATOMIC_RELEASE);
+        if (!skip) {
+            return rc;
+        }
+    }
+}
+
+/**
+ * Closes a channel.  Any values that have already been sent can still
+ * be received, but no more can be sent.
+ */
+
+static void
+channel_close(Channel *c)
+{
+    __atomic_store_n(&c->closed, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lua access — shared handles
+ */
+
+/**
+ * Schemas and value implementations are immutable once they've been
+ * created, and the Avro library updates their reference counts
+ * atomically, so it's safe to use the same instance from several
+ * threads at once.  (Values, on the other hand, must only be used by
+ * one thread at a time.)  Shared handles let us pass schemas and
+ * resolvers from one Lua state to another without having to parse and
+ * resolve them again.
+ *
+ * Exporting an object registers it in a process-wide table, and gives
+ * back an opaque handle string, which can be passed to another Lua
+ * state by any means.  Importing the handle there gives you a new Lua
+ * object that shares the same underlying schema or resolver.  Imported
+ * objects hold their own references, so they remain valid after the
+ * handle is released; releasing a handle only prevents it from being
+ * imported again.  Handles are validated against the table, so an
+ * unknown or released handle produces an error instead of a crash.
+ */
+
+typedef enum
+{
+    SHARED_SCHEMA,
+    SHARED_RESOLVED_READER,
+    SHARED_RESOLVED_WRITER,
+    SHARED_CHANNEL
+} SharedKind;
+
+static const char  *SHARED_KIND_NAMES[] = {
+    "schema", "resolved_reader", "resolved_writer", "channel"
+};
+
+#define SHARED_HANDLE_SIZE  64
+
+typedef struct _SharedHandle
+{
+    uint64_t  id;
+    SharedKind  kind;
+    avro_schema_t  schema;
+    avro_value_iface_t  *iface;
+    bool  has_fingerprint;
+    char  fingerprint[FINGERPRINT_SIZE];
+    Channel  *channel;
+} SharedHandle;
+
+/**
+ * The exported handles, sorted by ID.  Since IDs are assigned in
+ * increasing order, we can always append new handles to the end.
+ */
+
+static SharedHandle  *shared_handles = NULL;
+static size_t  shared_handle_count = 0;
+static size_t  shared_handle_capacity = 0;
+static uint64_t  shared_next_id = 1;
+static pthread_mutex_t  shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Finds a handle given its string form.  Must be called with the
+ * shared lock held.
+ */
+
+static SharedHandle *
+shared_find(const char *handle, SharedKind kind)
+{
+    size_t  prefix_size = 5 + strlen(SHARED_KIND_NAMES[kind]);
+    if (strncmp(handle, "avro:", 5) != 0 ||
+        strncmp(handle + 5, SHARED_KIND_NAMES[kind], prefix_size - 5) != 0 ||
+        handle[prefix_size] != ':') {
+        return NULL;
+    }
+
+    char  *end;
+    uint64_t  id = strtoull(handle + prefix_size + 1, &end, 10);
+    if (*end != '\0') {
+        return NULL;
+    }
+
+    size_t  lo = 0;
+    size_t  hi = shared_handle_count;
+    while (lo < hi) {
+        size_t  mid = lo + (hi - lo) / 2;
+        if (shared_handles[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < shared_handle_count && shared_handles[lo].id == id) {
+        return &shared_handles[lo];
+    }
+    return NULL;
+}
+
+/**
+ * Exports a schema, resolver, or channel.  The handle table takes its
+ * own reference to the schema, iface, and channel, any of which can be
+ * NULL.  fingerprint can also be NULL.  The string form of the new
+ * handle is written into handle, which must be at least
+ * SHARED_HANDLE_SIZE bytes.
+ */
+
+static int
+shared_export_object(SharedKind kind, avro_schema_t schema,
+                     avro_value_iface_t *iface, const char *fingerprint,
+                     Channel *channel, char *handle)
+{
+    pthread_mutex_lock(&shared_lock);
+    if (shared_handle_count == shared_handle_capacity) {
+        size_t  capacity = (shared_handle_capacity == 0)?
+            16: shared_handle_capacity * 2;
+        SharedHandle  *new_handles =
+            realloc(shared_handles, capacity * sizeof(SharedHandle));
+        if (new_handles == NULL) {
+            pthread_mutex_unlock(&shared_lock);
+            avro_set_error("Out of memory");
+            return ENOMEM;
+        }
+        shared_handles = new_handles;
+        shared_handle_capacity = capacity;
+    }
+
+    SharedHandle  *shared = &shared_handles[shared_handle_count++];
+    shared->id = shared_next_id++;
+    shared->kind = kind;
+    shared->schema = (schema == NULL)? NULL: avro_schema_incref(schema);
+    shared->iface = (iface == NULL)? NULL: avro_value_iface_incref(iface);
+    shared->channel = (channel == NULL)? NULL: channel_incref(channel);
+    shared->has_fingerprint = (fingerprint != NULL);
+    if (fingerprint != NULL) {
+        memcpy(shared->fingerprint, fingerprint, FINGERPRINT_SIZE);
+    }
+    snprintf(handle, SHARED_HANDLE_SIZE, "avro:%s:%llu",
+             SHARED_KIND_NAMES[kind], (unsigned long long) shared->id);
+    pthread_mutex_unlock(&shared_lock);
+    return 0;
+}
+
+static int
+shared_export(SharedKind kind, avro_schema_t schema,
+              avro_value_iface_t *iface, const char *fingerprint,
+              char *handle)
+{
+    return shared_export_object
+        (kind, schema, iface, fingerprint, NULL, handle);
+}
+
+/**
+ * Imports a handle, filling in dest with a copy of its contents.  The
+ * caller receives a new reference to the schema, iface, and channel
+ * (whichever are present).
+ */
+
+static int
+shared_import(const char *handle, SharedKind kind, SharedHandle *dest)
+{
+    pthread_mutex_lock(&shared_lock);
+    SharedHandle  *shared = shared_find(handle, kind);
+    if (shared == NULL) {
+        pthread_mutex_unlock(&shared_lock);
+        avro_set_error("Unknown %s handle %s",
+                       SHARED_KIND_NAMES[kind], handle);
+        return EINVAL;
+    }
+    *dest = *shared;
+    if (dest->schema != NULL) {
+        avro_schema_incref(dest->schema);
+    }
+    if (dest->iface != NULL) {
+        avro_value_iface_incref(dest->iface);
+    }
+    if (dest->channel != NULL) {
+        channel_incref(dest->channel);
+    }
+    pthread_mutex_unlock(&shared_lock);
+    return 0;
+}
+
+static bool
+shared_release(const char *handle)
+{
+    SharedKind  kind;
+    for (kind = SHARED_SCHEMA; kind <= SHARED_CHANNEL; kind++) {
+        pthread_mutex_lock(&shared_lock);
+        SharedHandle  *shared = shared_find(handle, kind);
+        if (shared != NULL) {
+            SharedHandle  copy = *shared;
+            size_t  index = shared - shared_handles;
+            memmove(shared, shared + 1,
+                    (shared_handle_count - index - 1) * sizeof(SharedHandle));
+            shared_handle_count--;
+            pthread_mutex_unlock(&shared_lock);
+
+            if (copy.schema != NULL) {
+                avro_schema_decref(copy.schema);
+            }
+            if (copy.iface != NULL) {
+                avro_value_iface_decref(copy.iface);
+            }
+            if (copy.channel != NULL) {
+                channel_decref(copy.channel);
+            }
+            return true;
+        }
+        pthread_mutex_unlock(&shared_lock);
+    }
+    return false;
+}
+
+/**
+ * Returns the userdata at the given stack index if it has the given
+ * metatable, or NULL otherwise.
+ */
+
+static void *
+test_udata(lua_State *L, int index, const char *tname)
+{
+    void  *result = NULL;
+    if (lua_isuserdata(L, index) && lua_getmetatable(L, index)) {
+        lua_getfield(L, LUA_REGISTRYINDEX, tname);
+        if (lua_rawequal(L, -1, -2)) {
+            result = lua_touserdata(L, index);
+        }
+        lua_pop(L, 2);
+    }
+    return result;
+}
+
+/**
+ * Exports a schema, returning a handle string.  If the schema doesn't
+ * have a fingerprint, one can be passed in as the second parameter.
+ */
+
+static int
+l_export_schema(lua_State *L)
+{
+    if (test_udata(L, 1, MT_AVRO_SCHEMA) == NULL) {
+        lua_getfield(L, 1, "raw_schema");
+        lua_pushvalue(L, 1);
+        lua_call(L, 1, 1);
+        lua_replace(L, 1);
+    }
+    LuaAvroSchema  *l_schema = luaL_checkudata(L, 1, MT_AVRO_SCHEMA);
+
+    const char  *fingerprint = NULL;
+    if (schema_resolve_fingerprint(L, 1)) {
+        fingerprint =
+            l_schema->single_object_header + SINGLE_OBJECT_MARKER_SIZE;
+    } else if (!lua_isnoneornil(L, 2)) {
+        size_t  fingerprint_size;
+        fingerprint = luaL_checklstring(L, 2, &fingerprint_size);
+        if (fingerprint_size != FINGERPRINT_SIZE) {
+            return luaL_error(L, "Fingerprint must be %d bytes",
+                              FINGERPRINT_SIZE);
+        }
+    }
+
+    /* Create the iface now, so that importers can share it. */
+    if (l_schema->iface == NULL) {
+        l_schema->iface = avro_generic_class_from_schema(l_schema->schema);
+        if (l_schema->iface == NULL) {
+            return lua_avro_error(L);
+        }
+    }
+
+    char  handle[SHARED_HANDLE_SIZE];
+    check(shared_export(SHARED_SCHEMA, l_schema->schema, l_schema->iface,
+                        fingerprint, handle));
+    lua_pushstring(L, handle);
+    return 1;
+}
+
+/**
+ * Imports a schema handle, returning a new AvroSchema instance.  Like
+ * the Schema function, we also return the underlying schema pointer,
+ * along with the iface and fingerprint, for the FFI binding's benefit.
+ */
+
+static int
+l_import_schema(lua_State *L)
+{
+    const char  *handle = luaL_checkstring(L, 1);
+    SharedHandle  shared;
+    if (shared_import(handle, SHARED_SCHEMA, &shared) != 0) {
+        return lua_return_avro_error(L);
+    }
+
+    lua_avro_push_schema(L, shared.schema);
+    avro_schema_decref(shared.schema);
+    LuaAvroSchema  *l_schema = lua_touserdata(L, -1);
+    l_schema->iface = shared.iface;
+    int  schema_index = lua_gettop(L);
+
+    if (shared.has_fingerprint) {
+        lua_pushcfunction(L, l_schema_set_fingerprint);
+        lua_pushvalue(L, schema_index);
+        lua_pushlstring(L, shared.fingerprint, FINGERPRINT_SIZE);
+        lua_call(L, 2, 0);
+    }
+
+    lua_pushlightuserdata(L, shared.schema);
+    lua_pushlightuserdata(L, shared.iface);
+    if (shared.has_fingerprint) {
+        lua_pushlstring(L, shared.fingerprint, FINGERPRINT_SIZE);
+    } else {
+        lua_pushnil(L);
+    }
+    return 4;
+}
+
+/**
+ * Exports a ResolvedReader or ResolvedWriter, returning a handle
+ * string.
+ */
+
+static int
+l_export_resolver(lua_State *L)
+{
+    char  handle[SHARED_HANDLE_SIZE];
+    LuaAvroResolvedReader  *l_reader =
+        test_udata(L, 1, MT_AVRO_RESOLVED_READER);
+    if (l_reader != NULL) {
+        check(shared_export(SHARED_RESOLVED_READER, NULL,
+                            l_reader->resolver, NULL, handle));
+    } else {
+        LuaAvroResolvedWriter  *l_writer =
+            luaL_checkudata(L, 1, MT_AVRO_RESOLVED_WRITER);
+        check(shared_export(SHARED_RESOLVED_WRITER, NULL,
+                            l_writer->resolver, NULL, handle));
+    }
+    lua_pushstring(L, handle);
+    return 1;
+}
+
+/**
+ * Imports a resolver handle, returning a new ResolvedReader or
+ * ResolvedWriter instance.
+ */
+
+static int
+l_import_resolver(lua_State *L)
+{
+    const char  *handle = luaL_checkstring(L, 1);
+    SharedHandle  shared;
+    if (shared_import(handle, SHARED_RESOLVED_READER, &shared) == 0) {
+        return lua_avro_push_resolved_reader(L, shared.iface);
+    }
+    if (shared_import(handle, SHARED_RESOLVED_WRITER, &shared) == 0) {
+        return lua_avro_push_resolved_writer(L, shared.iface);
+    }
+    avro_set_error("Unknown resolver handle %s", handle);
+    return lua_return_avro_error(L);
+}
+
+/**
+ * Releases a handle.  Objects that have already been imported from it
+ * remain valid.
+ */
+
+static int
+l_release_handle(lua_State *L)
+{
+    const char  *handle = luaL_checkstring(L, 1);
+    if (!shared_release(handle)) {
+        return luaL_error(L, "Unknown handle %s", handle);
+    }
+    return 0;
+}
+
+/**
+ * The shared handle functions, made available to the LuaJIT FFI
+ * binding via shared_handle_api, so that it can export and import its
+ * own resolvers.
+ */
+
+typedef struct _SharedHandleApi
+{
+    int (*export_iface)(SharedKind kind, avro_schema_t schema,
+                        avro_value_iface_t *iface, const char *fingerprint,
+                        char *handle);
+    int (*import_iface)(const char *handle, SharedKind kind,
+                        SharedHandle *dest);
+} SharedHandleApi;
+
+static const SharedHandleApi  shared_handle_api = {
+    shared_export,
+    shared_import
+};
+
+static int
+l_shared_handle_api(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void *) &shared_handle_api);
+    return 1;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lua access — channels
+ */
+
+/**
+ * The string used to identify the AvroChannel class's metatable in the
+ * Lua registry.
+ */
+
+#define MT_AVRO_CHANNEL "avro:AvroChannel"
+
+/**
+ * Each Lua state that uses a channel has its own AvroChannel instance,
+ * with its own memory reader and writer.
+ */
+
+typedef struct _LuaAvroChannel
+{
+    Channel  *channel;
+    avro_writer_t  writer;
+    avro_reader_t  reader;
+} LuaAvroChannel;
+
+/**
+ * Pushes a new AvroChannel instance, which takes ownership of the
+ * given reference to the channel.  Like the Schema function, we also
+ * push the underlying channel pointer, for the FFI binding's benefit.
+ */
+
+static int
+lua_avro_push_channel(lua_State *L, Channel *channel)
+{
+    LuaAvroChannel  *l_channel = lua_newuserdata(L, sizeof(LuaAvroChannel));
+    l_channel->channel = channel;
+    l_channel->writer = avro_writer_memory(NULL, 0);
+    l_channel->reader = avro_reader_memory(NULL, 0);
+    luaL_getmetatable(L, MT_AVRO_CHANNEL);
+    lua_setmetatable(L, -2);
+    lua_pushlightuserdata(L, channel);
+    return 2;
+}
+
+static LuaAvroChannel *
+lua_avro_get_channel(lua_State *L, int index)
+{
+    LuaAvroChannel  *l_channel = luaL_checkudata(L, index, MT_AVRO_CHANNEL);
+    if (l_channel->channel == NULL) {
+        luaL_error(L, "Channel has been freed");
+    }
+    return l_channel;
+}
+
+/**
+ * Creates a new channel with (at least) the given capacity in bytes.
+ */
+
+static int
+l_channel_new(lua_State *L)
+{
+    lua_Integer  capacity = luaL_optinteger(L, 1, 0);
+    luaL_argcheck(L, capacity >= 0, 1, "Invalid channel capacity");
+    Channel  *channel = channel_new(capacity);
+    if (channel == NULL) {
+        return luaL_error(L, "Out of memory");
+    }
+    return lua_avro_push_channel(L, channel);
+}
+
+/**
+ * Imports a channel handle, returning a new AvroChannel instance.
+ */
+
+static int
+l_import_channel(lua_State *L)
+{
+    const char  *handle = luaL_checkstring(L, 1);
+    SharedHandle  shared;
+    if (shared_import(handle, SHARED_CHANNEL, &shared) != 0) {
+        return lua_return_avro_error(L);
+    }
+    return lua_avro_push_channel(L, shared.channel);
+}
+
+/**
+ * Returns a handle that can be used to import the channel into another
+ * Lua state.
+ */
+
+static int
+l_channel_export(lua_State *L)
+{
+    LuaAvroChannel  *l_channel = lua_avro_get_channel(L, 1);
+    char  handle[SHARED_HANDLE_SIZE];
+    check(shared_export_object(SHARED_CHANNEL, NULL, NULL, NULL,
+                               l_channel->channel, handle));
+    lua_pushstring(L, handle);
+    return 1;
+}
+
+/**
+ * Translates the result of channel_send into Lua results: true if the
+ * values were sent, or false if the channel was full.  Other errors are
+ * raised.
+ */
+
+static int
+channel_send_result(lua_State *L, int rc)
+{
+    if (rc == EAGAIN) {
+        lua_pushboolean(L, false);
+        lua_pushliteral(L, "full");
+        return 2;
+    }
+    check(rc);
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+/**
+ * Sends a value into the channel.  If the channel is full, we return
+ * false, unless the second parameter is true, in which case we wait for
+ * room.
+ */
+
+static int
+l_channel_send(lua_State *L)
+{
+    LuaAvroChannel  *l_channel = lua_avro_get_channel(L, 1);
+    avro_value_t  *value = lua_avro_get_value(L, 2);
+    bool  wait = lua_toboolean(L, 3);
+    int  rc = channel_send(l_channel->channel, l_channel->writer,
+                           value, 1, wait);
+    return channel_send_result(L, rc);
+}
+
+/**
+ * Sends a list of values into the channel.  They're published all at
+ * once, so the consumer will see either all of them or none.
+ */
+
+static int
+l_channel_send_batch(lua_State *L)
+{
+    LuaAvroChannel  *l_channel = lua_avro_get_channel(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    bool  wait = lua_toboolean(L, 3);
+
+    size_t  count = lua_objlen(L, 2);
+    if (count == 0) {
+        lua_pushboolean(L, true);
+        return 1;
+    }
+
+    avro_value_t  *values = lua_newuserdata(L, count * sizeof(avro_value_t));
+    size_t  i;
+    for (i = 0; i < count; i++) {
+        lua_rawgeti(L, 2, i+1);
+        values[i] = *lua_avro_get_value(L, -1);
+        lua_pop(L, 1);
+    }
+
+    int  rc = channel_send(l_channel->channel, l_channel->writer,
+                           values, count, wait);
+    return channel_send_result(L, rc);
+}
+
+/**
+ * Receives the next value from the channel into the given AvroValue,
+ * which must have the same schema as the values that were sent.  We
+ * return the value, or nil and "empty" if there are no values waiting,
+ * or nil and "closed" if the channel has been closed and drained.  If
+ * the third parameter is true, we wait for a value instead of
+ * returning "empty".
+ */
+
+static int
+l_channel_receive(lua_State *L)
+{
+    LuaAvroChannel  *l_channel = lua_avro_get_channel(L, 1);
+    avro_value_t  *value = lua_avro_get_value(L, 2);
+    bool  wait = lua_toboolean(L, 3);
+    int  rc = channel_receive(l_channel->channel, l_channel->reader,
+                              value, wait);
+    if (rc == EAGAIN) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "empty");
+        return 2;
+    }
+    if (rc == EPIPE) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+    check(rc);
+    lua_pushvalue(L, 2);
+    return 1;
+}
+
+/**
+ * Closes the channel, for every Lua state that's using it.  Values that
+ * have already been sent can still be received.
+ */
+
+static int
+l_channel_close(lua_State *L)
+{
+    LuaAvroChannel  *l_channel = lua_avro_get_channel(L, 1);
+    channel_close(l_channel->channel);
+    return 0;
+}
+
+/**
+ * Finalizes an AvroChannel instance.
+ */
+
+static int
+l_channel_gc(lua_State *L)
+{
+    LuaAvroChannel  *l_channel = luaL_checkudata(L, 1, MT_AVRO_CHANNEL);
+    if (l_channel->channel != NULL) {
+        channel_decref(l_channel->channel);
+        l_channel->channel = NULL;
+    }
+    if (l_channel->writer != NULL) {
+        avro_writer_free(l_channel->writer);
+        l_channel->writer = NULL;
+    }
+    if (l_channel->reader != NULL) {
+        avro_reader_free(l_channel->reader);
+        l_channel->reader = NULL;
+    }
+    return 0;
+}
+
+/**
+ * The channel functions, made available to the LuaJIT FFI binding via
+ * channel_api, so that it can send and receive its own values.
+ */
+
+typedef struct _ChannelApi
+{
+    int (*send)(Channel *c, avro_writer_t writer, avro_value_t *values,
+                size_t count, bool wait);
+    int (*receive)(Channel *c, avro_reader_t reader, avro_value_t *dest,
+                   bool wait);
+} ChannelApi;
+
+static const ChannelApi  channel_api = {
+    channel_send,
+    channel_receive
+};
+
+static int
+l_channel_api(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void *) &channel_api);
+    return 1;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Container files
+ */
+
+/**
+ * A few helpers for parsing the Avro object container format directly.
+ * We only use these to find the boundaries of the header and of each
+ * block; the contents of the blocks are still decompressed and decoded
+ * by the Avro library.  Each parsing function returns one of the
+ * following result codes.
+ */
+
+#define CONTAINER_OK  0
+#define CONTAINER_SHORT  1
+#define CONTAINER_INVALID  2
+
+#define CONTAINER_MAGIC  "Obj\x01"
+#define CONTAINER_MAGIC_SIZE  4
+#define CONTAINER_SYNC_SIZE  16
+
+/**
+ * The largest possible size of the count and byte size that start each
+ * block, which are both zig-zag encoded longs.
+ */
+
+#define CONTAINER_BLOCK_START_MAX  20
+
+static int
+container_read_long(const char *buf, size_t size, size_t *pos, int64_t *result)
+{
+    uint64_t  value = 0;
+    int  shift = 0;
+    size_t  i = *pos;
+    for (;;) {
+        if (i >= size) {
+            return CONTAINER_SHORT;
+        }
+        uint8_t  b = buf[i++];
+        value |= (uint64_t) (b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            break;
+        }
+        shift += 7;
+        if (shift >= 64) {
+            return CONTAINER_INVALID;
+        }
+    }
+    *result = (int64_t) ((value >> 1) ^ -(value & 1));
+    *pos = i;
+    return CONTAINER_OK;
+}
+
+/**
+ * Encodes a zig-zag long, returning the number of bytes used.  buf must
+ * have room for at least 10 bytes.
+ */
+
+static size_t
+container_write_long(char *buf, int64_t value)
+{
+    uint64_t  n = ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+    size_t  i = 0;
+    while (n & ~((uint64_t) 0x7f)) {
+        buf[i++] = (char) ((n & 0x7f) | 0x80);
+        n >>= 7;
+    }
+    buf[i++] = (char) n;
+    return i;
+}
+
+#define check_container(call) \
+    do { \
+        int __rc = call; \
+        if (__rc != CONTAINER_OK) { \
+            return __rc; \
+        } \
+    } while (0)
+
+/**
+ * Skips over a length-prefixed string or bytes value.
+ */
+
+static int
+container_skip_bytes(const char *buf, size_t size, size_t *pos)
+{
+    int64_t  length;
+    check_container(container_read_long(buf, size, pos, &length));
+    if (length < 0) {
+        return CONTAINER_INVALID;
+    }
+    if ((uint64_t) length > size - *pos) {
+        return CONTAINER_SHORT;
+    }
+    *pos += length;
+    return CONTAINER_OK;
+}
+
+/**
+ * Parses the header of a container file.  On success, we fill in the
+ * size of the header (including the sync marker), and copy the sync
+ * marker into sync.
+ */
+
+static int
+container_parse_header(const char *buf, size_t size,
+                       size_t *header_size, char *sync)
+{
+    size_t  magic_size =
+        (size < CONTAINER_MAGIC_SIZE)? size: CONTAINER_MAGIC_SIZE;
+    if (memcmp(buf, CONTAINER_MAGIC, magic_size) != 0) {
+        return CONTAINER_INVALID;
+    }
+    if (size < CONTAINER_MAGIC_SIZE) {
+        return CONTAINER_SHORT;
+    }
+
+    /* The metadata map */
+    size_t  pos = CONTAINER_MAGIC_SIZE;
+    for (;;) {
+        int64_t  count;
+        check_container(container_read_long(buf, size, &pos, &count));
+        if (count == 0) {
+            break;
+        }
+        if (count < 0) {
+            int64_t  block_size;
+            count = -count;
+            check_container(container_read_long(buf, size, &pos, &block_size));
+        }
+        int64_t  i;
+        for (i = 0; i < count; i++) {
+            check_container(container_skip_bytes(buf, size, &pos));
+            check_container(container_skip_bytes(buf, size, &pos));
+        }
+    }
+
+    if (size - pos < CONTAINER_SYNC_SIZE) {
+        return CONTAINER_SHORT;
+    }
+    memcpy(sync, buf + pos, CONTAINER_SYNC_SIZE);
+    *header_size = pos + CONTAINER_SYNC_SIZE;
+    return CONTAINER_OK;
+}
+
+/**
+ * Finds a metadata entry in a container file header that has already
+ * been validated by container_parse_header.  Returns false if there's
+ * no entry with the given key.
+ */
+
+static bool
+container_header_meta(const char *header, size_t header_size,
+                      const char *key, const char **value, size_t *value_size)
+{
+    size_t  key_len = strlen(key);
+    size_t  pos = CONTAINER_MAGIC_SIZE;
+    for (;;) {
+        int64_t  count = 0;
+        container_read_long(header, header_size, &pos, &count);
+        if (count == 0) {
+            return false;
+        }
+        if (count < 0) {
+            int64_t  block_size = 0;
+            count = -count;
+            container_read_long(header, header_size, &pos, &block_size);
+        }
+
+        int64_t  i;
+        for (i = 0; i < count; i++) {
+            int64_t  entry_key_size = 0;
+            int64_t  entry_value_size = 0;
+            container_read_long(header, header_size, &pos, &entry_key_size);
+            const char  *entry_key = header + pos;
+            pos += entry_key_size;
+            container_read_long(header, header_size, &pos, &entry_value_size);
+            if ((size_t) entry_key_size == key_len &&
+                memcmp(entry_key, key, key_len) == 0) {
+                *value = header + pos;
+                *value_size = entry_value_size;
+                return true;
+            }
+            pos += entry_value_size;
+        }
+    }
+}
+
+/**
+ * Parses the record count and byte size at the start of a block.
+ * start_size is filled in with the number of bytes they take up.  The
+ * block's data follows, and then its sync marker.
+ */
+
+static int
+container_parse_block_start(const char *buf, size_t size, int64_t *count,
+                            int64_t *data_size, size_t *start_size)
+{
+    size_t  pos = 0;
+    check_container(container_read_long(buf, size, &pos, count));
+    check_container(container_read_long(buf, size, &pos, data_size));
+    if (*count < 0 || *data_size < 0) {
+        return CONTAINER_INVALID;
+    }
+    *start_size = pos;
+    return CONTAINER_OK;
+}
+
+/**
+ * Reads the header of a container file from the given file descriptor.
+ * Returns a newly allocated copy of the header, or NULL if it can't be
+ * read, in which case error is filled in.
+ */
+
+static char *
+container_read_header(int fd, size_t *header_size, char *sync,
+                      const char **error)
+{
+    size_t  capacity = 4096;
+    char  *buf = NULL;
+    for (;;) {
+        char  *new_buf = realloc(buf, capacity);
+        if (new_buf == NULL) {
+            free(buf);
+            *error = "Out of memory";
+            return NULL;
+        }
+        buf = new_buf;
+
+        ssize_t  size = pread(fd, buf, capacity, 0);
+        if (size < 0) {
+            free(buf);
+            *error = strerror(errno);
+            return NULL;
+        }
+
+        int  rc = container_parse_header(buf, size, header_size, sync);
+        if (rc == CONTAINER_OK) {
+            return buf;
+        }
+        if (rc == CONTAINER_INVALID || (size_t) size < capacity) {
+            free(buf);
+            *error = "Not an Avro container file";
+            return NULL;
+        }
+        capacity *= 2;
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Read-ahead
+ */
+
+/**
+ * A read-ahead reader has a background thread that reads blocks from a
+ * container file and decompresses them, keeping up to a fixed number of
+ * decompressed blocks queued up ahead of the caller.  The queue is
+ * exposed as a stdio stream containing an uncompressed ("null" codec)
+ * copy of the file, which we hand to the Avro library's file reader as
+ * usual; decoding still happens on the calling thread.
+ *
+ * We only decompress codecs that we can handle ourselves ("null" and
+ * "deflate"); files that use any other codec are read without any
+ * read-ahead.
+ */
+
+typedef enum
+{
+    PREFETCH_NULL,
+    PREFETCH_DEFLATE,
+    PREFETCH_UNSUPPORTED
+} PrefetchCodec;
+
+typedef struct _PrefetchBlock
+{
+    struct _PrefetchBlock  *next;
+    size_t  size;
+    size_t  pos;
+    char  data[];
+} PrefetchBlock;
+
+typedef struct _Prefetch
+{
+    int  fd;
+    off_t  offset;
+    PrefetchCodec  codec;
+    char  sync[CONTAINER_SYNC_SIZE];
+    pthread_t  thread;
+    pthread_mutex_t  lock;
+    pthread_cond_t  cond;
+    PrefetchBlock  *head;
+    PrefetchBlock  *tail;
+    size_t  queued;
+    size_t  capacity;
+    bool  done;
+    bool  closing;
+    const char  *error;
+} Prefetch;
+
+static PrefetchBlock *
+prefetch_block_new(size_t size)
+{
+    PrefetchBlock  *block = malloc(sizeof(PrefetchBlock) + size);
+    if (block != NULL) {
+        block->next = NULL;
+        block->size = size;
+        block->pos = 0;
+    }
+    return block;
+}
+
+/**
+ * Copies a container file's header, replacing its codec with "null".
+ * We also fill in which codec the original file used.
+ */
+
+static PrefetchBlock *
+prefetch_rewrite_header(const char *header, size_t header_size,
+                        PrefetchCodec *codec)
+{
+    /* The rewritten header is never longer than the original. */
+    PrefetchBlock  *block = prefetch_block_new(header_size);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    char  *out = block->data;
+    size_t  out_pos = CONTAINER_MAGIC_SIZE;
+    size_t  pos = CONTAINER_MAGIC_SIZE;
+    memcpy(out, header, CONTAINER_MAGIC_SIZE);
+    *codec = PREFETCH_NULL;
+
+    /*
+     * The header has already been validated by container_parse_header,
+     * so we don't need to check for errors here.
+     */
+
+    for (;;) {
+        int64_t  count = 0;
+        container_read_long(header, header_size, &pos, &count);
+        if (count < 0) {
+            int64_t  block_size = 0;
+            count = -count;
+            container_read_long(header, header_size, &pos, &block_size);
+        }
+        out_pos += container_write_long(out + out_pos, count);
+        if (count == 0) {
+            break;
+        }
+
+        int64_t  i;
+        for (i = 0; i < count; i++) {
+            int64_t  key_size = 0;
+            int64_t  value_size = 0;
+            container_read_long(header, header_size, &pos, &key_size);
+            const char  *key = header + pos;
+            pos += key_size;
+            container_read_long(header, header_size, &pos, &value_size);
+            const char  *value = header + pos;
+            pos += value_size;
+
+            out_pos += container_write_long(out + out_pos, key_size);
+            memcpy(out + out_pos, key, key_size);
+            out_pos += key_size;
+
+            if (key_size == 10 && memcmp(key, "avro.codec", 10) == 0) {
+                if (value_size == 7 && memcmp(value, "deflate", 7) == 0) {
+                    *codec = PREFETCH_DEFLATE;
+                } else if (value_size != 4 || memcmp(value, "null", 4) != 0) {
+                    *codec = PREFETCH_UNSUPPORTED;
+                }
+                value = "null";
+                value_size = 4;
+            }
+
+            out_pos += container_write_long(out + out_pos, value_size);
+            memcpy(out + out_pos, value, value_size);
+            out_pos += value_size;
+        }
+    }
+
+    memcpy(out + out_pos, header + pos, CONTAINER_SYNC_SIZE);
+    block->size = out_pos + CONTAINER_SYNC_SIZE;
+    return block;
+}
+
+/**
+ * Inflates a block of deflate-compressed data.  Returns a new buffer
+ * with enough room before the data for the block's count and size.
+ */
+
+static char *
+prefetch_inflate(const char *data, size_t size, size_t *inflated_size)
+{
+    z_stream  stream;
+    memset(&stream, 0, sizeof(z_stream));
+    if (inflateInit2(&stream, -15) != Z_OK) {
+        return NULL;
+    }
+
+    size_t  capacity = (size < 1024)? 4096: size * 4;
+    char  *buf = malloc(CONTAINER_BLOCK_START_MAX + capacity);
+    stream.next_in = (Bytef *) data;
+    stream.avail_in = size;
+
+    int  rc = Z_OK;
+    while (buf != NULL) {
+        stream.next_out =
+            (Bytef *) buf + CONTAINER_BLOCK_START_MAX + stream.total_out;
+        stream.avail_out = capacity - stream.total_out;
+        rc = inflate(&stream, Z_FINISH);
+        if (rc != Z_BUF_ERROR || stream.avail_out != 0) {
+            break;
+        }
+        capacity *= 2;
+        char  *new_buf = realloc(buf, CONTAINER_BLOCK_START_MAX + capacity);
+        if (new_buf == NULL) {
+            free(buf);
+        }
+        buf = new_buf;
+    }
+
+    inflateEnd(&stream);
+    if (buf != NULL && rc != Z_STREAM_END) {
+        free(buf);
+        return NULL;
+    }
+    *inflated_size = stream.total_out;
+    return buf;
+}
+
+/**
+ * Reads the next block from the file, returning an uncompressed copy
+ * of it.  Sets *error and returns NULL if something goes wrong, and
+ * returns NULL without setting *error at the end of the file.
+ */
+
+static PrefetchBlock *
+prefetch_read_block(Prefetch *p, const char **error)
+{
+    char  start[CONTAINER_BLOCK_START_MAX];
+    ssize_t  size = pread(p->fd, start, sizeof(start), p->offset);
+    if (size <= 0) {
+        if (size < 0) {
+            *error = strerror(errno);
+        }
+        return NULL;
+    }
+
+    int64_t  count;
+    int64_t  data_size;
+    size_t  start_size;
+    if (container_parse_block_start(start, size, &count, &data_size,
+                                    &start_size) != CONTAINER_OK) {
+        *error = "Invalid block in container file";
+        return NULL;
+    }
+
+    size_t  raw_size = data_size + CONTAINER_SYNC_SIZE;
+    char  *raw = malloc(raw_size);
+    if (raw == NULL) {
+        *error = "Out of memory";
+        return NULL;
+    }
+    size = pread(p->fd, raw, raw_size, p->offset + start_size);
+    if (size < 0 || (size_t) size != raw_size) {
+        free(raw);
+        *error = "Truncated block in container file";
+        return NULL;
+    }
+    if (memcmp(raw + data_size, p->sync, CONTAINER_SYNC_SIZE) != 0) {
+        free(raw);
+        *error = "Invalid sync marker in container file";
+        return NULL;
+    }
+    p->offset += start_size + raw_size;
+
+    const char  *data = raw;
+    char  *inflated = NULL;
+    size_t  inflated_size = data_size;
+    if (p->codec == PREFETCH_DEFLATE) {
+        inflated = prefetch_inflate(raw, data_size, &inflated_size);
+        if (inflated == NULL) {
+            free(raw);
+            *error = "Cannot decompress block";
+            return NULL;
+        }
+        data = inflated + CONTAINER_BLOCK_START_MAX;
+    }
+
+    PrefetchBlock  *block = prefetch_block_new
+        (CONTAINER_BLOCK_START_MAX + inflated_size + CONTAINER_SYNC_SIZE);
+    if (block == NULL) {
+        free(inflated);
+        free(raw);
+        *error = "Out of memory";
+        return NULL;
+    }
+
+    size_t  pos = container_write_long(block->data, count);
+    pos += container_write_long(block->data + pos, inflated_size);
+    memcpy(block->data + pos, data, inflated_size);
+    pos += inflated_size;
+    memcpy(block->data + pos, p->sync, CONTAINER_SYNC_SIZE);
+    block->size = pos + CONTAINER_SYNC_SIZE;
+
+    free(inflated);
+    free(raw);
+    return block;
+}
+
+static void *
+prefetch_main(void *vp)
+{
+    Prefetch  *p = vp;
+    const char  *error = NULL;
+    PrefetchBlock  *block;
+
+    while ((block = prefetch_read_block(p, &error)) != NULL) {
+        pthread_mutex_lock(&p->lock);
+        while (p->queued >= p->capacity && !p->closing) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->closing) {
+            pthread_mutex_unlock(&p->lock);
+            free(block);
+            return NULL;
+        }
+        if (p->tail == NULL) {
+            p->head = block;
+        } else {
+            p->tail->next = block;
+        }
+        p->tail = block;
+        p->queued++;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->done = true;
+    p->error = error;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static ssize_t
+prefetch_stream_read(void *vp, char *buf, size_t size)
+{
+    Prefetch  *p = vp;
+    size_t  total = 0;
+
+    pthread_mutex_lock(&p->lock);
+    while (total < size) {
+        /* Only wait for more blocks if we haven't read anything yet. */
+        while (p->head == NULL && !p->done && total == 0) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->head == NULL) {
+            break;
+        }
+
+        PrefetchBlock  *block = p->head;
+        size_t  chunk = block->size - block->pos;
+        if (chunk > size - total) {
+            chunk = size - total;
+        }
+        memcpy(buf + total, block->data + block->pos, chunk);
+        block->pos += chunk;
+        total += chunk;
+
+        if (block->pos == block->size) {
+            p->head = block->next;
+            if (p->head == NULL) {
+                p->tail = NULL;
+            }
+            p->queued--;
+            free(block);
+            pthread_cond_broadcast(&p->cond);
+        }
+    }
+    const char  *error = (total == 0)? p->error: NULL;
+    pthread_mutex_unlock(&p->lock);
+
+    if (error != NULL) {
+        avro_set_error("%s", error);
+        errno = EIO;
+        return -1;
+    }
+    return total;
+}
+
+static int
+prefetch_stream_close(void *vp)
+{
+    Prefetch  *p = vp;
+
+    pthread_mutex_lock(&p->lock);
+    p->closing = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+
+    while (p->head != NULL) {
+        PrefetchBlock  *next = p->head->next;
+        free(p->head);
+        p->head = next;
+    }
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    close(p->fd);
+    free(p);
+    return 0;
+}
+
+/**
+ * Opens a file reader that reads up to capacity blocks ahead of the
+ * caller.  Returns an Avro error code, like avro_file_reader.
+ */
+
+static int
+lua_avro_prefetch_file_reader(const char *path, size_t capacity,
+                              avro_file_reader_t *reader)
+{
+    int  fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        int  rc = errno;
+        avro_set_error("Cannot open file %s: %s", path, strerror(rc));
+        return rc;
+    }
+
+    const char  *error = NULL;
+    size_t  header_size;
+    char  sync[CONTAINER_SYNC_SIZE];
+    char  *header = container_read_header(fd, &header_size, sync, &error);
+    if (header == NULL) {
+        close(fd);
+        avro_set_error("%s", error);
+        return EILSEQ;
+    }
+
+    PrefetchCodec  codec;
+    PrefetchBlock  *header_block =
+        prefetch_rewrite_header(header, header_size, &codec);
+    free(header);
+    if (header_block == NULL || codec == PREFETCH_UNSUPPORTED) {
+        /* Fall back on a regular reader. */
+        free(header_block);
+        close(fd);
+        return avro_file_reader(path, reader);
+    }
+
+    Prefetch  *p = calloc(1, sizeof(Prefetch));
+    if (p == NULL) {
+        free(header_block);
+        close(fd);
+        avro_set_error("Out of memory");
+        return ENOMEM;
+    }
+    p->fd = fd;
+    p->offset = header_size;
+    p->codec = codec;
+    memcpy(p->sync, sync, CONTAINER_SYNC_SIZE);
+    p->head = p->tail = header_block;
+    p->queued = 1;
+    p->capacity = capacity;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&p->thread, NULL, prefetch_main, p) != 0) {
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        free(header_block);
+        close(fd);
+        free(p);
+        avro_set_error("Cannot create read-ahead thread");
+        return EAGAIN;
+    }
+
+    FILE  *fp =
+        reader_stream_open(p, prefetch_stream_read, prefetch_stream_close);
+    if (fp == NULL) {
+        /* Fall back on a regular reader here, too. */
+        prefetch_stream_close(p);
+        return avro_file_reader(path, reader);
+    }
+
+    /* The reader takes ownership of the stream, even on error. */
+    return avro_file_reader_fp(fp, path, 1, reader);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Asynchronous writers
+ */
+
+/**
+ * An asynchronous writer encodes values into block buffers on the
+ * calling thread, and hands each full block to a pool of background
+ * threads, which compress the blocks and write them to the file.  At
+ * most queue_depth blocks can be waiting for a background thread; once
+ * the queue is full, the caller blocks until there's room for another
+ * one.
+ *
+ * Each block is given a sequence number when it's queued.  The threads
+ * compress blocks in parallel, but take turns writing them, in sequence
+ * order, so the file is the same no matter how many threads we use.
+ *
+ * We write the container format ourselves, since the Avro library's
+ * file writer compresses and writes each block synchronously.  Like
+ * the read-ahead readers, we support the "null" and "deflate" codecs.
+ */
+
+#define ASYNC_WRITER_DEFAULT_BLOCK_SIZE  (16*1024)
+#define ASYNC_WRITER_DEFAULT_SYNC_INTERVAL  1000000000
+#define ASYNC_WRITER_DEFAULT_QUEUE_DEPTH  4
+#define ASYNC_WRITER_MAX_THREADS  256
+
+typedef enum
+{
+    ASYNC_CODEC_NULL,
+    ASYNC_CODEC_DEFLATE
+} AsyncCodec;
+
+/**
+ * How hard we try to get blocks onto disk once they've been written.
+ * With ASYNC_DURABILITY_BLOCK, each block is synced before the next one
+ * is written.  With ASYNC_DURABILITY_INTERVAL, blocks are synced in
+ * groups: a single sync covers every block that was written since the
+ * last one, and we sync at most once every sync_interval nanoseconds,
+ * so at most that much data can be lost in a crash.  An idle writer
+ * thread makes sure that the last group is synced even if no more
+ * blocks arrive.
+ */
+
+typedef enum
+{
+    ASYNC_DURABILITY_NONE,
+    ASYNC_DURABILITY_BLOCK,
+    ASYNC_DURABILITY_INTERVAL
+} AsyncDurability;
+
+typedef struct _AsyncBlock
+{
+    struct _AsyncBlock  *next;
+    char  *data;
+    size_t  size;
+    size_t  capacity;
+    int64_t  count;
+    int64_t  seq;
+    char  *compressed;
+    size_t  compressed_capacity;
+} AsyncBlock;
+
+typedef struct _AsyncWriter
+{
+    int  fd;
+    AsyncCodec  codec;
+    char  sync[CONTAINER_SYNC_SIZE];
+    size_t  block_size;
+    avro_writer_t  encoder;
+    AsyncBlock  *current;
+
+    pthread_t  *threads;
+    size_t  thread_count;
+    pthread_mutex_t  lock;
+    pthread_cond_t  cond;
+    AsyncBlock  *head;
+    AsyncBlock  *tail;
+    AsyncBlock  *free_blocks;
+    size_t  queued;
+    size_t  queue_depth;
+    size_t  busy;
+    int64_t  next_seq;
+    int64_t  next_write;
+    bool  closing;
+    char  *error;
+    int64_t  bytes;
+
+    AsyncDurability  durability;
+    int64_t  sync_interval;
+    int64_t  last_sync;
+    bool  dirty;
+    bool  syncing;
+} AsyncWriter;
+
+static bool
+write_fully(int fd, const char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t  written = write(fd, buf, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += written;
+        size -= written;
+    }
+    return true;
+}
+
+/**
+ * Fills in a random sync marker.
+ */
+
+static void
+container_new_sync(char *sync)
+{
+    int  fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        ssize_t  size = read(fd, sync, CONTAINER_SYNC_SIZE);
+        close(fd);
+        if (size == CONTAINER_SYNC_SIZE) {
+            return;
+        }
+    }
+
+    int  i;
+    for (i = 0; i < CONTAINER_SYNC_SIZE; i++) {
+        sync[i] = (char) rand();
+    }
+}
+
+/**
+ * Writes a container file header for the given schema and codec.
+ */
+
+static int
+container_write_header(int fd, avro_schema_t schema, const char *codec,
+                       const char *sync)
+{
+    size_t  json_capacity = 4096;
+    char  *json = NULL;
+    int64_t  json_size;
+    for (;;) {
+        char  *new_json = realloc(json, json_capacity);
+        if (new_json == NULL) {
+            free(json);
+            avro_set_error("Out of memory");
+            return ENOMEM;
+        }
+        json = new_json;
+
+        avro_writer_t  writer = avro_writer_memory(json, json_capacity);
+        int  rc = avro_schema_to_json(schema, writer);
+        json_size = avro_writer_tell(writer);
+        avro_writer_free(writer);
+        if (rc == 0) {
+            break;
+        }
+        if (rc != ENOSPC) {
+            free(json);
+            return rc;
+        }
+        json_capacity *= 2;
+    }
+
+    size_t  codec_size = strlen(codec);
+    char  *header = malloc(json_size + codec_size + 128);
+    if (header == NULL) {
+        free(json);
+        avro_set_error("Out of memory");
+        return ENOMEM;
+    }
+
+    size_t  pos = CONTAINER_MAGIC_SIZE;
+    memcpy(header, CONTAINER_MAGIC, CONTAINER_MAGIC_SIZE);
+    pos += container_write_long(header + pos, 2);
+    pos += container_write_long(header + pos, 10);
+    memcpy(header + pos, "avro.codec", 10);
+    pos += 10;
+    pos += container_write_long(header + pos, codec_size);
+    memcpy(header + pos, codec, codec_size);
+    pos += codec_size;
+    pos += container_write_long(header + pos, 11);
+    memcpy(header + pos, "avro.schema", 11);
+    pos += 11;
+    pos += container_write_long(header + pos, json_size);
+    memcpy(header + pos, json, json_size);
+    pos += json_size;
+    pos += container_write_long(header + pos, 0);
+    memcpy(header + pos, sync, CONTAINER_SYNC_SIZE);
+    pos += CONTAINER_SYNC_SIZE;
+
+    int  rc = 0;
+    if (!write_fully(fd, header, pos)) {
+        rc = errno;
+        avro_set_error("Cannot write file header: %s", strerror(rc));
+    }
+    free(header);
+    free(json);
+    return rc;
+}
+
+/**
+ * Compresses a block into its compression buffer, returning the
+ * compressed data and filling in its size.
+ */
+
+static const char *
+async_compress_block(AsyncWriter *w, AsyncBlock *block, size_t *size,
+                     const char **error)
+{
+    if (w->codec == ASYNC_CODEC_NULL) {
+        *size = block->size;
+        return block->data;
+    }
+
+    z_stream  stream;
+    memset(&stream, 0, sizeof(z_stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        *error = "Cannot initialize deflate";
+        return NULL;
+    }
+
+    size_t  bound = deflateBound(&stream, block->size);
+    if (bound > block->compressed_capacity) {
+        char  *new_buf = realloc(block->compressed, bound);
+        if (new_buf == NULL) {
+            deflateEnd(&stream);
+            *error = "Out of memory";
+            return NULL;
+        }
+        block->compressed = new_buf;
+        block->compressed_capacity = bound;
+    }
+
+    stream.next_in = (Bytef *) block->data;
+    stream.avail_in = block->size;
+    stream.next_out = (Bytef *) block->compressed;
+    stream.avail_out = block->compressed_capacity;
+    int  rc = deflate(&stream, Z_FINISH);
+    *size = stream.total_out;
+    deflateEnd(&stream);
+    if (rc != Z_STREAM_END) {
+        *error = "Cannot compress block";
+        return NULL;
+    }
+    return block->compressed;
+}
+
+static bool
+async_write_block(AsyncWriter *w, AsyncBlock *block, const char *data,
+                  size_t size, const char **error)
+{
+    char  start[CONTAINER_BLOCK_START_MAX];
+    size_t  start_size = container_write_long(start, block->count);
+    start_size += container_write_long(start + start_size, size);
+    if (!write_fully(w->fd, start, start_size) ||
+        !write_fully(w->fd, data, size) ||
+        !write_fully(w->fd, w->sync, CONTAINER_SYNC_SIZE)) {
+        *error = strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Returns whether there are written blocks that are due to be synced.
+ * Must be called with the writer's lock held.
+ */
+
+static bool
+async_writer_sync_due(AsyncWriter *w)
+{
+    return w->durability == ASYNC_DURABILITY_INTERVAL &&
+        w->dirty && !w->syncing && w->error == NULL &&
+        timing_now() - w->last_sync >= w->sync_interval;
+}
+
+/**
+ * Syncs every block that's been written so far.  Must be called with
+ * the writer's lock held; we release it while we're syncing, so that
+ * other threads can keep writing.
+ */
+
+static void
+async_writer_sync_locked(AsyncWriter *w)
+{
+    w->syncing = true;
+    w->dirty = false;
+    pthread_mutex_unlock(&w->lock);
+    int  rc = lua_avro_fdatasync(w->fd);
+    int  error = errno;
+    pthread_mutex_lock(&w->lock);
+    w->syncing = false;
+    w->last_sync = timing_now();
+    if (rc != 0 && w->error == NULL) {
+        w->error = strdup(strerror(error));
+    }
+    pthread_cond_broadcast(&w->cond);
+}
+
+/**
+ * Waits for something to happen to the writer.  If there are blocks
+ * waiting to be synced, we only wait until they're due.  Must be
+ * called with the writer's lock held.
+ */
+
+static void
+async_writer_wait(AsyncWriter *w)
+{
+    if (w->durability != ASYNC_DURABILITY_INTERVAL ||
+        !w->dirty || w->syncing) {
+        pthread_cond_wait(&w->cond, &w->lock);
+        return;
+    }
+
+    struct timespec  ts;
+    cond_deadline(w->last_sync + w->sync_interval, &ts);
+    pthread_cond_timedwait(&w->cond, &w->lock, &ts);
+}
+
+static void *
+async_writer_main(void *vw)
+{
+    AsyncWriter  *w = vw;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->head == NULL && !w->closing) {
+            if (async_writer_sync_due(w)) {
+                async_writer_sync_locked(w);
+            } else {
+                async_writer_wait(w);
+            }
+        }
+        if (w->head == NULL) {
+            break;
+        }
+
+        AsyncBlock  *block = w->head;
+        w->head = block->next;
+        if (w->head == NULL) {
+            w->tail = NULL;
+        }
+        w->queued--;
+        w->busy++;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+
+        /* Once something fails, we drop any remaining blocks. */
+        const char  *error = NULL;
+        const char  *data = NULL;
+        size_t  size = 0;
+        if (w->error == NULL) {
+            data = async_compress_block(w, block, &size, &error);
+        }
+
+        /* Wait for our turn to write. */
+        pthread_mutex_lock(&w->lock);
+        while (w->next_write != block->seq && w->error == NULL) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (data != NULL && w->error == NULL) {
+            pthread_mutex_unlock(&w->lock);
+            if (async_write_block(w, block, data, size, &error) &&
+                w->durability == ASYNC_DURABILITY_BLOCK &&
+                lua_avro_fdatasync(w->fd) != 0) {
+                error = strerror(errno);
+            }
+            pthread_mutex_lock(&w->lock);
+            w->dirty = true;
+        }
+
+        if (error != NULL && w->error == NULL) {
+            w->error = strdup(error);
+        }
+        w->next_write++;
+        block->size = 0;
+        block->count = 0;
+        block->next = w->free_blocks;
+        w->free_blocks = block;
+        w->busy--;
+        pthread_cond_broadcast(&w->cond);
+
+        if (async_writer_sync_due(w)) {
+            async_writer_sync_locked(w);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/**
+ * Reports a previous error from the background thread.  Must be called
+ * with the writer's lock held.
+ */
+
+static int
+async_writer_check_error(AsyncWriter *w)
+{
+    if (w->error != NULL) {
+        avro_set_error("%s", w->error);
+        return EIO;
+    }
+    return 0;
+}
+
+/**
+ * Hands the current block to the background thread, waiting for room
+ * in the queue if necessary, and starts a new current block.
+ */
+
+static int
+async_writer_submit(AsyncWriter *w)
+{
+    pthread_mutex_lock(&w->lock);
+    while (w->queued >= w->queue_depth && w->error == NULL) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    int  rc = async_writer_check_error(w);
+
+    /*
+     * Find the current block's replacement before queuing it, so that
+     * w->current stays valid if we can't allocate one.
+     */
+
+    AsyncBlock  *next = NULL;
+    if (rc == 0) {
+        next = w->free_blocks;
+        if (next != NULL) {
+            w->free_blocks = next->next;
+        } else {
+            next = calloc(1, sizeof(AsyncBlock));
+            if (next == NULL) {
+                avro_set_error("Out of memory");
+                rc = ENOMEM;
+            }
+        }
+    }
+
+    if (rc == 0) {
+        AsyncBlock  *block = w->current;
+        if (w->tail == NULL) {
+            w->head = block;
+        } else {
+            w->tail->next = block;
+        }
+        w->tail = block;
+        block->next = NULL;
+        block->seq = w->next_seq++;
+        w->queued++;
+
+        next->next = NULL;
+        w->current = next;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return rc;
+}
+
+static int
+async_writer_append(AsyncWriter *w, avro_value_t *value)
+{
+    size_t  size;
+    check_rc(avro_value_sizeof(value, &size));
+
+    AsyncBlock  *block = w->current;
+    if (block->count > 0 && block->size + size > w->block_size) {
+        check_rc(async_writer_submit(w));
+        block = w->current;
+    }
+
+    if (block->size + size > block->capacity) {
+        size_t  capacity = (block->capacity == 0)?
+            w->block_size: block->capacity;
+        while (capacity < block->size + size) {
+            capacity *= 2;
+        }
+        char  *new_data = realloc(block->data, capacity);
+        if (new_data == NULL) {
+            avro_set_error("Out of memory");
+            return ENOMEM;
+        }
+        block->data = new_data;
+        block->capacity = capacity;
+    }
+
+    avro_writer_memory_set_dest(w->encoder, block->data + block->size, size);
+    check_rc(avro_value_write(w->encoder, value));
+    block->size += size;
+    block->count++;
+    w->bytes += size;
+    return 0;
+}
+
+/**
+ * Waits until every value that's been appended so far has been written
+ * to the file.
+ */
+
+static int
+async_writer_flush(AsyncWriter *w)
+{
+    if (w->current->count > 0) {
+        check_rc(async_writer_submit(w));
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while ((w->head != NULL || w->busy > 0) && w->error == NULL) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    int  rc = async_writer_check_error(w);
+    pthread_mutex_unlock(&w->lock);
+    return rc;
+}
+
+/**
+ * Flushes the writer, and then makes sure that everything it's written
+ * is on disk.
+ */
+
+static int
+async_writer_sync(AsyncWriter *w)
+{
+    check_rc(async_writer_flush(w));
+    if (fsync(w->fd) != 0) {
+        int  rc = errno;
+        avro_set_error("Cannot sync file: %s", strerror(rc));
+        return rc;
+    }
+    return 0;
+}
+
+/**
+ * Sets the writer's durability policy.  This should be called before
+ * anything is written.  sync_interval is only used for
+ * ASYNC_DURABILITY_INTERVAL; if it's 0, we use a default.
+ */
+
+static int
+async_writer_set_durability(AsyncWriter *w, AsyncDurability durability,
+                            int64_t sync_interval)
+{
+    pthread_mutex_lock(&w->lock);
+    w->durability = durability;
+    if (sync_interval > 0) {
+        w->sync_interval = sync_interval;
+    }
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+static void
+async_block_list_free(AsyncBlock *block)
+{
+    while (block != NULL) {
+        AsyncBlock  *next = block->next;
+        free(block->data);
+        free(block->compressed);
+        free(block);
+        block = next;
+    }
+}
+
+/**
+ * Flushes and closes an asynchronous writer, freeing it.  Returns an
+ * error if any of the remaining values couldn't be written.
+ */
+
+static int
+async_writer_close(AsyncWriter *w)
+{
+    int  rc = (w->durability == ASYNC_DURABILITY_NONE)?
+        async_writer_flush(w): async_writer_sync(w);
+
+    pthread_mutex_lock(&w->lock);
+    w->closing = true;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    size_t  i;
+    for (i = 0; i < w->thread_count; i++) {
+        pthread_join(w->threads[i], NULL);
+    }
+
+    if (close(w->fd) != 0 && rc == 0) {
+        rc = errno;
+        avro_set_error("Cannot close file: %s", strerror(rc));
+    }
+
+    async_block_list_free(w->current);
+    async_block_list_free(w->head);
+    async_block_list_free(w->free_blocks);
+    avro_writer_free(w->encoder);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    free(w->threads);
+    free(w->error);
+    free(w);
+    return rc;
+}
+
+/**
+ * Opens an asynchronous writer, which compresses blocks using
+ * thread_count background threads.
+ */
+
+static int
+async_writer_open(const char *path, avro_schema_t schema, const char *codec,
+                  size_t block_size, size_t queue_depth, size_t thread_count,
+                  AsyncWriter **dest)
+{
+    AsyncCodec  codec_type;
+    if (codec == NULL || strcmp(codec, "null") == 0) {
+        codec = "null";
+        codec_type = ASYNC_CODEC_NULL;
+    } else if (strcmp(codec, "deflate") == 0) {
+        codec_type = ASYNC_CODEC_DEFLATE;
+    } else {
+        avro_set_error("Unsupported codec for asynchronous writer: %s",
+                       codec);
+        return EINVAL;
+    }
+    if (thread_count == 0) {
+        thread_count = 1;
+    } else if (thread_count > ASYNC_WRITER_MAX_THREADS) {
+        avro_set_error("Invalid number of writer threads");
+        return EINVAL;
+    }
+
+    int  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        int  rc = errno;
+        avro_set_error("Cannot open file %s: %s", path, strerror(rc));
+        return rc;
+    }
+
+    AsyncWriter  *w = calloc(1, sizeof(AsyncWriter));
+    if (w == NULL) {
+        close(fd);
+        avro_set_error("Out of memory");
+        return ENOMEM;
+    }
+    w->fd = fd;
+    w->codec = codec_type;
+    w->block_size = (block_size > 0)?
+        block_size: ASYNC_WRITER_DEFAULT_BLOCK_SIZE;
+    w->queue_depth = (queue_depth > 0)?
+        queue_depth: ASYNC_WRITER_DEFAULT_QUEUE_DEPTH;
+    container_new_sync(w->sync);
+
+    int  rc = container_write_header(fd, schema, codec, w->sync);
+    if (rc == 0) {
+        w->encoder = avro_writer_memory(NULL, 0);
+        w->current = calloc(1, sizeof(AsyncBlock));
+        w->threads = calloc(thread_count, sizeof(pthread_t));
+        if (w->encoder == NULL || w->current == NULL || w->threads == NULL) {
+            avro_set_error("Out of memory");
+            rc = ENOMEM;
+        }
+    }
+    if (rc != 0) {
+        if (w->encoder != NULL) {
+            avro_writer_free(w->encoder);
+        }
+        free(w->current);
+        free(w->threads);
+        close(fd);
+        free(w);
+        return rc;
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+    cond_init(&w->cond);
+    w->sync_interval = ASYNC_WRITER_DEFAULT_SYNC_INTERVAL;
+    w->last_sync = timing_now();
+    for (w->thread_count = 0; w->thread_count < thread_count;
+         w->thread_count++) {
+        if (pthread_create(&w->threads[w->thread_count], NULL,
+                           async_writer_main, w) != 0) {
+            /* async_writer_close will shut down the threads we did
+             * manage to start. */
+            async_writer_close(w);
+            avro_set_error("Cannot create writer thread");
+            return EAGAIN;
+        }
+    }
+
+    *dest = w;
+    return 0;
+}
+
+/**
+ * The asynchronous writer functions, made available to the LuaJIT FFI
+ * binding via async_writer_api.
+ */
+
+typedef struct _AsyncWriterApi
+{
+    int (*open)(const char *path, avro_schema_t schema, const char *codec,
+                size_t block_size, size_t queue_depth, size_t thread_count,
+                AsyncWriter **dest);
+    int (*append)(AsyncWriter *w, avro_value_t *value);
+    int (*flush)(AsyncWriter *w);
+    int (*close)(AsyncWriter *w);
+    int (*sync)(AsyncWriter *w);
+    int (*set_durability)(AsyncWriter *w, AsyncDurability durability,
+                          int64_t sync_interval);
+} AsyncWriterApi;
+
+static const AsyncWriterApi  async_writer_api = {
+    async_writer_open,
+    async_writer_append,
+    async_writer_flush,
+    async_writer_close,
+    async_writer_sync,
+    async_writer_set_durability
+};
+
+static int
+l_async_writer_api(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void *) &async_writer_api);
+    return 1;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Rolling writers
+ */
+
+/**
+ * A rolling writer writes a sequence of container files, starting a
+ * new one whenever the current file has reached a certain size, number
+ * of records, or age.  Each file's name comes from filling in a
+ * pattern with its sequence number ("{seq}") and, optionally, the UTC
+ * time that it was opened ("{time}").  Files are written under a
+ * temporary name, and only renamed once they're complete, so that
+ * anything watching the directory never sees a partial file.
+ *
+ * Each file is written by an asynchronous writer.  Finishing a file
+ * (flushing, syncing, closing, and renaming it) can take a while, so
+ * we can optionally hand that off to a background thread, and let the
+ * caller carry on with the next file straight away.
+ *
+ * The size limit counts encoded bytes before compression, so files
+ * that use a codec will be smaller than that.  The age limit is only
+ * checked when a record is written.  We don't create a file until
+ * there's a record to put in it, so we never leave empty files behind.
+ */
+
+#define ROLLING_WRITER_TEMP_SUFFIX  ".tmp"
+
+typedef struct _RollingFile
+{
+    struct _RollingFile  *next;
+    AsyncWriter  *writer;
+    char  *temp_path;
+    char  *path;
+} RollingFile;
+
+typedef struct _RollingWriter
+{
+    char  *pattern;
+    avro_schema_t  schema;
+    char  *codec;
+    size_t  block_size;
+    size_t  queue_depth;
+    size_t  thread_count;
+    int64_t  max_bytes;
+    int64_t  max_records;
+    int64_t  max_age;
+    bool  sync;
+
+    int64_t  sequence;
+    RollingFile  *current;
+    int64_t  records;
+    int64_t  opened_at;
+
+    /* Only used when files are finished in the background */
+    bool  background;
+    pthread_t  thread;
+    pthread_mutex_t  lock;
+    pthread_cond_t  cond;
+    RollingFile  *head;
+    RollingFile  *tail;
+    bool  closing;
+    char  *error;
+} RollingWriter;
+
+/**
+ * Fills in a file name pattern, returning a newly allocated string.
+ */
+
+static char *
+rolling_writer_path(const char *pattern, int64_t sequence, time_t now)
+{
+    char  seq[32];
+    char  timestamp[32];
+    struct tm  tm;
+    snprintf(seq, sizeof(seq), "%06lld", (long long) sequence);
+    gmtime_r(&now, &tm);
+    strftime(timestamp, sizeof(timestamp), "%Y%m%dT%H%M%SZ", &tm);
+
+    size_t  size = strlen(pattern) + 1;
+    const char  *p;
+    for (p = strchr(pattern, '{'); p != NULL; p = strchr(p + 1, '{')) {
+        size += sizeof(seq) + sizeof(timestamp);
+    }
+
+    char  *path = malloc(size);
+    if (path == NULL) {
+        return NULL;
+    }
+    char  *out = path;
+    for (p = pattern; *p != '\0'; ) {
+        if (strncmp(p, "{seq}", 5) == 0) {
+            out = stpcpy(out, seq);
+            p += 5;
+        } else if (strncmp(p, "{time}", 6) == 0) {
+            out = stpcpy(out, timestamp);
+            p += 6;
+        } else {
+            *out++ = *p++;
+        }
+    }
+    *out = '\0';
+    return path;
+}
+
+static void
+rolling_file_free(RollingFile *f)
+{
+    free(f->temp_path);
+    free(f->path);
+    free(f);
+}
+
+/**
+ * Syncs the directory containing path, so that a rename within it is
+ * durable.
+ */
+
+static int
+sync_parent_directory(const char *path)
+{
+    const char  *slash = strrchr(path, '/');
+    char  *dir = (slash == NULL)? strdup("."):
+        (slash == path)? strdup("/"): strndup(path, slash - path);
+    if (dir == NULL) {
+        avro_set_error("Out of memory");
+        return ENOMEM;
+    }
+
+    int  rc = 0;
+    int  fd = open(dir, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fsync(fd) != 0) {
+        rc = errno;
+        avro_set_error("Cannot sync directory %s: %s", dir, strerror(rc));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(dir);
+    return rc;
+}
+
+/**
+ * Finishes writing a file, and moves it to its final name.  If any of
+ * that fails, we leave it under its temporary name.  Frees f either
+ * way.
+ */
+
+static int
+rolling_file_finish(RollingFile *f, bool sync)
+{
+    int  rc = sync? async_writer_sync(f->writer): 0;
+    int  close_rc = async_writer_close(f->writer);
+    if (rc == 0) {
+        rc = close_rc;
+    }
+    if (rc == 0 && rename(f->temp_path, f->path) != 0) {
+        rc = errno;
+        avro_set_error("Cannot rename %s to %s: %s",
+                       f->temp_path, f->path, strerror(rc));
+    }
+    if (rc == 0 && sync) {
+        rc = sync_parent_directory(f->path);
+    }
+    rolling_file_free(f);
+    return rc;
+}
+
+static void *
+rolling_writer_main(void *vrw)
+{
+    RollingWriter  *rw = vrw;
+
+    pthread_mutex_lock(&rw->lock);
+    for (;;) {
+        while (rw->head == NULL && !rw->closing) {
+            pthread_cond_wait(&rw->cond, &rw->lock);
+        }
+        if (rw->head == NULL) {
+            break;
+        }
+
+        RollingFile  *f = rw->head;
+        rw->head = f->next;
+        if (rw->head == NULL) {
+            rw->tail = NULL;
+        }
+        pthread_mutex_unlock(&rw->lock);
+
+        int  rc = rolling_file_finish(f, rw->sync);
+
+        /* We keep finishing later files, but report the first error. */
+        pthread_mutex_lock(&rw->lock);
+        if (rc != 0 && rw->error == NULL) {
+            rw->error = strdup(avro_strerror());
+        }
+    }
+    pthread_mutex_unlock(&rw->lock);
+    return NULL;
+}
+
+/**
+ * Reports an error from the background thread, if there's been one.
+ */
+
+static int
+rolling_writer_check_error(RollingWriter *rw)
+{
+    if (!rw->background) {
+        return 0;
+    }
+    int  rc = 0;
+    pthread_mutex_lock(&rw->lock);
+    if (rw->error != NULL) {
+        avro_set_error("%s", rw->error);
+        rc = EIO;
+    }
+    pthread_mutex_unlock(&rw->lock);
+    return rc;
+}
+
+/**
+ * Finishes the current file, if there is one.  The next record that's
+ * written will go into a new file.
+ */
+
+static int
+rolling_writer_roll(RollingWriter *rw)
+{
+    RollingFile  *f = rw->current;
+    if (f == NULL) {
+        return 0;
+    }
+    rw->current = NULL;
+
+    if (!rw->background) {
+        return rolling_file_finish(f, rw->sync);
+    }
+
+    pthread_mutex_lock(&rw->lock);
+    f->next = NULL;
+    if (rw->tail == NULL) {
+        rw->head = f;
+    } else {
+        rw->tail->next = f;
+    }
+    rw->tail = f;
+    pthread_cond_signal(&rw->cond);
+    pthread_mutex_unlock(&rw->lock);
+    return rolling_writer_check_error(rw);
+}
+
+static int
+rolling_writer_open_file(RollingWriter *rw)
+{
+    RollingFile  *f = calloc(1, sizeof(RollingFile));
+    if (f == NULL) {
+        avro_set_error("Out of memory");
+        return ENOMEM;
+    }
+    f->path = rolling_writer_path(rw->pattern, rw->sequence, time(NULL));
+    if (f->path != NULL) {
+        size_t  size = strlen(f->path) + sizeof(ROLLING_WRITER_TEMP_SUFFIX);
+        f->temp_path = malloc(size);
+        if (f->temp_path != NULL) {
+            snprintf(f->temp_path, size, "%s" ROLLING_WRITER_TEMP_SUFFIX,
+                     f->path);
+        }
+    }
+    if (f->path == NULL || f->temp_path == NULL) {
+        rolling_file_free(f);
+        avro_set_error("Out of memory");
+        return ENOMEM;
+    }
+
+    int  rc = async_writer_open
+        (f->temp_path, rw->schema, rw->codec, rw->block_size,
+         rw->queue_depth, rw->thread_count, &f->writer);
+    if (rc != 0) {
+        rolling_file_free(f);
+        return rc;
+    }
+
+    rw->sequence++;
+    rw->current = f;
+    rw->records = 0;
+    rw->opened_at = timing_now();
+    return 0;
+}
+
+static int
+rolling_writer_append(RollingWriter *rw, avro_value_t *value)
+{
+    check_rc(rolling_writer_check_error(rw));
+
+    if (rw->current != NULL && rw->max_age > 0 &&
+        timing_now() - rw->opened_at >= rw->max_age) {
+        check_rc(rolling_writer_roll(rw));
+    }
+    if (rw->current == NULL) {
+        check_rc(rolling_writer_open_file(rw));
+    }
+
+    AsyncWriter  *w = rw->current->writer;
+    check_rc(async_writer_append(w, value));
+    rw->records++;
+
+    /* Finish the file as soon as it's full, rather than on the next
+     * write, so that it's available as soon as possible. */
+    if ((rw->max_records > 0 && rw->records >= rw->max_records) ||
+        (rw->max_bytes > 0 && w->bytes >= rw->max_bytes)) {
+        check_rc(rolling_writer_roll(rw));
+    }
+    return 0;
+}
+
+static int
+rolling_writer_flush(RollingWriter *rw)
+{
+    check_rc(rolling_writer_check_error(rw));
+    if (rw->current != NULL) {
+        check_rc(async_writer_flush(rw->current->writer));
+    }
+    return 0;
+}
+
+/**
+ * Finishes the current file, waits for any files that are being
+ * finished in the background, and frees the writer.
+ */
+
+static int
+rolling_writer_close(RollingWriter *rw)
+{
+    int  rc = rolling_writer_roll(rw);
+
+    if (rw->background) {
+        pthread_mutex_lock(&rw->lock);
+        rw->closing = true;
+        pthread_cond_signal(&rw->cond);
+        pthread_mutex_unlock(&rw->lock);
+        pthread_join(rw->thread, NULL);
+        if (rc == 0) {
+            rc = rolling_writer_check_error(rw);
+        }
+        pthread_cond_destroy(&rw->cond);
+        pthread_mutex_destroy(&rw->lock);
+    }
+
+    avro_schema_decref(rw->schema);
+    free(rw->pattern);
+    free(rw->codec);
+    free(rw->error);
+    free(rw);
+    return rc;
+}
+
+static int
+rolling_writer_new(const char *pattern, avro_schema_t schema,
+                   const char *codec, size_t block_size, size_t queue_depth,
+                   size_t thread_count, bool background,
+                   RollingWriter **dest)
+{
+    if (strstr(pattern, "{seq}") == NULL) {
+        avro_set_error("File name pattern must contain {seq}");
+        return EINVAL;
+    }
+
+    RollingWriter  *rw = calloc(1, sizeof(RollingWriter));
+    if (rw == NULL) {
+        avro_set_error("Out of memory");
+        return ENOMEM;
+    }
+    rw->pattern = strdup(pattern);
+    rw->codec = (codec == NULL)? NULL: strdup(codec);
+    if (rw->pattern == NULL || (codec != NULL && rw->codec == NULL)) {
+        free(rw->pattern);
+        free(rw->codec);
+        free(rw);
+        avro_set_error("Out of memory");
+        return ENOMEM;
+    }
+    rw->schema = avro_schema_incref(schema);
+    rw->block_size = block_size;
+    rw->queue_depth = queue_depth;
+    rw->thread_count = thread_count;
+    rw->sync = true;
+
+    if (background) {
+        pthread_mutex_init(&rw->lock, NULL);
+        pthread_cond_init(&rw->cond, NULL);
+        if (pthread_create(&rw->thread, NULL, rolling_writer_main, rw) != 0) {
+            pthread_cond_destroy(&rw->cond);
+            pthread_mutex_destroy(&rw->lock);
+            rolling_writer_close(rw);
+            avro_set_error("Cannot create writer thread");
+            return EAGAIN;
+        }
+        rw->background = true;
+    }
+
+    *dest = rw;
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lua access — rolling writers
+ */
+
+/**
+ * The string used to identify the AvroRollingWriter class's metatable
+ * in the Lua registry.
+ */
+
+#define MT_AVRO_ROLLING_WRITER "avro:AvroRollingWriter"
+
+typedef struct _LuaAvroRollingWriter
+{
+    RollingWriter  *writer;
+} LuaAvroRollingWriter;
+
+static RollingWriter *
+lua_avro_get_rolling_writer(lua_State *L, int index)
+{
+    LuaAvroRollingWriter  *l_writer =
+        luaL_checkudata(L, index, MT_AVRO_ROLLING_WRITER);
+    if (l_writer->writer == NULL) {
+        luaL_error(L, "Rolling writer has been closed");
+    }
+    return l_writer->writer;
+}
+
+/**
+ * Creates a new rolling writer.  The options are the same as for
+ * writing a single file, plus:
+ *
+ *   roll_bytes:       start a new file after this many (uncompressed) bytes
+ *   roll_records:     start a new file after this many records
+ *   roll_seconds:     start a new file once the current one is this old
+ *   sequence:         the sequence number of the first file
+ *   sync:             whether to fsync each file before renaming it
+ *   background_close: whether to finish files on a background thread
+ *
+ * Like the Channel function, we also return the underlying pointer,
+ * for the FFI binding's benefit.
+ */
+
+static int
+l_rolling_writer_new(lua_State *L)
+{
+    const char  *pattern = luaL_checkstring(L, 1);
+    avro_schema_t  schema = lua_avro_get_schema(L, 2);
+    const char  *codec = NULL;
+    lua_Integer  block_size = 0;
+    lua_Integer  queue_depth = 0;
+    lua_Integer  compression_threads = 0;
+    lua_Integer  roll_bytes = 0;
+    lua_Integer  roll_records = 0;
+    lua_Number  roll_seconds = 0;
+    lua_Integer  sequence = 0;
+    bool  sync = true;
+    bool  background = false;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "codec");
+        codec = luaL_optstring(L, -1, NULL);
+        lua_getfield(L, 3, "block_size");
+        block_size = luaL_optinteger(L, -1, 0);
+        lua_getfield(L, 3, "queue_depth");
+        queue_depth = luaL_optinteger(L, -1, 0);
+        lua_getfield(L, 3, "compression_threads");
+        compression_threads = luaL_optinteger(L, -1, 0);
+        lua_getfield(L, 3, "roll_bytes");
+        roll_bytes = luaL_optinteger(L, -1, 0);
+        lua_getfield(L, 3, "roll_records");
+        roll_records = luaL_optinteger(L, -1, 0);
+        lua_getfield(L, 3, "roll_seconds");
+        roll_seconds = luaL_optnumber(L, -1, 0);
+        lua_getfield(L, 3, "sequence");
+        sequence = luaL_optinteger(L, -1, 0);
+        lua_getfield(L, 3, "sync");
+        sync = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        lua_getfield(L, 3, "background_close");
+        background = lua_toboolean(L, -1);
+        lua_pop(L, 10);
+    }
+
+    RollingWriter  *writer;
+    if (rolling_writer_new(pattern, schema, codec, block_size, queue_depth,
+                           compression_threads, background, &writer) != 0) {
+        return lua_return_avro_error(L);
+    }
+    writer->max_bytes = roll_bytes;
+    writer->max_records = roll_records;
+    writer->max_age = (int64_t) (roll_seconds * 1e9);
+    writer->sequence = sequence;
+    writer->sync = sync;
+
+    LuaAvroRollingWriter  *l_writer =
+        lua_newuserdata(L, sizeof(LuaAvroRollingWriter));
+    l_writer->writer = writer;
+    luaL_getmetatable(L, MT_AVRO_ROLLING_WRITER);
+    lua_setmetatable(L, -2);
+    lua_pushlightuserdata(L, writer);
+    return 2;
+}
+
+static int
+l_rolling_writer_write(lua_State *L)
+{
+    RollingWriter  *writer = lua_avro_get_rolling_writer(L, 1);
+    avro_value_t  *value = lua_avro_get_value(L, 2);
+    int64_t  start = timing_start();
+    check(rolling_writer_append(writer, value));
+    timing_record(TIMING_WRITE, start, 0);
+    return 0;
+}
+
+/**
+ * Finishes the current file, even if it hasn't reached any of the
+ * limits yet.
+ */
+
+static int
+l_rolling_writer_roll(lua_State *L)
+{
+    RollingWriter  *writer = lua_avro_get_rolling_writer(L, 1);
+    check(rolling_writer_roll(writer));
+    return 0;
+}
+
+static int
+l_rolling_writer_flush(lua_State *L)
+{
+    RollingWriter  *writer = lua_avro_get_rolling_writer(L, 1);
+    check(rolling_writer_flush(writer));
+    return 0;
+}
+
+/**
+ * Returns the final name of the file that's currently being written,
+ * or nil if there isn't one.
+ */
+
+static int
+l_rolling_writer_path(lua_State *L)
+{
+    RollingWriter  *writer = lua_avro_get_rolling_writer(L, 1);
+    if (writer->current == NULL) {
+        lua_pushnil(L);
+    } else {
+        lua_pushstring(L, writer->current->path);
+    }
+    return 1;
+}
+
+static int
+l_rolling_writer_close(lua_State *L)
+{
+    LuaAvroRollingWriter  *l_writer =
+        luaL_checkudata(L, 1, MT_AVRO_ROLLING_WRITER);
+    if (l_writer->writer != NULL) {
+        int  rc = rolling_writer_close(l_writer->writer);
+        l_writer->writer = NULL;
+        check(rc);
+    }
+    return 0;
+}
+
+/**
+ * Finalizes a rolling writer.  We can't raise errors here, so any error
+ * from finishing the last file is lost; call close to see it.
+ */
+
+static int
+l_rolling_writer_gc(lua_State *L)
+{
+    LuaAvroRollingWriter  *l_writer =
+        luaL_checkudata(L, 1, MT_AVRO_ROLLING_WRITER);
+    if (l_writer->writer != NULL) {
+        rolling_writer_close(l_writer->writer);
+        l_writer->writer = NULL;
+    }
+    return 0;
+}
+
+/**
+ * The rolling writer functions, made available to the LuaJIT FFI
+ * binding via rolling_writer_api, so that it can write its own values.
+ */
+
+typedef struct _RollingWriterApi
+{
+    int (*append)(RollingWriter *rw, avro_value_t *value);
+} RollingWriterApi;
+
+static const RollingWriterApi  rolling_writer_api = {
+    rolling_writer_append
+};
+
+static int
+l_rolling_writer_api(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void *) &rolling_writer_api);
+    return 1;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Stream readers
+ */
+
+/**
+ * A stream reader is a push parser for the container format.  Rather
+ * than reading from a file, the caller feeds it chunks of a container
+ * file as they arrive (from a pipe or socket, say), and pulls records
+ * out as soon as the blocks that contain them are complete.  It never
+ * blocks; if there isn't enough input yet to produce the next record,
+ * it says so, and the caller can try again once it's fed some more.
+ * That makes it easy to drive from a coroutine in an event loop.
+ *
+ * We buffer any input that we haven't parsed yet.  Once a whole block
+ * has arrived, we move its decompressed contents into a separate
+ * buffer, and decode records from there, so that the input buffer can
+ * be compacted as we go.  Like the read-ahead readers, we support the
+ * "null" and "deflate" codecs.
+ *
+ * A stream reader can also follow a container file that's still being
+ * written.  Instead of being fed, it reads whatever has been appended
+ * to the file whenever it runs out of input.  Since we only ever parse
+ * complete blocks, a block that's only partly written yet stays in the
+ * buffer until the rest of it shows up.  To wait for the file to grow,
+ * we use inotify where it's available, and poll the file's size
+ * otherwise.
+ *
+ * The functions below return 0 on success, EAGAIN if they need more
+ * input, EPIPE at the end of a finished stream, or some other error
+ * code (with the Avro error message filled in) if the input is invalid.
+ */
+
+#define STREAM_READER_READ_SIZE  (64*1024)
+
+typedef struct _StreamReader
+{
+    char  *input;
+    size_t  input_size;
+    size_t  input_pos;
+    size_t  input_capacity;
+    bool  finished;
+    bool  have_header;
+    char  sync[CONTAINER_SYNC_SIZE];
+    PrefetchCodec  codec;
+    avro_schema_t  wschema;
+    avro_value_iface_t  *iface;
+    char  *block;
+    int64_t  remaining;
+    avro_reader_t  reader;
+
+    /* Only used when following a file */
+    int  fd;
+    off_t  offset;
+    int  notify_fd;
+    int64_t  poll_interval;
+} StreamReader;
+
+static StreamReader *
+stream_reader_new(void)
+{
+    StreamReader  *s = calloc(1, sizeof(StreamReader));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->reader = avro_reader_memory(NULL, 0);
+    if (s->reader == NULL) {
+        free(s);
+        return NULL;
+    }
+    s->fd = -1;
+    s->notify_fd = -1;
+    return s;
+}
+
+static void
+stream_reader_free(StreamReader *s)
+{
+    free(s->input);
+    free(s->block);
+    if (s->iface != NULL) {
+        avro_value_iface_decref(s->iface);
+    }
+    if (s->wschema != NULL) {
+        avro_schema_decref(s->wschema);
+    }
+    avro_reader_free(s->reader);
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    if (s->notify_fd >= 0) {
+        close(s->notify_fd);
+    }
+    free(s);
+}
+
+/**
+ * Makes sure there's room for size more bytes at the end of the input
+ * buffer.
+ */
+
+static int
+stream_reader_reserve(StreamReader *s, size_t size)
+{
+    /* Throw away the input that we've already parsed, if we need room. */
+    if (s->input_size + size > s->input_capacity && s->input_pos > 0) {
+        memmove(s->input, s->input + s->input_pos,
+                s->input_size - s->input_pos);
+        s->input_size -= s->input_pos;
+        s->input_pos = 0;
+    }
+
+    if (s->input_size + size > s->input_capacity) {
+        size_t  capacity = (s->input_capacity == 0)? 4096: s->input_capacity;
+        while (capacity < s->input_size + size) {
+            capacity *= 2;
+        }
+        char  *new_input = realloc(s->input, capacity);
+        if (new_input == NULL) {
+            avro_set_error("Out of memory");
+            return ENOMEM;
+        }
+        s->input = new_input;
+        s->input_capacity = capacity;
+    }
+    return 0;
+}
+
+/**
+ * Adds a chunk of input to the end of the stream.
+ */
+
+static int
+stream_reader_feed(StreamReader *s, const char *data, size_t size)
+{
+    if (s->finished) {
+        avro_set_error("Stream has already been finished");
+        return EPIPE;
+    }
+    if (s->fd >= 0) {
+        avro_set_error("Can't feed a stream reader that follows a file");
+        return EINVAL;
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    int  rc = stream_reader_reserve(s, size);
+    if (rc != 0) {
+        return rc;
+    }
+    memcpy(s->input + s->input_size, data, size);
+    s->input_size += size;
+    return 0;
+}
+
+/**
+ * Marks the end of the stream.  Any input that's still buffered can
+ * be read, but if the stream ends partway through a block, that's now
+ * an error instead of a request for more input.  If we're following a
+ * file, we stop reading from it.
+ */
+
+static void
+stream_reader_finish(StreamReader *s)
+{
+    s->finished = true;
+}
+
+static int
+stream_reader_short(StreamReader *s, const char *what)
+{
+    if (s->finished) {
+        avro_set_error("Truncated container %s", what);
+        return EILSEQ;
+    }
+    return EAGAIN;
+}
+
+static int
+stream_reader_read_header(StreamReader *s)
+{
+    const char  *buf = s->input + s->input_pos;
+    size_t  size = s->input_size - s->input_pos;
+    size_t  header_size;
+    int  rc = container_parse_header(buf, size, &header_size, s->sync);
+    if (rc == CONTAINER_SHORT) {
+        return stream_reader_short(s, "header");
+    }
+    if (rc == CONTAINER_INVALID) {
+        avro_set_error("Not an Avro container file");
+        return EILSEQ;
+    }
+
+    const char  *value;
+    size_t  value_size;
+    s->codec = PREFETCH_NULL;
+    if (container_header_meta(buf, header_size, "avro.codec",
+                              &value, &value_size)) {
+        if (value_size == 7 && memcmp(value, "deflate", 7) == 0) {
+            s->codec = PREFETCH_DEFLATE;
+        } else if (value_size != 4 || memcmp(value, "null", 4) != 0) {
+            avro_set_error("Unsupported codec %.*s", (int) value_size, value);
+            return EILSEQ;
+        }
+    }
+
+    if (!container_header_meta(buf, header_size, "avro.schema",
+                               &value, &value_size)) {
+        avro_set_error("Container file has no schema");
+        return EILSEQ;
+    }
+    if (avro_schema_from_json_length(value, value_size, &s->wschema) != 0) {
+        return EILSEQ;
+    }
+    s->iface = avro_generic_class_from_schema(s->wschema);
+    if (s->iface == NULL) {
+        return ENOMEM;
+    }
+
+    s->input_pos += header_size;
+    s->have_header = true;
+    return 0;
+}
+
+static int
+stream_reader_read_block(StreamReader *s)
+{
+    const char  *buf = s->input + s->input_pos;
+    size_t  size = s->input_size - s->input_pos;
+    if (size == 0) {
+        return s->finished? EPIPE: EAGAIN;
+    }
+
+    int64_t  count;
+    int64_t  data_size;
+    size_t  start_size;
+    int  rc = container_parse_block_start(buf, size, &count, &data_size,
+                                          &start_size);
+    if (rc == CONTAINER_INVALID) {
+        avro_set_error("Invalid container block");
+        return EILSEQ;
+    }
+    if (rc == CONTAINER_SHORT ||
+        (uint64_t) data_size > size - start_size ||
+        size - start_size - data_size < CONTAINER_SYNC_SIZE) {
+        return stream_reader_short(s, "block");
+    }
+
+    const char  *data = buf + start_size;
+    if (memcmp(data + data_size, s->sync, CONTAINER_SYNC_SIZE) != 0) {
+        avro_set_error("Invalid sync marker");
+        return EILSEQ;
+    }
+
+    free(s->block);
+    const char  *block_data;
+    size_t  block_size;
+    if (s->codec == PREFETCH_DEFLATE) {
+        s->block = prefetch_inflate(data, data_size, &block_size);
+        if (s->block == NULL) {
+            avro_set_error("Cannot decompress container block");
+            return EILSEQ;
+        }
+        block_data = s->block + CONTAINER_BLOCK_START_MAX;
+    } else {
+        s->block = malloc(data_size + 1);
+        if (s->block == NULL) {
+            avro_set_error("Out of memory");
+            return ENOMEM;
+        }
+        memcpy(s->block, data, data_size);
+        block_data = s->block;
+        block_size = data_size;
+    }
+
+    avro_reader_memory_set_source(s->reader, block_data, block_size);
+    s->remaining = count;
+    s->input_pos += start_size + data_size + CONTAINER_SYNC_SIZE;
+    return 0;
+}
+
+/**
+ * Reads more input from the file that we're following.  Returns EAGAIN
+ * if nothing new has been written to it.
+ */
+
+static int
+stream_reader_read_file(StreamReader *s)
+{
+    int  rc = stream_reader_reserve(s, STREAM_READER_READ_SIZE);
+    if (rc != 0) {
+        return rc;
+    }
+
+    ssize_t  size = pread(s->fd, s->input + s->input_size,
+                          STREAM_READER_READ_SIZE, s->offset);
+    if (size < 0) {
+        rc = errno;
+        avro_set_error("Cannot read file: %s", strerror(rc));
+        return rc;
+    }
+    if (size == 0) {
+        struct stat  st;
+        if (fstat(s->fd, &st) == 0 && st.st_size < s->offset) {
+            avro_set_error("File has been truncated");
+            return EILSEQ;
+        }
+        return EAGAIN;
+    }
+
+    s->input_size += size;
+    s->offset += size;
+    return 0;
+}
+
+/**
+ * Creates a stream reader that follows the given file.  poll_interval
+ * (in nanoseconds) is how often we check the file's size when we can't
+ * use inotify.
+ */
+
+static int
+stream_reader_follow(const char *path, bool use_inotify,
+                     int64_t poll_interval, StreamReader **dest)
+{
+    int  fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        int  rc = errno;
+        avro_set_error("Cannot open file %s: %s", path, strerror(rc));
+        return rc;
+    }
+
+    StreamReader  *s = stream_reader_new();
+    if (s == NULL) {
+        close(fd);
+        avro_set_error("Out of memory");
+        return ENOMEM;
+    }
+    s->fd = fd;
+    s->poll_interval = poll_interval;
+
+#ifdef __linux__
+    if (use_inotify) {
+        s->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (s->notify_fd >= 0 &&
+            inotify_add_watch(s->notify_fd, path, IN_MODIFY) < 0) {
+            /* Fall back on polling. */
+            close(s->notify_fd);
+            s->notify_fd = -1;
+        }
+    }
+#endif
+
+    *dest = s;
+    return 0;
+}
+
+/**
+ * Waits until the file that we're following has grown, or until
+ * timeout nanoseconds have passed (forever, if timeout is negative).
+ * Returns ETIMEDOUT if the file didn't change.  A successful return
+ * doesn't guarantee that a whole block has been written yet.
+ */
+
+static int
+stream_reader_wait(StreamReader *s, int64_t timeout)
+{
+    if (s->fd < 0) {
+        avro_set_error("Stream reader isn't following a file");
+        return EINVAL;
+    }
+
+    int64_t  deadline = timing_now() + timeout;
+    for (;;) {
+        struct stat  st;
+        if (fstat(s->fd, &st) != 0 || st.st_size != s->offset) {
+            return 0;
+        }
+
+        int64_t  wait = (timeout < 0)? -1: deadline - timing_now();
+        if (timeout >= 0 && wait <= 0) {
+            return ETIMEDOUT;
+        }
+
+        if (s->notify_fd >= 0) {
+            /* Round up to milliseconds, so we don't wake up early. */
+            struct pollfd  pfd = { s->notify_fd, POLLIN, 0 };
+            int  ms = (wait < 0)? -1: (int) ((wait + 999999) / 1000000);
+            if (poll(&pfd, 1, ms) > 0) {
+                char  events[4096];
+                while (read(s->notify_fd, events, sizeof(events)) > 0) {
+                }
+            }
+        } else {
+            if (wait < 0 || wait > s->poll_interval) {
+                wait = s->poll_interval;
+            }
+            struct timespec  delay = {
+                wait / 1000000000, wait % 1000000000
+            };
+            nanosleep(&delay, NULL);
+        }
+    }
+}
+
+/**
+ * Parses as much of the buffered input as we need to before the next
+ * record can be read.  Once this succeeds, the writer schema and value
+ * iface are available.
+ */
+
+static int
+stream_reader_fill(StreamReader *s)
+{
+    while (s->remaining == 0) {
+        int  rc = s->have_header?
+            stream_reader_read_block(s):
+            stream_reader_read_header(s);
+        if (rc == EAGAIN && s->fd >= 0 && !s->finished) {
+            rc = stream_reader_read_file(s);
+        }
+        if (rc != 0) {
+            return rc;
+        }
+    }
     return 0;
 }
 
+/**
+ * Reads the next record from the stream into dest.
+ */
+
+static int
+stream_reader_next(StreamReader *s, avro_value_t *dest)
+{
+    int  rc = stream_reader_fill(s);
+    if (rc != 0) {
+        return rc;
+    }
+    s->remaining--;
+    return avro_value_read(s->reader, dest);
+}
+
+static avro_value_iface_t *
+stream_reader_iface(StreamReader *s)
+{
+    return s->iface;
+}
+
 
 /*-----------------------------------------------------------------------
- * Lua access — schemas
+ * Lua access — stream readers
  */
 
 /**
- * The string used to identify the AvroSchema class's metatable in the
- * Lua registry.
+ * The string used to identify the AvroStreamReader class's metatable
+ * in the Lua registry.
  */
 
-#define MT_AVRO_SCHEMA "avro:AvroSchema"
+#define MT_AVRO_STREAM_READER "avro:AvroStreamReader"
 
-typedef struct _LuaAvroSchema
+typedef struct _LuaAvroStreamReader
 {
-    avro_schema_t  schema;
-    avro_value_iface_t  *iface;
-} LuaAvroSchema;
+    StreamReader  *stream;
+} LuaAvroStreamReader;
+
+static StreamReader *
+lua_avro_get_stream_reader(lua_State *L, int index)
+{
+    LuaAvroStreamReader  *l_stream =
+        luaL_checkudata(L, index, MT_AVRO_STREAM_READER);
+    if (l_stream->stream == NULL) {
+        luaL_error(L, "Stream reader has been closed");
+    }
+    return l_stream->stream;
+}
 
+/**
+ * Pushes a new AvroStreamReader instance, which takes ownership of the
+ * given stream reader.  Like the Channel function, we also push the
+ * underlying pointer, for the FFI binding's benefit.
+ */
 
-int
-lua_avro_push_schema(lua_State *L, avro_schema_t schema)
+static int
+lua_avro_push_stream_reader(lua_State *L, StreamReader *stream)
 {
-    LuaAvroSchema  *l_schema;
-    l_schema = lua_newuserdata(L, sizeof(LuaAvroSchema));
-    l_schema->schema = avro_schema_incref(schema);
-    l_schema->iface = NULL;
-    luaL_getmetatable(L, MT_AVRO_SCHEMA);
+    LuaAvroStreamReader  *l_stream =
+        lua_newuserdata(L, sizeof(LuaAvroStreamReader));
+    l_stream->stream = stream;
+    luaL_getmetatable(L, MT_AVRO_STREAM_READER);
     lua_setmetatable(L, -2);
-    return 1;
+    lua_pushlightuserdata(L, stream);
+    return 2;
 }
 
-int
-lua_avro_push_schema_no_link(lua_State *L, avro_schema_t schema)
+/**
+ * Creates a new stream reader.
+ */
+
+static int
+l_stream_reader_new(lua_State *L)
 {
-    while (is_avro_link(schema)) {
-        schema = avro_schema_link_target(schema);
+    StreamReader  *stream = stream_reader_new();
+    if (stream == NULL) {
+        return luaL_error(L, "Out of memory");
     }
-    return lua_avro_push_schema(L, schema);
+    return lua_avro_push_stream_reader(L, stream);
 }
 
+/**
+ * Adds a chunk of input to the stream.  Passing nil marks the end of
+ * the stream, just like the finish method.
+ */
 
-avro_schema_t
-lua_avro_get_schema(lua_State *L, int index)
+static int
+l_stream_reader_feed(lua_State *L)
 {
-    lua_pushliteral(L, "raw_schema");
-    lua_gettable(L, index);
-    lua_pushvalue(L, index);
-    lua_call(L, 1, 1);
-    LuaAvroSchema  *l_schema = luaL_checkudata(L, -1, MT_AVRO_SCHEMA);
-    lua_pop(L, 1);
-    return l_schema->schema;
+    StreamReader  *stream = lua_avro_get_stream_reader(L, 1);
+    if (lua_isnoneornil(L, 2)) {
+        stream_reader_finish(stream);
+        return 0;
+    }
+    size_t  size;
+    const char  *data = luaL_checklstring(L, 2, &size);
+    check(stream_reader_feed(stream, data, size));
+    return 0;
+}
+
+static int
+l_stream_reader_finish(lua_State *L)
+{
+    StreamReader  *stream = lua_avro_get_stream_reader(L, 1);
+    stream_reader_finish(stream);
+    return 0;
+}
+
+/**
+ * Reads the next record from the stream, into the given AvroValue if
+ * there is one.  We return nil and "need more data" if the record
+ * hasn't fully arrived yet, and nil and "eof" once a finished stream
+ * has been read completely.
+ */
+
+static int
+l_stream_reader_next(lua_State *L)
+{
+    int  nargs = lua_gettop(L);
+    StreamReader  *stream = lua_avro_get_stream_reader(L, 1);
+
+    int  rc = stream_reader_fill(stream);
+    if (rc == EAGAIN) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "need more data");
+        return 2;
+    }
+    if (rc == EPIPE) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "eof");
+        return 2;
+    }
+    if (rc != 0) {
+        return lua_return_avro_error(L);
+    }
+
+    if (nargs == 1) {
+        /* No Value instance given, so create one. */
+        avro_value_t  value;
+        check(avro_generic_value_new(stream_reader_iface(stream), &value));
+        int64_t  start = timing_start();
+        if (stream_reader_next(stream, &value) != 0) {
+            avro_value_decref(&value);
+            return lua_return_avro_error(L);
+        }
+        timing_record(TIMING_READ, start, 0);
+        lua_avro_push_value(L, &value, true);
+        return 1;
+    }
+
+    else {
+        /* Otherwise read into the given value. */
+        avro_value_t  *value = lua_avro_get_value(L, 2);
+        int64_t  start = timing_start();
+        if (stream_reader_next(stream, value) != 0) {
+            return lua_return_avro_error(L);
+        }
+        timing_record(TIMING_READ, start, 0);
+        lua_pushvalue(L, 2);
+        return 1;
+    }
+}
+
+/**
+ * Returns the writer schema of the stream, or nil if we haven't
+ * received the whole header yet.
+ */
+
+static int
+l_stream_reader_schema_json(lua_State *L)
+{
+    StreamReader  *stream = lua_avro_get_stream_reader(L, 1);
+    if (!stream->have_header) {
+        int  rc = stream_reader_read_header(stream);
+        if (rc == EAGAIN) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "need more data");
+            return 2;
+        }
+        if (rc != 0) {
+            return lua_return_avro_error(L);
+        }
+    }
+
+    static char  static_buf[65536];
+    avro_writer_t  writer = avro_writer_memory(static_buf, sizeof(static_buf));
+    int  rc = avro_schema_to_json(stream->wschema, writer);
+    int64_t  length = avro_writer_tell(writer);
+    avro_writer_free(writer);
+
+    if (rc != 0) {
+        return lua_avro_error(L);
+    }
+
+    lua_pushlstring(L, static_buf, length);
+    return 1;
 }
 
-avro_schema_t
-lua_avro_get_raw_schema(lua_State *L, int index)
+/**
+ * Waits for the file that the stream reader is following to grow.
+ * The timeout is in seconds; if it's not given, we wait forever.
+ * Returns true if the file has grown, or false if we timed out.
+ */
+
+static int
+l_stream_reader_wait(lua_State *L)
 {
-    LuaAvroSchema  *l_schema = luaL_checkudata(L, index, MT_AVRO_SCHEMA);
-    return l_schema->schema;
+    StreamReader  *stream = lua_avro_get_stream_reader(L, 1);
+    int64_t  timeout = -1;
+    if (!lua_isnoneornil(L, 2)) {
+        lua_Number  seconds = luaL_checknumber(L, 2);
+        timeout = (seconds <= 0)? 0: (int64_t) (seconds * 1e9);
+    }
+    int  rc = stream_reader_wait(stream, timeout);
+    if (rc == ETIMEDOUT) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    check(rc);
+    lua_pushboolean(L, true);
+    return 1;
 }
 
+/**
+ * Frees a stream reader, along with any input that it's buffered.
+ */
 
 static int
-l_new_raw_schema(lua_State *L)
+l_stream_reader_close(lua_State *L)
 {
-    avro_schema_t  schema = lua_touserdata(L, 1);
-    if (schema == NULL) {
-        lua_pushliteral(L, "Cannot create NULL schema wrapper");
-        return lua_error(L);
+    LuaAvroStreamReader  *l_stream =
+        luaL_checkudata(L, 1, MT_AVRO_STREAM_READER);
+    if (l_stream->stream != NULL) {
+        stream_reader_free(l_stream->stream);
+        l_stream->stream = NULL;
     }
-    lua_avro_push_schema(L, schema);
-    lua_pushlightuserdata(L, schema);
-    return 2;
+    return 0;
 }
 
-
 /**
- * Creates a new AvroValue for the given schema.
+ * Opens a stream reader that follows a container file as it's written.
+ * We return the underlying pointer as well, or nil and an error
+ * message.  options is the stack index of open's options table.
  */
 
 static int
-l_schema_new_raw_value(lua_State *L)
+lua_avro_push_follow_reader(lua_State *L, const char *path, int options)
 {
-    LuaAvroSchema  *l_schema = luaL_checkudata(L, 1, MT_AVRO_SCHEMA);
-    if (l_schema->iface == NULL) {
-        l_schema->iface = avro_generic_class_from_schema(l_schema->schema);
-        if (l_schema->iface == NULL) {
-            lua_pushstring(L, avro_strerror());
-            return lua_error(L);
-        }
+    bool  use_inotify = true;
+    lua_Number  poll_interval = 0.1;
+    if (lua_istable(L, options)) {
+        lua_getfield(L, options, "inotify");
+        use_inotify = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        lua_getfield(L, options, "poll_interval");
+        poll_interval = luaL_optnumber(L, -1, poll_interval);
+        lua_pop(L, 2);
     }
 
-    if (lua_gettop(L) >= 2) {
-        LuaAvroValue  *l_value = luaL_checkudata(L, 2, MT_AVRO_VALUE);
-        if (l_value->should_decref && l_value->value.self != NULL) {
-            avro_value_decref(&l_value->value);
-        }
-        check(avro_generic_value_new(l_schema->iface, &l_value->value));
-        l_value->should_decref = true;
-        lua_pushvalue(L, 2);
-    } else {
-        avro_value_t  value;
-        check(avro_generic_value_new(l_schema->iface, &value));
-        lua_avro_push_value(L, &value, true);
+    StreamReader  *stream = NULL;
+    if (stream_reader_follow(path, use_inotify,
+                             (int64_t) (poll_interval * 1e9),
+                             &stream) != 0) {
+        return lua_return_avro_error(L);
     }
-    return 1;
+    return lua_avro_push_stream_reader(L, stream);
 }
 
+static int
+l_follow_file_reader(lua_State *L)
+{
+    const char  *path = luaL_checkstring(L, 1);
+    return lua_avro_push_follow_reader(L, path, 2);
+}
 
 /**
- * Returns the type of an AvroSchema instance.
+ * The stream reader functions, made available to the LuaJIT FFI
+ * binding via stream_reader_api, so that it can read into its own
+ * values.
  */
 
+typedef struct _StreamReaderApi
+{
+    int (*fill)(StreamReader *s);
+    int (*next)(StreamReader *s, avro_value_t *dest);
+    avro_value_iface_t *(*iface)(StreamReader *s);
+} StreamReaderApi;
+
+static const StreamReaderApi  stream_reader_api = {
+    stream_reader_fill,
+    stream_reader_next,
+    stream_reader_iface
+};
+
 static int
-l_schema_type(lua_State *L)
+l_stream_reader_api(lua_State *L)
 {
-    avro_schema_t  schema = lua_avro_get_raw_schema(L, 1);
-    lua_pushnumber(L, avro_typeof(schema));
+    lua_pushlightuserdata(L, (void *) &stream_reader_api);
     return 1;
 }
 
 
+/*-----------------------------------------------------------------------
+ * Lua access — data files
+ */
+
 /**
- * Returns the name of an AvroSchema instance.
+ * The string used to identify the AvroDataInputFile class's metatable
+ * in the Lua registry.
  */
 
-static int
-l_schema_name(lua_State *L)
+#define MT_AVRO_DATA_INPUT_FILE "avro:AvroDataInputFile"
+
+
+typedef struct _LuaAvroDataInputFile
 {
-    avro_schema_t  schema = lua_avro_get_raw_schema(L, 1);
-    lua_pushstring(L, avro_schema_type_name(schema));
+    avro_file_reader_t  reader;
+    avro_schema_t  wschema;
+    avro_value_iface_t  *iface;
+} LuaAvroDataInputFile;
+
+int
+lua_avro_push_file_reader(lua_State *L, avro_file_reader_t reader)
+{
+    LuaAvroDataInputFile  *l_file;
+
+    l_file = lua_newuserdata(L, sizeof(LuaAvroDataInputFile));
+    l_file->reader = reader;
+    l_file->wschema = avro_file_reader_get_writer_schema(reader);
+    l_file->iface = avro_generic_class_from_schema(l_file->wschema);
+    atomic_add(stats.files_opened, 1);
+    atomic_add(stats.files_live, 1);
+    luaL_getmetatable(L, MT_AVRO_DATA_INPUT_FILE);
+    lua_setmetatable(L, -2);
     return 1;
 }
 
 
+avro_file_reader_t
+lua_avro_get_file_reader(lua_State *L, int index)
+{
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, index, MT_AVRO_DATA_INPUT_FILE);
+    return l_file->reader;
+}
+
+
 /**
- * Finalizes an AvroSchema instance.
+ * Closes a file reader.
  */
 
 static int
-l_schema_gc(lua_State *L)
+l_input_file_close(lua_State *L)
 {
-    LuaAvroSchema  *l_schema = luaL_checkudata(L, 1, MT_AVRO_SCHEMA);
-    if (l_schema->schema != NULL) {
-        avro_schema_decref(l_schema->schema);
-        l_schema->schema = NULL;
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    if (l_file->reader != NULL) {
+        avro_file_reader_close(l_file->reader);
+        l_file->reader = NULL;
+        atomic_add(stats.files_closed, 1);
+        atomic_add(stats.files_live, -1);
     }
-    if (l_schema->iface != NULL) {
-        avro_value_iface_decref(l_schema->iface);
-        l_schema->iface = NULL;
+    l_file->wschema = NULL;
+    if (l_file->iface != NULL) {
+        avro_value_iface_decref(l_file->iface);
+        l_file->iface = NULL;
     }
     return 0;
 }
 
-
 /**
- * Creates a new AvroSchema instance from a JSON schema string.
+ * Returns the writer schema used to create the file.
  */
 
 static int
-l_schema_new(lua_State *L)
+l_input_file_schema_json(lua_State *L)
 {
-    if (lua_isstring(L, 1)) {
-        size_t  json_len;
-        const char  *json_str = lua_tolstring(L, 1, &json_len);
-        avro_schema_t  schema;
-
-        /* First check for the primitive types */
-        if (strcmp(json_str, "boolean") == 0) {
-            schema = avro_schema_boolean();
-        }
-
-        else if (strcmp(json_str, "bytes") == 0) {
-            schema = avro_schema_bytes();
-        }
-
-        else if (strcmp(json_str, "double") == 0) {
-            schema = avro_schema_double();
-        }
-
-        else if (strcmp(json_str, "float") == 0) {
-            schema = avro_schema_float();
-        }
+    static char  static_buf[65536];
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
 
-        else if (strcmp(json_str, "int") == 0) {
-            schema = avro_schema_int();
-        }
+    avro_writer_t  writer = avro_writer_memory(static_buf, sizeof(static_buf));
+    int  rc = avro_schema_to_json(l_file->wschema, writer);
+    int64_t  length = avro_writer_tell(writer);
+    avro_writer_free(writer);
 
-        else if (strcmp(json_str, "long") == 0) {
-            schema = avro_schema_long();
-        }
+    if (rc != 0) {
+        return lua_avro_error(L);
+    }
 
-        else if (strcmp(json_str, "null") == 0) {
-            schema = avro_schema_null();
-        }
+    lua_pushlstring(L, static_buf, length);
+    return 1;
+}
 
-        else if (strcmp(json_str, "string") == 0) {
-            schema = avro_schema_string();
-        }
+/**
+ * Reads a value from a file reader.
+ */
 
-        /* Otherwise assume it's JSON */
+static int
+l_input_file_read_raw(lua_State *L)
+{
+    int  nargs = lua_gettop(L);
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
 
-        else {
-            avro_schema_error_t  schema_error;
-            check(avro_schema_from_json(json_str, json_len, &schema, &schema_error));
+    if (nargs == 1) {
+        /* No Value instance given, so create one. */
+        avro_value_t  value;
+        check(avro_generic_value_new(l_file->iface, &value));
+        int64_t  start = timing_start();
+        int  rc = avro_file_reader_read_value(l_file->reader, &value);
+        if (rc != 0) {
+            return lua_return_avro_error(L);
         }
-
-        lua_avro_push_schema(L, schema);
-        avro_schema_decref(schema);
-        lua_pushlightuserdata(L, schema);
-        return 2;
+        timing_record(TIMING_READ, start, 0);
+        lua_avro_push_value(L, &value, true);
+        return 1;
     }
 
-    if (lua_isuserdata(L, 1)) {
-        if (lua_getmetatable(L, 1)) {
-            lua_getfield(L, LUA_REGISTRYINDEX, MT_AVRO_SCHEMA);
-            if (lua_rawequal(L, -1, -2)) {
-                /* This is already a schema object, so just return it. */
-                lua_pop(L, 2);  /* remove both metatables */
-                LuaAvroSchema  *l_schema = lua_touserdata(L, 1);
-                lua_pushlightuserdata(L, l_schema->schema);
-                return 2;
-            }
+    else {
+        /* Otherwise read into the given value. */
+        avro_value_t  *value = lua_avro_get_value(L, 2);
+        int64_t  start = timing_start();
+        int  rc = avro_file_reader_read_value(l_file->reader, value);
+        if (rc != 0) {
+            return lua_return_avro_error(L);
         }
+        timing_record(TIMING_READ, start, 0);
+        lua_pushvalue(L, 2);
+        return 1;
     }
-
-    lua_pushliteral(L, "Invalid input to Schema function");
-    return lua_error(L);
 }
 
 
-/*-----------------------------------------------------------------------
- * Lua access — resolved readers
- */
-
 /**
- * The string used to identify the AvroResolvedReader class's metatable
+ * The string used to identify the AvroDataOutputFile class's metatable
  * in the Lua registry.
  */
 
-#define MT_AVRO_RESOLVED_READER "avro:AvroResolvedReader"
+#define MT_AVRO_DATA_OUTPUT_FILE "avro:AvroDataOutputFile"
 
-typedef struct _LuaAvroResolvedReader
+
+typedef struct _LuaAvroDataOutputFile
 {
-    avro_value_iface_t  *resolver;
-} LuaAvroResolvedReader;
+    avro_file_writer_t  writer;
+    AsyncWriter  *async;
+    /* The stream that writer writes to, if we opened it ourselves */
+    FILE  *fp;
+} LuaAvroDataOutputFile;
 
 
 int
-lua_avro_push_resolved_reader(lua_State *L, avro_value_iface_t *resolver)
+lua_avro_push_file_writer(lua_State *L, avro_file_writer_t writer)
 {
-    LuaAvroResolvedReader  *l_resolver;
+    LuaAvroDataOutputFile  *l_file;
 
-    l_resolver = lua_newuserdata(L, sizeof(LuaAvroResolvedReader));
-    l_resolver->resolver = resolver;
-    luaL_getmetatable(L, MT_AVRO_RESOLVED_READER);
+    l_file = lua_newuserdata(L, sizeof(LuaAvroDataOutputFile));
+    l_file->writer = writer;
+    l_file->async = NULL;
+    l_file->fp = NULL;
+    atomic_add(stats.files_opened, 1);
+    atomic_add(stats.files_live, 1);
+    luaL_getmetatable(L, MT_AVRO_DATA_OUTPUT_FILE);
     lua_setmetatable(L, -2);
     return 1;
 }
 
 
-avro_value_iface_t *
-lua_avro_get_resolved_reader(lua_State *L, int index)
+static int
+lua_avro_push_async_file_writer(lua_State *L, AsyncWriter *async)
+{
+    lua_avro_push_file_writer(L, NULL);
+    LuaAvroDataOutputFile  *l_file = lua_touserdata(L, -1);
+    l_file->async = async;
+    return 1;
+}
+
+
+avro_file_writer_t
+lua_avro_get_file_writer(lua_State *L, int index)
 {
-    LuaAvroResolvedReader  *l_resolver =
-        luaL_checkudata(L, index, MT_AVRO_RESOLVED_READER);
-    return l_resolver->resolver;
+    LuaAvroDataOutputFile  *l_file =
+        luaL_checkudata(L, index, MT_AVRO_DATA_OUTPUT_FILE);
+    return l_file->writer;
 }
 
 
 /**
- * Creates a new AvroResolvedReader for the given schemas.
+ * Closes a file writer.  For an asynchronous writer, we first wait for
+ * any queued blocks to be written, and return an error code if that
+ * fails.
  */
 
 static int
-l_resolved_reader_new(lua_State *L)
+output_file_close(LuaAvroDataOutputFile *l_file)
 {
-    avro_schema_t  writer_schema = lua_avro_get_schema(L, 1);
-    avro_schema_t  reader_schema = lua_avro_get_schema(L, 2);
-    avro_value_iface_t  *resolver =
-        avro_resolved_reader_new(writer_schema, reader_schema);
-    if (resolver == NULL) {
-        return lua_return_avro_error(L);
-    } else {
-        lua_avro_push_resolved_reader(L, resolver);
-        return 1;
+    int  rc = 0;
+    if (l_file->writer != NULL) {
+        avro_file_writer_close(l_file->writer);
+        l_file->writer = NULL;
+        atomic_add(stats.files_closed, 1);
+        atomic_add(stats.files_live, -1);
     }
+    if (l_file->fp != NULL) {
+        if (fclose(l_file->fp) != 0) {
+            rc = errno;
+            avro_set_error("Cannot close file: %s", strerror(rc));
+        }
+        l_file->fp = NULL;
+    }
+    if (l_file->async != NULL) {
+        rc = async_writer_close(l_file->async);
+        l_file->async = NULL;
+        atomic_add(stats.files_closed, 1);
+        atomic_add(stats.files_live, -1);
+    }
+    return rc;
 }
 
+static int
+l_output_file_close(lua_State *L)
+{
+    LuaAvroDataOutputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_OUTPUT_FILE);
+    check(output_file_close(l_file));
+    return 0;
+}
 
 /**
- * Finalizes an AvroResolvedReader instance.
+ * Closes a file writer when it's garbage collected.  There's no one to
+ * report an error to, so we ignore it.
  */
 
 static int
-l_resolved_reader_gc(lua_State *L)
+l_output_file_gc(lua_State *L)
 {
-    LuaAvroResolvedReader  *l_resolver =
-        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_READER);
-    if (l_resolver->resolver != NULL) {
-        avro_value_iface_decref(l_resolver->resolver);
-        l_resolver->resolver = NULL;
-    }
+    LuaAvroDataOutputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_OUTPUT_FILE);
+    output_file_close(l_file);
     return 0;
 }
 
-
 /**
- * Creates a new AvroValue for the given resolved reader.
+ * Writes any buffered values to the file.
  */
 
 static int
-l_resolved_reader_new_raw_value(lua_State *L)
+l_output_file_flush(lua_State *L)
 {
-    avro_value_iface_t  *resolver = lua_avro_get_resolved_reader(L, 1);
-    avro_value_t  value;
-    check(avro_resolved_reader_new_value(resolver, &value));
-    lua_avro_push_value(L, &value, true);
-    return 1;
+    LuaAvroDataOutputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_OUTPUT_FILE);
+    if (l_file->writer != NULL) {
+        check(avro_file_writer_flush(l_file->writer));
+    }
+    if (l_file->async != NULL) {
+        check(async_writer_flush(l_file->async));
+    }
+    return 0;
 }
 
-
-/*-----------------------------------------------------------------------
- * Lua access — resolved writers
- */
-
 /**
- * The string used to identify the AvroResolvedWriter class's metatable
- * in the Lua registry.
+ * Flushes the file, and then makes sure that everything that's been
+ * written to it is on disk.
  */
 
-#define MT_AVRO_RESOLVED_WRITER "avro:AvroResolvedWriter"
-
-typedef struct _LuaAvroResolvedWriter
-{
-    avro_value_iface_t  *resolver;
-    avro_value_t  value;
-} LuaAvroResolvedWriter;
-
-
-int
-lua_avro_push_resolved_writer(lua_State *L, avro_value_iface_t *resolver)
+static int
+output_file_sync(LuaAvroDataOutputFile *l_file)
 {
-    LuaAvroResolvedWriter  *l_resolver;
-
-    l_resolver = lua_newuserdata(L, sizeof(LuaAvroResolvedWriter));
-    l_resolver->resolver = resolver;
-    avro_resolved_writer_new_value(resolver, &l_resolver->value);
-    luaL_getmetatable(L, MT_AVRO_RESOLVED_WRITER);
-    lua_setmetatable(L, -2);
-    return 1;
+    if (l_file->writer != NULL) {
+        if (l_file->fp == NULL) {
+            avro_set_error("Cannot sync a file that we didn't open");
+            return EINVAL;
+        }
+        check_rc(avro_file_writer_flush(l_file->writer));
+        if (fsync(fileno(l_file->fp)) != 0) {
+            int  rc = errno;
+            avro_set_error("Cannot sync file: %s", strerror(rc));
+            return rc;
+        }
+    }
+    if (l_file->async != NULL) {
+        check_rc(async_writer_sync(l_file->async));
+    }
+    return 0;
 }
 
-
-avro_value_iface_t *
-lua_avro_get_resolved_writer(lua_State *L, int index)
+static int
+l_output_file_sync(lua_State *L)
 {
-    LuaAvroResolvedWriter  *l_resolver =
-        luaL_checkudata(L, index, MT_AVRO_RESOLVED_WRITER);
-    return l_resolver->resolver;
+    LuaAvroDataOutputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_OUTPUT_FILE);
+    check(output_file_sync(l_file));
+    return 0;
 }
 
-
 /**
- * Creates a new AvroResolvedWriter for the given schemas.
+ * Writes a value to a file writer.
  */
 
 static int
-l_resolved_writer_new(lua_State *L)
+l_output_file_write(lua_State *L)
 {
-    avro_schema_t  writer_schema = lua_avro_get_schema(L, 1);
-    avro_schema_t  reader_schema = lua_avro_get_schema(L, 2);
-    avro_value_iface_t  *resolver =
-        avro_resolved_writer_new(writer_schema, reader_schema);
-    if (resolver == NULL) {
-        return lua_return_avro_error(L);
+    LuaAvroDataOutputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_OUTPUT_FILE);
+    avro_value_t  *value = lua_avro_get_value(L, 2);
+    int64_t  start = timing_start();
+    if (l_file->async != NULL) {
+        check(async_writer_append(l_file->async, value));
+    } else if (l_file->writer != NULL) {
+        check(avro_file_writer_append_value(l_file->writer, value));
     } else {
-        lua_avro_push_resolved_writer(L, resolver);
-        return 1;
+        return luaL_error(L, "File is closed");
     }
+    timing_record(TIMING_WRITE, start, 0);
+    return 0;
 }
 
 
 /**
- * Finalizes an AvroResolvedWriter instance.
+ * Opens a synchronous file writer.  We open the file ourselves, rather
+ * than letting the Avro library do it, so that we can sync it.
  */
 
 static int
-l_resolved_writer_gc(lua_State *L)
+output_file_open(const char *path, avro_schema_t schema, const char *codec,
+                 size_t block_size, FILE **fp, avro_file_writer_t *writer)
 {
-    LuaAvroResolvedWriter  *l_resolver =
-        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_WRITER);
-    if (l_resolver->value.self != NULL) {
-        avro_value_decref(&l_resolver->value);
-        l_resolver->value.iface = NULL;
-        l_resolver->value.self = NULL;
+    *fp = fopen(path, "wb");
+    if (*fp == NULL) {
+        int  rc = errno;
+        avro_set_error("Cannot open file %s: %s", path, strerror(rc));
+        return rc;
     }
-    if (l_resolver->resolver != NULL) {
-        avro_value_iface_decref(l_resolver->resolver);
-        l_resolver->resolver = NULL;
+    int  rc = avro_file_writer_create_with_codec_fp
+        (*fp, path, 0, schema, writer,
+         (codec == NULL)? "null": codec, block_size);
+    if (rc != 0) {
+        fclose(*fp);
+        *fp = NULL;
+        return rc;
     }
     return 0;
 }
 
-
 /**
- * Creates a new AvroValue for the given resolved writer.
+ * The synchronous file writer functions, made available to the LuaJIT
+ * FFI binding via output_file_api.  The FFI binding writes and flushes
+ * values itself, using the Avro library directly.
  */
 
 static int
-l_resolved_writer_new_raw_value(lua_State *L)
+output_file_api_open(const char *path, avro_schema_t schema,
+                     const char *codec, size_t block_size,
+                     LuaAvroDataOutputFile *dest)
 {
-    avro_value_iface_t  *resolver = lua_avro_get_resolved_writer(L, 1);
-    avro_value_t  value;
-    check(avro_resolved_writer_new_value(resolver, &value));
-    lua_avro_push_value(L, &value, true);
+    dest->async = NULL;
+    check_rc(output_file_open(path, schema, codec, block_size,
+                              &dest->fp, &dest->writer));
+    atomic_add(stats.files_opened, 1);
+    atomic_add(stats.files_live, 1);
+    return 0;
+}
+
+typedef struct _OutputFileApi
+{
+    int (*open)(const char *path, avro_schema_t schema, const char *codec,
+                size_t block_size, LuaAvroDataOutputFile *dest);
+    int (*sync)(LuaAvroDataOutputFile *l_file);
+    int (*close)(LuaAvroDataOutputFile *l_file);
+} OutputFileApi;
+
+static const OutputFileApi  output_file_api = {
+    output_file_api_open,
+    output_file_sync,
+    output_file_close
+};
+
+static int
+l_output_file_api(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void *) &output_file_api);
     return 1;
 }
 
+/**
+ * Reads a durability policy ("none", "block", or "interval") from the
+ * given stack index.  If it's nil, we use "interval" if an interval was
+ * given, and "none" otherwise.
+ */
+
+static AsyncDurability
+lua_avro_get_durability(lua_State *L, int index, bool have_interval)
+{
+    static const char  *NAMES[] = { "none", "block", "interval", NULL };
+    if (lua_isnil(L, index)) {
+        return have_interval? ASYNC_DURABILITY_INTERVAL: ASYNC_DURABILITY_NONE;
+    }
+    const char  *name = luaL_checkstring(L, index);
+    int  i;
+    for (i = 0; NAMES[i] != NULL; i++) {
+        if (strcmp(name, NAMES[i]) == 0) {
+            return (AsyncDurability) i;
+        }
+    }
+    luaL_error(L, "Invalid durability %s", name);
+    return ASYNC_DURABILITY_NONE;
+}
 
 /**
- * Decode an Avro value using the given resolver.
+ * Opens a new input or output file.  When opening a file for reading,
+ * the third parameter can be a table of options.  Its prefetch field
+ * gives the number of decompressed blocks that a background thread
+ * should keep queued up ahead of the reader.  If follow is true, we
+ * return a stream reader that follows the file as it's written.
+ *
+ * When opening a file for writing, the third parameter is the schema,
+ * and the fourth can be a table of options: codec and block_size
+ * control how blocks are compressed and how large they are.  If async
+ * is true, blocks are compressed and written by a background thread,
+ * with up to queue_depth blocks waiting to be written.  Setting
+ * compression_threads uses that many background threads to compress
+ * blocks in parallel (and implies async).  durability can be "block"
+ * to sync each block as it's written, or "interval" to sync at most
+ * every interval_ms milliseconds; either implies async.
  */
 
 static int
-l_resolved_writer_decode(lua_State *L)
+l_file_open(lua_State *L)
 {
-    LuaAvroResolvedWriter  *l_resolver =
-        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_WRITER);
-    size_t  size = 0;
-    const char  *buf = luaL_checklstring(L, 2, &size);
-    avro_value_t  *value = lua_avro_get_value(L, 3);
+    static const char  *MODES[] = { "r", "w", NULL };
 
-    avro_reader_t  reader = avro_reader_memory(buf, size);
-    avro_resolved_writer_set_dest(&l_resolver->value, value);
-    int rc = avro_value_read(reader, &l_resolver->value);
-    avro_reader_free(reader);
+    const char  *path = luaL_checkstring(L, 1);
+    int  mode = luaL_checkoption(L, 2, "r", MODES);
 
-    if (rc != 0) {
-        return lua_return_avro_error(L);
+    if (mode == 0) {
+        /* mode == "r" */
+        lua_Integer  prefetch = 0;
+        bool  follow = false;
+        if (lua_istable(L, 3)) {
+            lua_getfield(L, 3, "prefetch");
+            prefetch = luaL_optinteger(L, -1, 0);
+            lua_getfield(L, 3, "follow");
+            follow = lua_toboolean(L, -1);
+            lua_pop(L, 2);
+        }
+
+        if (follow) {
+            lua_avro_push_follow_reader(L, path, 3);
+            if (lua_isnil(L, -2)) {
+                return 2;
+            }
+            /* Only return the reader, not its pointer. */
+            lua_pop(L, 1);
+            return 1;
+        }
+
+        avro_file_reader_t  reader;
+        int  rc = (prefetch > 0)?
+            lua_avro_prefetch_file_reader(path, prefetch, &reader):
+            avro_file_reader(path, &reader);
+        if (rc != 0) {
+            return lua_return_avro_error(L);
+        }
+        lua_avro_push_file_reader(L, reader);
+        return 1;
+
+    } else if (mode == 1) {
+        /* mode == "w" */
+        avro_schema_t  schema = lua_avro_get_schema(L, 3);
+        const char  *codec = NULL;
+        lua_Integer  block_size = 0;
+        lua_Integer  queue_depth = 0;
+        lua_Integer  compression_threads = 0;
+        bool  async = false;
+        AsyncDurability  durability = ASYNC_DURABILITY_NONE;
+        lua_Integer  interval_ms = 0;
+        if (lua_istable(L, 4)) {
+            lua_getfield(L, 4, "codec");
+            codec = luaL_optstring(L, -1, NULL);
+            lua_getfield(L, 4, "block_size");
+            block_size = luaL_optinteger(L, -1, 0);
+            lua_getfield(L, 4, "async");
+            async = lua_toboolean(L, -1);
+            lua_getfield(L, 4, "queue_depth");
+            queue_depth = luaL_optinteger(L, -1, 0);
+            lua_getfield(L, 4, "compression_threads");
+            compression_threads = luaL_optinteger(L, -1, 0);
+            lua_getfield(L, 4, "interval_ms");
+            interval_ms = luaL_optinteger(L, -1, 0);
+            lua_getfield(L, 4, "durability");
+            durability = lua_avro_get_durability(L, -1, interval_ms > 0);
+            lua_pop(L, 7);
+        }
+
+        /* Only the asynchronous writer can sync blocks as they're
+         * written. */
+        if (async || compression_threads > 1 ||
+            durability != ASYNC_DURABILITY_NONE) {
+            AsyncWriter  *writer;
+            int  rc = async_writer_open
+                (path, schema, codec, block_size, queue_depth,
+                 compression_threads, &writer);
+            if (rc != 0) {
+                return lua_return_avro_error(L);
+            }
+            async_writer_set_durability
+                (writer, durability, (int64_t) interval_ms * 1000000);
+            lua_avro_push_async_file_writer(L, writer);
+            return 1;
+        }
+
+        FILE  *fp;
+        avro_file_writer_t  writer;
+        if (output_file_open(path, schema, codec, block_size,
+                             &fp, &writer) != 0) {
+            return lua_return_avro_error(L);
+        }
+        lua_avro_push_file_writer(L, writer);
+        LuaAvroDataOutputFile  *l_file = lua_touserdata(L, -1);
+        l_file->fp = fp;
+        return 1;
     }
 
-    lua_pushboolean(L, true);
-    return 1;
+    return 0;
 }
 
-
 /**
- * Decode an Avro value, using the binary encoding, from the given
- * memory region, which is provided as a light user data and a size.
- * There's no safety checking here; to make it easier to not include
- * this function in sandboxes, it's exposed as a global function in the
- * "avro" package, and not as a method of the AvroValue class.
+ * Opens a read-ahead file reader, returning it as a light userdata.
+ * This is used by the LuaJIT FFI binding, which wraps the reader in its
+ * own file class.
  */
 
 static int
-l_value_decode_raw(lua_State *L)
+l_prefetch_file_reader(lua_State *L)
 {
-    LuaAvroResolvedWriter  *l_resolver =
-        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_WRITER);
-    if (!lua_islightuserdata(L, 2)) {
-        return luaL_error(L, "Destination buffer should be a light userdata");
-    }
-    void  *buf = lua_touserdata(L, 2);
-    size_t  size = luaL_checkinteger(L, 3);
-    avro_value_t  *value = lua_avro_get_value(L, 4);
-
-    avro_reader_t  reader = avro_reader_memory(buf, size);
-    avro_resolved_writer_set_dest(&l_resolver->value, value);
-    int rc = avro_value_read(reader, &l_resolver->value);
-    avro_reader_free(reader);
-
-    if (rc != 0) {
+    const char  *path = luaL_checkstring(L, 1);
+    lua_Integer  prefetch = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, prefetch > 0, 2, "Invalid prefetch size");
+    avro_file_reader_t  reader;
+    if (lua_avro_prefetch_file_reader(path, prefetch, &reader) != 0) {
         return lua_return_avro_error(L);
     }
-
-    lua_pushboolean(L, true);
+    lua_pushlightuserdata(L, reader);
     return 1;
 }
 
 
 /*-----------------------------------------------------------------------
- * Lua access — data files
+ * Lua access — parallel scans
  */
 
 /**
- * The string used to identify the AvroDataInputFile class's metatable
- * in the Lua registry.
+ * A parallel scan splits a container file into tasks, each of which
+ * covers a run of consecutive blocks, and hands the tasks out to a pool
+ * of native worker threads.  Each worker has its own Lua state, in
+ * which it runs a worker script.  To process a task, a worker builds an
+ * in-memory container consisting of the file's header followed by the
+ * task's blocks, and reads that using the Avro library as usual.
  */
 
-#define MT_AVRO_DATA_INPUT_FILE "avro:AvroDataInputFile"
-
-
-typedef struct _LuaAvroDataInputFile
+typedef struct _ScanTask
 {
-    avro_file_reader_t  reader;
-    avro_schema_t  wschema;
-    avro_value_iface_t  *iface;
-} LuaAvroDataInputFile;
+    off_t  start;
+    size_t  size;
+} ScanTask;
 
-int
-lua_avro_push_file_reader(lua_State *L, avro_file_reader_t reader)
+typedef struct _ScanJob
 {
-    LuaAvroDataInputFile  *l_file;
-
-    l_file = lua_newuserdata(L, sizeof(LuaAvroDataInputFile));
-    l_file->reader = reader;
-    l_file->wschema = avro_file_reader_get_writer_schema(reader);
-    l_file->iface = avro_generic_class_from_schema(l_file->wschema);
-    luaL_getmetatable(L, MT_AVRO_DATA_INPUT_FILE);
-    lua_setmetatable(L, -2);
-    return 1;
-}
+    const char  *path;
+    int  fd;
+    const char  *header;
+    size_t  header_size;
+    ScanTask  *tasks;
+    size_t  task_count;
+    size_t  next_task;
+    int  failed;
+    pthread_mutex_t  lock;
+    const char  *script;
+    const char  *package_path;
+    const char  *package_cpath;
+    int  nworkers;
+} ScanJob;
+
+typedef struct _ScanWorker
+{
+    ScanJob  *job;
+    int  index;
+    pthread_t  thread;
+    lua_State  *L;
+    char  *error;
+    int  errnum;
+    int64_t  records;
+} ScanWorker;
+
+/*
+ * Records a worker's failure.  The error might come from lua_tostring,
+ * which returns NULL if the script raised something other than a
+ * string.  System errors are recorded as an errno value, which the
+ * calling thread turns into a message, since strerror isn't
+ * thread-safe.
+ */
 
+static void
+scan_worker_fail_errno(ScanWorker *worker, const char *error, int errnum)
+{
+    if (worker->error == NULL && worker->errnum == 0) {
+        if (error == NULL) {
+            worker->errnum = (errnum != 0)? errnum: EIO;
+        } else if ((worker->error = strdup(error)) == NULL) {
+            worker->errnum = ENOMEM;
+        }
+    }
+    pthread_mutex_lock(&worker->job->lock);
+    worker->job->failed = 1;
+    pthread_mutex_unlock(&worker->job->lock);
+}
 
-avro_file_reader_t
-lua_avro_get_file_reader(lua_State *L, int index)
+static void
+scan_worker_fail(ScanWorker *worker, const char *error)
 {
-    LuaAvroDataInputFile  *l_file =
-        luaL_checkudata(L, index, MT_AVRO_DATA_INPUT_FILE);
-    return l_file->reader;
+    if (error == NULL) {
+        error = "Worker script raised a non-string error";
+    }
+    scan_worker_fail_errno(worker, error, 0);
 }
 
+static bool
+scan_next_task(ScanJob *job, ScanTask *task)
+{
+    bool  result = false;
+    pthread_mutex_lock(&job->lock);
+    if (!job->failed && job->next_task < job->task_count) {
+        *task = job->tasks[job->next_task++];
+        result = true;
+    }
+    pthread_mutex_unlock(&job->lock);
+    return result;
+}
 
 /**
- * Closes a file reader.
+ * Sets up a worker's Lua state.  We load in this module, and then run
+ * the worker script, which should return either a function that
+ * processes a single record, or a table with "process" and (optionally)
+ * "finish" functions.  We leave the finish function (or nil) at stack
+ * index 1, and the process function at index 2.
  */
 
-static int
-l_input_file_close(lua_State *L)
+static bool
+scan_worker_init(ScanWorker *worker)
 {
-    LuaAvroDataInputFile  *l_file =
-        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
-    if (l_file->reader != NULL) {
-        avro_file_reader_close(l_file->reader);
-        l_file->reader = NULL;
+    ScanJob  *job = worker->job;
+    lua_State  *L = luaL_newstate();
+    if (L == NULL) {
+        scan_worker_fail(worker, "Cannot create Lua state");
+        return false;
     }
-    l_file->wschema = NULL;
-    if (l_file->iface != NULL) {
-        avro_value_iface_decref(l_file->iface);
-        l_file->iface = NULL;
+    worker->L = L;
+    luaL_openlibs(L);
+
+    lua_getglobal(L, "package");
+    lua_pushstring(L, job->package_path);
+    lua_setfield(L, -2, "path");
+    lua_pushstring(L, job->package_cpath);
+    lua_setfield(L, -2, "cpath");
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "require");
+    lua_pushliteral(L, "avro.legacy.avro");
+    if (lua_pcall(L, 1, 0, 0) != 0 ||
+        luaL_loadfile(L, job->script) != 0) {
+        scan_worker_fail(worker, lua_tostring(L, -1));
+        return false;
     }
-    return 0;
+
+    lua_pushinteger(L, worker->index + 1);
+    lua_pushinteger(L, job->nworkers);
+    if (lua_pcall(L, 2, 1, 0) != 0) {
+        scan_worker_fail(worker, lua_tostring(L, -1));
+        return false;
+    }
+
+    if (lua_isfunction(L, -1)) {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+    } else if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, "finish");
+        lua_getfield(L, -2, "process");
+        lua_remove(L, -3);
+        if (!lua_isfunction(L, -1)) {
+            scan_worker_fail(worker, "Worker script has no process function");
+            return false;
+        }
+    } else {
+        scan_worker_fail(worker,
+                         "Worker script must return a function or table");
+        return false;
+    }
+    return true;
 }
 
 /**
- * Returns the writer schema used to create the file.
+ * Processes one task.  The value instance at stack index 3 is pointed
+ * at each record in turn before being passed to the process function.
  */
 
-static int
-l_input_file_schema_json(lua_State *L)
+static bool
+scan_worker_run_task(ScanWorker *worker, ScanTask *task)
 {
-    static char  static_buf[65536];
-    LuaAvroDataInputFile  *l_file =
-        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    ScanJob  *job = worker->job;
+    lua_State  *L = worker->L;
+    LuaAvroValue  *l_value = lua_touserdata(L, 3);
+
+    size_t  size = job->header_size + task->size;
+    char  *buf = malloc(size);
+    if (buf == NULL) {
+        scan_worker_fail(worker, "Out of memory");
+        return false;
+    }
+    memcpy(buf, job->header, job->header_size);
+    ssize_t  read_size =
+        pread(job->fd, buf + job->header_size, task->size, task->start);
+    if (read_size < 0 || (size_t) read_size != task->size) {
+        free(buf);
+        scan_worker_fail(worker, "Cannot read blocks from file");
+        return false;
+    }
 
-    avro_writer_t  writer = avro_writer_memory(static_buf, sizeof(static_buf));
-    int  rc = avro_schema_to_json(l_file->wschema, writer);
-    int64_t  length = avro_writer_tell(writer);
-    avro_writer_free(writer);
+    FILE  *fp = memory_stream_open(buf, size);
+    if (fp == NULL) {
+        free(buf);
+        scan_worker_fail_errno(worker, NULL, errno);
+        return false;
+    }
 
-    if (rc != 0) {
-        return lua_avro_error(L);
+    avro_file_reader_t  reader;
+    if (avro_file_reader_fp(fp, job->path, 1, &reader) != 0) {
+        free(buf);
+        scan_worker_fail(worker, avro_strerror());
+        return false;
     }
 
-    lua_pushlstring(L, static_buf, length);
-    return 1;
-}
+    bool  ok = true;
+    avro_schema_t  wschema = avro_file_reader_get_writer_schema(reader);
+    avro_value_iface_t  *iface = avro_generic_class_from_schema(wschema);
+    avro_value_t  value;
+    if (iface == NULL || avro_generic_value_new(iface, &value) != 0) {
+        scan_worker_fail(worker, avro_strerror());
+        ok = false;
+    } else {
+        int  rc;
+        l_value->value = value;
+        while ((rc = avro_file_reader_read_value(reader, &value)) == 0) {
+            lua_pushvalue(L, 2);
+            lua_pushvalue(L, 3);
+            if (lua_pcall(L, 1, 0, 0) != 0) {
+                scan_worker_fail(worker, lua_tostring(L, -1));
+                lua_pop(L, 1);
+                ok = false;
+                break;
+            }
+            worker->records++;
+        }
+        if (ok && rc != EOF) {
+            scan_worker_fail(worker, avro_strerror());
+            ok = false;
+        }
+        l_value->value.iface = NULL;
+        l_value->value.self = NULL;
+        avro_value_decref(&value);
+    }
 
-/**
- * Reads a value from a file reader.
- */
+    if (iface != NULL) {
+        avro_value_iface_decref(iface);
+    }
+    avro_file_reader_close(reader);
+    free(buf);
+    return ok;
+}
 
-static int
-l_input_file_read_raw(lua_State *L)
+static void *
+scan_worker_main(void *vworker)
 {
-    int  nargs = lua_gettop(L);
-    LuaAvroDataInputFile  *l_file =
-        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    ScanWorker  *worker = vworker;
+    if (!scan_worker_init(worker)) {
+        return NULL;
+    }
 
-    if (nargs == 1) {
-        /* No Value instance given, so create one. */
-        avro_value_t  value;
-        check(avro_generic_value_new(l_file->iface, &value));
-        int  rc = avro_file_reader_read_value(l_file->reader, &value);
-        if (rc != 0) {
-            return lua_return_avro_error(L);
+    avro_value_t  empty = { NULL, NULL };
+    lua_avro_push_value(worker->L, &empty, false);
+
+    ScanTask  task;
+    while (scan_next_task(worker->job, &task)) {
+        if (!scan_worker_run_task(worker, &task)) {
+            return NULL;
         }
-        lua_avro_push_value(L, &value, true);
-        return 1;
     }
 
-    else {
-        /* Otherwise read into the given value. */
-        avro_value_t  *value = lua_avro_get_value(L, 2);
-        int  rc = avro_file_reader_read_value(l_file->reader, value);
-        if (rc != 0) {
-            return lua_return_avro_error(L);
+    /* Call the finish function, leaving its result at stack index 1. */
+    lua_State  *L = worker->L;
+    lua_settop(L, 1);
+    if (!lua_isnil(L, 1)) {
+        if (lua_pcall(L, 0, 1, 0) != 0) {
+            scan_worker_fail(worker, lua_tostring(L, -1));
         }
-        lua_pushvalue(L, 2);
-        return 1;
     }
+    return NULL;
 }
 
-
 /**
- * The string used to identify the AvroDataOutputFile class's metatable
- * in the Lua registry.
+ * Copies a plain Lua value (nil, boolean, number, string, or a table of
+ * those) from one Lua state to another.  Returns an error message if
+ * the value can't be copied.
  */
 
-#define MT_AVRO_DATA_OUTPUT_FILE "avro:AvroDataOutputFile"
-
+#define SCAN_COPY_MAX_DEPTH  32
 
-typedef struct _LuaAvroDataOutputFile
+static const char *
+scan_copy_value(lua_State *from, int index, lua_State *to, int depth)
 {
-    avro_file_writer_t  writer;
-} LuaAvroDataOutputFile;
+    switch (lua_type(from, index))
+    {
+      case LUA_TNIL:
+        lua_pushnil(to);
+        return NULL;
 
+      case LUA_TBOOLEAN:
+        lua_pushboolean(to, lua_toboolean(from, index));
+        return NULL;
 
-int
-lua_avro_push_file_writer(lua_State *L, avro_file_writer_t writer)
-{
-    LuaAvroDataOutputFile  *l_file;
+      case LUA_TNUMBER:
+        lua_pushnumber(to, lua_tonumber(from, index));
+        return NULL;
 
-    l_file = lua_newuserdata(L, sizeof(LuaAvroDataOutputFile));
-    l_file->writer = writer;
-    luaL_getmetatable(L, MT_AVRO_DATA_OUTPUT_FILE);
-    lua_setmetatable(L, -2);
-    return 1;
-}
+      case LUA_TSTRING:
+        {
+            size_t  size;
+            const char  *str = lua_tolstring(from, index, &size);
+            lua_pushlstring(to, str, size);
+            return NULL;
+        }
 
+      case LUA_TTABLE:
+        {
+            if (depth >= SCAN_COPY_MAX_DEPTH) {
+                return "Worker result is nested too deeply";
+            }
+            if (index < 0) {
+                index = lua_gettop(from) + index + 1;
+            }
+            lua_newtable(to);
+            lua_pushnil(from);
+            while (lua_next(from, index) != 0) {
+                const char  *error =
+                    scan_copy_value(from, -2, to, depth+1);
+                if (error == NULL) {
+                    error = scan_copy_value(from, -1, to, depth+1);
+                    if (error != NULL) {
+                        lua_pop(to, 1);
+                    }
+                }
+                if (error != NULL) {
+                    lua_pop(from, 2);
+                    return error;
+                }
+                lua_rawset(to, -3);
+                lua_pop(from, 1);
+            }
+            return NULL;
+        }
 
-avro_file_writer_t
-lua_avro_get_file_writer(lua_State *L, int index)
-{
-    LuaAvroDataOutputFile  *l_file =
-        luaL_checkudata(L, index, MT_AVRO_DATA_OUTPUT_FILE);
-    return l_file->writer;
+      default:
+        return "Worker results can only contain plain Lua values";
+    }
 }
 
-
 /**
- * Closes a file writer.
+ * Builds the list of tasks for a parallel scan.  We first find all of
+ * the blocks in the file, verifying each block's sync marker as we go,
+ * and then group consecutive blocks into roughly equal-sized tasks.
  */
 
-static int
-l_output_file_close(lua_State *L)
+static const char *
+scan_find_tasks(ScanJob *job, const char *sync)
 {
-    LuaAvroDataOutputFile  *l_file =
-        luaL_checkudata(L, 1, MT_AVRO_DATA_OUTPUT_FILE);
-    if (l_file->writer != NULL) {
-        avro_file_writer_close(l_file->writer);
-        l_file->writer = NULL;
+    struct stat  st;
+    if (fstat(job->fd, &st) != 0) {
+        return strerror(errno);
     }
-    return 0;
-}
 
-/**
- * Writes a value to a file writer.
- */
+    off_t  offset = job->header_size;
+    size_t  capacity = 64;
+    job->tasks = malloc(capacity * sizeof(ScanTask));
+    job->task_count = 0;
+    if (job->tasks == NULL) {
+        return "Out of memory";
+    }
 
-static int
-l_output_file_write(lua_State *L)
-{
-    avro_file_writer_t  writer = lua_avro_get_file_writer(L, 1);
-    avro_value_t  *value = lua_avro_get_value(L, 2);
-    check(avro_file_writer_append_value(writer, value));
-    return 0;
+    /* First one task per block... */
+    while (offset < st.st_size) {
+        char  start[CONTAINER_BLOCK_START_MAX];
+        ssize_t  size = pread(job->fd, start, sizeof(start), offset);
+        if (size <= 0) {
+            return "Cannot read block from file";
+        }
+
+        int64_t  count;
+        int64_t  data_size;
+        size_t  start_size;
+        if (container_parse_block_start(start, size, &count, &data_size,
+                                        &start_size) != CONTAINER_OK) {
+            return "Invalid block in container file";
+        }
+
+        uint64_t  block_size = start_size + data_size + CONTAINER_SYNC_SIZE;
+        if (block_size > (uint64_t) (st.st_size - offset)) {
+            return "Truncated block in container file";
+        }
+
+        char  block_sync[CONTAINER_SYNC_SIZE];
+        off_t  sync_offset = offset + block_size - CONTAINER_SYNC_SIZE;
+        if (pread(job->fd, block_sync, CONTAINER_SYNC_SIZE, sync_offset)
+                != CONTAINER_SYNC_SIZE ||
+            memcmp(block_sync, sync, CONTAINER_SYNC_SIZE) != 0) {
+            return "Invalid sync marker in container file";
+        }
+
+        if (job->task_count == capacity) {
+            capacity *= 2;
+            ScanTask  *new_tasks =
+                realloc(job->tasks, capacity * sizeof(ScanTask));
+            if (new_tasks == NULL) {
+                return "Out of memory";
+            }
+            job->tasks = new_tasks;
+        }
+        job->tasks[job->task_count].start = offset;
+        job->tasks[job->task_count].size = block_size;
+        job->task_count++;
+        offset += block_size;
+    }
+
+    /*
+     * ...and then merge them.  We aim for a few tasks per worker, so
+     * that workers that finish early can pick up the slack.
+     */
+
+    size_t  total_size = st.st_size - job->header_size;
+    size_t  target_size = total_size / (job->nworkers * 4) + 1;
+    size_t  i;
+    size_t  merged = 0;
+    for (i = 0; i < job->task_count; i++) {
+        if (merged > 0 && job->tasks[merged-1].size < target_size) {
+            job->tasks[merged-1].size += job->tasks[i].size;
+        } else {
+            job->tasks[merged++] = job->tasks[i];
+        }
+    }
+    job->task_count = merged;
+    return NULL;
 }
 
+#define SCAN_MAX_WORKERS  256
 
 /**
- * Opens a new input or output file.
+ * Scans a container file in parallel, using a pool of worker threads,
+ * each with its own Lua state.  The worker script is the path to a Lua
+ * file, which is run once in each worker, and is passed the worker's
+ * (1-based) index and the number of workers.  It should return a
+ * function, which is called with each record, or a table containing
+ * "process" and "finish" functions.  Records are AvroValue instances
+ * from the C binding.  The same instance is reused for every record,
+ * so it's only valid during the call to process.
+ *
+ * The finish function is called once each worker has processed all of
+ * its records, and its result is copied back into the calling Lua
+ * state; it can be nil, a boolean, number, or string, or a table of
+ * those.  We return a list of these results (one per worker) and the
+ * total number of records processed, or nil and an error message.
  */
 
 static int
-l_file_open(lua_State *L)
+l_parallel_scan(lua_State *L)
 {
-    static const char  *MODES[] = { "r", "w", NULL };
-
     const char  *path = luaL_checkstring(L, 1);
-    int  mode = luaL_checkoption(L, 2, "r", MODES);
+    int  nworkers = luaL_checkinteger(L, 2);
+    const char  *script = luaL_checkstring(L, 3);
+    if (nworkers < 1 || nworkers > SCAN_MAX_WORKERS) {
+        return luaL_error(L, "Invalid number of workers");
+    }
 
-    if (mode == 0) {
-        /* mode == "r" */
-        avro_file_reader_t  reader;
-        int  rc = avro_file_reader(path, &reader);
-        if (rc != 0) {
-            return lua_return_avro_error(L);
+    ScanJob  job;
+    memset(&job, 0, sizeof(ScanJob));
+    job.path = path;
+    job.script = script;
+    job.nworkers = nworkers;
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "path");
+    lua_getfield(L, -2, "cpath");
+    job.package_path = lua_tostring(L, -2);
+    job.package_cpath = lua_tostring(L, -1);
+    if (job.package_path == NULL || job.package_cpath == NULL) {
+        return luaL_error(L, "Cannot find package.path and package.cpath");
+    }
+
+    job.fd = open(path, O_RDONLY);
+    if (job.fd < 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", path, strerror(errno));
+        return 2;
+    }
+
+    const char  *error = NULL;
+    size_t  header_size;
+    char  sync[CONTAINER_SYNC_SIZE];
+    char  *header = container_read_header(job.fd, &header_size, sync, &error);
+    if (header != NULL) {
+        job.header = header;
+        job.header_size = header_size;
+        error = scan_find_tasks(&job, sync);
+    }
+    if (error != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        free(header);
+        free(job.tasks);
+        close(job.fd);
+        return 2;
+    }
+
+    /* Start the workers and wait for them to finish. */
+
+    pthread_mutex_init(&job.lock, NULL);
+    ScanWorker  *workers = calloc(nworkers, sizeof(ScanWorker));
+    int  started = 0;
+    int  i;
+    if (workers == NULL) {
+        error = "Out of memory";
+    } else {
+        for (i = 0; i < nworkers; i++) {
+            workers[i].job = &job;
+            workers[i].index = i;
+            if (pthread_create(&workers[i].thread, NULL,
+                               scan_worker_main, &workers[i]) != 0) {
+                pthread_mutex_lock(&job.lock);
+                job.failed = 1;
+                pthread_mutex_unlock(&job.lock);
+                error = "Cannot create worker thread";
+                break;
+            }
+            started++;
         }
-        lua_avro_push_file_reader(L, reader);
-        return 1;
+        for (i = 0; i < started; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
 
-    } else if (mode == 1) {
-        /* mode == "w" */
-        avro_schema_t  schema = lua_avro_get_schema(L, 3);
-        avro_file_writer_t  writer;
-        int  rc = avro_file_writer_create(path, schema, &writer);
-        if (rc != 0) {
-            return lua_return_avro_error(L);
+    /* Collect the results. */
+
+    int64_t  records = 0;
+    lua_createtable(L, nworkers, 0);
+    for (i = 0; i < started; i++) {
+        if (error == NULL && workers[i].error != NULL) {
+            lua_pushstring(L, workers[i].error);
+            error = lua_tostring(L, -1);
+        } else if (error == NULL && workers[i].errnum != 0) {
+            error = strerror(workers[i].errnum);
+        }
+        records += workers[i].records;
+        if (error == NULL) {
+            error = scan_copy_value(workers[i].L, 1, L, 0);
+            if (error == NULL) {
+                lua_rawseti(L, -2, i+1);
+            }
         }
-        lua_avro_push_file_writer(L, writer);
-        return 1;
     }
 
-    return 0;
+    for (i = 0; i < started; i++) {
+        if (workers[i].L != NULL) {
+            lua_close(workers[i].L);
+        }
+        free(workers[i].error);
+    }
+    free(workers);
+    pthread_mutex_destroy(&job.lock);
+    free(header);
+    free(job.tasks);
+    close(job.fd);
+
+    if (error != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
+    }
+    lua_pushnumber(L, (lua_Number) records);
+    return 2;
 }
 
 
@@ -1934,21 +8569,30 @@ static const luaL_Reg  value_methods[] =
 {
     {"add", l_value_add},
     {"append", l_value_append},
+    {"append_buffer", l_value_append_buffer},
+    {"append_many", l_value_append_many},
     {"cmp", l_value_cmp},
     {"copy_from", l_value_copy_from},
     {"discriminant", l_value_discriminant},
     {"discriminant_index", l_value_discriminant_index},
     {"encode", l_value_encode},
+    {"encode_single_object", l_value_encode_single_object},
     {"encoded_size", l_value_encoded_size},
     {"get", l_value_get},
+    {"get_field", l_value_get_field},
+    {"get_many", l_value_get_many},
+    {"get_path", l_value_get_path},
     {"hash", l_value_hash},
     {"iterate", l_value_iterate},
     {"raw_value", l_value_raw_value},
     {"release", l_value_release},
+    {"reserve", l_value_reserve},
     {"reset", l_value_reset},
     {"schema_name", l_value_schema_name},
     {"set", l_value_set},
     {"set_dest", l_value_set_dest},
+    {"set_field", l_value_set_field},
+    {"set_many", l_value_set_many},
     {"set_from_ast", l_value_set_from_ast},
     {"set_source", l_value_set_source},
     {"size", l_value_size},
@@ -1962,6 +8606,8 @@ static const luaL_Reg  schema_methods[] =
 {
     {"name", l_schema_name},
     {"new_raw_value", l_schema_new_raw_value},
+    {"raw_schema", l_schema_raw_schema},
+    {"set_fingerprint", l_schema_set_fingerprint},
     {"type", l_schema_type},
     {NULL, NULL}
 };
@@ -1991,9 +8637,46 @@ static const luaL_Reg  input_file_methods[] =
 };
 
 
+static const luaL_Reg  channel_methods[] =
+{
+    {"close", l_channel_close},
+    {"export", l_channel_export},
+    {"receive", l_channel_receive},
+    {"send", l_channel_send},
+    {"send_batch", l_channel_send_batch},
+    {NULL, NULL}
+};
+
+
+static const luaL_Reg  rolling_writer_methods[] =
+{
+    {"close", l_rolling_writer_close},
+    {"flush", l_rolling_writer_flush},
+    {"path", l_rolling_writer_path},
+    {"roll", l_rolling_writer_roll},
+    {"write_raw", l_rolling_writer_write},
+    {NULL, NULL}
+};
+
+
+static const luaL_Reg  stream_reader_methods[] =
+{
+    {"close", l_stream_reader_close},
+    {"feed", l_stream_reader_feed},
+    {"finish", l_stream_reader_finish},
+    {"next", l_stream_reader_next},
+    {"read_raw", l_stream_reader_next},
+    {"schema_json", l_stream_reader_schema_json},
+    {"wait", l_stream_reader_wait},
+    {NULL, NULL}
+};
+
+
 static const luaL_Reg  output_file_methods[] =
 {
     {"close", l_output_file_close},
+    {"flush", l_output_file_flush},
+    {"sync", l_output_file_sync},
     {"write_raw", l_output_file_write},
     {NULL, NULL}
 };
@@ -2001,13 +8684,43 @@ static const luaL_Reg  output_file_methods[] =
 
 static const luaL_Reg  mod_methods[] =
 {
+    {"Channel", l_channel_new},
     {"ResolvedReader", l_resolved_reader_new},
     {"ResolvedWriter", l_resolved_writer_new},
+    {"RollingWriter", l_rolling_writer_new},
     {"Schema", l_schema_new},
+    {"StreamReader", l_stream_reader_new},
+    {"async_writer_api", l_async_writer_api},
+    {"channel_api", l_channel_api},
+    {"enable_allocation_stats", l_enable_allocation_stats},
+    {"enable_timings", l_enable_timings},
+    {"export_resolver", l_export_resolver},
+    {"export_schema", l_export_schema},
+    {"fingerprint64", l_fingerprint64},
+    {"follow_file_reader", l_follow_file_reader},
+    {"import_channel", l_import_channel},
+    {"import_resolver", l_import_resolver},
+    {"import_schema", l_import_schema},
     {"new_raw_schema", l_new_raw_schema},
     {"open", l_file_open},
+    {"output_file_api", l_output_file_api},
+    {"parallel_scan", l_parallel_scan},
+    {"prefetch_file_reader", l_prefetch_file_reader},
     {"raw_decode_value", l_value_decode_raw},
     {"raw_encode_value", l_value_encode_raw},
+    {"release_handle", l_release_handle},
+    {"reset_stats", l_reset_stats},
+    {"reset_timings", l_reset_timings},
+    {"rolling_writer_api", l_rolling_writer_api},
+    {"shared_handle_api", l_shared_handle_api},
+    {"stats", l_stats},
+    {"stats_api", l_stats_api},
+    {"stats_counters", l_stats_counters},
+    {"stream_reader_api", l_stream_reader_api},
+    {"timings", l_timings},
+    {"timings_api", l_timings_api},
+    {"timings_counters", l_timings_counters},
+    {"with_arena", l_with_arena},
     {NULL, NULL}
 };
 
@@ -2015,6 +8728,20 @@ static const luaL_Reg  mod_methods[] =
 int
 luaopen_avro_legacy_avro(lua_State *L)
 {
+    allocator_init();
+    crc64_avro_init();
+    timings_init();
+    generic_array_class_init();
+
+    /* Single-object schema table */
+
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, SINGLE_OBJECT_SCHEMAS);
+
     /* AvroSchema metatable */
 
     luaL_newmetatable(L, MT_AVRO_SCHEMA);
@@ -2084,12 +8811,52 @@ luaopen_avro_legacy_avro(lua_State *L)
     lua_createtable(L, 0, sizeof(output_file_methods) / sizeof(luaL_Reg) - 1);
     luaL_register(L, NULL, output_file_methods);
     lua_setfield(L, -2, "__index");
-    lua_pushcfunction(L, l_output_file_close);
+    lua_pushcfunction(L, l_output_file_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    /* AvroRollingWriter metatable */
+
+    luaL_newmetatable(L, MT_AVRO_ROLLING_WRITER);
+    lua_createtable(L, 0, sizeof(rolling_writer_methods) / sizeof(luaL_Reg) - 1);
+    luaL_register(L, NULL, rolling_writer_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_rolling_writer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    /* AvroStreamReader metatable */
+
+    luaL_newmetatable(L, MT_AVRO_STREAM_READER);
+    lua_createtable(L, 0, sizeof(stream_reader_methods) / sizeof(luaL_Reg) - 1);
+    luaL_register(L, NULL, stream_reader_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_stream_reader_close);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    /* AvroChannel metatable */
+
+    luaL_newmetatable(L, MT_AVRO_CHANNEL);
+    lua_createtable(L, 0, sizeof(channel_methods) / sizeof(luaL_Reg) - 1);
+    luaL_register(L, NULL, channel_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_channel_gc);
     lua_setfield(L, -2, "__gc");
     lua_pop(L, 1);
 
     lua_newtable(L);
     luaL_register(L, NULL, mod_methods);
 
+    /*
+     * The channel and stream reader APIs report "try again" and "end
+     * of stream" as EAGAIN and EPIPE, whose values vary by platform.
+     */
+
+    lua_pushinteger(L, EAGAIN);
+    lua_setfield(L, -2, "EAGAIN");
+    lua_pushinteger(L, EPIPE);
+    lua_setfield(L, -2, "EPIPE");
+
     return 1;
 }
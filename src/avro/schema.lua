@@ -19,6 +19,7 @@ local next = next
 local pairs = pairs
 local print = print
 local setmetatable = setmetatable
+local string = string
 local table = table
 local tonumber = tonumber
 local tostring = tostring
@@ -45,7 +46,24 @@ end
 
 Schema.__mt.__tostring = Schema.to_json
 
-function Schema:check_for_existing(link_table)
+-- Returns the Parsing Canonical Form of the schema, as defined by the
+-- Avro specification.  This is the form that's used to calculate the
+-- schema's fingerprint.  Named types always appear with their
+-- fullnames.
+function Schema:canonical_form()
+   if not self.canonical then
+      self.canonical = self:build_canonical({})
+   end
+   return self.canonical
+end
+
+-- Returns the 64-bit Rabin fingerprint of the schema, as an 8-byte
+-- little-endian string.
+function Schema:fingerprint()
+   return AC.fingerprint64(self:canonical_form())
+end
+
+function Schema:check_for_existing(link_table, link_name)
    -- Verify that there's not already a schema with the same name in the
    -- link table, unless it's equivalent to ourselves.
    local existing = link_table[self.schema_name]
@@ -53,7 +71,7 @@ function Schema:check_for_existing(link_table)
       if self == existing then
          -- The existing schema is the same as self, so the JSON
          -- encoding of ourselves is a link to the existing schema.
-         return [["]]..self.schema_name..[["]]
+         return [["]]..(link_name or self.schema_name)..[["]]
       else
          error("Two mismatching schemas named "..self.schema_name)
       end
@@ -71,6 +89,7 @@ end
 function Schema:raw_schema()
    if not self.raw then
       self.raw = assert(AC.Schema(self:to_json()))
+      self.raw:set_fingerprint(function() return self:fingerprint() end)
    end
    return self.raw
 end
@@ -91,6 +110,17 @@ function Schema:name()
    return self.schema_name
 end
 
+-- Returns the schema's fullname, which includes the namespace that it
+-- was parsed with, if any.  Only the canonical form uses fullnames;
+-- everything else (including name) uses the name as given.
+function Schema:full_name()
+   local namespace = self.schema_namespace
+   if namespace and namespace ~= "" then
+      return namespace.."."..self.schema_name
+   end
+   return self.schema_name
+end
+
 function Schema:type()
    return self.schema_type
 end
@@ -137,6 +167,10 @@ function PrimitiveSchema:build_json(link_table)
    return [[{"type": "]]..self.schema_name..[["}]]
 end
 
+function PrimitiveSchema:build_canonical(link_table)
+   return [["]]..self.schema_name..[["]]
+end
+
 function PrimitiveSchema:default_wrapper_class()
    return self.__default_wrapper_class
 end
@@ -190,6 +224,11 @@ function ArraySchema:build_json(link_table)
    return [[{"type": "array", "items": ]]..item_json..[[}]]
 end
 
+function ArraySchema:build_canonical(link_table)
+   local item_canonical = self.item_schema:build_canonical(link_table)
+   return [[{"type":"array","items":]]..item_canonical..[[}]]
+end
+
 function ArraySchema:default_wrapper_class()
    local class = AW.ArrayValue:subclass(self.schema_name)
    self.__wrapper_class = class
@@ -228,6 +267,11 @@ function MapSchema:build_json(link_table)
    return [[{"type": "map", "values": ]]..value_json..[[}]]
 end
 
+function MapSchema:build_canonical(link_table)
+   local value_canonical = self.value_schema:build_canonical(link_table)
+   return [[{"type":"map","values":]]..value_canonical..[[}]]
+end
+
 function MapSchema:default_wrapper_class()
    local class = AW.MapValue:subclass(self.schema_name)
    self.__wrapper_class = class
@@ -271,6 +315,7 @@ end
 function EnumSchema:add_symbol(symbol)
    table.insert(self.symbols, symbol)
    self.json = nil
+   self.canonical = nil
    self.raw = nil
 end
 
@@ -288,6 +333,20 @@ function EnumSchema:build_json(link_table)
           [[", "symbols": []]..all_symbols.."]}"
 end
 
+function EnumSchema:build_canonical(link_table)
+   local existing = self:check_for_existing(link_table, self:full_name())
+   if existing then return existing end
+
+   local symbol_strs = {}
+   for _, sym in ipairs(self.symbols) do
+      table.insert(symbol_strs, [["]]..sym..[["]])
+   end
+   local all_symbols = table.concat(symbol_strs, ",")
+
+   return [[{"name":"]]..self:full_name()..
+          [[","type":"enum","symbols":[]]..all_symbols.."]}"
+end
+
 function EnumSchema:default_wrapper_class()
    return AW.ScalarValue
 end
@@ -299,6 +358,7 @@ function EnumSchema:clone(clones)
    end
 
    local schema = EnumSchema:new(self.schema_name)
+   schema.schema_namespace = self.schema_namespace
    clones[self.schema_name] = schema
    for _, sym in ipairs(self.symbols) do
       schema:add_symbol(sym)
@@ -335,6 +395,13 @@ function FixedSchema:build_json(link_table)
           [[", "size": ]]..self.fixed_size..[[}]]
 end
 
+function FixedSchema:build_canonical(link_table)
+   local existing = self:check_for_existing(link_table, self:full_name())
+   if existing then return existing end
+   return [[{"name":"]]..self:full_name()..
+          [[","type":"fixed","size":]]..self.fixed_size..[[}]]
+end
+
 function FixedSchema:default_wrapper_class()
    return AW.ScalarValue
 end
@@ -346,6 +413,7 @@ function FixedSchema:clone(clones)
    end
 
    local schema = FixedSchema:new(self.schema_name, self.fixed_size)
+   schema.schema_namespace = self.schema_namespace
    clones[self.schema_name] = schema
    return schema
 end
@@ -366,6 +434,7 @@ function RecordSchema:new(name)
       schema_type=ACC.RECORD,
       fields={},
       fields_by_name={},
+      field_defaults={},
    }
    return setmetatable(obj, self.__mt)
 end
@@ -381,10 +450,14 @@ function RecordSchema:get(field_name)
    return self.fields_by_name[field_name]
 end
 
-function RecordSchema:add_field(name, schema)
+-- The default value is only used when checking schema compatibility;
+-- a JSON null default is represented by json.null.
+function RecordSchema:add_field(name, schema, default)
    table.insert(self.fields, {[name]=schema})
    self.fields_by_name[name] = schema
+   self.field_defaults[name] = default
    self.json = nil
+   self.canonical = nil
    self.raw = nil
 end
 
@@ -406,6 +479,24 @@ function RecordSchema:build_json(link_table)
           [[", "fields": []]..all_fields.."]}"
 end
 
+function RecordSchema:build_canonical(link_table)
+   local existing = self:check_for_existing(link_table, self:full_name())
+   if existing then return existing end
+
+   local field_strs = {}
+   for _, field in ipairs(self.fields) do
+      local field_name, field_schema = next(field)
+      local field_schema_str = field_schema:build_canonical(link_table)
+      table.insert(field_strs,
+                   [[{"name":"]]..field_name..
+                   [[","type":]]..field_schema_str..[[}]])
+   end
+   local all_fields = table.concat(field_strs, ",")
+
+   return [[{"name":"]]..self:full_name()..
+          [[","type":"record","fields":[]]..all_fields.."]}"
+end
+
 function RecordSchema:default_wrapper_class()
    local class = AW.RecordValue:subclass(self.schema_name)
    self.__wrapper_class = class
@@ -434,11 +525,13 @@ function RecordSchema:clone(clones)
    end
 
    local schema = RecordSchema:new(self.schema_name)
+   schema.schema_namespace = self.schema_namespace
    clones[self.schema_name] = schema
    for _, field in ipairs(self.fields) do
       local field_name, field_schema = next(field)
       local field_clone = field_schema:clone(clones)
-      schema:add_field(field_name, field_clone)
+      schema:add_field(field_name, field_clone,
+                       self.field_defaults[field_name])
    end
    return schema
 end
@@ -452,6 +545,55 @@ function RecordSchema:field_names()
    return result
 end
 
+-- Returns the (1-based) index of the field with the given name, or nil
+-- if there isn't one.
+function RecordSchema:field_index(field_name)
+   for i, field in ipairs(self.fields) do
+      if next(field) == field_name then
+         return i
+      end
+   end
+   return nil
+end
+
+-- Returns a field handle, which can be passed to the get_field and
+-- set_field methods of a raw value to access a field without looking
+-- it up by name.  The path is a field name, or a dot-separated list of
+-- field names for a field in a nested record.
+function RecordSchema:field_handle(path)
+   local handle = {}
+   local schema = self
+   for field_name in string.gmatch(path, "[^.]+") do
+      if not schema or schema:type() ~= ACC.RECORD then
+         error("Field path "..path.." doesn't refer to a record field")
+      end
+      local index = schema:field_index(field_name)
+      if not index then
+         error("No field named "..field_name.." in "..schema:name())
+      end
+      table.insert(handle, index)
+      schema = schema:get(field_name)
+   end
+
+   if #handle == 0 then
+      error("Empty field path")
+   elseif #handle == 1 then
+      return handle[1]
+   else
+      return handle
+   end
+end
+
+-- Returns a list of field handles for a list of field paths.  This can
+-- be passed to the get_many and set_many methods of a raw value.
+function RecordSchema:field_handles(paths)
+   local handles = {}
+   for i, path in ipairs(paths) do
+      handles[i] = self:field_handle(path)
+   end
+   return handles
+end
+
 
 ------------------------------------------------------------------------
 -- Unions
@@ -492,6 +634,7 @@ function UnionSchema:add_branch(branch_schema)
    table.insert(self.branches, branch_schema)
    self.indices_by_name[branch_name] = #self.branches
    self.json = nil
+   self.canonical = nil
    self.raw = nil
 end
 
@@ -506,6 +649,15 @@ function UnionSchema:build_json(link_table)
    return "["..all_branches.."]"
 end
 
+function UnionSchema:build_canonical(link_table)
+   local branch_strs = {}
+   for _, branch_schema in ipairs(self.branches) do
+      local branch_schema_str = branch_schema:build_canonical(link_table)
+      table.insert(branch_strs, branch_schema_str)
+   end
+   return "["..table.concat(branch_strs, ",").."]"
+end
+
 function UnionSchema:default_wrapper_class()
    local class = AW.UnionValue:subclass(self.schema_name)
    self.__wrapper_class = class
@@ -537,16 +689,236 @@ function UnionSchema:clone(clones)
 end
 
 
+------------------------------------------------------------------------
+-- Compiled paths
+
+-- A path identifies a value nested somewhere within a larger value.  It
+-- consists of record field names, array indices, and map keys:
+--
+--   a.b[3].c["key"]
+--
+-- Array indices are 1-based.  Unions don't appear in the path; when a
+-- path passes through a union, we use the branch that can contain the
+-- next part of the path.  Compiling a path resolves all of this against
+-- a schema once, so that the path can then be followed in a value with
+-- a single call.
+
+local CompiledPath = {}
+avro.schema.CompiledPath = CompiledPath
+
+CompiledPath.__mt = { __index=CompiledPath }
+
+local function parse_path(path)
+   local parts = {}
+   local pos = 1
+   local need_name = false
+   while pos <= #path do
+      local name, next_pos = string.match(path, "^([%a_][%w_]*)()", pos)
+      local index, key
+      if not name and not need_name then
+         index, next_pos = string.match(path, "^%[(%d+)%]()", pos)
+         if not index then
+            key, next_pos = string.match(path, [[^%["([^"]*)"%]()]], pos)
+         end
+      end
+
+      if name then
+         table.insert(parts, name)
+      elseif index then
+         table.insert(parts, tonumber(index))
+      elseif key then
+         table.insert(parts, { key=key })
+      else
+         error("Invalid path "..path)
+      end
+
+      pos = next_pos
+      need_name = string.sub(path, pos, pos) == "."
+      if need_name then pos = pos + 1 end
+   end
+
+   if #parts == 0 or need_name then
+      error("Invalid path "..path)
+   end
+   return parts
+end
+
+-- Whether a schema can contain a particular part of a path.
+local function schema_accepts_part(schema, part)
+   if type(part) == "string" then
+      return schema:type() == ACC.RECORD and schema:get(part) ~= nil
+   elseif type(part) == "number" then
+      return schema:type() == ACC.ARRAY
+   else
+      return schema:type() == ACC.MAP
+   end
+end
+
+function Schema:compile_path(path)
+   local steps = {}
+   local schema = self
+   for _, part in ipairs(parse_path(path)) do
+      if schema:type() == ACC.UNION then
+         local branch_index
+         for i, branch in ipairs(schema.branches) do
+            if schema_accepts_part(branch, part) then
+               if branch_index then
+                  error("Path "..path.." is ambiguous in "..schema:name())
+               end
+               branch_index = i
+            end
+         end
+         if not branch_index then
+            error("Path "..path.." doesn't match schema")
+         end
+         table.insert(steps, ACC.UNION)
+         table.insert(steps, branch_index)
+         schema = schema.branches[branch_index]
+      end
+
+      if not schema_accepts_part(schema, part) then
+         error("Path "..path.." doesn't match schema")
+      end
+
+      if type(part) == "string" then
+         table.insert(steps, ACC.RECORD)
+         table.insert(steps, schema:field_index(part))
+         schema = schema:get(part)
+      elseif type(part) == "number" then
+         table.insert(steps, ACC.ARRAY)
+         table.insert(steps, part)
+         schema = schema.item_schema
+      else
+         table.insert(steps, ACC.MAP)
+         table.insert(steps, part.key)
+         schema = schema.value_schema
+      end
+   end
+
+   local obj = {
+      path=path,
+      steps=steps,
+      leaf_schema=schema,
+   }
+   return setmetatable(obj, CompiledPath.__mt)
+end
+
+-- Returns the value at the end of the path.  Scalars are returned as
+-- the equivalent Lua value; compound values as a raw value.  If the
+-- path doesn't exist in this particular value (because an array is too
+-- short, a map key is missing, or a union has a different branch), we
+-- return nil and an error message.
+function CompiledPath:get(raw_value)
+   return raw_value:get_path(self.steps)
+end
+
+
+------------------------------------------------------------------------
+-- Value pools
+
+-- A value pool hands out raw values for a particular schema, and takes
+-- them back when you're done with them.  Released values are reset
+-- rather than freed, so the next acquire can reuse the value's storage
+-- (including the capacity of any arrays and maps) instead of
+-- allocating a new value.  At most max_idle released values are kept
+-- around; any more than that are freed.
+
+local ValuePool = {}
+avro.schema.ValuePool = ValuePool
+ValuePool.__mt = { __index=ValuePool }
+
+function Schema:value_pool(max_idle)
+   max_idle = max_idle or 16
+   if max_idle < 0 then
+      error("Invalid value pool size "..tostring(max_idle))
+   end
+   local obj = {
+      schema=self,
+      max_idle=max_idle,
+      idle={},
+      idle_count=0,
+   }
+   return setmetatable(obj, ValuePool.__mt)
+end
+
+function ValuePool:acquire()
+   local count = self.idle_count
+   if count == 0 then
+      return self.schema:new_raw_value()
+   end
+   local value = self.idle[count]
+   self.idle[count] = nil
+   self.idle_count = count - 1
+   return value
+end
+
+function ValuePool:release(value)
+   if self.idle_count >= self.max_idle then
+      value:release()
+      return
+   end
+   value:reset()
+   self.idle_count = self.idle_count + 1
+   self.idle[self.idle_count] = value
+end
+
+-- Returns the number of released values that are waiting to be reused.
+function ValuePool:size()
+   return self.idle_count
+end
+
+-- Frees all of the released values that are waiting to be reused.
+function ValuePool:clear()
+   for i = 1, self.idle_count do
+      self.idle[i]:release()
+      self.idle[i] = nil
+   end
+   self.idle_count = 0
+end
+
+
 ------------------------------------------------------------------------
 -- Construct a schema from JSON
 
-local function parse_decoded_json(decoded, link_table)
+-- Named types keep the name they're given, but we also remember their
+-- namespace, so that the canonical form can use fullnames.  A name that
+-- contains a dot is already a fullname; otherwise its namespace is the
+-- type's namespace attribute, or that of the enclosing named type.
+-- Returns the namespace to store in the schema (if any), and the
+-- namespace to use for nested types.
+local function resolve_namespace(decoded, namespace)
+   local name = decoded.name
+   if type(name) ~= "string" then
+      error("Invalid schema name "..tostring(name))
+   end
+   if string.find(name, ".", 1, true) then
+      return nil, string.match(name, "^(.*)%.[^.]*$")
+   end
+   if type(decoded.namespace) == "string" then
+      namespace = decoded.namespace
+   end
+   if namespace == "" then
+      namespace = nil
+   end
+   return namespace, namespace
+end
+
+-- Named types can be referred to by name or by fullname.
+local function link_schema(link_table, schema)
+   link_table[schema:name()] = schema
+   if schema.schema_namespace then
+      link_table[schema:full_name()] = schema
+   end
+end
+
+local function parse_decoded_json(decoded, link_table, namespace)
    if type(decoded) == "string" then
       -- Check for primitives first, then any named types we've already
-      -- processed
+      -- processed.
       if PRIMITIVES[decoded] then
          return PRIMITIVES[decoded]
-      elseif link_table[decoded] then
+      end
+      if link_table[decoded] then
          return link_table[decoded]
       else
          error([[Cannot find linked schema "]]..decoded..[["]])
@@ -565,7 +937,8 @@ local function parse_decoded_json(decoded, link_table)
       -- Union type
       local schema = UnionSchema:new()
       for _, branch_json in ipairs(decoded) do
-         local branch_schema = parse_decoded_json(branch_json, link_table)
+         local branch_schema =
+            parse_decoded_json(branch_json, link_table, namespace)
          schema:add_branch(branch_schema)
       end
       return schema
@@ -573,7 +946,7 @@ local function parse_decoded_json(decoded, link_table)
    elseif decoded.type == "array" then
       -- Array type
       local items_json = assert(decoded.items, "No items schema for array")
-      local items_schema = parse_decoded_json(items_json, link_table)
+      local items_schema = parse_decoded_json(items_json, link_table, namespace)
       return ArraySchema:new(items_schema)
 
    elseif decoded.type == "enum" then
@@ -581,7 +954,8 @@ local function parse_decoded_json(decoded, link_table)
       local old_schema = link_table[name]
 
       local schema = EnumSchema:new(name)
-      link_table[name] = schema
+      schema.schema_namespace = resolve_namespace(decoded, namespace)
+      link_schema(link_table, schema)
 
       local symbols = assert(decoded.symbols, "No symbols for enum")
       for _, sym in ipairs(symbols) do
@@ -593,7 +967,7 @@ local function parse_decoded_json(decoded, link_table)
 
       if old_schema then
          if schema == old_schema then
-            link_table[name] = old_schema
+            link_schema(link_table, old_schema)
             return old_schema
          else
             error([[Already have a schema named "]]..name..[["]])
@@ -610,22 +984,24 @@ local function parse_decoded_json(decoded, link_table)
          error("Fixed size must be a number")
       end
       local schema = FixedSchema:new(name, size)
+      schema.schema_namespace = resolve_namespace(decoded, namespace)
 
       if old_schema then
          if schema == old_schema then
-            link_table[name] = old_schema
+            link_schema(link_table, old_schema)
             return old_schema
          else
             error([[Already have a schema named "]]..name..[["]])
          end
       end
-      link_table[name] = schema
+      link_schema(link_table, schema)
       return schema
 
    elseif decoded.type == "map" then
       -- Map type
       local values_json = assert(decoded.values, "No values schema for map")
-      local values_schema = parse_decoded_json(values_json, link_table)
+      local values_schema =
+         parse_decoded_json(values_json, link_table, namespace)
       return MapSchema:new(values_schema)
 
    elseif decoded.type == "record" then
@@ -633,7 +1009,10 @@ local function parse_decoded_json(decoded, link_table)
       local old_schema = link_table[name]
 
       local schema = RecordSchema:new(name)
-      link_table[name] = schema
+      local record_namespace
+      schema.schema_namespace, record_namespace =
+         resolve_namespace(decoded, namespace)
+      link_schema(link_table, schema)
 
       local fields = assert(decoded.fields, "No fields for record")
       for _, field in ipairs(fields) do
@@ -643,13 +1022,14 @@ local function parse_decoded_json(decoded, link_table)
 
          local field_name = assert(field.name, "No name for record field")
          local field_type = assert(field.type, "No type for record field")
-         local field_schema = parse_decoded_json(field_type, link_table)
-         schema:add_field(field_name, field_schema)
+         local field_schema =
+            parse_decoded_json(field_type, link_table, record_namespace)
+         schema:add_field(field_name, field_schema, field.default)
       end
 
       if old_schema then
          if schema == old_schema then
-            link_table[name] = old_schema
+            link_schema(link_table, old_schema)
             return old_schema
          else
             error([[Already have a schema named "]]..name..[["]])
@@ -658,7 +1038,7 @@ local function parse_decoded_json(decoded, link_table)
       return schema
 
    elseif type(decoded.type) == "string" then
-      return parse_decoded_json(decoded.type, link_table)
+      return parse_decoded_json(decoded.type, link_table, namespace)
 
    else
       error("Invalid JSON schema")
@@ -666,7 +1046,7 @@ local function parse_decoded_json(decoded, link_table)
 end
 
 function Schema:new(json_str)
-   local decoded, _, err = json.decode(json_str)
+   local decoded, _, err = json.decode(json_str, 1, json.null)
    if decoded then
       return parse_decoded_json(decoded, {})
    else
@@ -854,4 +1234,197 @@ function avro.schema.union(branches)
    return schema
 end
 
+
+------------------------------------------------------------------------
+-- Schema compatibility
+
+-- Checks whether data written with the writer schema can be read using
+-- the reader schema, following the schema resolution rules from the
+-- Avro specification.  Returns a boolean indicating whether the schemas
+-- are compatible, and a list of issues.  Each issue is a table with the
+-- following fields:
+--
+--   kind     "type_mismatch", "name_mismatch", "size_mismatch",
+--            "missing_field", "missing_enum_symbol",
+--            "union_branch_mismatch", or "promotion"
+--   path     where the issue occurs, such as "a.b[]{}<int>"; [] is an
+--            array's items, {} is a map's values, and <name> is a
+--            union branch in the writer schema
+--   message  a human-readable description
+--   fatal    false for issues that don't prevent resolution (namely
+--            promotions)
+--
+-- Both schemas can be schema objects or JSON strings.
+
+local PROMOTIONS = {
+   [ACC.INT] = { [ACC.LONG]=true, [ACC.FLOAT]=true, [ACC.DOUBLE]=true },
+   [ACC.LONG] = { [ACC.FLOAT]=true, [ACC.DOUBLE]=true },
+   [ACC.FLOAT] = { [ACC.DOUBLE]=true },
+   [ACC.STRING] = { [ACC.BYTES]=true },
+   [ACC.BYTES] = { [ACC.STRING]=true },
+}
+
+local NAMED_TYPES = {
+   [ACC.ENUM] = true,
+   [ACC.FIXED] = true,
+   [ACC.RECORD] = true,
+}
+
+-- Whether a writer schema can be resolved against a particular reader
+-- schema.  Neither schema can be a union.  If exact is true, we don't
+-- allow promotions.
+local function schemas_match(writer, reader, exact)
+   local writer_type, reader_type = writer:type(), reader:type()
+   if writer_type == reader_type then
+      return not NAMED_TYPES[writer_type] or writer:name() == reader:name()
+   end
+   return not exact and PROMOTIONS[writer_type] and
+          PROMOTIONS[writer_type][reader_type] or false
+end
+
+-- Finds the reader union branch that the writer schema resolves to,
+-- preferring exact matches over promotions.
+local function find_branch(writer, reader_union)
+   for _, exact in ipairs { true, false } do
+      for _, branch in ipairs(reader_union.branches) do
+         if schemas_match(writer, branch, exact) then
+            return branch
+         end
+      end
+   end
+   return nil
+end
+
+local function add_issue(state, kind, path, message, fatal)
+   table.insert(state.issues, {
+      kind=kind,
+      path=path,
+      message=message,
+      fatal=fatal ~= false,
+   })
+   if fatal ~= false then state.compatible = false end
+end
+
+local check_schemas
+
+local function check_non_union(state, writer, reader, path)
+   local writer_type, reader_type = writer:type(), reader:type()
+
+   if writer_type ~= reader_type then
+      if schemas_match(writer, reader) then
+         add_issue(state, "promotion", path,
+                   "Promoting "..writer:name().." to "..reader:name(), false)
+      else
+         add_issue(state, "type_mismatch", path,
+                   "Cannot read "..writer:name().." as "..reader:name())
+      end
+      return
+   end
+
+   if NAMED_TYPES[writer_type] and writer:name() ~= reader:name() then
+      add_issue(state, "name_mismatch", path,
+                "Cannot read "..writer:name().." as "..reader:name())
+      return
+   end
+
+   if writer_type == ACC.RECORD then
+      for _, field in ipairs(reader.fields) do
+         local field_name, reader_field = next(field)
+         local field_path = path == "" and field_name or path.."."..field_name
+         local writer_field = writer.fields_by_name[field_name]
+         if writer_field then
+            check_schemas(state, writer_field, reader_field, field_path)
+         elseif reader.field_defaults[field_name] == nil then
+            add_issue(state, "missing_field", field_path,
+                      "Field "..field_name.." is missing from writer "..
+                      "schema and has no default value")
+         end
+      end
+
+   elseif writer_type == ACC.ENUM then
+      local reader_symbols = {}
+      for _, sym in ipairs(reader.symbols) do
+         reader_symbols[sym] = true
+      end
+      for _, sym in ipairs(writer.symbols) do
+         if not reader_symbols[sym] then
+            add_issue(state, "missing_enum_symbol", path,
+                      "Symbol "..sym.." is missing from reader schema")
+         end
+      end
+
+   elseif writer_type == ACC.FIXED then
+      if writer.fixed_size ~= reader.fixed_size then
+         add_issue(state, "size_mismatch", path,
+                   "Cannot read fixed of size "..writer.fixed_size..
+                   " as fixed of size "..reader.fixed_size)
+      end
+
+   elseif writer_type == ACC.ARRAY then
+      check_schemas(state, writer.item_schema, reader.item_schema, path.."[]")
+
+   elseif writer_type == ACC.MAP then
+      check_schemas(state, writer.value_schema, reader.value_schema,
+                    path.."{}")
+   end
+end
+
+function check_schemas(state, writer, reader, path)
+   -- Recursive schemas would send us into an infinite loop, so only
+   -- check each pair of records once.  (This means that issues within
+   -- a record that's used in several places are only reported once.)
+   if writer:type() == ACC.RECORD then
+      local seen = state.seen[writer]
+      if not seen then
+         seen = {}
+         state.seen[writer] = seen
+      end
+      if seen[reader] then return end
+      seen[reader] = true
+   end
+
+   local reader_is_union = reader:type() == ACC.UNION
+
+   if writer:type() == ACC.UNION then
+      for _, branch in ipairs(writer.branches) do
+         local branch_path = path.."<"..branch:name()..">"
+         local reader_branch = reader
+         if reader_is_union then
+            reader_branch = find_branch(branch, reader)
+         elseif not schemas_match(branch, reader) then
+            reader_branch = nil
+         end
+
+         if reader_branch then
+            check_schemas(state, branch, reader_branch, branch_path)
+         else
+            add_issue(state, "union_branch_mismatch", branch_path,
+                      "Writer union branch "..branch:name()..
+                      " doesn't match the reader schema")
+         end
+      end
+
+   elseif reader_is_union then
+      local reader_branch = find_branch(writer, reader)
+      if reader_branch then
+         check_schemas(state, writer, reader_branch, path)
+      else
+         add_issue(state, "type_mismatch", path,
+                   "No branch of the reader union matches "..writer:name())
+      end
+
+   else
+      check_non_union(state, writer, reader, path)
+   end
+end
+
+function avro.schema.check_compatibility(writer, reader)
+   if type(writer) == "string" then writer = Schema:new(writer) end
+   if type(reader) == "string" then reader = Schema:new(reader) end
+
+   local state = { compatible=true, issues={}, seen={} }
+   check_schemas(state, writer, reader, "")
+   return state.compatible, state.issues
+end
+
 return avro.schema
@@ -9,3 +9,4 @@
 require "avro.tests.schema"
 require "avro.tests.raw"
 require "avro.tests.wrapper"
+require "avro.tests.wire"
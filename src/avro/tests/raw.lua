@@ -50,7 +50,7 @@ do
       array2:copy_from(array)
       local actual = {}
       for _,element in array:iterate() do
-         table.insert(actual, element:get())
+         table.insert(actual, element)
       end
       local array3 = schema:new_raw_value()
       array3:set_from_ast(expected)
@@ -71,6 +71,160 @@ do
    test_array("string", { "", "a", "hello", "world!" })
 end
 
+------------------------------------------------------------------------
+-- Reused iteration elements
+
+do
+   local map = A.map(A.long):new_raw_value()
+   map:set_from_ast { a=1, b=2, c=3 }
+   local first
+   local actual = {}
+   for key,element in map:iterate(true, true) do
+      first = first or element
+      assert(rawequal(element, first))
+      actual[key] = tonumber(element:get())
+   end
+   assert(deepcompare(actual, { a=1, b=2, c=3 }))
+   map:release()
+
+   local array = A.array(A.record "r" {{a = A.int}}):new_raw_value()
+   array:set_from_ast { { a = 1 }, { a = 2 } }
+   first = nil
+   actual = {}
+   for i,element in array:iterate(false, true) do
+      first = first or element
+      assert(rawequal(element, first))
+      actual[i] = element:get("a"):get()
+   end
+   assert(deepcompare(actual, { 1, 2 }))
+   array:release()
+end
+
+------------------------------------------------------------------------
+-- Bulk array appends
+
+do
+   local function array_contents(array)
+      local actual = {}
+      for _,element in array:iterate(true) do
+         table.insert(actual, element:get())
+      end
+      return actual
+   end
+
+   local int_array = A.array(A.int):new_raw_value()
+   local double_array = A.array(A.double):new_raw_value()
+   local string_array = A.array(A.string):new_raw_value()
+   local record_array = A.array(A.record "r" {{a = A.int}}):new_raw_value()
+
+   assert(int_array:reserve(100))
+   int_array:append_many { 1, 2, 3 }
+   int_array:append_many {}
+   assert(deepcompare(array_contents(int_array), { 1, 2, 3 }))
+
+   string_array:append_many { "a", "b" }
+   assert(deepcompare(array_contents(string_array), { "a", "b" }))
+
+   record_array:append_many { { a = 1 }, { a = 2 } }
+   assert(record_array:size() == 2)
+   assert(record_array:get(2):get("a"):get() == 2)
+
+   -- Little-endian int32 and double buffers
+   local ints = "\001\000\000\000\002\000\000\000\003\000\000\000"
+   local doubles = "\000\000\000\000\000\000\240\063"..
+                   "\000\000\000\000\000\000\004\064"
+
+   -- Same element type: a single copy
+   int_array:append_buffer(ints, 3, "int")
+   assert(deepcompare(array_contents(int_array), { 1, 2, 3, 1, 2, 3 }))
+   double_array:append_buffer(doubles, 2, "double")
+   assert(deepcompare(array_contents(double_array), { 1, 2.5 }))
+
+   -- Different element type: converted one at a time
+   double_array:append_buffer(ints, 2, "int32_t")
+   assert(deepcompare(array_contents(double_array), { 1, 2.5, 1, 2 }))
+   int_array:reset()
+   int_array:append_buffer(doubles, 2, "double")
+   assert(deepcompare(array_contents(int_array), { 1, 2 }))
+
+   assert(not pcall(int_array.append_buffer, int_array, ints, 4, "int"))
+   assert(not pcall(int_array.append_buffer, int_array, ints, -1, "int"))
+   assert(not pcall(int_array.append_buffer, int_array, ints, 1, "short"))
+   assert(not pcall(string_array.append_buffer, string_array, ints, 1, "int"))
+
+   if A.c.ffi_present then
+      local ffi = require "ffi"
+      local buf = ffi.new("double[3]", 1.5, 2.5, 3.5)
+      double_array:reset()
+      double_array:append_buffer(buf, 3, "double")
+      assert(deepcompare(array_contents(double_array), { 1.5, 2.5, 3.5 }))
+      assert(not pcall(double_array.append_buffer, double_array,
+                       buf, -1, "double"))
+      assert(double_array:size() == 3)
+   end
+
+   int_array:release()
+   double_array:release()
+   string_array:release()
+   record_array:release()
+end
+
+------------------------------------------------------------------------
+-- Typed array views
+
+if A.c.ffi_present then
+   local ffi = require "ffi"
+
+   local long_array = A.array(A.long):new_raw_value()
+   local double_array = A.array(A.double):new_raw_value()
+   local string_array = A.array(A.string):new_raw_value()
+
+   long_array:append_many { 10, 20, 30 }
+   local ptr, count = long_array:as_ffi_view()
+   assert(count == 3)
+   assert(ptr[0] == 10 and ptr[2] == 30)
+
+   -- The view aliases the array's storage.
+   ptr[1] = 25
+   assert(long_array:get(2):get() == 25)
+
+   double_array:append_many { 1.5, 2.5 }
+   local dest = ffi.new("double[2]")
+   local result
+   result, count = double_array:as_ffi_view(dest)
+   assert(result == dest and count == 2)
+   assert(dest[0] == 1.5 and dest[1] == 2.5)
+   dest[0] = 0
+   assert(double_array:get(1):get() == 1.5)
+
+   double_array:reset()
+   ptr, count = double_array:as_ffi_view()
+   assert(count == 0)
+
+   -- Resolved values can't be aliased, so they're always copied.
+   local int_array = A.array(A.int):new_raw_value()
+   int_array:append_many { 1, 2, 3 }
+   local resolver = assert(A.ResolvedReader(A.array(A.int), A.array(A.double)))
+   local resolved = resolver:new_raw_value()
+   resolved:set_source(int_array)
+   result, count = resolved:as_ffi_view()
+   assert(count == 3)
+   assert(result[0] == 1 and result[2] == 3)
+   result[0] = 5
+   assert(int_array:get(1):get() == 1)
+   resolved:release()
+   int_array:release()
+
+   local int_value = A.int:new_raw_value()
+   assert(not pcall(string_array.as_ffi_view, string_array))
+   assert(not pcall(int_value.as_ffi_view, int_value))
+   int_value:release()
+
+   long_array:release()
+   double_array:release()
+   string_array:release()
+end
+
 ------------------------------------------------------------------------
 -- Maps
 
@@ -88,7 +242,7 @@ do
       map2:copy_from(map)
       local actual = {}
       for key,element in map:iterate() do
-         actual[key] = element:get()
+         actual[key] = element
       end
       local map3 = schema:new_raw_value()
       map3:set_from_ast(expected)
@@ -185,6 +339,336 @@ do
    rec3:release()
 end
 
+------------------------------------------------------------------------
+-- Record field handles
+
+do
+   local schema = A.Schema:new [[
+      {
+         "type": "record",
+         "name": "test",
+         "fields": [
+            { "name": "i", "type": "int" },
+            { "name": "sub", "type": {
+               "type": "record",
+               "name": "sub",
+               "fields": [
+                  { "name": "s", "type": "string" },
+                  { "name": "e", "type": {
+                     "type": "enum", "name": "color",
+                     "symbols": ["RED", "GREEN"]
+                  } }
+               ]
+            } },
+            { "name": "ls", "type": { "type": "array", "items": "long" } }
+         ]
+      }
+   ]]
+
+   assert(schema:field_index("i") == 1)
+   assert(schema:field_index("ls") == 3)
+   assert(schema:field_index("missing") == nil)
+
+   local h_i = schema:field_handle("i")
+   local h_s = schema:field_handle("sub.s")
+   local h_e = schema:field_handle("sub.e")
+   local h_ls = schema:field_handle("ls")
+   assert(h_i == 1)
+   assert(deepcompare(h_s, {2, 1}))
+   assert(not pcall(schema.field_handle, schema, "sub.missing"))
+   assert(not pcall(schema.field_handle, schema, "i.x"))
+
+   local rec = schema:new_raw_value()
+   rec:set_field(h_i, 42)
+   rec:set_field(h_s, "hello")
+   rec:set_field(h_e, "GREEN")
+   rec:set_field(h_ls, { 1, 2, 3 })
+
+   assert(rec:get_field(h_i) == 42)
+   assert(rec:get_field(h_s) == "hello")
+   assert(rec:get_field(h_e) == "GREEN")
+   assert(rec:get_field(h_ls):size() == 3)
+   assert(rec:get_field(2):get("s"):get() == "hello")
+   assert(rec:get("sub"):get("e"):get() == "GREEN")
+
+   assert(not rec:get_field(4))
+   assert(not rec:get_field(0))
+   assert(not rec:get_field({1, 1}))
+   assert(not rec:get_field({}))
+   assert(rec:get_field("i") == 42)
+   assert(not rec:get_field("missing"))
+
+   -- Multiple fields at once
+   local i, s, e, ls = rec:get_many { h_i, h_s, h_e, "ls" }
+   assert(i == 42 and s == "hello" and e == "GREEN")
+   assert(ls:size() == 3)
+
+   local out = {}
+   assert(rawequal(rec:get_many({ h_s, h_i }, out), out))
+   assert(deepcompare(out, { "hello", 42 }))
+   assert(select("#", rec:get_many {}) == 0)
+   assert(not pcall(rec.get_many, rec, { h_i, 7 }))
+
+   -- Setting multiple fields at once
+   local rec2 = schema:new_raw_value()
+   rec2:set_many {
+      i = 42,
+      sub = { s = "hello", e = "GREEN" },
+      [3] = { 1, 2, 3 },
+   }
+   assert(rec == rec2)
+
+   local handles = schema:field_handles { "i", "sub.s", "sub.e", "ls" }
+   assert(deepcompare(handles, { h_i, h_s, h_e, h_ls }))
+   rec2:set_many({ 7, "bye", "RED", {} }, handles)
+   assert(deepcompare({ rec2:get_many(handles, {}) }, {
+      { 7, "bye", "RED", rec2:get("ls") },
+   }))
+   assert(rec2:get("ls"):size() == 0)
+   assert(not pcall(rec2.set_many, rec2, { missing = 1 }))
+   assert(not pcall(rec2.set_many, rec2, { "x" }, { h_i }))
+
+   rec:release()
+   rec2:release()
+end
+
+------------------------------------------------------------------------
+-- Compiled paths
+
+do
+   local schema = A.Schema:new [[
+      {
+         "type": "record",
+         "name": "test",
+         "fields": [
+            { "name": "a", "type": ["null", {
+               "type": "record",
+               "name": "a",
+               "fields": [
+                  { "name": "b", "type": {
+                     "type": "array",
+                     "items": {
+                        "type": "record",
+                        "name": "b",
+                        "fields": [
+                           { "name": "c", "type": "long" },
+                           { "name": "m", "type": {
+                              "type": "map", "values": "string"
+                           } }
+                        ]
+                     }
+                  } }
+               ]
+            } ] }
+         ]
+      }
+   ]]
+
+   local p_c = schema:compile_path("a.b[2].c")
+   local p_m = schema:compile_path('a.b[1].m["key"]')
+   local p_b = schema:compile_path("a.b")
+   assert(p_c.leaf_schema == A.long)
+   assert(deepcompare(p_c.steps, {
+      A.RECORD, 1, A.UNION, 2, A.RECORD, 1, A.ARRAY, 2, A.RECORD, 1,
+   }))
+
+   assert(not pcall(schema.compile_path, schema, "a.x"))
+   assert(not pcall(schema.compile_path, schema, "a.b.c"))
+   assert(not pcall(schema.compile_path, schema, "a..b"))
+   assert(not pcall(schema.compile_path, schema, "a.b[1]."))
+
+   local value = schema:new_raw_value()
+
+   -- The union is null, so none of the paths exist.
+   value:set_from_ast { a = nil }
+   assert(not p_c:get(value))
+
+   value:set_from_ast {
+      a = { a = { b = {
+         { c = 1, m = { key = "first" } },
+         { c = 2, m = {} },
+      } } },
+   }
+   assert(p_c:get(value) == 2)
+   assert(p_m:get(value) == "first")
+   assert(p_b:get(value):size() == 2)
+   assert(not schema:compile_path("a.b[3].c"):get(value))
+   assert(not schema:compile_path('a.b[2].m["key"]'):get(value))
+
+   value:release()
+end
+
+------------------------------------------------------------------------
+-- Value pools
+
+do
+   local schema = A.record "pooled" {
+      {a = A.int},
+      {b = A.array(A.string)},
+   }
+   local pool = schema:value_pool(2)
+
+   local v1 = pool:acquire()
+   local v2 = pool:acquire()
+   local v3 = pool:acquire()
+   assert(pool:size() == 0)
+   v1:set_from_ast { a = 1, b = { "x", "y" } }
+
+   -- Released values are reset and handed out again.
+   pool:release(v1)
+   pool:release(v2)
+   pool:release(v3)
+   assert(pool:size() == 2)
+   local v4 = pool:acquire()
+   local v5 = pool:acquire()
+   assert(rawequal(v4, v2) and rawequal(v5, v1))
+   assert(v5:get("a"):get() == 0)
+   assert(v5:get("b"):size() == 0)
+   assert(pool:size() == 0)
+
+   pool:release(v4)
+   pool:release(v5)
+   pool:clear()
+   assert(pool:size() == 0)
+   assert(not pcall(schema.value_pool, schema, -1))
+end
+
+------------------------------------------------------------------------
+-- Allocation arenas
+
+do
+   local schema = A.record "arena_test" {
+      {a = A.int},
+      {b = A.array(A.string)},
+      {c = A.map(A.long)},
+   }
+   local buf
+   do
+      local value = schema:new_raw_value()
+      value:set_from_ast { a = 1, b = { "x", "y", "z" }, c = { k = 5 } }
+      buf = value:encode()
+      value:release()
+   end
+
+   local resolver = assert(A.ResolvedWriter(schema, schema))
+   local count, kept = A.with_arena(function (n)
+      local total = 0
+      for i = 1, n do
+         local value = schema:new_raw_value()
+         assert(resolver:decode(buf, value))
+         total = total + value:get("b"):size()
+         value:release()
+      end
+      -- A value that outlives the arena.
+      local kept = schema:new_raw_value()
+      assert(resolver:decode(buf, kept))
+      return total, kept
+   end, 100)
+   assert(count == 300)
+   assert(kept:get("b"):get(3):get() == "z")
+   kept:get("b"):append("w")
+   assert(kept:get("c"):get(1):get() == 5)
+   kept:release()
+
+   -- Small slabs, nested arenas, and errors
+   A.with_arena(64, function ()
+      local value = schema:new_raw_value()
+      A.with_arena(function () assert(resolver:decode(buf, value)) end)
+      assert(value:get("b"):size() == 3)
+      value:release()
+   end)
+   assert(not pcall(A.with_arena, function () error "oops" end))
+   assert(not pcall(A.with_arena, 0, function () end))
+   assert(not pcall(A.with_arena, 10))
+end
+
+------------------------------------------------------------------------
+-- Statistics
+
+do
+   assert(A.enable_allocation_stats(true) == false)
+   A.reset_stats()
+   local before = A.stats()
+   assert(before.values_created == 0)
+   assert(before.alloc_calls == 0)
+   assert(before.bytes_peak == before.bytes_live)
+
+   local schema = A.array(A.string)
+   local value = schema:new_raw_value()
+   value:set_from_ast { "a", "b", "c" }
+   local resolver = assert(A.ResolvedWriter(schema, schema))
+
+   local during = A.stats()
+   assert(during.values_created == 1)
+   assert(during.values_live == before.values_live + 1)
+   assert(during.resolvers_created == 1)
+   assert(during.alloc_calls > 0)
+   assert(during.bytes_live > before.bytes_live)
+   assert(during.bytes_peak >= during.bytes_live)
+
+   value:release()
+   value:release()
+   local after = A.stats()
+   assert(after.values_freed == 1)
+   assert(after.values_live == before.values_live)
+   assert(after.free_calls > 0)
+   assert(after.bytes_live < during.bytes_live)
+   resolver = nil
+
+   -- Nothing is counted while the memory counters are turned off.
+   assert(A.enable_allocation_stats(false) == true)
+   local value = schema:new_raw_value()
+   value:release()
+   local off = A.stats()
+   assert(off.alloc_calls == after.alloc_calls)
+   assert(off.values_created == after.values_created + 1)
+end
+
+------------------------------------------------------------------------
+-- Timing histograms
+
+do
+   local schema = A.array(A.long)
+   local value = schema:new_raw_value()
+   value:set_from_ast { 1, 2, 3 }
+   local resolver = assert(A.ResolvedWriter(schema, schema))
+
+   -- Disabled by default, so nothing is recorded.
+   A.reset_timings()
+   local buf = value:encode()
+   assert(A.timings().encode.count == 0)
+
+   assert(A.enable_timings(true) == false)
+   for i = 1, 10 do
+      buf = value:encode()
+      assert(resolver:decode(buf, value))
+   end
+   assert(A.c.Schema [[{"type": "array", "items": "int"}]])
+   assert(A.enable_timings(false) == true)
+   value:encode()
+
+   local timings = A.timings()
+   local encode = timings.encode
+   assert(encode.count == 10)
+   assert(encode.bytes == 10 * #buf)
+   assert(encode.min_ns <= encode.p50_ns)
+   assert(encode.p50_ns <= encode.p99_ns)
+   assert(encode.p99_ns <= encode.max_ns)
+   assert(encode.total_ns >= encode.max_ns)
+   local total = 0
+   for _, count in ipairs(encode.buckets) do total = total + count end
+   assert(total == 10)
+   assert(timings.decode.count == 10)
+   assert(timings.decode.bytes == 10 * #buf)
+   assert(timings.schema_parse.count == 1)
+   assert(timings.read_raw.count == 0)
+
+   A.reset_timings()
+   assert(A.timings().encode.count == 0)
+   assert(A.timings().encode.min_ns == 0)
+   value:release()
+end
+
 ------------------------------------------------------------------------
 -- Unions
 
@@ -507,6 +991,654 @@ do
    os.remove(filename)
 end
 
+------------------------------------------------------------------------
+-- Writer options
+
+do
+   local filename = "test-writer.avro"
+   local schema = A.Schema:new([[{"type": "int"}]])
+   local value = schema:new_raw_value()
+   local count, sum = 20000, 0
+   for i = 1, count do sum = sum + i end
+
+   local function check_file(options, expected_count)
+      local reader = A.open(filename, "r", options)
+      local actual_count, actual_sum = 0, 0
+      while reader:read_raw(value) do
+         actual_count = actual_count + 1
+         actual_sum = actual_sum + value:get()
+      end
+      reader:close()
+      assert(actual_count == (expected_count or count))
+      assert(expected_count or actual_sum == sum)
+   end
+
+   local OPTIONS = {
+      {},
+      {codec="deflate", block_size=4096},
+      {async=true},
+      {async=true, codec="deflate", block_size=1024, queue_depth=1},
+      {compression_threads=4, codec="deflate", block_size=1024},
+      {durability="block", block_size=4096},
+      {durability="interval", interval_ms=5, compression_threads=2},
+      {interval_ms=5, codec="deflate"},
+   }
+
+   for _, options in ipairs(OPTIONS) do
+      local writer = A.open(filename, "w", schema, options)
+      for i = 1, count do
+         value:set(i)
+         writer:write_raw(value)
+         if i == count / 2 then
+            writer:flush()
+         end
+         if i == count * 3 / 4 then
+            -- Everything written so far is now in complete blocks.
+            writer:sync()
+            check_file(nil, i)
+         end
+      end
+      writer:close()
+      check_file()
+      check_file({prefetch=2})
+   end
+
+   assert(not pcall(A.open, filename, "w", schema, {durability="bogus"}))
+
+   value:release()
+   os.remove(filename)
+end
+
+------------------------------------------------------------------------
+-- Read-ahead
+
+do
+   -- Enough records that the file contains several blocks.
+   local filename = "test-prefetch.avro"
+   local schema = A.Schema:new([[{"type": "int"}]])
+   local writer = A.open(filename, "w", schema)
+   local value = schema:new_raw_value()
+   local count, sum = 20000, 0
+   for i = 1, count do
+      value:set(i)
+      writer:write_raw(value)
+      sum = sum + i
+   end
+   writer:close()
+
+   for _, prefetch in ipairs {1, 4} do
+      local reader = A.open(filename, "r", {prefetch=prefetch})
+      local actual_count, actual_sum = 0, 0
+      while reader:read_raw(value) do
+         actual_count = actual_count + 1
+         actual_sum = actual_sum + value:get()
+      end
+      reader:close()
+      assert(actual_count == count)
+      assert(actual_sum == sum)
+   end
+
+   -- Closing early stops the read-ahead thread.
+   local reader = A.open(filename, "r", {prefetch=1})
+   assert(reader:read_raw(value))
+   assert(value:get() == 1)
+   reader:close()
+
+   value:release()
+   os.remove(filename)
+end
+
+------------------------------------------------------------------------
+-- Rolling writers
+
+do
+   local schema = A.Schema:new([[{"type": "int"}]])
+   local value = schema:new_raw_value()
+
+   local function exists(filename)
+      local f = io.open(filename, "rb")
+      if f then f:close() end
+      return f ~= nil
+   end
+
+   local function read_file(filename)
+      local reader = A.open(filename)
+      local count, sum = 0, 0
+      while reader:read_raw(value) do
+         count = count + 1
+         sum = sum + value:get()
+      end
+      reader:close()
+      os.remove(filename)
+      return count, sum
+   end
+
+   -- Roll by record count.  The current file is only visible under a
+   -- temporary name until it's finished.
+   local writer = A.RollingWriter("test-roll-{seq}.avro", schema,
+                                  {roll_records=100})
+   assert(writer:path() == nil)
+   for i = 1, 250 do
+      value:set(i)
+      writer:write_raw(value)
+   end
+   assert(writer:path() == "test-roll-000002.avro")
+   assert(exists("test-roll-000002.avro.tmp"))
+   assert(not exists("test-roll-000002.avro"))
+   writer:close()
+   assert(not exists("test-roll-000002.avro.tmp"))
+   assert(read_file("test-roll-000000.avro") == 100)
+   assert(read_file("test-roll-000001.avro") == 100)
+   local count, sum = read_file("test-roll-000002.avro")
+   assert(count == 50 and sum == 201 * 25 + 250 * 25)
+   assert(not exists("test-roll-000003.avro"))
+
+   -- Roll by size, finishing files on a background thread.
+   local writer = A.RollingWriter("test-roll-{seq}.avro", schema, {
+      roll_bytes=1000, codec="deflate", background_close=true,
+      sequence=10,
+   })
+   for i = 1, 5000 do
+      value:set(i)
+      writer:write_raw(value)
+   end
+   writer:close()
+   local seq, total_count, total_sum = 10, 0, 0
+   while exists(string.format("test-roll-%06d.avro", seq)) do
+      local count, sum =
+         read_file(string.format("test-roll-%06d.avro", seq))
+      assert(count > 0)
+      total_count = total_count + count
+      total_sum = total_sum + sum
+      seq = seq + 1
+   end
+   assert(seq > 12)
+   assert(total_count == 5000 and total_sum == 5000 * 5001 / 2)
+
+   -- Roll by age, and explicitly.
+   local writer = A.RollingWriter("test-roll-{time}-{seq}.avro", schema,
+                                  {roll_seconds=0.05, sync=false})
+   value:set(1)
+   writer:write_raw(value)
+   local first = writer:path()
+   assert(first:match("^test%-roll%-%d+T%d+Z%-000000%.avro$"))
+   local start = os.clock()
+   while os.clock() - start < 0.06 do end
+   writer:write_raw(value)
+   local second = writer:path()
+   assert(second ~= first)
+   writer:roll()
+   assert(writer:path() == nil)
+   writer:close()
+   assert(read_file(first) == 1)
+   assert(read_file(second) == 1)
+
+   assert(A.RollingWriter("test-roll.avro", schema) == nil)
+
+   value:release()
+end
+
+------------------------------------------------------------------------
+-- Stream readers
+
+do
+   local filename = "test-stream.avro"
+   local schema = A.Schema:new([[{"type": "int"}]])
+   local value = schema:new_raw_value()
+   local count, sum = 5000, 0
+
+   for _, codec in ipairs {"null", "deflate"} do
+      local writer = A.open(filename, "w", schema,
+                            {codec=codec, block_size=1024})
+      sum = 0
+      for i = 1, count do
+         value:set(i)
+         writer:write_raw(value)
+         sum = sum + i
+      end
+      writer:close()
+      local f = assert(io.open(filename, "rb"))
+      local data = f:read("*a")
+      f:close()
+
+      -- Feed the file in chunks of varying sizes, reading whatever
+      -- records are available after each one.
+      local reader = A.StreamReader()
+      local _, err = reader:next(value)
+      assert(err == "need more data")
+      assert(select(2, reader:schema_json()) == "need more data")
+      local actual_count, actual_sum = 0, 0
+      local pos, chunk_size = 1, 1
+      while pos <= #data do
+         reader:feed(data:sub(pos, pos + chunk_size - 1))
+         pos = pos + chunk_size
+         chunk_size = chunk_size % 700 + 13
+         while true do
+            local result, err = reader:next(value)
+            if not result then
+               assert(err == "need more data")
+               break
+            end
+            actual_count = actual_count + 1
+            actual_sum = actual_sum + value:get()
+         end
+      end
+      assert(reader:schema_json() == [[{"type":"int"}]])
+      reader:finish()
+      assert(select(2, reader:next(value)) == "eof")
+      assert(actual_count == count)
+      assert(actual_sum == sum)
+      reader:close()
+
+      -- Driven from a coroutine, creating new values as we go.
+      local consumer = coroutine.wrap(function (reader)
+         local total = 0
+         while true do
+            local v, err = reader:next()
+            if v then
+               total = total + v:get()
+               v:release()
+            elseif err == "need more data" then
+               coroutine.yield()
+            else
+               assert(err == "eof")
+               return total
+            end
+         end
+      end)
+      local reader = A.StreamReader()
+      consumer(reader)
+      local result
+      for pos = 1, #data, 4096 do
+         reader:feed(data:sub(pos, pos + 4095))
+         result = consumer()
+      end
+      reader:feed(nil)
+      result = result or consumer()
+      assert(result == sum)
+      reader:close()
+
+      -- A stream that ends partway through a block is an error.
+      local reader = A.StreamReader()
+      reader:feed(data:sub(1, #data - 1))
+      reader:finish()
+      local n = 0
+      while true do
+         local result, err = reader:next(value)
+         if not result then
+            assert(err ~= "need more data" and err ~= "eof")
+            break
+         end
+         n = n + 1
+      end
+      assert(n < count)
+      assert(not pcall(reader.feed, reader, "more"))
+      reader:close()
+   end
+
+   local reader = A.StreamReader()
+   reader:feed("not an avro file")
+   local result, err = reader:next(value)
+   assert(result == nil and err ~= "need more data")
+   reader:close()
+
+   value:release()
+   os.remove(filename)
+end
+
+------------------------------------------------------------------------
+-- Following files
+
+do
+   local filename = "test-follow.avro"
+   local schema = A.Schema:new([[{"type": "int"}]])
+   local value = schema:new_raw_value()
+
+   local function read_available(reader)
+      local sum = 0
+      while true do
+         local result, err = reader:read_raw(value)
+         if not result then
+            assert(err == "need more data")
+            return sum
+         end
+         sum = sum + value:get()
+      end
+   end
+
+   for _, options in ipairs {
+      {follow=true},
+      {follow=true, inotify=false, poll_interval=0.01},
+   } do
+      local writer = A.open(filename, "w", schema)
+      local reader = A.open(filename, "r", options)
+      for i = 1, 100 do
+         value:set(i)
+         writer:write_raw(value)
+      end
+      writer:flush()
+      assert(read_available(reader) == 5050)
+
+      -- Nothing new yet.
+      assert(reader:wait(0.05) == false)
+
+      -- Only the newly appended blocks are read.
+      for i = 1, 10 do
+         value:set(1000)
+         writer:write_raw(value)
+      end
+      writer:flush()
+      assert(reader:wait(5) == true)
+      assert(read_available(reader) == 10000)
+
+      writer:close()
+      reader:close()
+      os.remove(filename)
+   end
+
+   -- A block that's only been partly written is picked up once the
+   -- rest of it arrives.
+   local writer = A.open(filename, "w", schema, {block_size=1024})
+   for i = 1, 10000 do
+      value:set(i)
+      writer:write_raw(value)
+   end
+   writer:close()
+   local f = assert(io.open(filename, "rb"))
+   local data = f:read("*a")
+   f:close()
+
+   local partial = "test-follow-partial.avro"
+   local out = assert(io.open(partial, "wb"))
+   local half = math.floor(#data / 2)
+   out:write(data:sub(1, half))
+   out:flush()
+   local reader = A.open(partial, "r", {follow=true})
+   local sum = read_available(reader)
+   assert(sum > 0 and sum < 50005000)
+   out:write(data:sub(half + 1))
+   out:close()
+   assert(reader:wait(5))
+   assert(sum + read_available(reader) == 50005000)
+   reader:finish()
+   assert(select(2, reader:read_raw(value)) == "eof")
+   reader:close()
+
+   -- Only readers that follow a file can wait for it.
+   local plain = A.StreamReader()
+   assert(not pcall(plain.wait, plain, 0))
+   plain:close()
+
+   local ok, err = A.open("test-follow-missing.avro", "r", {follow=true})
+   assert(ok == nil and err)
+
+   value:release()
+   os.remove(partial)
+   os.remove(filename)
+end
+
+------------------------------------------------------------------------
+-- Parallel scans
+
+do
+   -- Enough records that the file contains several blocks.
+   local filename = "test-scan.avro"
+   local schema = A.Schema:new([[{"type": "int"}]])
+   local writer = A.open(filename, "w", schema)
+   local value = schema:new_raw_value()
+   local count, sum = 20000, 0
+   for i = 1, count do
+      value:set(i)
+      writer:write_raw(value)
+      sum = sum + i
+   end
+   writer:close()
+   value:release()
+
+   local script = "test-scan-worker.lua"
+   local f = assert(io.open(script, "w"))
+   f:write([[
+      local index, nworkers = ...
+      local count, sum = 0, 0
+      return {
+         process = function (value)
+            count = count + 1
+            sum = sum + value:get()
+         end,
+         finish = function ()
+            return { index=index, nworkers=nworkers, count=count, sum=sum }
+         end,
+      }
+   ]])
+   f:close()
+
+   local results, records = A.parallel_scan(filename, 3, script)
+   assert(results, records)
+   assert(records == count)
+   assert(#results == 3)
+   local total_count, total_sum = 0, 0
+   for i, result in ipairs(results) do
+      assert(result.index == i)
+      assert(result.nworkers == 3)
+      total_count = total_count + result.count
+      total_sum = total_sum + result.sum
+   end
+   assert(total_count == count)
+   assert(total_sum == sum)
+
+   -- Errors in a worker are reported to the caller.
+   f = assert(io.open(script, "w"))
+   f:write([[return function (value) error("worker failed") end]])
+   f:close()
+   local results, err = A.parallel_scan(filename, 2, script)
+   assert(results == nil)
+   assert(err:find("worker failed", 1, true))
+
+   f = assert(io.open(script, "w"))
+   f:write([[return function (value) error({}) end]])
+   f:close()
+   local results, err = A.parallel_scan(filename, 2, script)
+   assert(results == nil)
+   assert(err:find("non-string", 1, true))
+
+   local results, err = A.parallel_scan(script, 2, script)
+   assert(results == nil)
+
+   os.remove(script)
+   os.remove(filename)
+end
+
+------------------------------------------------------------------------
+-- Shared handles
+
+do
+   local schema = A.record "shared" { {a = A.int}, {b = A.string} }
+   local value = schema:new_raw_value()
+   value:set_from_ast { a = 42, b = "hello" }
+   local buf = value:encode()
+
+   local schema_handle = A.export_schema(schema)
+   local resolver_handle =
+      A.export_resolver(A.ResolvedWriter(schema, schema))
+   assert(type(schema_handle) == "string")
+   local other_handle = A.export_schema(schema)
+   assert(other_handle ~= schema_handle)
+   A.release_handle(other_handle)
+
+   -- Import into the same state.
+   local imported = assert(A.import_schema(schema_handle))
+   local imported_value = imported:new_raw_value()
+   imported_value:set_from_ast { a = 42, b = "hello" }
+   assert(imported_value:encode() == buf)
+   assert(imported_value:encode_single_object() ==
+          value:encode_single_object())
+
+   local resolver = assert(A.import_resolver(resolver_handle))
+   assert(resolver:decode(buf, imported_value))
+   assert(imported_value:get("a"):get() == 42)
+
+   -- Imported schemas can be used like any other schema.
+   local resolver2 = assert(A.ResolvedWriter(imported, imported))
+   assert(resolver2:decode(buf, imported_value))
+
+   -- Import into the Lua state of a worker thread.
+   local filename = "test-shared.avro"
+   local writer = A.open(filename, "w", schema)
+   writer:write_raw(value)
+   writer:close()
+
+   local script = "test-shared-worker.lua"
+   local f = assert(io.open(script, "w"))
+   f:write(string.format([[
+      local AC = require "avro.legacy.avro"
+      local schema = assert(AC.import_schema(%q))
+      local resolver = assert(AC.import_resolver(%q))
+      local value = schema:new_raw_value()
+      local result
+      return {
+         process = function (record)
+            assert(resolver:decode(record:encode(), value))
+            result = value:get("b"):get()
+         end,
+         finish = function () return result end,
+      }
+   ]], schema_handle, resolver_handle))
+   f:close()
+   local results = assert(A.parallel_scan(filename, 1, script))
+   assert(results[1] == "hello")
+   os.remove(script)
+   os.remove(filename)
+
+   -- Released handles can't be imported again, but the objects that
+   -- were already imported are still usable.
+   A.release_handle(schema_handle)
+   A.release_handle(resolver_handle)
+   assert(A.import_schema(schema_handle) == nil)
+   assert(A.import_resolver(resolver_handle) == nil)
+   assert(not pcall(A.release_handle, schema_handle))
+   assert(A.import_schema("avro:schema:bogus") == nil)
+   assert(imported_value:encode() == buf)
+
+   value:release()
+   imported_value:release()
+end
+
+------------------------------------------------------------------------
+-- Channels
+
+do
+   local schema = A.record "message" { {id = A.int}, {text = A.string} }
+   local value = schema:new_raw_value()
+   local received = schema:new_raw_value()
+
+   local channel = A.Channel()
+   local _, err = channel:receive(received)
+   assert(err == "empty")
+
+   value:set_from_ast { id = 1, text = "one" }
+   assert(channel:send(value))
+   value:set_from_ast { id = 2, text = "two" }
+   assert(channel:send(value))
+   assert(channel:receive(received) == received)
+   assert(received:get("id"):get() == 1)
+   assert(received:get("text"):get() == "one")
+   assert(channel:receive(received))
+   assert(received:get("id"):get() == 2)
+
+   -- Batches are sent all at once.
+   local batch = {}
+   for i = 1, 3 do
+      batch[i] = schema:new_raw_value()
+      batch[i]:set_from_ast { id = 10 + i, text = "batch" }
+   end
+   assert(channel:send_batch(batch))
+   for i = 1, 3 do
+      assert(channel:receive(received))
+      assert(received:get("id"):get() == 10 + i)
+   end
+   assert(select(2, channel:receive(received)) == "empty")
+
+   -- Fill the channel, and then keep it busy long enough to wrap around
+   -- the end of the buffer a few times.
+   value:set_from_ast { id = 0, text = string.rep("x", 100) }
+   local sent = 0
+   while channel:send(value) do sent = sent + 1 end
+   local ok, err = channel:send(value)
+   assert(not ok and err == "full")
+   assert(sent > 10)
+   for i = 1, sent * 4 do
+      assert(channel:receive(received))
+      value:get("id"):set(i)
+      assert(channel:send(value))
+   end
+   for i = 1, sent do
+      assert(channel:receive(received))
+   end
+   assert(received:get("id"):get() == sent * 4)
+   assert(received:get("text"):get() == string.rep("x", 100))
+
+   -- Records that could never fit are rejected outright.
+   value:set_from_ast { id = 0, text = string.rep("x", 10000) }
+   assert(not pcall(channel.send, channel, value))
+
+   -- The same goes for batches whose records fit on their own but not
+   -- all together, even if we're willing to wait.
+   value:set_from_ast { id = 0, text = string.rep("x", 100) }
+   local big_batch = {}
+   for i = 1, 40 do big_batch[i] = value end
+   assert(not pcall(channel.send_batch, channel, big_batch))
+   assert(not pcall(channel.send_batch, channel, big_batch, true))
+   assert(select(2, channel:receive(received)) == "empty")
+
+   -- Once closed, nothing more can be sent, but values already in the
+   -- channel can still be received.
+   value:set_from_ast { id = 99, text = "last" }
+   assert(channel:send(value))
+   channel:close()
+   assert(not pcall(channel.send, channel, value))
+   assert(channel:receive(received))
+   assert(received:get("id"):get() == 99)
+   assert(select(2, channel:receive(received)) == "closed")
+
+   -- Records sent from worker threads.
+   local filename = "test-channel.avro"
+   local writer = A.open(filename, "w", schema)
+   for i = 1, 100 do
+      value:set_from_ast { id = i, text = "record "..i }
+      writer:write_raw(value)
+   end
+   writer:close()
+
+   channel = A.Channel(64 * 1024)
+   local channel_handle = channel:export()
+   local script = "test-channel-worker.lua"
+   local f = assert(io.open(script, "w"))
+   f:write(string.format([[
+      local AC = require "avro.legacy.avro"
+      local channel = assert(AC.import_channel(%q))
+      return function (record)
+         assert(channel:send(record, true))
+      end
+   ]], channel_handle))
+   f:close()
+   local _, count = assert(A.parallel_scan(filename, 2, script))
+   assert(count == 100)
+   local sum = 0
+   for i = 1, 100 do
+      assert(channel:receive(received))
+      sum = sum + received:get("id"):get()
+   end
+   assert(sum == 5050)
+   assert(select(2, channel:receive(received)) == "empty")
+   A.release_handle(channel_handle)
+   os.remove(script)
+   os.remove(filename)
+
+   value:release()
+   received:release()
+   for _, v in ipairs(batch) do v:release() end
+end
+
 ------------------------------------------------------------------------
 -- Recursive
 
@@ -157,3 +157,92 @@ do
    assert(schema1 == clone)
    assert(schema2 == clone)
 end
+
+------------------------------------------------------------------------
+-- Schema compatibility
+
+do
+   local function issue_kinds(issues)
+      local result = {}
+      for _, issue in ipairs(issues) do
+         table.insert(result, issue.kind.." "..issue.path)
+      end
+      table.sort(result)
+      return result
+   end
+
+   local function test_compat(writer, reader, expected_ok, expected_kinds)
+      local ok, issues = A.check_compatibility(writer, reader)
+      assert(ok == expected_ok)
+      assert(deepcompare(issue_kinds(issues), expected_kinds or {}))
+   end
+
+   test_compat(A.int, A.int, true)
+   test_compat(A.int, A.long, true, {"promotion "})
+   test_compat(A.long, A.int, false, {"type_mismatch "})
+   test_compat(A.string, A.bytes, true, {"promotion "})
+   test_compat(A.int, [[["null", "long", "int"] ]], true)
+   test_compat(A.int, [[["null", "double"] ]], true, {"promotion "})
+   test_compat(A.int, [[["null", "string"] ]], false, {"type_mismatch "})
+   test_compat([[["null", "int", "string"] ]], [[["null", "int"] ]],
+               false, {"union_branch_mismatch <string>"})
+   test_compat([[["null", "int"] ]], A.int,
+               false, {"union_branch_mismatch <null>"})
+   test_compat(A.array { A.int }, A.array { A.double },
+               true, {"promotion []"})
+   test_compat(A.map(A.string), A.map(A.int),
+               false, {"type_mismatch {}"})
+   test_compat(A.enum "e" {"A", "B", "C"}, A.enum "e" {"C", "A"},
+               false, {"missing_enum_symbol "})
+   test_compat(A.enum "e" {"A"}, A.enum "f" {"A"},
+               false, {"name_mismatch "})
+   test_compat(A.fixed "f" {size=4}, A.fixed "f" {size=8},
+               false, {"size_mismatch "})
+
+   local writer = [[
+     {
+       "type": "record",
+       "name": "foo",
+       "fields": [
+         {"name": "a", "type": "int"},
+         {"name": "b", "type": {
+           "type": "record",
+           "name": "bar",
+           "fields": [{"name": "x", "type": "string"}]
+         }},
+         {"name": "next", "type": ["null", "foo"]}
+       ]
+     }
+   ]]
+
+   local reader = [[
+     {
+       "type": "record",
+       "name": "foo",
+       "fields": [
+         {"name": "a", "type": "long"},
+         {"name": "b", "type": {
+           "type": "record",
+           "name": "bar",
+           "fields": [
+             {"name": "x", "type": "int"},
+             {"name": "y", "type": "int"},
+             {"name": "z", "type": ["null", "int"], "default": null}
+           ]
+         }},
+         {"name": "c", "type": "string", "default": "hi"},
+         {"name": "d", "type": "double"},
+         {"name": "next", "type": ["null", "foo"]}
+       ]
+     }
+   ]]
+
+   test_compat(writer, reader, false, {
+      "missing_field b.y",
+      "missing_field d",
+      "promotion a",
+      "type_mismatch b.x",
+   })
+   test_compat(writer, writer, true)
+   test_compat(A.Schema:new(reader), A.Schema:new(reader), true)
+end
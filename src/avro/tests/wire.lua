@@ -0,0 +1,277 @@
+-- -*- coding: utf-8 -*-
+------------------------------------------------------------------------
+-- Copyright © 2011-2015, RedJack, LLC.
+-- All rights reserved.
+--
+-- Please see the COPYING file in this distribution for license details.
+------------------------------------------------------------------------
+
+local A = require "avro"
+
+------------------------------------------------------------------------
+-- Value:encode() with a header
+
+do
+   local schema = A.Schema:new([[{"type": "int"}]])
+   local value = schema:new_raw_value()
+   value:set(1)
+   assert(value:encode("") == "\002")
+   assert(value:encode("abc") == "abc\002")
+   value:release()
+end
+
+------------------------------------------------------------------------
+-- Resolver:decode() with an offset
+
+do
+   local schema = A.Schema:new([[{"type": "int"}]])
+   local value = schema:new_raw_value()
+   local resolver = assert(A.ResolvedWriter(schema, schema))
+   assert(resolver:decode("xyz\002", value, 3))
+   assert(value:get() == 1)
+   assert(not resolver:decode("xyz\002", value, 5))
+   value:release()
+end
+
+------------------------------------------------------------------------
+-- Wire format headers
+
+do
+   local function test_header(schema_id, expected)
+      assert(A.wire.encode_header(schema_id) == expected)
+      assert(A.wire.decode_header(expected) == schema_id)
+   end
+
+   test_header(0, "\000\000\000\000\000")
+   test_header(1, "\000\000\000\000\001")
+   test_header(258, "\000\000\000\001\002")
+   test_header(0xffffffff, "\000\255\255\255\255")
+
+   assert(not A.wire.decode_header("\001\000\000\000\001"))
+   assert(not A.wire.decode_header("\000\000"))
+   assert(not pcall(A.wire.encode_header, -1))
+end
+
+------------------------------------------------------------------------
+-- Wire format encode/decode
+
+do
+   local writer_schema = A.Schema:new [[
+     {
+       "type": "record",
+       "name": "foo",
+       "fields": [
+         {"name": "a", "type": "int"},
+         {"name": "b", "type": "string"}
+       ]
+     }
+   ]]
+
+   local reader_schema = A.Schema:new [[
+     {
+       "type": "record",
+       "name": "foo",
+       "fields": [
+         {"name": "b", "type": "string"}
+       ]
+     }
+   ]]
+
+   local registry = {
+      [7] = writer_schema,
+      [8] = [[{"type": "long"}]],
+   }
+
+   local value = writer_schema:new_raw_value()
+   value:set_from_ast { a = 10, b = "hello" }
+   local buf = A.wire.encode(7, value)
+   assert(buf == "\000\000\000\000\007"..value:encode())
+
+   -- Without a reader schema we decode using the writer schema.
+   local decoded, schema_id = assert(A.wire.decode(buf, registry))
+   assert(schema_id == 7)
+   assert(decoded == value)
+   decoded:release()
+
+   -- With a reader schema, and a destination value.
+   local dest = reader_schema:new_raw_value()
+   for i = 1, 3 do
+      local result = assert(A.wire.decode(buf, registry, reader_schema, dest))
+      assert(rawequal(result, dest))
+      assert(dest:get("b"):get() == "hello")
+   end
+   dest:release()
+
+   -- A registry function, and a JSON schema string.
+   local long_value = A.long:new_raw_value()
+   long_value:set(42)
+   local long_buf = A.wire.encode(8, long_value)
+   local function lookup(schema_id) return registry[schema_id] end
+   decoded, schema_id = assert(A.wire.decode(long_buf, lookup))
+   assert(schema_id == 8)
+   assert(decoded:get() == 42)
+   decoded:release()
+   long_value:release()
+
+   -- Failures
+   assert(not A.wire.decode("\001"..buf:sub(2), registry))
+   assert(not A.wire.decode("\000\000\000\000\009\002", registry))
+   assert(not A.wire.decode(buf, registry, A.boolean))
+
+   value:release()
+end
+
+------------------------------------------------------------------------
+-- Fingerprints
+
+do
+   local function test_fingerprint(schema, canonical, expected)
+      assert(schema:canonical_form() == canonical)
+      local fp = schema:fingerprint()
+      assert(#fp == 8)
+      local hex = fp:gsub(".", function (c)
+         return string.format("%02x", c:byte())
+      end)
+      assert(hex == expected)
+   end
+
+   test_fingerprint(A.null, [["null"]], "8a8f25cce724dd63")
+   test_fingerprint(A.boolean, [["boolean"]], "64f7d4a478fc429f")
+   test_fingerprint(A.int, [["int"]], "8f5c393f1ad57572")
+   test_fingerprint(A.long, [["long"]], "b71df49344e154d0")
+   test_fingerprint(A.float, [["float"]], "90d7a83ecb027c4d")
+   test_fingerprint(A.double, [["double"]], "7e95ab32c035758e")
+   test_fingerprint(A.bytes, [["bytes"]], "651920c3da16c04f")
+   test_fingerprint(A.string, [["string"]], "c70345637248018f")
+
+   local schema = A.Schema:new [[
+     {
+       "type": "record",
+       "name": "foo",
+       "fields": [
+         {"name": "a", "type": {"type": "array", "items": "int"}},
+         {"name": "b", "type": ["null", {"type": "map", "values": "foo"}]},
+         {"name": "c", "type": {"type": "enum", "name": "e", "symbols": ["X", "Y"]}},
+         {"name": "d", "type": {"type": "fixed", "name": "f", "size": 4}}
+       ]
+     }
+   ]]
+   assert(schema:canonical_form() ==
+          [[{"name":"foo","type":"record","fields":[]]..
+          [[{"name":"a","type":{"type":"array","items":"int"}},]]..
+          [[{"name":"b","type":["null",{"type":"map","values":"foo"}]},]]..
+          [[{"name":"c","type":{"name":"e","type":"enum","symbols":["X","Y"]}},]]..
+          [[{"name":"d","type":{"name":"f","type":"fixed","size":4}}]}]])
+
+   -- Names are replaced with fullnames, and namespaces are dropped.
+   -- Everywhere else, the schema keeps the names as given.
+   local schema = A.Schema:new [[
+     {
+       "type": "record",
+       "name": "foo",
+       "namespace": "x.y",
+       "fields": [
+         {"name": "a", "type": {"type": "enum", "name": "e", "symbols": ["X"]}},
+         {"name": "b", "type": "e"},
+         {"name": "c", "type": {"type": "fixed", "name": "z.f", "size": 4}},
+         {"name": "d", "type": {"type": "fixed", "name": "g",
+                                "namespace": "", "size": 4}},
+         {"name": "e", "type": "z.f"},
+         {"name": "f", "type": "x.y.e"}
+       ]
+     }
+   ]]
+   assert(schema:canonical_form() ==
+          [[{"name":"x.y.foo","type":"record","fields":[]]..
+          [[{"name":"a","type":{"name":"x.y.e","type":"enum","symbols":["X"]}},]]..
+          [[{"name":"b","type":"x.y.e"},]]..
+          [[{"name":"c","type":{"name":"z.f","type":"fixed","size":4}},]]..
+          [[{"name":"d","type":{"name":"g","type":"fixed","size":4}},]]..
+          [[{"name":"e","type":"z.f"},]]..
+          [[{"name":"f","type":"x.y.e"}]}]])
+   assert(schema:name() == "foo")
+   assert(schema:get("a"):name() == "e")
+   assert(schema:get("f") == schema:get("a"))
+   local value = schema:new_raw_value()
+   value:set_from_ast {
+      a = "X", b = "X", c = "abcd", d = "efgh", e = "ijkl", f = "X"
+   }
+   assert(value:get("e"):get() == "ijkl")
+   value:release()
+end
+
+------------------------------------------------------------------------
+-- Single-object encoding
+
+do
+   local writer_schema = A.Schema:new [[
+     {
+       "type": "record",
+       "name": "foo",
+       "fields": [
+         {"name": "a", "type": "int"},
+         {"name": "b", "type": "string"}
+       ]
+     }
+   ]]
+
+   local reader_schema = A.Schema:new [[
+     {
+       "type": "record",
+       "name": "foo",
+       "fields": [
+         {"name": "b", "type": "string"}
+       ]
+     }
+   ]]
+
+   local value = writer_schema:new_raw_value()
+   value:set_from_ast { a = 10, b = "hello" }
+   local buf = assert(value:encode_single_object())
+   assert(buf == "\195\001"..writer_schema:fingerprint()..value:encode())
+
+   -- Without a reader schema we decode using the writer schema.
+   local decoder = A.wire.SingleObjectDecoder()
+   assert(decoder:add(writer_schema) == writer_schema:fingerprint())
+   local decoded, fingerprint = assert(decoder:decode(buf))
+   assert(fingerprint == writer_schema:fingerprint())
+   assert(decoded == value)
+   decoded:release()
+
+   -- With a reader schema, and a destination value.
+   decoder = A.wire.SingleObjectDecoder(reader_schema)
+   decoder:add(writer_schema)
+   decoder:add(A.long)
+   local dest = reader_schema:new_raw_value()
+   for i = 1, 3 do
+      local result = assert(decoder:decode(buf, dest))
+      assert(rawequal(result, dest))
+      assert(dest:get("b"):get() == "hello")
+   end
+   dest:release()
+
+   -- Failures
+   assert(not decoder:decode("\195\002"..buf:sub(3)))
+   assert(not decoder:decode(buf:sub(1, 6)))
+   assert(not A.wire.SingleObjectDecoder():decode(buf))
+   local raw_schema = A.c.Schema(writer_schema:to_json())
+   local raw_value = raw_schema:new_raw_value()
+   assert(not raw_value:encode_single_object())
+   raw_value:release()
+
+   -- A fingerprint function is only called once, when it's needed.
+   local calls = 0
+   raw_schema:set_fingerprint(function()
+      calls = calls + 1
+      return writer_schema:fingerprint()
+   end)
+   assert(calls == 0)
+   raw_value = raw_schema:new_raw_value()
+   raw_value:set_from_ast { a = 10, b = "hello" }
+   assert(raw_value:encode_single_object() == buf)
+   assert(raw_value:encode_single_object() == buf)
+   assert(calls == 1)
+   raw_value:release()
+
+   value:release()
+end
@@ -162,12 +162,17 @@ do
       ls = { 1, 100 },
    }
 
+   local _, rec4 = schema:new_wrapped_value()
+   rec4:set_many { i = 1, b = true, s = "fantastic", ls = { 1, 100 } }
+
    assert(rec == rec2)
    assert(rec == rec3)
+   assert(rec == rec4)
 
    rec:release()
    rec2:release()
    rec3:release()
+   rec4:release()
 end
 
 ------------------------------------------------------------------------
@@ -0,0 +1,231 @@
+-- -*- coding: utf-8 -*-
+------------------------------------------------------------------------
+-- Copyright © 2011-2015, RedJack, LLC.
+-- All rights reserved.
+--
+-- Please see the COPYING file in this distribution for license details.
+------------------------------------------------------------------------
+
+-- Framed message encodings.  This module implements the "wire format"
+-- used by schema registries: each message starts with a zero magic
+-- byte and a 4-byte big-endian schema ID, followed by the binary
+-- encoding of the value.
+--
+--   local buf = avro.wire.encode(42, value)
+--   local value, schema_id = avro.wire.decode(buf, registry, reader_schema)
+--
+-- The registry can either be a table mapping schema IDs to schemas, or
+-- a function that takes in a schema ID and returns its schema.  The
+-- schemas can be schema objects or JSON strings.  Resolvers are cached
+-- per registry and reader schema, so each writer schema is only
+-- looked up and resolved once.
+--
+-- We also support the single-object encoding from the Avro
+-- specification, in which each message starts with a two-byte marker
+-- and the 8-byte Rabin fingerprint of the writer schema:
+--
+--   local buf = value:encode_single_object()
+--   local decoder = avro.wire.SingleObjectDecoder(reader_schema)
+--   decoder:add(writer_schema)
+--   local value = decoder:decode(buf)
+
+local AC = require "avro.c"
+local AS = require "avro.schema"
+
+local error = error
+local setmetatable = setmetatable
+local string = string
+local tostring = tostring
+local type = type
+
+local avro = require "avro.module"
+avro.wire = {}
+
+
+------------------------------------------------------------------------
+-- Resolver cache
+
+-- registry -> reader schema -> schema ID -> { resolver=, schema= }
+local RESOLVERS = setmetatable({}, { __mode="k" })
+
+-- Used as the reader schema key when the caller doesn't provide one.
+local NO_READER = {}
+
+local function lookup_schema(registry, schema_id)
+   local schema
+   if type(registry) == "function" then
+      schema = registry(schema_id)
+   else
+      schema = registry[schema_id]
+   end
+   if type(schema) == "string" then
+      schema = AS.Schema:new(schema)
+   end
+   return schema
+end
+
+local function get_resolver(registry, schema_id, reader_schema)
+   local by_reader = RESOLVERS[registry]
+   if not by_reader then
+      by_reader = setmetatable({}, { __mode="k" })
+      RESOLVERS[registry] = by_reader
+   end
+
+   local by_id = by_reader[reader_schema or NO_READER]
+   if not by_id then
+      by_id = {}
+      by_reader[reader_schema or NO_READER] = by_id
+   end
+
+   local entry = by_id[schema_id]
+   if entry then return entry end
+
+   local writer_schema = lookup_schema(registry, schema_id)
+   if not writer_schema then
+      return nil, "Unknown schema ID "..schema_id
+   end
+
+   reader_schema = reader_schema or writer_schema
+   local resolver, err = AC.ResolvedWriter(writer_schema, reader_schema)
+   if not resolver then return nil, err end
+
+   entry = { resolver=resolver, schema=reader_schema }
+   by_id[schema_id] = entry
+   return entry
+end
+
+-- Forgets any cached resolvers for the given registry, or for all
+-- registries if none is given.  Call this if the contents of a registry
+-- table change.
+function avro.wire.clear_cache(registry)
+   if registry then
+      RESOLVERS[registry] = nil
+   else
+      RESOLVERS = setmetatable({}, { __mode="k" })
+   end
+end
+
+
+------------------------------------------------------------------------
+-- Schema ID framing
+
+local HEADER_SIZE = 5
+
+local function encode_header(schema_id)
+   if type(schema_id) ~= "number" or schema_id < 0 or schema_id > 0xffffffff
+   or schema_id % 1 ~= 0 then
+      error("Invalid schema ID "..tostring(schema_id))
+   end
+   local b4 = schema_id % 256
+   schema_id = (schema_id - b4) / 256
+   local b3 = schema_id % 256
+   schema_id = (schema_id - b3) / 256
+   local b2 = schema_id % 256
+   local b1 = (schema_id - b2) / 256
+   return string.char(0, b1, b2, b3, b4)
+end
+
+local function decode_header(buf)
+   local magic, b1, b2, b3, b4 = string.byte(buf, 1, HEADER_SIZE)
+   if magic ~= 0 or not b4 then
+      return nil, "Invalid wire format header"
+   end
+   return ((b1 * 256 + b2) * 256 + b3) * 256 + b4
+end
+
+avro.wire.encode_header = encode_header
+avro.wire.decode_header = decode_header
+
+-- Encodes a raw value, prefixing it with the header for the given
+-- schema ID.
+function avro.wire.encode(schema_id, value)
+   return value:encode(encode_header(schema_id))
+end
+
+-- Decodes a framed message.  If dest is given, the message is decoded
+-- into that raw value; otherwise we create a new value for the reader
+-- schema (or the writer schema, if there's no reader schema).  Returns
+-- the decoded value and the message's schema ID.
+function avro.wire.decode(buf, registry, reader_schema, dest)
+   local schema_id, err = decode_header(buf)
+   if not schema_id then return nil, err end
+
+   local entry
+   entry, err = get_resolver(registry, schema_id, reader_schema)
+   if not entry then return nil, err end
+
+   local value = dest or entry.schema:new_raw_value()
+   local ok
+   ok, err = entry.resolver:decode(buf, value, HEADER_SIZE)
+   if not ok then
+      if not dest then value:release() end
+      return nil, err
+   end
+   return value, schema_id
+end
+
+
+------------------------------------------------------------------------
+-- Single-object encoding
+
+local SINGLE_OBJECT_MARKER_1 = 0xc3
+local SINGLE_OBJECT_MARKER_2 = 0x01
+local SINGLE_OBJECT_HEADER_SIZE = 10
+
+local SingleObjectDecoder = {}
+SingleObjectDecoder.__mt = { __index=SingleObjectDecoder }
+
+-- Creates a decoder for single-object encoded messages.  Each writer
+-- schema that might appear in a message must be registered with the
+-- add method.  If reader_schema is nil, messages are decoded using
+-- their writer schemas.
+function avro.wire.SingleObjectDecoder(reader_schema)
+   local obj = {
+      reader_schema=reader_schema,
+      -- fingerprint -> { resolver=, schema= }
+      entries={},
+   }
+   return setmetatable(obj, SingleObjectDecoder.__mt)
+end
+
+function SingleObjectDecoder:add(writer_schema)
+   if type(writer_schema) == "string" then
+      writer_schema = AS.Schema:new(writer_schema)
+   end
+
+   local reader_schema = self.reader_schema or writer_schema
+   local resolver, err = AC.ResolvedWriter(writer_schema, reader_schema)
+   if not resolver then return nil, err end
+
+   local fingerprint = writer_schema:fingerprint()
+   self.entries[fingerprint] = { resolver=resolver, schema=reader_schema }
+   return fingerprint
+end
+
+-- Decodes a single-object encoded message.  If dest is given, the
+-- message is decoded into that raw value; otherwise we create a new
+-- value.  Returns the decoded value and the writer schema's
+-- fingerprint.
+function SingleObjectDecoder:decode(buf, dest)
+   local m1, m2 = string.byte(buf, 1, 2)
+   if m1 ~= SINGLE_OBJECT_MARKER_1 or m2 ~= SINGLE_OBJECT_MARKER_2
+   or #buf < SINGLE_OBJECT_HEADER_SIZE then
+      return nil, "Invalid single-object header"
+   end
+
+   local fingerprint = string.sub(buf, 3, SINGLE_OBJECT_HEADER_SIZE)
+   local entry = self.entries[fingerprint]
+   if not entry then
+      return nil, "Unknown schema fingerprint"
+   end
+
+   local value = dest or entry.schema:new_raw_value()
+   local ok, err = entry.resolver:decode(buf, value, SINGLE_OBJECT_HEADER_SIZE)
+   if not ok then
+      if not dest then value:release() end
+      return nil, err
+   end
+   return value, fingerprint
+end
+
+return avro.wire
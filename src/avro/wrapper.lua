@@ -315,9 +315,9 @@ end
 
 function ArrayValue:iterate(want_raw)
    if want_raw then
-      return self.raw:iterate()
+      return self.raw:iterate(true)
    else
-      local f, s, var = self.raw:iterate()
+      local f, s, var = self.raw:iterate(true)
       local state = { f=f, s=s, var=var, self=self }
       return iterate_wrapped, state, nil
    end
@@ -392,9 +392,9 @@ MapValue.set = MapValue.add
 
 function MapValue:iterate(want_raw)
    if want_raw then
-      return self.raw:iterate()
+      return self.raw:iterate(true)
    else
-      local f, s, var = self.raw:iterate()
+      local f, s, var = self.raw:iterate(true)
       local state = { f=f, s=s, var=var, self=self }
       return iterate_wrapped, state, nil
    end
@@ -464,6 +464,13 @@ function RecordValue:set(idx, val)
    child:fill_from(val)
 end
 
+-- Sets several fields at once; see the set_many method of raw values.
+-- This goes straight to the raw value, so it bypasses any custom
+-- wrapper classes for the fields.
+function RecordValue:set_many(values, handles)
+   return self.raw:set_many(values, handles)
+end
+
 function RecordValue:tostring()
    local field_str = {}
    for i, field_name in ipairs(self.__field_names) do